@@ -0,0 +1,101 @@
+#ifndef ACCESS_HINTS_H
+#define ACCESS_HINTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "file_storage_internal.h"
+
+// identifies a hints file and the version of its format
+#define ACCESS_HINTS_MAGIC "FSHINT01"
+#define ACCESS_HINTS_MAGIC_LENGTH 8
+
+/**
+ * The access hints are the metadata of the replacement policies (the number
+ * of accesses and the time of the last one) of the files of the storage,
+ * saved by name on shutdown and applied to the files with the same name on
+ * startup, so that the LRU and LFU policies do not start cold. Unlike a
+ * snapshot they do not contain the files, so they also apply to the files
+ * replayed from the write-ahead log or preloaded from a directory.
+ *
+ * A hints file is the header, followed by an entry for every file, each
+ * followed by the name of the file (without the terminator). The numbers are
+ * in the byte order of the machine.
+*/
+struct access_hints_header {
+    char magic[ACCESS_HINTS_MAGIC_LENGTH];
+    uint64_t num_hints;
+};
+
+struct access_hints_entry {
+    int64_t last_used;
+    uint32_t used_counter;
+    uint32_t name_length;
+};
+
+typedef struct access_hint {
+    // terminated name of the file
+    const char* name;
+    uint32_t used_counter;
+    time_t last_used;
+} access_hint_t;
+
+/**
+ * Hints loaded from a hints file, sorted by name
+*/
+typedef struct access_hints {
+    size_t num_hints;
+    access_hint_t* hints;
+    // storage of the names of the hints
+    char* names;
+    // the least recent access among the hints
+    time_t oldest_access;
+} access_hints_t;
+
+/**
+ * Save the access hints of all the files of the storage in path. The hints
+ * are written to a temporary file that then replaces path, so path always
+ * contains complete hints, and they are durable when the function returns.
+ * Must be called when no other thread uses the storage.
+ * Returns the number of hints saved, or -1 on error and errno is set
+ * appropriately
+*/
+long save_access_hints(file_storage_t* storage, const char* path);
+
+/**
+ * Load the access hints in path
+ * Returns the hints, to be freed with free_access_hints, or NULL on error and
+ * errno is set appropriately (EINVAL if path is not a valid hints file)
+*/
+access_hints_t* load_access_hints(const char* path);
+
+/**
+ * Apply the hints to the files of the storage that have not been accessed
+ * since they were loaded (used_counter is 0): a file with a hint takes its
+ * number of accesses and the time of its last access, while a file without a
+ * hint is considered less recently used than all the files with hints, since
+ * it was not in the storage when the hints were saved. The function can be
+ * called again after more files are loaded.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files with a hint, or -1 on error and errno is set
+ * appropriately
+*/
+long apply_access_hints(file_storage_t* storage, const access_hints_t* hints);
+
+/**
+ * Apply the hints to vfile, if it has not been accessed since it was loaded
+ * (used_counter is 0), as apply_access_hints does for all the files of the
+ * storage. The hint can be applied before the file is added to the storage,
+ * so that the files loaded one at a time are compared by the replacement
+ * policy with their hints.
+ * Returns true if the file has a hint
+*/
+bool apply_file_access_hint(const access_hints_t* hints, vfile_t* vfile);
+
+/**
+ * Free the hints returned by load_access_hints
+*/
+void free_access_hints(access_hints_t* hints);
+#endif
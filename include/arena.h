@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+struct arena_statistics {
+    // number of chunks allocated from the system, including the big ones
+    unsigned long num_chunks;
+    unsigned long num_resets;
+    // maximum number of bytes allocated between two resets
+    size_t maximum_used;
+};
+
+struct arena_chunk;
+
+/**
+ * Bump pointer allocator for memory that lives until the next reset of the
+ * arena. The memory is taken from chunks of chunk_size bytes; an allocation
+ * bigger than a quarter of chunk_size gets a chunk of its own.
+ * The allocations cannot be freed one by one: arena_reset frees all of them at
+ * once, keeping the first chunk so that the next uses do not call malloc.
+ * The arena is not thread safe, it is meant to be owned by a single thread.
+*/
+typedef struct arena {
+    // chunks in use, the first one is the one the allocations are taken from
+    struct arena_chunk* chunks;
+    size_t chunk_size;
+    // bytes allocated since the last reset
+    size_t used;
+    struct arena_statistics statistics;
+} arena_t;
+
+/**
+ * Create an arena that allocates memory in chunks of chunk_size bytes
+ * The arena shall be destroyed with destroy_arena
+ * Returns NULL on error and errno is set appropriately
+*/
+arena_t* create_arena(size_t chunk_size);
+
+/**
+ * Destroy the arena and all the memory allocated from it
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_arena(arena_t* arena);
+
+/**
+ * Allocate size bytes from the arena, aligned like the memory returned by
+ * malloc. The memory is valid until the next arena_reset
+ * Returns NULL on error and errno is set appropriately
+*/
+void* arena_alloc(arena_t* arena, size_t size);
+
+/**
+ * Free all the memory allocated from the arena
+*/
+void arena_reset(arena_t* arena);
+
+/**
+ * Copy size bytes from ptr, that can be memory of an arena, in a new buffer
+ * allocated on the heap, so that they outlive the reset of the arena
+ * Returns NULL on error and errno is set appropriately
+*/
+void* arena_promote(const void* ptr, size_t size);
+#endif
@@ -0,0 +1,84 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+// number of buckets of an empty store, the table doubles when the number of
+// blobs reaches the number of buckets
+#define BLOB_STORE_INITIAL_BUCKETS 64
+
+/**
+ * Immutable buffer shared by the files that contain the same data
+*/
+typedef struct blob {
+    uint64_t hash;
+    // number of references to the blob, a file can reference it more than once
+    unsigned int refcount;
+    void* data;
+    size_t size;
+    // next blob in the same bucket
+    struct blob* next;
+} blob_t;
+
+/**
+ * Content addressed store of blobs: a hash table of refcounted buffers,
+ * keyed by the hash of the content. The store is not thread safe, it shall be
+ * protected by the lock of its owner. The content of a blob never changes,
+ * so it can be read by many threads at once.
+*/
+typedef struct blob_store {
+    blob_t** buckets;
+    size_t num_buckets;
+    size_t num_blobs;
+} blob_store_t;
+
+/**
+ * Create an empty blob store
+ * The store shall be destroyed with destroy_blob_store
+ * Returns NULL on error and errno is set appropriately
+*/
+blob_store_t* create_blob_store(void);
+
+/**
+ * Destroy the store and all the blobs in it, even if they are still referenced
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_blob_store(blob_store_t* store);
+
+/**
+ * Returns the hash of the content made of iovcnt buffers
+*/
+uint64_t hash_content(const struct iovec* iov, size_t iovcnt);
+
+/**
+ * Find the blob with the given hash whose content is equal to the size bytes
+ * of buf. The reference count of the blob is not changed.
+ * Returns NULL if there is no such blob
+*/
+blob_t* blob_store_find(blob_store_t* store, uint64_t hash, const void* buf, size_t size);
+
+/**
+ * Add to the store a new blob with the given hash, that shall be the hash of
+ * the size bytes of data. data is not copied: the blob takes the ownership of
+ * it, so it shall be allocated on the heap. The blob has one reference.
+ * Returns NULL on error and errno is set appropriately, in this case data is
+ * not taken by the blob
+*/
+blob_t* blob_store_insert(blob_store_t* store, uint64_t hash, void* data, size_t size);
+
+/**
+ * Drop a reference to blob. If it was the last one, the blob is removed from
+ * the store, and the caller shall destroy it with destroy_blob when it is
+ * convenient.
+ * Returns true if the blob has been removed
+*/
+bool blob_store_release(blob_store_t* store, blob_t* blob);
+
+/**
+ * Free a blob removed from its store by blob_store_release
+*/
+void destroy_blob(blob_t* blob);
+#endif
@@ -0,0 +1,92 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "file_storage_internal.h"
+
+// the times are in microseconds
+struct checkpoint_statistics {
+    unsigned long num_checkpoints;
+    unsigned long num_failures;
+    // time from the start of a checkpoint to the end of its snapshot
+    unsigned long last_duration;
+    unsigned long maximum_duration;
+    // time the storage lock is held to start a checkpoint, during which the
+    // clients are not served
+    unsigned long last_pause;
+    unsigned long maximum_pause;
+    unsigned long total_pause;
+    // size of the last snapshot written
+    size_t last_size;
+};
+
+/**
+ * Background checkpoints of the storage. A checkpoint prepares the snapshot
+ * (see prepare_snapshot) and forks a child process while holding the storage
+ * lock in write mode, then releases the lock: the child writes the snapshot
+ * from its copy-on-write image of the storage, that no one else modifies,
+ * while the workers keep serving the clients. The clients are paused only to
+ * build the index of the snapshot and to fork, not for the whole snapshot.
+ * The child only writes and syncs the snapshot to a temporary file opened by
+ * the parent, since the locks and the allocator of the other threads may be
+ * in an inconsistent state in its image. The parent moves the temporary file
+ * in place when the child is done.
+ * At most one checkpoint runs at a time. The functions are not thread safe,
+ * they are meant to be called by a single thread.
+*/
+typedef struct checkpoint {
+    // path of the snapshot, and of the temporary file written by the child
+    char* path;
+    char* tmp_path;
+    // temporary file of the running checkpoint, -1 if none is running
+    int fd;
+    // child writing the snapshot, -1 if no checkpoint is running
+    pid_t pid;
+    struct timespec start;
+    // sequence of the last record of the write-ahead log in the snapshot
+    uint64_t wal_sequence;
+    struct checkpoint_statistics statistics;
+} checkpoint_t;
+
+/**
+ * Create the checkpoints of a storage, whose snapshot is saved in path.
+ * The checkpoints shall be destroyed with destroy_checkpoint
+ * Returns NULL on error and errno is set appropriately
+*/
+checkpoint_t* create_checkpoint(const char* path);
+
+/**
+ * Wait for the running checkpoint, if any, and destroy the checkpoints
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_checkpoint(checkpoint_t* checkpoint, file_storage_t* storage);
+
+/**
+ * Start a checkpoint of the storage. Must be called without holding the
+ * storage lock, that is taken in write mode only to prepare the snapshot and
+ * to fork the child.
+ * Returns -1 on error and errno is set appropriately (EBUSY if a checkpoint is
+ * already running)
+*/
+int checkpoint_start(checkpoint_t* checkpoint, file_storage_t* storage);
+
+/**
+ * Returns true if a checkpoint is running
+*/
+bool checkpoint_is_running(checkpoint_t* checkpoint);
+
+/**
+ * Complete the running checkpoint if its snapshot is written, or wait for it
+ * if wait is true. When a checkpoint succeeds, its snapshot durably replaces
+ * the previous one, then the records of the write-ahead log of the storage
+ * that are in the snapshot are discarded.
+ * Returns 1 if the checkpoint succeeded, 0 if it is still running (or if none
+ * is running), -1 if it failed and errno is set to the error of the snapshot
+*/
+int checkpoint_finish(checkpoint_t* checkpoint, file_storage_t* storage, bool wait);
+#endif
@@ -0,0 +1,31 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stdlib.h>
+
+/**
+ * Block compressor of the LZ77 family, in the format of LZ4 blocks: the data
+ * is a sequence of literal runs, each one followed by a back reference to
+ * the previous 64KB of output. It is meant to be fast rather than to compress
+ * well, and it needs no memory except a small table on the stack.
+*/
+
+/**
+ * Returns the maximum size of the compression of size bytes
+*/
+size_t compress_bound(size_t size);
+
+/**
+ * Compress the size bytes of src in dst, that has room for capacity bytes
+ * Returns the size of the compressed data, or 0 if it does not fit in dst
+*/
+size_t compress_buffer(const void* src, size_t size, void* dst, size_t capacity);
+
+/**
+ * Decompress the size bytes of src, that shall be the compression of
+ * original_size bytes, in dst, that shall have room for them
+ * Returns -1 on error and errno is set appropriately (EINVAL if src is not
+ * a valid compression of original_size bytes)
+*/
+int decompress_buffer(const void* src, size_t size, void* dst, size_t original_size);
+#endif
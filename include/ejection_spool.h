@@ -0,0 +1,92 @@
+#ifndef EJECTION_SPOOL_H
+#define EJECTION_SPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "file_data.h"
+
+/**
+ * A file ejected from the storage that has not been delivered yet to the
+ * client whose request caused the ejection
+*/
+typedef struct ejected_file {
+    int client_fd;
+    // pinned files are going to be delivered as soon as the current request
+    // of the client completes, so they are never dropped
+    bool pinned;
+    char* filename;
+    size_t size;
+    file_data_t data;
+    struct ejected_file* next;
+} ejected_file_t;
+
+struct ejection_spool_statistics {
+    unsigned long num_spooled;
+    unsigned long num_dropped;
+    size_t maximum_size_reached;
+};
+
+/**
+ * The spool holds the ejected files outside the storage, so that they can be
+ * sent to the clients without holding the storage lock. The memory used by the
+ * spool is accounted separately from the storage and it is capped: when the
+ * spool is full the oldest files that are not pinned are dropped.
+ * All the functions are thread safe.
+*/
+typedef struct ejection_spool {
+    pthread_mutex_t mutex;
+    ejected_file_t* first;
+    ejected_file_t* last;
+    size_t total_size;
+    size_t max_size;
+    struct ejection_spool_statistics statistics;
+} ejection_spool_t;
+
+/**
+ * Create an empty spool that holds at most max_size bytes of files that are not pinned
+ * The spool shall be destroyed with destroy_ejection_spool
+ * Returns NULL on error and errno is set appropriately
+*/
+ejection_spool_t* create_ejection_spool(size_t max_size);
+
+/**
+ * Destroy the spool and all the files contained in it
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_ejection_spool(ejection_spool_t* spool);
+
+/**
+ * Put in the spool a file ejected for client_fd. The spool takes the ownership
+ * of filename, that shall be allocated on the heap, and the content of data is
+ * moved to the spool (data is left empty).
+ * If the file is not pinned and the spool is full, the oldest files that are
+ * not pinned are dropped (possibly the file itself, if it is bigger than the spool).
+ * The dropped files are not destroyed but added to the list dropped, so that
+ * the caller can destroy them with destroy_ejected_files after releasing its
+ * locks.
+ * Returns -1 on error and errno is set appropriately
+*/
+int ejection_spool_put(ejection_spool_t* spool, int client_fd, bool pinned, char* filename, file_data_t* data,
+    ejected_file_t** dropped);
+
+/**
+ * Remove from the spool all the files of client_fd and return them as a list,
+ * in the order they were ejected. The list is NULL if there are no files.
+ * The list shall be destroyed with destroy_ejected_files
+*/
+ejected_file_t* ejection_spool_take(ejection_spool_t* spool, int client_fd);
+
+/**
+ * Destroy a list of files returned by ejection_spool_take, or dropped by
+ * ejection_spool_put
+*/
+void destroy_ejected_files(ejected_file_t* list);
+
+/**
+ * Copy the statistics of the spool in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int ejection_spool_get_statistics(ejection_spool_t* spool, struct ejection_spool_statistics* stats);
+#endif
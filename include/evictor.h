@@ -0,0 +1,64 @@
+#ifndef EVICTOR_H
+#define EVICTOR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "file_storage_internal.h"
+#include "unbounded_shared_buffer.h"
+
+// maximum number of files ejected by the evictor before releasing the storage lock
+#define EVICTOR_BATCH_FILES 16
+
+/**
+ * Background evictor. The evictor is a thread that wakes up when the usage of
+ * the storage (the size, the number of files or the memory) crosses the high
+ * watermark, and then deletes files until the usage is below the low watermark.
+ * The files are ejected in batches, releasing the storage lock between them,
+ * so that the workers are not blocked for a long time.
+*/
+typedef struct evictor_s {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup_cond;
+    bool wakeup_requested;
+    bool terminate;
+
+    file_storage_t* storage;
+    usbuf_t* logger_buffer;
+
+    // thresholds derived from the watermarks
+    size_t high_size;
+    size_t low_size;
+    unsigned int high_num_files;
+    unsigned int low_num_files;
+    // 0 if the storage has no memory budget
+    size_t high_memory;
+    size_t low_memory;
+} evictor_t;
+
+/**
+ * Start the evictor thread on storage. high_watermark and low_watermark are
+ * percentages of max_storage_size, max_num_files and of the memory budget of
+ * the storage (if it has one), and it must be
+ * 0 < low_watermark < high_watermark <= 100.
+ * The evictor shall be stopped with evictor_stop
+ * Returns NULL on error and errno is set appropriately
+*/
+evictor_t* evictor_start(file_storage_t* storage, usbuf_t* logger_buffer, long max_storage_size, long max_num_files,
+    long high_watermark, long low_watermark);
+
+/**
+ * Wake up the evictor if the usage of the storage is above the high watermark.
+ * Must be called while holding the storage lock (in read or write mode), after
+ * an operation that increased the usage of the storage.
+ * Returns -1 on error and errno is set appropriately
+*/
+int evictor_notify(evictor_t* evictor);
+
+/**
+ * Stop the evictor thread and free its resources
+ * Returns -1 on error and errno is set appropriately
+*/
+int evictor_stop(evictor_t* evictor);
+#endif
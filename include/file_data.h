@@ -0,0 +1,135 @@
+#ifndef FILE_DATA_H
+#define FILE_DATA_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+// bounds of the size of the segments allocated by file_data_append. The size of
+// a new segment is the current size of the file, so the number of segments
+// grows logarithmically up to the maximum size, and linearly after it
+#define MIN_SEGMENT_SIZE 4096
+#define MAX_SEGMENT_SIZE (1024 * 1024)
+
+/**
+ * Content of a file, stored as an array of segments. Only the last segment
+ * can have free space, so appending data copies only the appended bytes and
+ * never moves the data already in the file.
+ * The segments are described by iovecs (iov_len is the used part of the
+ * segment), so the content can be sent as it is with writev.
+ * A content can have an inline buffer, owned by the structure that contains
+ * the content (see init_file_data_inline): if the first data appended fits in
+ * it, the inline buffer becomes the first segment, and a small content does
+ * not need any allocation.
+*/
+typedef struct file_data {
+    struct iovec* segments;
+    size_t num_segments;
+    // number of iovecs allocated in segments
+    size_t max_segments;
+    // bytes allocated for the last segment
+    size_t last_capacity;
+    // bytes allocated for the new segment of the pending reservation
+    size_t reserved_capacity;
+    // bytes allocated for all the segments, used or not, except the inline buffer
+    size_t capacity;
+    size_t size;
+
+    // inline buffer, NULL if there is none, and the array of segments used
+    // while the content is only in the inline buffer
+    void* inline_buffer;
+    size_t inline_capacity;
+    struct iovec inline_segment;
+} file_data_t;
+
+/**
+ * Initialize data to an empty content
+*/
+void init_file_data(file_data_t* data);
+
+/**
+ * Initialize data to an empty content, with buffer of capacity bytes as inline
+ * buffer. The buffer is never freed by data
+*/
+void init_file_data_inline(file_data_t* data, void* buffer, size_t capacity);
+
+/**
+ * Free all the segments of data, and leave it empty. The inline buffer is kept
+*/
+void destroy_file_data(file_data_t* data);
+
+/**
+ * Move the content of src to dst, that shall be empty, leaving src empty. The
+ * inline buffer of dst is not used, and if src uses its inline buffer the
+ * bytes in it are copied to a new segment.
+ * Returns -1 on error and errno is set appropriately, in this case src is not
+ * modified
+*/
+int file_data_move(file_data_t* dst, file_data_t* src);
+
+/**
+ * Returns true if the first segment of data is its inline buffer
+*/
+bool file_data_uses_inline(const file_data_t* data);
+
+/**
+ * Reserve space for size bytes at the end of data. reserved is filled with the
+ * two buffers where the bytes shall be written, in order: the free space of
+ * the last segment and a new segment (either of them can be empty).
+ * The content of data does not change until the reservation is committed with
+ * file_data_commit, or released with file_data_rollback.
+ * No other operation shall be done on data while a reservation is pending.
+ * Returns -1 on error and errno is set appropriately
+*/
+int file_data_reserve(file_data_t* data, size_t size, struct iovec reserved[2]);
+
+/**
+ * Add to the content of data the bytes written in the space reserved with
+ * file_data_reserve
+*/
+void file_data_commit(file_data_t* data, struct iovec reserved[2]);
+
+/**
+ * Release the space reserved with file_data_reserve, the content of data is
+ * not changed
+*/
+void file_data_rollback(file_data_t* data, struct iovec reserved[2]);
+
+/**
+ * Append size bytes, copied from buf, at the end of data. The free space of
+ * the last segment is filled first, then a new segment is allocated.
+ * Returns -1 on error and errno is set appropriately
+*/
+int file_data_append(file_data_t* data, const void* buf, size_t size);
+
+/**
+ * Returns the number of bytes that file_data_reserve or file_data_append
+ * allocate to append size bytes at the end of data
+*/
+size_t file_data_append_capacity(const file_data_t* data, size_t size);
+
+/**
+ * Append buf, that is size bytes long, at the end of data as a new segment.
+ * buf is not copied: data takes the ownership of it, so it shall be allocated
+ * on the heap. If data is empty and buf fits in the inline buffer, buf is
+ * copied there and freed.
+ * Returns -1 on error and errno is set appropriately, in this case buf is not
+ * taken by data
+*/
+int file_data_append_buffer(file_data_t* data, void* buf, size_t size);
+
+/**
+ * Append the count buffers described by buffers at the end of data, each as a
+ * new segment. The buffers are not copied, as in file_data_append_buffer, and
+ * the inline buffer is never used.
+ * Returns -1 on error and errno is set appropriately, in this case no buffer
+ * is taken by data
+*/
+int file_data_append_buffers(file_data_t* data, const struct iovec* buffers, size_t count);
+
+/**
+ * Copy the whole content of data in buf, that shall be at least data->size
+ * bytes long
+*/
+void file_data_copy(const file_data_t* data, void* buf);
+#endif
@@ -1,14 +1,45 @@
 #ifndef FILE_STORAGE_API_H
 #define FILE_STORAGE_API_H
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
 
+/**
+ * Metadata of a file stored in the server
+*/
+struct file_info {
+    char* filename;
+    size_t size;
+    uint64_t version;
+    int locked; // the file is locked by some client
+    int locked_by_me; // the file is locked by this client
+    int opened_by_me; // the file is opened by this client
+};
+
 int openConnection(const char* sockname, int msec, const struct timespec abstime);
 int closeConnection(const char* sockname);
 
+/**
+ * Open the file pathname. flags is a combination of O_CREATE, O_LOCK and
+ * O_HANDLE. With O_HANDLE the server returns a handle of the file, that is used
+ * instead of the name by readFile, writeFile, appendToFile, lockFile, unlockFile
+ * and closeFile until the file is closed or removed.
+ * Returns -1 on error and errno is set appropriately.
+*/
 int openFile(const char* pathname, int flags);
 int readFile(const char* pathname, void** buf, size_t* size);
+
+/**
+ * Conditional version of readFile.
+ * *version shall contain the version of the copy cached by the caller, or 0 if
+ * the caller has no copy of the file. If the file on the server has a different
+ * version, then its content is returned in buf and size as in readFile, the new
+ * version is stored in *version and the function returns 0. If the version is
+ * the same, then buf and size are not modified and the function returns 1.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int readFileIfModified(const char* pathname, void** buf, size_t* size, uint64_t* version);
 int readNFiles(int n, const char* dirname);
 int writeFile(const char* pathname, const char* dirname);
 int appendToFile(const char* pathname, void* buf, size_t size, const char* dirname);
@@ -16,6 +47,71 @@ int appendToFile(const char* pathname, void* buf, size_t size, const char* dirna
 int lockFile(const char* pathname);
 int unlockFile(const char* pathname);
 
+/**
+ * Get the metadata of the file pathname. No data is transferred.
+ * info->filename is allocated on the heap and shall be freed by the caller.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int statFile(const char* pathname, struct file_info* info);
+
+/**
+ * List at most max files (all if max <= 0) whose name begins with prefix
+ * (NULL or "" for every file). Only the metadata is transferred.
+ * *cursor shall be 0 to start listing from the beginning. On return the
+ * cursor is updated so that the next call continues where this one stopped;
+ * the listing is over when less than max entries are returned.
+ * The entries are returned in a newly allocated array that shall be freed
+ * with freeFileInfo.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int listFiles(const char* prefix, uint64_t* cursor, int max, struct file_info** entries, size_t* num_entries);
+
+/**
+ * Free an array of num_entries entries returned by listFiles
+*/
+void freeFileInfo(struct file_info* entries, size_t num_entries);
+
+/**
+ * Read the n files in pathnames with a single request.
+ * The content of the i-th file is returned in bufs[i] and sizes[i], the buffers
+ * are allocated on the heap and shall be freed by the caller. If the i-th file
+ * could not be read, then bufs[i] is NULL.
+ * Returns the number of files read on success, -1 on error and errno is set appropriately.
+*/
+int readFiles(size_t n, const char* pathnames[], void* bufs[], size_t sizes[]);
+
+/**
+ * Remove the n files in pathnames with a single request.
+ * Returns the number of files removed on success, -1 on error and errno is set appropriately.
+*/
+int removeFiles(size_t n, const char* pathnames[]);
+
+/**
+ * Lock the n files in pathnames with a single request. Either all the files are
+ * locked or none of them is; the call does not wait if a file is locked by
+ * another client, it fails instead.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int lockFiles(size_t n, const char* pathnames[]);
+
 int closeFile(const char* pathname);
 int removeFile(const char* pathname);
+/**
+ * Choose what the server sends to this client when one of its requests causes
+ * the ejection of some files: the whole files (EJECT_SEND_FILES, the default),
+ * only their names (EJECT_SEND_NAMES) or nothing (EJECT_DISCARD).
+ * With EJECT_DEFERRED the server keeps the files, for a limited amount of
+ * space, until they are asked with drainEjected.
+ * The choice lasts until the connection is closed.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int setEjectionMode(int mode);
+
+/**
+ * Receive the files ejected because of the requests of this client and kept by
+ * the server (see EJECT_DEFERRED). If dirname is not NULL the files are stored
+ * in dirname.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int drainEjected(const char* dirname);
 #endif
\ No newline at end of file
@@ -3,10 +3,40 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/select.h>
 #include <unistd.h>
 
+#include "blob_store.h"
+#include "file_data.h"
+#include "object_pool.h"
 #include "rw_lock.h"
+#include "spill_store.h"
+#include "wal.h"
+
+// estimate of the bookkeeping bytes that malloc adds to every allocation
+#define ALLOCATION_OVERHEAD 16
+
+// the shared contents are split in chunks of this size, the last chunk of a
+// file can be shorter
+#define FILE_CHUNK_SIZE (64 * 1024)
+#define NUM_FILE_CHUNKS(size) (((size) + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE)
+
+// a file is compressed only if it has at least MIN_COMPRESSIBLE_SIZE bytes,
+// and only if the compression saves at least 1/COMPRESSION_MIN_GAIN of them
+#define MIN_COMPRESSIBLE_SIZE 1024
+#define COMPRESSION_MIN_GAIN 8
+
+/**
+ * Memory used by files, see update_file_memory
+*/
+struct file_memory {
+    // segments of the content, including their free space
+    size_t data;
+    // vfile structure and array of the segments
+    size_t metadata;
+    size_t names;
+};
 
 enum file_replacement_policy {
     FIFO_REPLACEMENT,
@@ -18,6 +48,12 @@ typedef struct vfile {
     // metadata
     char* filename;
     size_t size;
+    // identifier assigned when the file is added to the storage. Identifiers
+    // are strictly increasing along the list of files, so they can be used as
+    // a stable cursor to iterate over the storage
+    uint64_t id;
+    // handle of the file, see get_file_from_handle
+    uint64_t handle;
     struct vfile* next;
     struct vfile* prev;
 
@@ -26,19 +62,66 @@ typedef struct vfile {
     fd_set lock_queue;
     int lock_queue_max;
 
+    // version of the content, it changes every time the content is modified
+    uint64_t version;
+
     // metadata for LFU replacement algorithm
     pthread_mutex_t replacement_mutex;
     unsigned int used_counter;
     time_t last_used;
 
-    // actual data
-    void* data;
+    // actual data, data.size is equal to size unless the content is shared
+    file_data_t data;
+    // chunks of the content, shared with the other files that contain them,
+    // NULL if the content is in data (see share_file_chunks)
+    blob_t** chunks;
+    size_t num_chunks;
+    // buffers of the chunks in order, to send the content with writev
+    struct iovec* chunk_segments;
+    // compressed content, NULL if the file is not compressed (see
+    // compress_file). When it is not NULL, data is empty
+    void* compressed;
+    size_t compressed_size;
+    // the content did not compress well, it is not tried again until the
+    // content changes
+    bool incompressible;
+    // content in the snapshot mapped by load_snapshot, iov_base is NULL if the
+    // content is not mapped. A mapped content is read in place, and it is
+    // copied in data before it is modified (see unshare_file_content)
+    struct iovec mapped;
+
+    // memory of the file that is charged to the storage
+    struct file_memory memory;
+
+    // inline buffer of the content, of inline_file_size bytes (see
+    // create_file_storage). It is allocated together with the structure
+    char inline_data[];
 } vfile_t;
 
+// an entry of the handle table. When the file is removed, the generation is
+// incremented, so that the old handles of the slot are not valid anymore
+struct handle_slot {
+    struct vfile* file;
+    uint32_t generation;
+    uint32_t next_free;
+};
+
 struct file_storage_statistics {
     size_t maximum_size_reached;
     unsigned int maximum_num_files;
     unsigned long num_replacements;
+    // replacements done by the background evictor (counted also in num_replacements)
+    unsigned long num_background_replacements;
+    unsigned long num_evictor_runs;
+    size_t maximum_memory_reached;
+    // chunks written that were already in the storage
+    unsigned long num_deduplicated_chunks;
+    unsigned long num_compressions;
+    // compressed files decompressed in place, reads do not count
+    unsigned long num_decompressions;
+    // files opened that were in the storage, and files opened that were not
+    unsigned long num_ram_hits;
+    unsigned long num_ram_misses;
 };
 
 typedef struct file_storage {
@@ -48,15 +131,50 @@ typedef struct file_storage {
     rw_lock_t* rw_lock;
     unsigned int num_files;
     size_t total_size;
+    // memory used by the files in the storage, including the metadata and the
+    // allocation overhead. It is limited by max_memory, if it is not 0
+    struct file_memory memory;
+    size_t max_memory;
+    uint64_t version_clock;
+    uint64_t next_id;
+    // handle table, the free slots are kept in a list linked through next_free
+    struct handle_slot* handle_slots;
+    uint32_t handle_slots_size;
+    uint32_t first_free_slot;
+    // the vfile structures, with their inline buffer, are allocated from this pool
+    object_pool_t* vfile_pool;
+    size_t inline_file_size;
+    // chunks shared by the files, NULL if the deduplication is disabled.
+    // total_size counts the bytes of every chunk only once, and
+    // deduplicated_size counts the bytes of the other references to them
+    blob_store_t* blobs;
+    size_t deduplicated_size;
+    // the cold files are compressed before any file is ejected, see
+    // compress_file. total_size counts the compressed size of the files, and
+    // compression_savings the bytes saved by the compression
+    bool compression;
+    size_t compression_savings;
+    // second tier where the ejected files are spilled, NULL if it is disabled.
+    // It is not owned by the storage, so it is not destroyed with it
+    spill_store_t* spill;
+    // snapshot mapped in memory by load_snapshot, NULL if there is none. It is
+    // unmapped when the storage is destroyed
+    void* snapshot;
+    size_t snapshot_size;
+    // write-ahead log where the mutations are recorded, NULL if it is
+    // disabled. It is not owned by the storage, so it is not closed with it
+    wal_t* wal;
     struct file_storage_statistics statistics;
 } file_storage_t;
 
 /*
  * Creates an empty file storage with given replacement policy.
+ * The content of the files up to inline_file_size bytes is stored inline in the
+ * vfile structure, without any other allocation (0 disables the inline storage).
  * The storage shall be destroyed using destoy_file_storage
  * Returns NULL on error and errno is set appropriately
 */
-file_storage_t* create_file_storage(enum file_replacement_policy replacement_policy);
+file_storage_t* create_file_storage(enum file_replacement_policy replacement_policy, size_t inline_file_size);
 
 /**
  * Destroy a file storage object. The function destroys all the files that are
@@ -66,17 +184,144 @@ file_storage_t* create_file_storage(enum file_replacement_policy replacement_pol
 int destroy_file_storage(file_storage_t* storage);
 
 /*
- * Creates an empty vfile
+ * Creates an empty vfile, that can be added to storage
  * The vfile shall be destroyed using destroy_vfile
  * Returns NULL on error and errno is set appropriately
 */
-vfile_t* create_vfile();
+vfile_t* create_vfile(file_storage_t* storage);
+
+/**
+ * Destroy a vfile object created for storage.
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_vfile(file_storage_t* storage, vfile_t* vfile);
+
+/**
+ * Put a vfile, already removed from the storage, in the list of retired files.
+ * Destroying a file can take a long time for big files, so it should not be
+ * done while holding the storage lock: the file is retired instead, and the
+ * list is destroyed with destroy_retired_vfiles after the lock is released.
+ * The list is linked through the next field of the files, so no memory is
+ * allocated. *retired shall be NULL for an empty list.
+*/
+void retire_vfile(vfile_t** retired, vfile_t* vfile);
+
+/**
+ * Destroy all the files in the list of retired files, and empty the list
+*/
+void destroy_retired_vfiles(file_storage_t* storage, vfile_t** retired);
+
+/**
+ * Enable the deduplication of the contents of the files: the files are
+ * stored as sequences of chunks, and the chunks with the same data are shared
+ * (see share_file_chunks)
+ * Returns -1 on error and errno is set appropriately
+*/
+int enable_file_deduplication(file_storage_t* storage);
+
+/**
+ * Returns the segments of the content of vfile, either its own, its chunks or
+ * its mapped content, and stores their number in num_segments
+*/
+const struct iovec* get_file_segments(const vfile_t* vfile, size_t* num_segments);
+
+/**
+ * Compute the hashes of the chunks of the size bytes of buf. hashes shall
+ * have room for NUM_FILE_CHUNKS(size) hashes
+*/
+void hash_file_chunks(const void* buf, size_t size, uint64_t* hashes);
+
+/**
+ * Compute the storage space and the memory needed to store the size bytes of
+ * buf in chunks, whose hashes are hashes: only the chunks that are not in the
+ * storage are counted.
+ * Must be called while holding the storage lock.
+*/
+void estimate_file_chunks(file_storage_t* storage, const void* buf, size_t size, const uint64_t* hashes,
+    size_t* space_needed, size_t* memory_needed);
+
+/**
+ * First step to make the size bytes of buf, whose chunks have the given
+ * hashes (see hash_file_chunks), the content of the empty vfile that is in the
+ * storage: the file takes a reference to the chunks that are already in the
+ * storage, so that they are not freed if other files are ejected before the
+ * second step, see fill_file_chunks.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int share_file_chunks(file_storage_t* storage, vfile_t* vfile, const void* buf, size_t size, const uint64_t* hashes);
+
+/**
+ * Second step to make the size bytes of buf the content of vfile, after
+ * share_file_chunks: the chunks that were not in the storage are copied in
+ * new chunks. total_size is incremented only by the bytes of the new chunks.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately, in this case vfile is
+ * left empty
+*/
+int fill_file_chunks(file_storage_t* storage, vfile_t* vfile, const void* buf, const uint64_t* hashes);
+
+/**
+ * Give to vfile, that is in the storage, its own copy of the content of its
+ * chunks or of its mapped content, so that it can be modified (copy on write).
+ * Nothing is done if the content of vfile is not in chunks and not mapped.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int unshare_file_content(file_storage_t* storage, vfile_t* vfile);
+
+/**
+ * Compress the content of vfile, that is in the storage. If the content does
+ * not compress well the file is left as it is, and it is marked as
+ * incompressible. The content of a compressed file is not in data, it shall
+ * be read with decompress_file_to_buffer, or decompressed in place with
+ * decompress_file before it is modified.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int compress_file(file_storage_t* storage, vfile_t* vfile);
+
+/**
+ * Decompress the content of vfile, that is in the storage, in its data.
+ * Nothing is done if vfile is not compressed.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int decompress_file(file_storage_t* storage, vfile_t* vfile);
 
 /**
- * Destroy a vfile object.
+ * Decompress the content of the compressed vfile in buf, that shall have room
+ * for vfile->size bytes. The file is not modified, so the storage lock can be
+ * held in read mode.
  * Returns -1 on error and errno is set appropriately
 */
-int destroy_vfile(vfile_t* vfile);
+int decompress_file_to_buffer(const vfile_t* vfile, void* buf);
+
+/**
+ * Returns the size of the contents of all the files in the storage, counting
+ * the shared chunks once for every reference and the compressed files with
+ * their original size. total_size is the physical size
+*/
+size_t get_logical_size(const file_storage_t* storage);
+
+/**
+ * Compute the memory used by vfile, and update the memory charged to the
+ * storage. Shall be called after the content of a file in the storage changes
+ * (add_vfile_to_storage and remove_file_from_storage do it by themselves).
+ * Must be called while holding the storage lock in write mode.
+*/
+void update_file_memory(file_storage_t* storage, vfile_t* vfile);
+
+/**
+ * Returns the total memory charged to the storage
+*/
+size_t get_storage_memory(const file_storage_t* storage);
+
+/**
+ * Returns true if the storage has a memory budget and memory_needed more bytes
+ * would exceed it
+*/
+bool is_memory_exceeded(const file_storage_t* storage, size_t memory_needed);
 
 /**
  * Get the rw lock contained in the storage
@@ -102,11 +347,23 @@ int add_vfile_to_storage(file_storage_t* storage, vfile_t* vfile);
 /**
  * Remove a file from the storage.
  * The file is simply removed from the storage and it is up to the caller to destroy it.
+ * If the content of the file is in chunks, the file drops its references: the
+ * chunks that are not referenced anymore are given back to the file, so that
+ * they are freed when it is destroyed.
  * As for add_vfile_to_storage, the caller now takes 'ownership' of the file.
  * Returns -1 on error and errno is set appropriately.
 */
 int remove_file_from_storage(file_storage_t* storage, vfile_t* vfile);
 
+/**
+ * Remove a file from the storage, as remove_file_from_storage, but the file
+ * keeps the whole content of its chunks (the ones shared with other files are
+ * copied), its decompressed content or a copy of its mapped content, so that the content can outlive the
+ * file in the storage. The copies are not charged to the storage.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int take_file_from_storage(file_storage_t* storage, vfile_t* vfile);
+
 /**
  * Returns a pointer to a victim file, chosen using the policy of the storage
  * If file_to_exclude is not NUL, then it is never returned
@@ -114,6 +371,14 @@ int remove_file_from_storage(file_storage_t* storage, vfile_t* vfile);
 */
 vfile_t* choose_victim_file(file_storage_t* storage, vfile_t* file_to_exclude);
 
+/**
+ * Returns a pointer to the file to compress, chosen among the files that can
+ * be compressed using the policy of the storage, as choose_victim_file.
+ * If file_to_exclude is not NUL, then it is never returned
+ * Returns NULL if no file can be compressed
+*/
+vfile_t* choose_compression_candidate(file_storage_t* storage, vfile_t* file_to_exclude);
+
 /**
  * Return a pointer to the file in the storage with given filename. If the file
  * is not found then the function returns NULL and errno is set to ENOENT
@@ -121,6 +386,36 @@ vfile_t* choose_victim_file(file_storage_t* storage, vfile_t* file_to_exclude);
 */
 vfile_t* get_file_from_name(file_storage_t* storage, size_t filename_len, const char* filename);
 
+/**
+ * Return a pointer to the file in the storage with given handle. A handle is
+ * assigned to a file when it is added to the storage and it is not valid anymore
+ * after the file is removed, even if the slot is reused by another file.
+ * If the handle is not valid then the function returns NULL and errno is set
+ * to ENOENT. Handle 0 is never valid.
+ * Returns NULL on error and errno is set appropriately.
+*/
+vfile_t* get_file_from_handle(file_storage_t* storage, uint64_t handle);
+
+/**
+ * Rebuild the handle table of the storage from the generations of the
+ * num_slots slots of the table of another storage, so that the handles given
+ * out by that storage stay valid: vfile->handle of each file shall be set to
+ * the handle the file had there, or to 0. The files whose handle does not fit
+ * in the table are given a new handle.
+ * Must be called before the storage is shared with other threads.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int restore_file_handles(file_storage_t* storage, const uint32_t* generations, uint32_t num_slots);
+
+/**
+ * Assign a new version to vfile. Versions are taken from a clock that is
+ * global to the storage, so a version is never reused, not even by a file that
+ * is removed and then created again with the same name.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int bump_file_version(file_storage_t* storage, vfile_t* vfile);
+
 /**
  * Atomically increment the used counter in vfile
  * This is safe to use even when the mutual exclusion is acquired in read mode
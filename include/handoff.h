@@ -0,0 +1,187 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/select.h>
+#include <sys/types.h>
+
+#include "file_storage_internal.h"
+#include "server_worker.h"
+
+// identifies a handoff and the version of its format
+#define HANDOFF_MAGIC "FSHOFF03"
+#define HANDOFF_MAGIC_LENGTH 8
+
+// maximum number of client connections passed in a single message
+#define HANDOFF_FDS_PER_MESSAGE 128
+
+/**
+ * The handoff passes a running server to a new process, so that a new build
+ * of the server is deployed without downtime. The new process connects to the
+ * control socket of the running one, that stops serving the clients and sends
+ * on the socket (with SCM_RIGHTS) its listening socket, the connections of
+ * its clients and two memory files: a snapshot of the storage (see
+ * save_snapshot_fd), that the new process maps without copying the contents,
+ * and the session of the clients. The requests of the clients wait in their
+ * connections, and their open files, locks, queued lock requests and file
+ * handles are preserved, so the clients do not notice the handoff. The files
+ * also keep their versions, and the version clock of the storage goes on from
+ * the one of the old process, so the versions cached by the clients stay
+ * valid.
+ *
+ * The snapshot is a full copy of the contents of the files, decompressed, so
+ * the memory of the files is doubled until the new process has taken over and
+ * the old one exits. With the write-ahead log the copy does not stop the
+ * clients: the running server writes the snapshot in background, from a
+ * forked child as a checkpoint does (see handoff_start_snapshot), while it
+ * keeps serving the clients, then it stops serving them only to send the
+ * session, and the new process catches up with the mutations after the
+ * snapshot replaying the log. Without the log the snapshot is written while
+ * the clients wait, and the pause grows with the size of the storage.
+ *
+ * The session is the header, followed by a handoff_client for every client,
+ * in the order their connections are sent, by the generations of the slots of
+ * the handle table (a uint32_t each), and by a handoff_file for every file,
+ * each followed by the name of the file, by the fds of the clients that
+ * opened it and by the fds of the clients waiting for its lock (an int32_t
+ * each). The fds are the ones of the running server. The numbers are in the
+ * byte order of the machine.
+*/
+struct handoff_header {
+    char magic[HANDOFF_MAGIC_LENGTH];
+    uint64_t num_clients;
+    uint64_t num_slots;
+    uint64_t num_files;
+    uint64_t version_clock;
+    // sequence of the last record of the write-ahead log when the session
+    // is written, the new process replays the log up to it
+    uint64_t wal_sequence;
+};
+
+struct handoff_client {
+    int32_t fd;
+    char eject_mode;
+};
+
+struct handoff_file {
+    uint64_t handle;
+    uint64_t version;
+    uint64_t name_length;
+    // -1 if the file is not locked
+    int32_t locked_by;
+    uint32_t num_opened;
+    uint32_t num_queued;
+};
+
+/**
+ * Snapshot of the storage for a handoff, written in background by
+ * handoff_start_snapshot
+*/
+typedef struct handoff_snapshot {
+    // memory file of the snapshot, -1 if there is none
+    int fd;
+    // child writing the snapshot, -1 if it is done
+    pid_t pid;
+} handoff_snapshot_t;
+
+/**
+ * Callback of handoff_receive, called after the snapshot is loaded and
+ * before the session is applied, to apply to the storage the mutations of
+ * the write-ahead log after the record *wal_sequence. *wal_sequence shall be
+ * updated to the last record applied.
+ * Returns -1 on error
+*/
+typedef int (*handoff_catch_up_t)(void* arg, file_storage_t* storage, uint64_t* wal_sequence);
+
+/**
+ * State of the server received by handoff_receive
+*/
+typedef struct handoff_state {
+    int listen_fd;
+    // connections of the clients
+    fd_set clients;
+    int clients_max;
+    unsigned int num_clients;
+    // number of files loaded in the storage
+    long num_files;
+    // sequence of the last record of the write-ahead log in the storage
+    uint64_t wal_sequence;
+} handoff_state_t;
+
+/**
+ * Create the control socket of the handoff, listening in path. An old socket
+ * in path, left by the server that handed off to this one, is replaced
+ * Returns the socket, or -1 on error and errno is set appropriately
+*/
+int handoff_listen(const char* path);
+
+/**
+ * Connect to the control socket in path of a running server, to take it over
+ * with handoff_receive
+ * Returns the connection, or -1 on error and errno is set appropriately
+ * (ENOENT or ECONNREFUSED if no server is running)
+*/
+int handoff_connect(const char* path);
+
+/**
+ * Start writing a snapshot of the storage for a handoff in a memory file. The
+ * storage lock is taken in write mode only to prepare the snapshot and to
+ * fork the child that writes it, then the storage can change: the mutations
+ * after the snapshot are in the write-ahead log of the storage, that shall
+ * be enabled, and no records shall be discarded from the log until the
+ * handoff. The snapshot is completed by handoff_finish_snapshot and released
+ * by handoff_discard_snapshot.
+ * Must be called without holding the storage lock.
+ * Returns -1 on error and errno is set appropriately
+*/
+int handoff_start_snapshot(file_storage_t* storage, handoff_snapshot_t* snapshot);
+
+/**
+ * Complete the snapshot if it is written, or wait for it if wait is true.
+ * Returns 1 if the snapshot is written, 0 if it is still running, -1 if it
+ * failed and errno is set to the error of the snapshot (the memory file is
+ * released)
+*/
+int handoff_finish_snapshot(handoff_snapshot_t* snapshot, bool wait);
+
+/**
+ * Release the snapshot, stopping the child that writes it if it is running
+*/
+void handoff_discard_snapshot(handoff_snapshot_t* snapshot);
+
+/**
+ * Send the server to the process connected to control_fd: the listening
+ * socket listen_fd, the connections of the clients in clients (up to
+ * clients_max) with their state in connections, and the storage, with
+ * wal_sequence as the last record of the write-ahead log in it. snapshot_fd
+ * is a snapshot written by handoff_start_snapshot, whose missing mutations
+ * are in the write-ahead log up to wal_sequence, or -1 to write the snapshot
+ * now. The function returns when the new process has loaded the storage:
+ * from then on the new process serves the clients, and the caller shall not
+ * read or write the connections, nor modify the storage or the write-ahead
+ * log.
+ * Must be called when no other thread uses the storage or the connections.
+ * Returns -1 on error and errno is set appropriately: the new process did not
+ * take over, and the caller can keep serving the clients
+*/
+int handoff_send(int control_fd, file_storage_t* storage, int snapshot_fd, int listen_fd, const fd_set* clients,
+    int clients_max, const connection_state_t* connections, uint64_t wal_sequence);
+
+/**
+ * Receive the server sent by handoff_send on control_fd. The files are loaded
+ * in the storage, that shall be empty, within max_num_files and
+ * max_storage_size (see load_snapshot_fd), then catch_up (if not NULL) is
+ * called with catch_up_arg to apply the mutations after the snapshot, then
+ * the files take their handles and the sessions of the clients are applied to
+ * the files and to connections (FD_SETSIZE elements). The listening socket
+ * and the connections are stored in state.
+ * Must be called before the storage is shared with other threads.
+ * Returns -1 on error and errno is set appropriately (EPROTO if the storage
+ * misses mutations after the snapshot): the old process keeps serving the
+ * clients, and the files loaded so far stay in the storage
+*/
+int handoff_receive(int control_fd, file_storage_t* storage, unsigned int max_num_files, size_t max_storage_size,
+    connection_state_t* connections, handoff_catch_up_t catch_up, void* catch_up_arg, handoff_state_t* state);
+#endif
@@ -1,6 +1,11 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include "object_pool.h"
+
+// size of the buffer of a log message, including the terminator
+#define LOG_MESSAGE_SIZE 512
+
 /**
  * Logger thread entry point
  * arg must be a pointer to an unbonded shared buffer allocated on the heap
@@ -12,15 +17,53 @@
 */
 void* logger_entry_point(void* arg);
 
+/**
+ * Keep the content of the log file when the logger opens it, instead of
+ * truncating it. It shall be called before the logger is started
+*/
+void keep_previous_log(void);
+
+/**
+ * Create the pool of the log messages, shared by all the loggers of the
+ * process. If the pool is not created the messages are allocated with malloc.
+ * It shall be called before any message is logged, and the pool shall be
+ * destroyed with destroy_log_message_pool after all the loggers terminated
+ * Returns -1 on error and errno is set appropriately
+*/
+int create_log_message_pool(void);
+
+/**
+ * Destroy the pool of the log messages
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_log_message_pool(void);
+
+/**
+ * Allocate a log message of LOG_MESSAGE_SIZE bytes
+ * Returns NULL on error and errno is set appropriately
+*/
+char* alloc_log_message(void);
+
+/**
+ * Free a log message allocated with alloc_log_message
+*/
+void free_log_message(char* message);
+
+/**
+ * Copy the statistics of the pool of the log messages in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int get_log_message_pool_statistics(struct object_pool_statistics* stats);
+
 /**
  * Log macro for easy formatted logging
 */
-#define LOG(log_buf, ...)                                         \
-    {                                                             \
-        char* log_str;                                            \
-        DIE_NULL(log_str = malloc(512 * sizeof(char)), "malloc"); \
-        sprintf(log_str, __VA_ARGS__);                            \
-        usbuf_put(log_buf, log_str);                              \
+#define LOG(log_buf, ...)                                                 \
+    {                                                                     \
+        char* log_str;                                                    \
+        DIE_NULL(log_str = alloc_log_message(), "alloc_log_message");     \
+        snprintf(log_str, LOG_MESSAGE_SIZE, __VA_ARGS__);                 \
+        usbuf_put(log_buf, log_str);                                      \
     }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,82 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <pthread.h>
+#include <stdlib.h>
+
+// number of objects allocated at once when the pool is empty
+#define OBJECT_POOL_SLAB_OBJECTS 64
+// number of objects moved at once between a thread cache and the pool
+#define OBJECT_POOL_CACHE_BATCH 32
+
+struct object_pool_statistics {
+    // size of the objects, including the padding
+    size_t object_size;
+    unsigned long num_slabs;
+    // number of times a thread cache took objects from the pool, and gave
+    // objects back to the pool
+    unsigned long num_refills;
+    unsigned long num_flushes;
+    // objects outside the shared free list: in use or in the thread caches
+    unsigned long num_taken;
+    unsigned long maximum_taken;
+};
+
+struct object_pool_cache;
+
+/**
+ * Pool of objects of the same size. The objects are allocated in slabs of
+ * OBJECT_POOL_SLAB_OBJECTS objects, and they are never given back to the
+ * system until the pool is destroyed.
+ * Every thread has a private cache of free objects, so most of the allocations
+ * and deallocations do not need any synchronization. The caches exchange
+ * objects with the shared free list of the pool, protected by the mutex, in
+ * batches of OBJECT_POOL_CACHE_BATCH objects.
+ * All the functions are thread safe, and an object can be freed by a thread
+ * different from the one that allocated it.
+*/
+typedef struct object_pool {
+    size_t object_size;
+    pthread_mutex_t mutex;
+    // key of the cache of the calling thread
+    pthread_key_t cache_key;
+    // free objects, linked through their first word
+    void* free_list;
+    // all the slabs allocated, linked through their first word
+    void* slabs;
+    // all the caches of the threads, so that they can be freed with the pool
+    struct object_pool_cache* caches;
+    struct object_pool_statistics statistics;
+} object_pool_t;
+
+/**
+ * Create a pool of objects of object_size bytes
+ * The pool shall be destroyed with destroy_object_pool
+ * Returns NULL on error and errno is set appropriately
+*/
+object_pool_t* create_object_pool(size_t object_size);
+
+/**
+ * Destroy the pool and free all the objects, including the ones that are in use.
+ * No thread shall use the pool during and after this call
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_object_pool(object_pool_t* pool);
+
+/**
+ * Get an object from the pool. The content of the object is undefined
+ * Returns NULL on error and errno is set appropriately
+*/
+void* object_pool_alloc(object_pool_t* pool);
+
+/**
+ * Give back to the pool an object obtained with object_pool_alloc
+*/
+void object_pool_free(object_pool_t* pool, void* object);
+
+/**
+ * Copy the statistics of the pool in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int object_pool_get_statistics(object_pool_t* pool, struct object_pool_statistics* stats);
+#endif
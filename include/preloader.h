@@ -0,0 +1,48 @@
+#ifndef PRELOADER_H
+#define PRELOADER_H
+
+#include <stdlib.h>
+
+#include "access_hints.h"
+#include "file_storage_internal.h"
+#include "unbounded_shared_buffer.h"
+
+struct preload_statistics {
+    // regular files found in the directory tree
+    unsigned long num_found;
+    unsigned long num_loaded;
+    // files already in the storage, or bigger than the storage
+    unsigned long num_skipped;
+    // files that could not be read
+    unsigned long num_errors;
+    // bytes of the files loaded
+    size_t loaded_size;
+    // files ejected to make room for the files loaded
+    unsigned long num_ejected;
+    // files loaded that took their access hint
+    unsigned long num_hinted;
+    // microseconds from the start of the preload to its end
+    unsigned long duration;
+};
+
+/**
+ * Load in the storage all the regular files of the directory tree rooted at
+ * dirname, with the names that `client -w dirname` would give them (the path
+ * of the file starting with dirname). The tree is walked by the calling
+ * thread while num_readers threads read the files and add them to the
+ * storage, so that the disk is kept busy. The storage stays within
+ * max_num_files, max_storage_size and its memory budget: when it is full the
+ * files chosen by the replacement policy are ejected (or compressed, if the
+ * compression is enabled), as for the files written by the clients. The files
+ * already in the storage are not replaced, and the files loaded are not
+ * recorded in the write-ahead log. Symbolic links to directories are not
+ * followed. The files that cannot be read are logged and skipped. If hints is
+ * not NULL every file loaded takes its access hint (see
+ * apply_file_access_hint) before the files are ejected to make room for it.
+ * Must be called before the storage is shared with the workers.
+ * Returns -1 on error and errno is set appropriately, the statistics of the
+ * preload are stored in stats
+*/
+int preload_directory(file_storage_t* storage, const char* dirname, unsigned int num_readers, long max_num_files,
+    long max_storage_size, const access_hints_t* hints, usbuf_t* logger_buffer, struct preload_statistics* stats);
+#endif
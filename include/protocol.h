@@ -8,6 +8,16 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#include "arena.h"
+
+// maximum number of names in a batch operation
+#define MAX_BATCH_FILES 4096
+// maximum size of a payload allocated from the arena of a packet, bigger
+// payloads are always allocated on the heap
+#define PACKET_ARENA_MAX_DATA 4096
 
 enum opcodes {
     NIL, // <- for representing an invalid packet
@@ -23,7 +33,26 @@ enum opcodes {
     APPEND_TO_FILE,
     LOCK_FILE,
     UNLOCK_FILE,
-    REMOVE_FILE
+    REMOVE_FILE,
+    READ_FILE_IF_MODIFIED,
+    VERSIONED_DATA,
+    NOT_MODIFIED,
+    LIST_FILES,
+    STAT_FILE,
+    FILE_INFO,
+    READ_FILES,
+    REMOVE_FILES,
+    LOCK_FILES,
+    HANDLE,
+    READ_HANDLE,
+    WRITE_HANDLE,
+    APPEND_HANDLE,
+    LOCK_HANDLE,
+    UNLOCK_HANDLE,
+    CLOSE_HANDLE,
+    SET_OPTIONS,
+    FILE_NAME,
+    DRAIN_EJECTED
 };
 
 enum err_codes {
@@ -34,12 +63,32 @@ enum err_codes {
     FILE_IS_NOT_OPENED,
     FILE_WAS_ALREADY_WRITTEN,
     FILE_IS_TOO_BIG,
-    FILE_IS_NOT_LOCKED
+    FILE_IS_NOT_LOCKED,
+    INVALID_OPTION,
+    // the request is malformed, the server closes the connection
+    INVALID_REQUEST
 };
 
 enum flags {
     O_CREATE = 1, //0b01
-    O_LOCK = 2 //0b10
+    O_LOCK = 2, //0b10
+    O_HANDLE = 4 //0b100
+};
+
+// what the server sends to a client when a request of the client causes the
+// ejection of some files, set with SET_OPTIONS
+enum eject_modes {
+    EJECT_SEND_FILES, // <- default, the whole files are sent (FILE_P)
+    EJECT_SEND_NAMES, // <- only the names of the files are sent (FILE_NAME)
+    EJECT_DISCARD, // <- nothing is sent
+    EJECT_DEFERRED // <- the files are kept until the client sends DRAIN_EJECTED
+};
+
+// flags of the FILE_INFO packet
+enum info_flags {
+    INFO_LOCKED = 1, //0b001
+    INFO_LOCKED_BY_YOU = 2, //0b010
+    INFO_OPENED_BY_YOU = 4 //0b100
 };
 
 struct packet {
@@ -49,8 +98,22 @@ struct packet {
     char* filename;
     uint64_t data_size;
     void* data;
+    // if not NULL, the data sent by send_packet is taken from these buffers
+    // instead of data. They are never freed by destroy_packet
+    const struct iovec* data_segments;
+    size_t num_data_segments;
     char flags;
     int64_t count;
+    uint64_t version;
+    uint64_t cursor;
+    uint64_t handle;
+    // list of names of the batch operations, the length of the list is count
+    uint64_t* name_lengths;
+    char** filenames;
+    // if not NULL, the names and the payloads up to PACKET_ARENA_MAX_DATA bytes
+    // are received in this arena, and they are not freed by destroy_packet.
+    // They shall be promoted (see arena_promote) to outlive the arena reset
+    arena_t* arena;
 };
 
 /**
@@ -80,15 +143,46 @@ ssize_t send_packet(int fd, struct packet* packet);
  * using destroy_packet. It is recommended to clear the packet before receiving data,
  * but it is not strictly required. See destroy_package description to get a full
  * explaination of this.
- * Return -1 on error and errno is set appropriately, returns 0 on fd closed,
+ * Return -1 on error and errno is set appropriately (EBADMSG if the packet is
+ * malformed, e.g. the opcode is not known or the count of a batch is out of
+ * range: the rest of the packet is left in fd), returns 0 on fd closed,
  * returns a positive value on success.
 */
 int receive_packet(int fd, struct packet* res_packet);
 
+/**
+ * Receive a packet through fd like receive_packet, but the payload of the
+ * requests that carry data (WRITE_FILE, APPEND_TO_FILE, WRITE_HANDLE,
+ * APPEND_HANDLE) is left in fd: data_size is set, but data is NULL.
+ * The caller shall then receive the data_size bytes of the payload, either
+ * with receive_packet_payload or by reading them directly from fd.
+ * Return -1 on error and errno is set appropriately (EBADMSG if the packet is
+ * malformed, as in receive_packet), returns 0 on fd closed,
+ * returns a positive value on success.
+*/
+int receive_packet_header(int fd, struct packet* res_packet);
+
+/**
+ * Receive the payload of a packet received with receive_packet_header in a
+ * buffer allocated on the heap (or in the arena of the packet), that is
+ * stored in packet->data.
+ * Nothing is received if the packet has no payload, or if it has been
+ * received already.
+ * Return -1 on error and errno is set appropriately, returns 0 on fd closed,
+ * returns a positive value on success.
+*/
+int receive_packet_payload(int fd, struct packet* packet);
+
+/**
+ * Returns true if the data of the packet has been received in the arena of the
+ * packet, so it cannot be taken as a heap buffer
+*/
+bool packet_data_in_arena(const struct packet* packet);
+
 /**
  * Destroy the packet.
  * This shall be called only on a packet in which all the pointers either point
- * to a vaild location on the heap or are NULL. If the packet's fields contain
+ * to a vaild location on the heap (or in the arena of the packet) or are NULL. If the packet's fields contain
  * garbage pointers calling this function is U.B and might lead to segfault.
 */
 int destroy_packet(struct packet* packet);
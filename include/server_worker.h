@@ -1,21 +1,83 @@
 #ifndef SERVER_WORKER_H
 #define SERVER_WORKER_H
 
+#include "arena.h"
+#include "ejection_spool.h"
+#include "evictor.h"
 #include "file_storage_internal.h"
 #include "unbounded_shared_buffer.h"
 
+// size of the chunks of the arena of a worker, that is reset after every request
+#define WORKER_ARENA_CHUNK_SIZE (64 * 1024)
+
+/**
+ * State of a connection that persists between the requests of the client
+*/
+typedef struct connection_state_s {
+    char eject_mode;
+} connection_state_t;
+
 /**
  * Struct that defines what is passed to all the worker threads
 */
 typedef struct worker_arg_s {
     usbuf_t* master_to_workers_buffer;
+    // pool of the client fds put in master_to_workers_buffer
+    object_pool_t* client_fd_pool;
     usbuf_t* logger_buffer;
     int worker_to_master_pipe_write_fd;
     file_storage_t* file_storage;
+    ejection_spool_t* spool;
+    // background evictor, NULL if it is disabled
+    evictor_t* evictor;
+
+    // state of the connections, indexed by client fd (FD_SETSIZE elements).
+    // A client is served by one worker at a time, so no lock is needed
+    connection_state_t* connections;
 
     long max_num_files;
     long max_storage_size;
 } worker_arg_t;
 
+/**
+ * Eject one victim file from the storage.
+ * eject_mode tells what happens to the file: with EJECT_SEND_FILES and
+ * EJECT_DEFERRED the file is moved to the spool, to be sent to client_fd
+ * after the storage lock is released or when the client asks for it. With
+ * EJECT_SEND_NAMES only the name is sent, with EJECT_DISCARD nothing (if
+ * client_fd is negative the file is simply deleted, and spool can be NULL).
+ * If the storage has a spill directory, the file is also spilled to it (a file
+ * moved to the spool is copied). The ejection is logged as a removal in the
+ * write-ahead log of the storage, if it is enabled.
+ * The victim is not destroyed but put in the retired list, see retire_vfile,
+ * and the files dropped by the spool to make room for it are put in the list
+ * dropped (that can be NULL if spool is NULL), see ejection_spool_put.
+ * Must be called while holding the storage lock in write mode
+*/
+void eject_one_file(int client_fd, char eject_mode, file_storage_t* storage, ejection_spool_t* spool, vfile_t** retired,
+    ejected_file_t** dropped, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker, const char* op);
+
+/**
+ * Eject files (possibly 0) until space_needed bytes are available to use in
+ * the storage, and memory_needed bytes are available in the memory budget of
+ * the storage. If the compression is enabled, the cold files are compressed
+ * before any file is ejected. What happens to the ejected files depends on
+ * eject_mode, see eject_one_file. If file_to_exclude is not NULL it is never
+ * ejected nor compressed.
+ * Must be called while holding the storage lock in write mode
+*/
+void eject_files(int client_fd, char eject_mode, long space_needed, size_t memory_needed, long max_storage_size,
+    file_storage_t* storage, ejection_spool_t* spool, vfile_t** retired, ejected_file_t** dropped, usbuf_t* logger_buffer,
+    vfile_t* file_to_exclude, int num_worker, const char* op);
+
+/**
+ * Compress the coldest file of the storage that can be compressed, chosen by
+ * the replacement policy. If file_to_exclude is not NULL it is never chosen.
+ * Must be called while holding the storage lock in write mode
+ * Returns false if no file can be compressed
+*/
+bool compress_one_file(file_storage_t* storage, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker,
+    int client_fd, const char* op);
+
 void* server_worker_entry_point(void* arg);
 #endif
\ No newline at end of file
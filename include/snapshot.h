@@ -0,0 +1,134 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "file_storage_internal.h"
+
+// identifies a snapshot file and the version of its format
+#define SNAPSHOT_MAGIC "FSSNAP03"
+#define SNAPSHOT_MAGIC_LENGTH 8
+
+/**
+ * A snapshot file is the header, followed by an entry for every file, each
+ * followed by the name of the file padded to a multiple of 8 bytes, followed
+ * by the contents of the files. The files are in the order of the storage
+ * list, and their contents are contiguous and in the same order. The numbers
+ * are in the byte order of the machine, since a snapshot is meant to be loaded
+ * by the server that saved it.
+*/
+struct snapshot_header {
+    char magic[SNAPSHOT_MAGIC_LENGTH];
+    uint64_t num_files;
+    // bytes of the entries, including the names
+    uint64_t index_size;
+    // bytes of the contents
+    uint64_t data_size;
+    // sequence of the last record of the write-ahead log contained in the
+    // snapshot, 0 if there is no log
+    uint64_t wal_sequence;
+    // version clock of the storage, so that the versions assigned after a
+    // restart are newer than the ones the clients already have
+    uint64_t version_clock;
+};
+
+struct snapshot_entry {
+    uint64_t size;
+    uint64_t name_length;
+    // offset of the content from the start of the snapshot
+    uint64_t offset;
+    // version of the content, see vfile_t
+    uint64_t version;
+    // metadata of the replacement policies
+    int64_t last_used;
+    uint32_t used_counter;
+    uint32_t padding;
+};
+
+/**
+ * A snapshot ready to be written: its header and its index are built, and the
+ * buffer where the compressed files are decompressed is allocated
+*/
+typedef struct prepared_snapshot {
+    struct snapshot_header header;
+    char* index;
+    // as big as the biggest compressed file, NULL if there are none
+    void* buffer;
+} prepared_snapshot_t;
+
+/**
+ * Save all the files of the storage, with their metadata, in a snapshot in
+ * path. The snapshot is written to a temporary file that then replaces path,
+ * so path always contains a complete snapshot, and a storage loaded from the
+ * previous snapshot can keep using its mapping. wal_sequence is the sequence
+ * of the last record of the write-ahead log of the storage (0 if there is no
+ * log), so that the records already in the snapshot are not replayed. When
+ * the function returns the snapshot is durable, rename included, so those
+ * records can be discarded.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int save_snapshot(file_storage_t* storage, const char* path, uint64_t wal_sequence);
+
+/**
+ * Write a snapshot of all the files of the storage, with their metadata, to
+ * fd, from its current offset. wal_sequence is stored in the snapshot as in
+ * save_snapshot. The data is not synced to the disk.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int save_snapshot_fd(file_storage_t* storage, int fd, uint64_t wal_sequence);
+
+/**
+ * Prepare a snapshot of all the files of the storage, with their metadata:
+ * the header and the index are built, and the memory needed to write the
+ * contents is allocated. wal_sequence is stored in the snapshot as in
+ * save_snapshot. The snapshot shall be freed with free_prepared_snapshot.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int prepare_snapshot(file_storage_t* storage, uint64_t wal_sequence, prepared_snapshot_t* snapshot);
+
+/**
+ * Write the snapshot prepared by prepare_snapshot to fd, from its current
+ * offset. The storage shall have the same files it had when the snapshot was
+ * prepared. The function only reads the storage and writes to fd: it does not
+ * allocate memory nor take locks, so it can be called by the child of a fork
+ * of a multithreaded process. The data is not synced to the disk.
+ * Returns -1 on error and errno is set appropriately
+*/
+int write_prepared_snapshot(file_storage_t* storage, int fd, prepared_snapshot_t* snapshot);
+
+/**
+ * Free the memory of a snapshot prepared by prepare_snapshot
+*/
+void free_prepared_snapshot(prepared_snapshot_t* snapshot);
+
+/**
+ * Load the files of the snapshot in path into the storage, that shall be
+ * empty. The snapshot is mapped in memory and the files are not read: the
+ * content of each file is read from the disk only when it is accessed, see
+ * the mapped field of vfile_t. The files that would exceed max_num_files or
+ * max_storage_size are not loaded. The files keep their versions, and the
+ * version clock of the storage goes on from the one of the snapshot. The
+ * sequence of the last record of the write-ahead log contained in the
+ * snapshot is stored in wal_sequence.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files loaded, or -1 on error and errno is set
+ * appropriately (EINVAL if path is not a valid snapshot). If the error happens
+ * while the files are loaded, the files loaded so far stay in the storage
+*/
+long load_snapshot(file_storage_t* storage, const char* path, unsigned int max_num_files, size_t max_storage_size,
+    uint64_t* wal_sequence);
+
+/**
+ * Load the files of the snapshot in the file fd into the storage, like
+ * load_snapshot. The whole file is mapped, so fd can be closed afterwards.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files loaded, or -1 on error and errno is set
+ * appropriately (EINVAL if fd is not a valid snapshot)
+*/
+long load_snapshot_fd(file_storage_t* storage, int fd, unsigned int max_num_files, size_t max_storage_size,
+    uint64_t* wal_sequence);
+#endif
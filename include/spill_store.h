@@ -0,0 +1,114 @@
+#ifndef SPILL_STORE_H
+#define SPILL_STORE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "file_data.h"
+
+/**
+ * A file ejected from the storage and spilled to the disk
+*/
+typedef struct spilled_file {
+    char* filename;
+    size_t size;
+    // the content is written in the file <id>.spill of the spill directory
+    uint64_t id;
+    // content waiting to be written by the writer thread, it is destroyed
+    // when the content is on the disk
+    file_data_t data;
+    bool written;
+    struct spilled_file* next;
+    struct spilled_file* prev;
+} spilled_file_t;
+
+struct spill_store_statistics {
+    unsigned long num_spilled;
+    unsigned long num_dropped;
+    // files found in the spill directory, and files looked up and not found
+    unsigned long num_hits;
+    unsigned long num_misses;
+    unsigned long num_write_errors;
+    size_t maximum_size_reached;
+};
+
+/**
+ * Second tier of the storage: the files ejected from the storage are kept in
+ * a directory of the local disk, from which they can be taken back.
+ * The files are written asynchronously by a writer thread, and until they are
+ * written their content is kept in memory. That memory is not charged to the
+ * memory budget of the storage: the ejection of a file would not free anything
+ * until the writer catches up, so the storage would eject file after file to
+ * make room. The pending content is bounded by max_size instead, like the
+ * files on the disk. The size of the spilled files is capped: when the spill
+ * directory is full the oldest files are dropped.
+ * All the functions are thread safe.
+*/
+typedef struct spill_store {
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    // signaled when a file is put in the store or the writer shall terminate
+    pthread_cond_t pending_cond;
+    // signaled when the writer is done with a file
+    pthread_cond_t written_cond;
+    bool terminate;
+
+    char* dirname;
+    // list of the files, ordered from the oldest to the newest
+    spilled_file_t* first;
+    spilled_file_t* last;
+    // file that the writer is writing, it cannot be taken or dropped meanwhile
+    spilled_file_t* writing;
+    unsigned long num_pending;
+    uint64_t next_id;
+    size_t total_size;
+    size_t max_size;
+    struct spill_store_statistics statistics;
+} spill_store_t;
+
+/**
+ * Create an empty spill store in the directory dirname, that is created if it
+ * does not exist, and start its writer thread. The files left in the directory
+ * by a previous spill store are removed. The store holds at most max_size bytes
+ * of files.
+ * The store shall be destroyed with destroy_spill_store
+ * Returns NULL on error and errno is set appropriately
+*/
+spill_store_t* create_spill_store(const char* dirname, size_t max_size);
+
+/**
+ * Stop the writer thread, and destroy the store and all the files contained in
+ * it, removing them from the disk
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_spill_store(spill_store_t* store);
+
+/**
+ * Put a file in the store, it is written to the disk later by the writer
+ * thread. The store takes the ownership of filename, that shall be allocated
+ * on the heap, and the content of data is moved to the store (data is left
+ * empty). If the store is full the oldest files are dropped (possibly the file
+ * itself, if it is bigger than the store).
+ * Returns -1 on error and errno is set appropriately
+*/
+int spill_store_put(spill_store_t* store, char* filename, file_data_t* data);
+
+/**
+ * Take the file with the given name out of the store: its content is appended
+ * to data, that shall be empty, and it is removed from the disk. The file is
+ * read from the disk without holding the mutex of the store. If the file is
+ * being written, the function waits for the write to complete, so it shall not
+ * be called while holding the storage lock.
+ * Returns -1 on error and errno is set appropriately (ENOENT if the file is
+ * not in the store). If the file cannot be read it is removed from the store
+*/
+int spill_store_take(spill_store_t* store, const char* filename, file_data_t* data);
+
+/**
+ * Copy the statistics of the store in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int spill_store_get_statistics(spill_store_t* store, struct spill_store_statistics* stats);
+#endif
@@ -1,6 +1,8 @@
 #ifndef UNBOUNDED_SHARED_BUFFER_H
 #define UNBOUNDED_SHARED_BUFFER_H
 
+#include "object_pool.h"
+
 typedef struct usbuf_s usbuf_t;
 typedef enum {
     FIFO_POLICY,
@@ -56,6 +58,12 @@ int usbuf_get(usbuf_t* buf, void** res);
 */
 int usbuf_close(usbuf_t* buf);
 
+/**
+ * Copy the statistics of the pool of the nodes of buf in stats
+ * Returns -1 on error
+*/
+int usbuf_get_pool_statistics(usbuf_t* buf, struct object_pool_statistics* stats);
+
 /**
  * free the shared buffer buf
  * if the buffer is non-empty, then the function returns -1 and the memory is not freed,
@@ -1,8 +1,12 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <sys/uio.h>
 #include <unistd.h>
 
+// number of iovecs passed to writev by writevn
+#define WRITEVN_BATCH 64
+
 #define DIE_NEG1(code, name) \
     if ((code) == -1) {      \
         perror(name);        \
@@ -45,6 +49,14 @@ ssize_t readn(int fd, void* buf, size_t nbytes);
 */
 ssize_t writen(int fd, void* buf, size_t nbytes);
 
+/**
+ * Write all the buffers described by the iovcnt iovecs in iov to the file
+ * descriptor fd, with as few writev calls as possible.
+ * this function returns the number of bytes written, with the same guarantees
+ * of writen. iov is not modified
+*/
+ssize_t writevn(int fd, const struct iovec* iov, size_t iovcnt);
+
 /**
  * Convert a string to a long
  * Return 0 on success and the resulting long is stored in n
@@ -52,6 +64,14 @@ ssize_t writen(int fd, void* buf, size_t nbytes);
 */
 int string_to_long(const char* s, long* n);
 
+/**
+ * Rename old_path to new_path, then sync the directory that contains
+ * new_path, so that the rename is durable: until the directory is synced, a
+ * crash of the machine can bring back the file that new_path replaced
+ * Returns -1 on error and errno is set appropriately
+*/
+int rename_durable(const char* old_path, const char* new_path);
+
 /**
  * save file filename to dirname
  * with content buf and size size
@@ -0,0 +1,157 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+// operations recorded in the log
+#define WAL_CREATE 1
+#define WAL_WRITE 2
+#define WAL_APPEND 3
+#define WAL_REMOVE 4
+
+// default batch interval of WAL_DURABILITY_BATCH, in milliseconds
+#define WAL_DEFAULT_BATCH_INTERVAL 10
+
+enum wal_durability {
+    // the records are written, but never synced: they survive a crash of the
+    // server, but not a crash of the machine
+    WAL_DURABILITY_NONE,
+    // the records are synced by a flusher thread, that waits for the batch
+    // interval after a record is written to sync it with the following ones
+    WAL_DURABILITY_BATCH,
+    // the records are synced as soon as possible: a writer waiting for its
+    // record syncs all the records written so far, for all the writers
+    WAL_DURABILITY_ALWAYS
+};
+
+/**
+ * Header of a record of the log, followed by the name of the file and by the
+ * data. The checksum is computed with the checksum field set to 0, over the
+ * whole record: a record with a wrong checksum marks the end of the log (a
+ * record that was being written when the server crashed).
+*/
+struct wal_record_header {
+    uint64_t checksum;
+    uint64_t sequence;
+    // version of the file after the mutation, so that the replay restores the
+    // versions known by the clients
+    uint64_t version;
+    uint64_t data_size;
+    uint32_t name_length;
+    char op;
+    char padding[3];
+};
+
+struct wal_statistics {
+    unsigned long num_records;
+    unsigned long num_syncs;
+    size_t bytes_written;
+};
+
+/**
+ * Write-ahead log of the mutations of the storage. The records are appended in
+ * the order of the mutations, each with a sequence number, and a writer that
+ * wants its mutation to be durable waits with wal_sync. The syncs are shared
+ * by all the records written before them (group commit), so the writers
+ * waiting at the same time pay for a single fsync.
+ * All the functions are thread safe.
+*/
+typedef struct wal {
+    char* path;
+    int fd;
+    pthread_mutex_t mutex;
+    // signaled when durable_sequence advances
+    pthread_cond_t synced_cond;
+    // signaled when a record is written or the flusher thread shall terminate
+    pthread_cond_t flusher_cond;
+    // flusher thread, it exists only with WAL_DURABILITY_BATCH
+    pthread_t tid;
+    bool terminate;
+
+    enum wal_durability durability;
+    long batch_interval;
+    // sequence of the last record written, and of the last record synced
+    uint64_t last_sequence;
+    uint64_t durable_sequence;
+    // a writer is syncing the log, the others wait for it
+    bool syncing;
+    // error of the last failed sync, the writers waiting for it fail too
+    int sync_error;
+    struct wal_statistics statistics;
+} wal_t;
+
+/**
+ * Callback of wal_replay, called for every record with the operation, the
+ * name of the file, its version and the data of the record (NULL if size is 0)
+ * Returns -1 on error
+*/
+typedef int (*wal_apply_t)(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size);
+
+/**
+ * Read the log in path and call apply for every record with a sequence greater
+ * than after_sequence, in order. The sequence of the last record is stored in
+ * last_sequence (after_sequence if there are none). A truncated or corrupted
+ * record ends the log, so the log is truncated before it.
+ * Returns the number of records applied, or -1 on error and errno is set
+ * appropriately (ENOENT if there is no log)
+*/
+long wal_replay(const char* path, uint64_t after_sequence, wal_apply_t apply, void* arg, uint64_t* last_sequence);
+
+/**
+ * Open the log in path, that is created if it does not exist, to append the
+ * records after the ones already in it. The first record gets the sequence
+ * first_sequence. With WAL_DURABILITY_BATCH the flusher thread syncs the log
+ * batch_interval milliseconds after a record is written.
+ * The log shall be closed with wal_close
+ * Returns NULL on error and errno is set appropriately
+*/
+wal_t* wal_open(const char* path, enum wal_durability durability, long batch_interval, uint64_t first_sequence);
+
+/**
+ * Sync the log, stop the flusher thread and close the log
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_close(wal_t* wal);
+
+/**
+ * Append a record of operation op on filename, that has the given version
+ * after the operation, with the data described by the iovcnt iovecs in data.
+ * The sequence of the record is stored in sequence, to wait for it with
+ * wal_sync.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_append(wal_t* wal, char op, const char* filename, uint64_t version, const struct iovec* data, size_t iovcnt,
+    uint64_t* sequence);
+
+/**
+ * Wait until the record with the given sequence is durable, as required by the
+ * durability of the log. Sequence 0 is never written, so it returns at once.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_sync(wal_t* wal, uint64_t sequence);
+
+/**
+ * Returns the sequence of the last record appended
+*/
+uint64_t wal_get_last_sequence(wal_t* wal);
+
+/**
+ * Remove from the log the records up to the given sequence, after they have
+ * been saved in a snapshot that is already durable: they are considered
+ * durable. The records after it, appended while the snapshot was written, are
+ * moved to a new log that replaces the old one. The writers are blocked
+ * meanwhile, but usually there are no records to move.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_discard(wal_t* wal, uint64_t sequence);
+
+/**
+ * Copy the statistics of the log in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_get_statistics(wal_t* wal, struct wal_statistics* stats);
+#endif
@@ -15,7 +15,7 @@ if ! [ -e $1 ]
 fi
 
 # calculate the requests and the successes of each operation
-for op in open close write read read_n append lock unlock remove
+for op in open close write read read_n append lock unlock remove list stat read_files remove_files lock_files options drain
 do
   n_req=$(grep -o ".${op}. REQUEST" log.txt | wc -l)
   n_succ=$(grep -o ".${op}. SUCCESS" log.txt | wc -l)
@@ -30,6 +30,14 @@ echo ""
 # calculate the number of replacements occurred
 n_rep=$(grep -o "REPLACEMENT" log.txt | wc -l)
 echo "Number of times the replacement algorithm ran: $n_rep"
+n_bg_rep=$(grep -o "\[evictor\] INFO REPLACEMENT" log.txt | wc -l)
+echo "Number of files ejected by the background evictor: $n_bg_rep"
+n_comp=$(grep -o "INFO COMPRESSION" log.txt | wc -l)
+echo "Number of cold files compressed: $n_comp"
+n_spill=$(grep -oE "op:(spool_)?spill" log.txt | wc -l)
+echo "Number of files spilled to the disk: $n_spill"
+n_fault=$(grep -o "read back from the spill directory" log.txt | wc -l)
+echo "Number of files read back from the disk: $n_fault"
 
 # calculate the avergae write size
 written=$(grep -o "written_bytes:[0-9]*" log.txt | awk -F ':' '{print $2}')
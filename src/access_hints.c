@@ -0,0 +1,282 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access_hints.h"
+#include "utils.h"
+
+// extension of the temporary file where the hints are written
+#define ACCESS_HINTS_TMP_EXTENSION ".tmp"
+
+/**
+ * Save the access hints of all the files of the storage in path. The hints
+ * are written to a temporary file that then replaces path, so path always
+ * contains complete hints, and they are durable when the function returns.
+ * Must be called when no other thread uses the storage.
+ * Returns the number of hints saved, or -1 on error and errno is set
+ * appropriately
+*/
+long save_access_hints(file_storage_t* storage, const char* path)
+{
+    if (storage == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the hints are small, so they are built in memory and written at once
+    struct access_hints_header header;
+    memcpy(header.magic, ACCESS_HINTS_MAGIC, ACCESS_HINTS_MAGIC_LENGTH);
+    header.num_hints = 0;
+    size_t size = sizeof(header);
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        ++header.num_hints;
+        size += sizeof(struct access_hints_entry) + strlen(f->filename);
+    }
+    char* buf = malloc(size);
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(buf, &header, sizeof(header));
+    char* pos = buf + sizeof(header);
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        struct access_hints_entry entry;
+        entry.last_used = f->last_used;
+        entry.used_counter = f->used_counter;
+        entry.name_length = strlen(f->filename);
+        memcpy(pos, &entry, sizeof(entry));
+        pos += sizeof(entry);
+        memcpy(pos, f->filename, entry.name_length);
+        pos += entry.name_length;
+    }
+
+    char tmp_path[strlen(path) + sizeof(ACCESS_HINTS_TMP_EXTENSION)];
+    sprintf(tmp_path, "%s" ACCESS_HINTS_TMP_EXTENSION, path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+    ssize_t written = writen(fd, buf, size);
+    free(buf);
+    if (written != (ssize_t)size || fsync(fd) == -1) {
+        int saved_errno = (written != -1 && written != (ssize_t)size) ? EIO : errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (close(fd) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename_durable(tmp_path, path) == -1) {
+        return -1;
+    }
+    return header.num_hints;
+}
+
+static int compare_hints(const void* a, const void* b)
+{
+    return strcmp(((const access_hint_t*)a)->name, ((const access_hint_t*)b)->name);
+}
+
+/**
+ * Read the whole file in path, storing its size in size
+ * Returns the content of the file, or NULL on error and errno is set
+ * appropriately
+*/
+static char* read_whole_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    char* buf = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (buf == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    ssize_t read_bytes = readn(fd, buf, st.st_size);
+    if (read_bytes != st.st_size) {
+        int saved_errno = read_bytes == -1 ? errno : EIO;
+        free(buf);
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    close(fd);
+    *size = st.st_size;
+    return buf;
+}
+
+/**
+ * Load the access hints in path
+ * Returns the hints, to be freed with free_access_hints, or NULL on error and
+ * errno is set appropriately (EINVAL if path is not a valid hints file)
+*/
+access_hints_t* load_access_hints(const char* path)
+{
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t size;
+    char* buf = read_whole_file(path, &size);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    struct access_hints_header header;
+    if (size < sizeof(header)) {
+        free(buf);
+        errno = EINVAL;
+        return NULL;
+    }
+    memcpy(&header, buf, sizeof(header));
+    // every hint takes at least its entry, so the number of hints is bounded
+    // by the size of the file
+    if (memcmp(header.magic, ACCESS_HINTS_MAGIC, ACCESS_HINTS_MAGIC_LENGTH) != 0
+        || header.num_hints > (size - sizeof(header)) / sizeof(struct access_hints_entry)) {
+        free(buf);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    access_hints_t* hints = malloc(sizeof(access_hints_t));
+    if (hints == NULL) {
+        free(buf);
+        errno = ENOMEM;
+        return NULL;
+    }
+    hints->num_hints = header.num_hints;
+    hints->oldest_access = 0;
+    // the names are terminated, so they take at most one byte more than in
+    // the file for every hint
+    hints->hints = malloc(header.num_hints * sizeof(access_hint_t) + 1);
+    hints->names = malloc(size - sizeof(header) + header.num_hints + 1);
+    if (hints->hints == NULL || hints->names == NULL) {
+        free(hints->hints);
+        free(hints->names);
+        free(hints);
+        free(buf);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    const char* pos = buf + sizeof(header);
+    const char* end = buf + size;
+    char* name = hints->names;
+    uint64_t i;
+    for (i = 0; i < header.num_hints; ++i) {
+        struct access_hints_entry entry;
+        if ((size_t)(end - pos) < sizeof(entry)) {
+            break;
+        }
+        memcpy(&entry, pos, sizeof(entry));
+        pos += sizeof(entry);
+        if (entry.name_length == 0 || entry.name_length > (size_t)(end - pos)
+            || memchr(pos, '\0', entry.name_length) != NULL) {
+            break;
+        }
+        memcpy(name, pos, entry.name_length);
+        name[entry.name_length] = '\0';
+        pos += entry.name_length;
+        hints->hints[i].name = name;
+        hints->hints[i].used_counter = entry.used_counter;
+        hints->hints[i].last_used = entry.last_used;
+        if (i == 0 || hints->hints[i].last_used < hints->oldest_access) {
+            hints->oldest_access = hints->hints[i].last_used;
+        }
+        name += entry.name_length + 1;
+    }
+    free(buf);
+    // every hint is read, and nothing follows them
+    if (i != header.num_hints || pos != end) {
+        free_access_hints(hints);
+        errno = EINVAL;
+        return NULL;
+    }
+    qsort(hints->hints, hints->num_hints, sizeof(access_hint_t), compare_hints);
+    return hints;
+}
+
+/**
+ * Apply the hints to vfile, if it has not been accessed since it was loaded
+ * (used_counter is 0), as apply_access_hints does for all the files of the
+ * storage. The hint can be applied before the file is added to the storage,
+ * so that the files loaded one at a time are compared by the replacement
+ * policy with their hints.
+ * Returns true if the file has a hint
+*/
+bool apply_file_access_hint(const access_hints_t* hints, vfile_t* vfile)
+{
+    if (vfile->used_counter != 0) {
+        return false;
+    }
+    access_hint_t key = { vfile->filename, 0, 0 };
+    const access_hint_t* hint = bsearch(&key, hints->hints, hints->num_hints, sizeof(access_hint_t), compare_hints);
+    if (hint != NULL) {
+        vfile->used_counter = hint->used_counter;
+        vfile->last_used = hint->last_used;
+        return true;
+    }
+    if (hints->num_hints > 0 && vfile->last_used >= hints->oldest_access) {
+        vfile->last_used = hints->oldest_access - 1;
+    }
+    return false;
+}
+
+/**
+ * Apply the hints to the files of the storage that have not been accessed
+ * since they were loaded (used_counter is 0): a file with a hint takes its
+ * number of accesses and the time of its last access, while a file without a
+ * hint is considered less recently used than all the files with hints, since
+ * it was not in the storage when the hints were saved. The function can be
+ * called again after more files are loaded.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files with a hint, or -1 on error and errno is set
+ * appropriately
+*/
+long apply_access_hints(file_storage_t* storage, const access_hints_t* hints)
+{
+    if (storage == NULL || hints == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    long num_applied = 0;
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        if (apply_file_access_hint(hints, f)) {
+            ++num_applied;
+        }
+    }
+    return num_applied;
+}
+
+/**
+ * Free the hints returned by load_access_hints
+*/
+void free_access_hints(access_hints_t* hints)
+{
+    if (hints == NULL) {
+        return;
+    }
+    free(hints->hints);
+    free(hints->names);
+    free(hints);
+}
@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+// the allocations are aligned like the memory returned by malloc
+#define ARENA_ALIGNMENT 16
+
+/**
+ * Chunk of memory of an arena. The memory of the allocations follows the
+ * header, that is padded to keep it aligned
+*/
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+};
+
+#define CHUNK_HEADER_SIZE ((sizeof(struct arena_chunk) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+#define CHUNK_MEMORY(chunk) ((char*)(chunk) + CHUNK_HEADER_SIZE)
+
+/**
+ * Allocate a chunk that can contain size bytes
+ * Returns NULL on error and errno is set appropriately
+*/
+static struct arena_chunk* allocate_chunk(arena_t* arena, size_t size)
+{
+    struct arena_chunk* chunk = malloc(CHUNK_HEADER_SIZE + size);
+    if (chunk == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    ++arena->statistics.num_chunks;
+    return chunk;
+}
+
+/**
+ * Create an arena that allocates memory in chunks of chunk_size bytes
+ * The arena shall be destroyed with destroy_arena
+ * Returns NULL on error and errno is set appropriately
+*/
+arena_t* create_arena(size_t chunk_size)
+{
+    if (chunk_size < ARENA_ALIGNMENT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    arena_t* arena = malloc(sizeof(arena_t));
+    if (arena == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena->chunk_size = chunk_size;
+    arena->used = 0;
+    arena->statistics.num_chunks = 0;
+    arena->statistics.num_resets = 0;
+    arena->statistics.maximum_used = 0;
+
+    arena->chunks = allocate_chunk(arena, chunk_size);
+    if (arena->chunks == NULL) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+/**
+ * Destroy the arena and all the memory allocated from it
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_arena(arena_t* arena)
+{
+    if (arena == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (arena->chunks != NULL) {
+        struct arena_chunk* tmp = arena->chunks;
+        arena->chunks = tmp->next;
+        free(tmp);
+    }
+    free(arena);
+    return 0;
+}
+
+/**
+ * Allocate size bytes from the arena, aligned like the memory returned by
+ * malloc. The memory is valid until the next arena_reset
+ * Returns NULL on error and errno is set appropriately
+*/
+void* arena_alloc(arena_t* arena, size_t size)
+{
+    if (arena == NULL || size > SIZE_MAX - CHUNK_HEADER_SIZE - ARENA_ALIGNMENT) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size = (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    void* ptr;
+    struct arena_chunk* current = arena->chunks;
+    if (current->size - current->used >= size) {
+        ptr = CHUNK_MEMORY(current) + current->used;
+        current->used += size;
+    } else if (size > arena->chunk_size / 4) {
+        // a big allocation gets its own chunk, that is put after the current
+        // one, so that the free space of the current chunk is not wasted
+        struct arena_chunk* chunk = allocate_chunk(arena, size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = size;
+        chunk->next = current->next;
+        current->next = chunk;
+        ptr = CHUNK_MEMORY(chunk);
+    } else {
+        struct arena_chunk* chunk = allocate_chunk(arena, arena->chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->used = size;
+        chunk->next = current;
+        arena->chunks = chunk;
+        ptr = CHUNK_MEMORY(chunk);
+    }
+
+    arena->used += size;
+    if (arena->used > arena->statistics.maximum_used) {
+        arena->statistics.maximum_used = arena->used;
+    }
+    return ptr;
+}
+
+/**
+ * Free all the memory allocated from the arena
+*/
+void arena_reset(arena_t* arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+    // the first chunk allocated is the last of the list, and it is the only
+    // one that is kept
+    while (arena->chunks->next != NULL) {
+        struct arena_chunk* tmp = arena->chunks;
+        arena->chunks = tmp->next;
+        free(tmp);
+    }
+    arena->chunks->used = 0;
+    arena->used = 0;
+    ++arena->statistics.num_resets;
+}
+
+/**
+ * Copy size bytes from ptr, that can be memory of an arena, in a new buffer
+ * allocated on the heap, so that they outlive the reset of the arena
+ * Returns NULL on error and errno is set appropriately
+*/
+void* arena_promote(const void* ptr, size_t size)
+{
+    if (ptr == NULL && size > 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void* promoted = malloc(size > 0 ? size : 1);
+    if (promoted == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size > 0) {
+        memcpy(promoted, ptr, size);
+    }
+    return promoted;
+}
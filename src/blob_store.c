@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob_store.h"
+
+// parameters of the 64 bit FNV-1a hash
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/**
+ * Create an empty blob store
+ * The store shall be destroyed with destroy_blob_store
+ * Returns NULL on error and errno is set appropriately
+*/
+blob_store_t* create_blob_store(void)
+{
+    blob_store_t* store = malloc(sizeof(blob_store_t));
+    if (store == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    store->buckets = calloc(BLOB_STORE_INITIAL_BUCKETS, sizeof(blob_t*));
+    if (store->buckets == NULL) {
+        free(store);
+        errno = ENOMEM;
+        return NULL;
+    }
+    store->num_buckets = BLOB_STORE_INITIAL_BUCKETS;
+    store->num_blobs = 0;
+    return store;
+}
+
+/**
+ * Destroy the store and all the blobs in it, even if they are still referenced
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_blob_store(blob_store_t* store)
+{
+    if (store == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (size_t i = 0; i < store->num_buckets; ++i) {
+        while (store->buckets[i] != NULL) {
+            blob_t* tmp = store->buckets[i];
+            store->buckets[i] = tmp->next;
+            destroy_blob(tmp);
+        }
+    }
+    free(store->buckets);
+    free(store);
+    return 0;
+}
+
+/**
+ * Returns the hash of the content made of iovcnt buffers
+*/
+uint64_t hash_content(const struct iovec* iov, size_t iovcnt)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        const unsigned char* bytes = iov[i].iov_base;
+        for (size_t j = 0; j < iov[i].iov_len; ++j) {
+            hash ^= bytes[j];
+            hash *= FNV_PRIME;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Find the blob with the given hash whose content is equal to the size bytes
+ * of buf. The reference count of the blob is not changed.
+ * Returns NULL if there is no such blob
+*/
+blob_t* blob_store_find(blob_store_t* store, uint64_t hash, const void* buf, size_t size)
+{
+    if (store == NULL || (buf == NULL && size > 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    for (blob_t* curr = store->buckets[hash & (store->num_buckets - 1)]; curr != NULL; curr = curr->next) {
+        if (curr->hash == hash && curr->size == size && memcmp(curr->data, buf, size) == 0) {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Double the number of buckets of the store. On error the store is left as it
+ * is, it is only slower
+*/
+static void grow_buckets(blob_store_t* store)
+{
+    size_t new_num_buckets = store->num_buckets * 2;
+    blob_t** new_buckets = calloc(new_num_buckets, sizeof(blob_t*));
+    if (new_buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < store->num_buckets; ++i) {
+        while (store->buckets[i] != NULL) {
+            blob_t* tmp = store->buckets[i];
+            store->buckets[i] = tmp->next;
+            size_t index = tmp->hash & (new_num_buckets - 1);
+            tmp->next = new_buckets[index];
+            new_buckets[index] = tmp;
+        }
+    }
+    free(store->buckets);
+    store->buckets = new_buckets;
+    store->num_buckets = new_num_buckets;
+}
+
+/**
+ * Add to the store a new blob with the given hash, that shall be the hash of
+ * the size bytes of data. data is not copied: the blob takes the ownership of
+ * it, so it shall be allocated on the heap. The blob has one reference.
+ * Returns NULL on error and errno is set appropriately, in this case data is
+ * not taken by the blob
+*/
+blob_t* blob_store_insert(blob_store_t* store, uint64_t hash, void* data, size_t size)
+{
+    if (store == NULL || (data == NULL && size > 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    blob_t* blob = malloc(sizeof(blob_t));
+    if (blob == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    blob->data = data;
+    blob->size = size;
+    blob->hash = hash;
+    blob->refcount = 1;
+
+    if (store->num_blobs >= store->num_buckets) {
+        grow_buckets(store);
+    }
+    size_t index = hash & (store->num_buckets - 1);
+    blob->next = store->buckets[index];
+    store->buckets[index] = blob;
+    ++store->num_blobs;
+    return blob;
+}
+
+/**
+ * Drop a reference to blob. If it was the last one, the blob is removed from
+ * the store, and the caller shall destroy it with destroy_blob when it is
+ * convenient.
+ * Returns true if the blob has been removed
+*/
+bool blob_store_release(blob_store_t* store, blob_t* blob)
+{
+    if (--blob->refcount > 0) {
+        return false;
+    }
+    blob_t** curr = &store->buckets[blob->hash & (store->num_buckets - 1)];
+    while (*curr != blob) {
+        curr = &(*curr)->next;
+    }
+    *curr = blob->next;
+    --store->num_blobs;
+    return true;
+}
+
+/**
+ * Free a blob removed from its store by blob_store_release
+*/
+void destroy_blob(blob_t* blob)
+{
+    if (blob == NULL) {
+        return;
+    }
+    free(blob->data);
+    free(blob);
+}
@@ -0,0 +1,234 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "rw_lock.h"
+#include "snapshot.h"
+#include "utils.h"
+
+// extension of the temporary file where the child writes the snapshot, not
+// the one of save_snapshot, so that the two never write the same file
+#define CHECKPOINT_TMP_EXTENSION ".checkpoint"
+
+/**
+ * Returns the microseconds elapsed from start to end
+*/
+static unsigned long elapsed_us(const struct timespec* start, const struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000L + (end->tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Create the checkpoints of a storage, whose snapshot is saved in path.
+ * The checkpoints shall be destroyed with destroy_checkpoint
+ * Returns NULL on error and errno is set appropriately
+*/
+checkpoint_t* create_checkpoint(const char* path)
+{
+    if (path == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    checkpoint_t* checkpoint = malloc(sizeof(checkpoint_t));
+    if (checkpoint == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    checkpoint->path = malloc(strlen(path) + 1);
+    checkpoint->tmp_path = malloc(strlen(path) + sizeof(CHECKPOINT_TMP_EXTENSION));
+    if (checkpoint->path == NULL || checkpoint->tmp_path == NULL) {
+        free(checkpoint->path);
+        free(checkpoint->tmp_path);
+        free(checkpoint);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(checkpoint->path, path);
+    sprintf(checkpoint->tmp_path, "%s" CHECKPOINT_TMP_EXTENSION, path);
+    checkpoint->fd = -1;
+    checkpoint->pid = -1;
+    checkpoint->wal_sequence = 0;
+    memset(&checkpoint->statistics, 0, sizeof(checkpoint->statistics));
+    return checkpoint;
+}
+
+/**
+ * Wait for the running checkpoint, if any, and destroy the checkpoints
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_checkpoint(checkpoint_t* checkpoint, file_storage_t* storage)
+{
+    if (checkpoint == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    // the failure of the last checkpoint is not an error of the destruction
+    if (checkpoint_finish(checkpoint, storage, true) == -1 && checkpoint->pid != -1) {
+        return -1;
+    }
+    free(checkpoint->path);
+    free(checkpoint->tmp_path);
+    free(checkpoint);
+    return 0;
+}
+
+/**
+ * Start a checkpoint of the storage. Must be called without holding the
+ * storage lock, that is taken in write mode only to prepare the snapshot and
+ * to fork the child.
+ * Returns -1 on error and errno is set appropriately (EBUSY if a checkpoint is
+ * already running)
+*/
+int checkpoint_start(checkpoint_t* checkpoint, file_storage_t* storage)
+{
+    if (checkpoint == NULL || storage == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (checkpoint->pid != -1) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // the child cannot open the file, the parent does it for the child
+    int fd = open(checkpoint->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+    if (write_lock(storage_lock) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(checkpoint->tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    struct timespec locked;
+    clock_gettime(CLOCK_MONOTONIC, &locked);
+    // no record is appended to the log while the lock is held
+    checkpoint->wal_sequence = storage->wal != NULL ? wal_get_last_sequence(storage->wal) : 0;
+    prepared_snapshot_t snapshot;
+    pid_t pid = -1;
+    if (prepare_snapshot(storage, checkpoint->wal_sequence, &snapshot) == 0) {
+        pid = fork();
+        if (pid == 0) {
+            // the child has only this thread, and no one else modifies its
+            // image of the storage, so the snapshot is written without the
+            // lock. The error is the exit status, and nothing inherited is
+            // flushed or freed
+            if (write_prepared_snapshot(storage, fd, &snapshot) == -1 || fsync(fd) == -1) {
+                _exit(errno != 0 ? errno : EIO);
+            }
+            _exit(0);
+        }
+        int saved_errno = errno;
+        free_prepared_snapshot(&snapshot);
+        errno = saved_errno;
+    }
+    int saved_errno = errno;
+    struct timespec unlocked;
+    clock_gettime(CLOCK_MONOTONIC, &unlocked);
+    if (write_unlock(storage_lock) == -1) {
+        return -1;
+    }
+    if (pid == -1) {
+        close(fd);
+        unlink(checkpoint->tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    checkpoint->pid = pid;
+    checkpoint->fd = fd;
+    checkpoint->start = locked;
+    unsigned long pause = elapsed_us(&locked, &unlocked);
+    checkpoint->statistics.last_pause = pause;
+    checkpoint->statistics.total_pause += pause;
+    if (pause > checkpoint->statistics.maximum_pause) {
+        checkpoint->statistics.maximum_pause = pause;
+    }
+    return 0;
+}
+
+/**
+ * Returns true if a checkpoint is running
+*/
+bool checkpoint_is_running(checkpoint_t* checkpoint)
+{
+    return checkpoint->pid != -1;
+}
+
+/**
+ * Complete the running checkpoint if its snapshot is written, or wait for it
+ * if wait is true. When a checkpoint succeeds, its snapshot durably replaces
+ * the previous one, then the records of the write-ahead log of the storage
+ * that are in the snapshot are discarded.
+ * Returns 1 if the checkpoint succeeded, 0 if it is still running (or if none
+ * is running), -1 if it failed and errno is set to the error of the snapshot
+*/
+int checkpoint_finish(checkpoint_t* checkpoint, file_storage_t* storage, bool wait)
+{
+    if (checkpoint == NULL || storage == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (checkpoint->pid == -1) {
+        return 0;
+    }
+    int status;
+    pid_t res;
+    while ((res = waitpid(checkpoint->pid, &status, wait ? 0 : WNOHANG)) == -1 && errno == EINTR) { }
+    if (res == -1) {
+        return -1;
+    }
+    if (res == 0) {
+        return 0;
+    }
+    checkpoint->pid = -1;
+
+    // the snapshot replaces the previous one only if it is complete
+    int error = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        error = WIFEXITED(status) ? WEXITSTATUS(status) : EINTR;
+    }
+    if (close(checkpoint->fd) == -1 && error == 0) {
+        error = errno;
+    }
+    checkpoint->fd = -1;
+    if (error == 0 && rename_durable(checkpoint->tmp_path, checkpoint->path) == -1) {
+        error = errno;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unsigned long duration = elapsed_us(&checkpoint->start, &end);
+    checkpoint->statistics.last_duration = duration;
+    if (duration > checkpoint->statistics.maximum_duration) {
+        checkpoint->statistics.maximum_duration = duration;
+    }
+    if (error != 0) {
+        unlink(checkpoint->tmp_path);
+        ++checkpoint->statistics.num_failures;
+        errno = error;
+        return -1;
+    }
+
+    ++checkpoint->statistics.num_checkpoints;
+    struct stat st;
+    if (stat(checkpoint->path, &st) == 0) {
+        checkpoint->statistics.last_size = st.st_size;
+    }
+    // if the records cannot be discarded they stay in the log, and they are
+    // skipped by the replay since they are older than the snapshot
+    if (storage->wal != NULL) {
+        wal_discard(storage->wal, checkpoint->wal_sequence);
+    }
+    return 1;
+}
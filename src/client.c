@@ -15,6 +15,7 @@
 
 #define CONNECTION_RETRY_MAX_TIME 3
 #define CONNECTION_RETRY_INTERVAL 500
+#define LIST_PAGE_SIZE 64
 
 // theese two variables points to a location on the argv vector
 char* sockname = NULL;
@@ -71,6 +72,8 @@ static void print_help(char* program_name)
     printf("  -l f1[,f2]\t\tlist of file to lock on the server\n");
     printf("  -u f1[,f2]\t\tlist of file to unlock on the server\n");
     printf("  -c f1[,f2]\t\tlist of file to remove from the server\n");
+    printf("  -L [prefix]\t\tlist the files on the server whose name begins with prefix;\n\t\t\tif prefix is not specified then all the files are listed\n");
+    printf("  -s f1[,f2]\t\tlist of file whose metadata is printed\n");
 }
 
 /*
@@ -137,6 +140,13 @@ static int validate_args(int argc, char* argv[])
             VALIDATE_BINARY_ARG("-u")
         } else if (strcmp(argv[i], "-c") == 0) {
             VALIDATE_BINARY_ARG("-c")
+        } else if (strcmp(argv[i], "-L") == 0) {
+            // -L arg is optional
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                ++i;
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            VALIDATE_BINARY_ARG("-s")
         } else {
             fprintf(stderr, "unrecognized option %s\n", argv[i]);
             return -1;
@@ -201,7 +211,7 @@ int recursively_visit_dir_and_write_file(const char dirname[], long* max_n)
                 }
             } else {
                 // write the file to the server
-                API_CALL(openFile(abs_path, O_CREATE | O_LOCK), "openFile");
+                API_CALL(openFile(abs_path, O_CREATE | O_LOCK | O_HANDLE), "openFile");
                 API_CALL(writeFile(abs_path, expelled_dirname), "writeFile");
                 API_CALL(closeFile(abs_path), "closeFile");
                 if (*max_n > 0) {
@@ -227,6 +237,35 @@ int recursively_visit_dir_and_write_file(const char dirname[], long* max_n)
     return 0;
 }
 
+static void print_file_info(const struct file_info* info)
+{
+    printf("%s {size:%zu; version:%lu; locked:%d; locked_by_me:%d; opened_by_me:%d}\n",
+        info->filename, info->size, (unsigned long)info->version,
+        info->locked, info->locked_by_me, info->opened_by_me);
+}
+
+/**
+ * List all the files with given prefix, one page at a time
+*/
+static int list_all_files(const char* prefix)
+{
+    uint64_t cursor = 0;
+    for (;;) {
+        struct file_info* entries;
+        size_t num_entries;
+        if (listFiles(prefix, &cursor, LIST_PAGE_SIZE, &entries, &num_entries) == -1) {
+            return -1;
+        }
+        for (size_t i = 0; i < num_entries; ++i) {
+            print_file_info(&entries[i]);
+        }
+        freeFileInfo(entries, num_entries);
+        if (num_entries < LIST_PAGE_SIZE) {
+            return 0;
+        }
+    }
+}
+
 static int run_commands(int argc, char* argv[])
 {
     // Open the connection to the server
@@ -237,6 +276,12 @@ static int run_commands(int argc, char* argv[])
         return -1;
     }
 
+    // the ejected files are transferred only if they are stored in a
+    // directory, with the prints enabled the names are enough
+    if (expelled_dirname == NULL) {
+        API_CALL(setEjectionMode(FILE_STORAGE_API_PRINTS_ENABLED ? EJECT_SEND_NAMES : EJECT_DISCARD), "setEjectionMode");
+    }
+
     for (int i = 1; i < argc; ++i) {
         if (strcmp(argv[i], "-w") == 0) {
             ++i;
@@ -267,7 +312,7 @@ static int run_commands(int argc, char* argv[])
             char* strtok_save = NULL;
             char* tok = strtok_r(argv[i], ",", &strtok_save);
             while (tok) {
-                API_CALL(openFile(tok, O_CREATE | O_LOCK), "openFile");
+                API_CALL(openFile(tok, O_CREATE | O_LOCK | O_HANDLE), "openFile");
                 API_CALL(writeFile(tok, expelled_dirname), "writeFile");
                 API_CALL(closeFile(tok), "closeFile");
                 tok = strtok_r(NULL, ",", &strtok_save);
@@ -279,7 +324,7 @@ static int run_commands(int argc, char* argv[])
             while (tok) {
                 void* buf = NULL;
                 size_t size;
-                API_CALL(openFile(tok, 0), "openFile");
+                API_CALL(openFile(tok, O_HANDLE), "openFile");
                 int read_res = readFile(tok, &buf, &size);
                 API_CALL(closeFile(tok), "closeFile");
                 if (read_res != -1 && read_dirname != NULL) {
@@ -311,7 +356,7 @@ static int run_commands(int argc, char* argv[])
             char* strtok_save = NULL;
             char* tok = strtok_r(argv[i], ",", &strtok_save);
             while (tok) {
-                API_CALL(openFile(tok, 0), "openFile");
+                API_CALL(openFile(tok, O_HANDLE), "openFile");
                 API_CALL(lockFile(tok), "lockFile");
                 API_CALL(closeFile(tok), "closeFile");
                 tok = strtok_r(NULL, ",", &strtok_save);
@@ -321,7 +366,7 @@ static int run_commands(int argc, char* argv[])
             char* strtok_save = NULL;
             char* tok = strtok_r(argv[i], ",", &strtok_save);
             while (tok) {
-                API_CALL(openFile(tok, O_LOCK), "openFile");
+                API_CALL(openFile(tok, O_LOCK | O_HANDLE), "openFile");
                 API_CALL(unlockFile(tok), "unlockFile");
                 API_CALL(closeFile(tok), "closeFile");
                 tok = strtok_r(NULL, ",", &strtok_save);
@@ -331,10 +376,31 @@ static int run_commands(int argc, char* argv[])
             char* strtok_save = NULL;
             char* tok = strtok_r(argv[i], ",", &strtok_save);
             while (tok) {
-                API_CALL(openFile(tok, O_LOCK), "openFile");
+                API_CALL(openFile(tok, O_LOCK | O_HANDLE), "openFile");
                 API_CALL(removeFile(tok), "removeFile");
                 tok = strtok_r(NULL, ",", &strtok_save);
             }
+        } else if (strcmp(argv[i], "-L") == 0) {
+            char* prefix = NULL;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                ++i;
+                prefix = argv[i];
+            }
+            API_CALL(list_all_files(prefix), "listFiles");
+        } else if (strcmp(argv[i], "-s") == 0) {
+            ++i;
+            char* strtok_save = NULL;
+            char* tok = strtok_r(argv[i], ",", &strtok_save);
+            while (tok) {
+                struct file_info info;
+                info.filename = NULL;
+                API_CALL(statFile(tok, &info), "statFile");
+                if (info.filename != NULL) {
+                    print_file_info(&info);
+                    free(info.filename);
+                }
+                tok = strtok_r(NULL, ",", &strtok_save);
+            }
         }
     }
 
@@ -0,0 +1,239 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression.h"
+
+// a back reference is at least MIN_MATCH bytes long
+#define MIN_MATCH 4
+// the last LAST_LITERALS bytes of the input are always stored as literals
+#define LAST_LITERALS 5
+// a back reference cannot point further than MAX_OFFSET bytes
+#define MAX_OFFSET 65535
+// the table of the last positions of the 4 byte sequences has 2^HASH_BITS entries
+#define HASH_BITS 12
+// a length that does not fit in the 4 bits of the token is continued with
+// bytes of value 255, terminated by a byte smaller than 255
+#define TOKEN_MAX_LENGTH 15
+
+static uint32_t read32(const unsigned char* ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return value;
+}
+
+static size_t hash4(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+ * Returns the number of bytes that continue a length of the token
+*/
+static size_t length_bytes(size_t length)
+{
+    return length < TOKEN_MAX_LENGTH ? 0 : (length - TOKEN_MAX_LENGTH) / 255 + 1;
+}
+
+/**
+ * Write the bytes that continue a length of the token
+*/
+static unsigned char* write_length(unsigned char* op, size_t length)
+{
+    if (length < TOKEN_MAX_LENGTH) {
+        return op;
+    }
+    length -= TOKEN_MAX_LENGTH;
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/**
+ * Read the bytes that continue a length of the token
+ * Returns -1 if the input ends before the length
+*/
+static int read_length(const unsigned char** ip, const unsigned char* in_end, size_t* length)
+{
+    if (*length < TOKEN_MAX_LENGTH) {
+        return 0;
+    }
+    unsigned char byte;
+    do {
+        if (*ip >= in_end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/**
+ * Write a sequence: the literals followed by a back reference of match_length
+ * bytes at offset. A match_length of 0 means no back reference, it is used
+ * only for the last literals.
+ * Returns NULL if the sequence does not fit before out_end
+*/
+static unsigned char* write_sequence(unsigned char* op, unsigned char* out_end,
+    const unsigned char* literals, size_t num_literals, size_t offset, size_t match_length)
+{
+    size_t needed = 1 + length_bytes(num_literals) + num_literals;
+    if (match_length > 0) {
+        needed += 2 + length_bytes(match_length - MIN_MATCH);
+    }
+    if (needed > (size_t)(out_end - op)) {
+        return NULL;
+    }
+
+    unsigned char* token = op++;
+    *token = (num_literals < TOKEN_MAX_LENGTH ? num_literals : TOKEN_MAX_LENGTH) << 4;
+    op = write_length(op, num_literals);
+    memcpy(op, literals, num_literals);
+    op += num_literals;
+    if (match_length == 0) {
+        return op;
+    }
+
+    size_t length = match_length - MIN_MATCH;
+    *token |= length < TOKEN_MAX_LENGTH ? length : TOKEN_MAX_LENGTH;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    return write_length(op, length);
+}
+
+/**
+ * Returns the maximum size of the compression of size bytes
+*/
+size_t compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+/**
+ * Compress the size bytes of src in dst, that has room for capacity bytes
+ * Returns the size of the compressed data, or 0 if it does not fit in dst
+*/
+size_t compress_buffer(const void* src, size_t size, void* dst, size_t capacity)
+{
+    if ((src == NULL && size > 0) || dst == NULL) {
+        errno = EINVAL;
+        return 0;
+    }
+    const unsigned char* base = src;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* in_end = base + size;
+    unsigned char* op = dst;
+    unsigned char* out_end = op + capacity;
+
+    if (size >= MIN_MATCH + LAST_LITERALS) {
+        // positions (plus one, so that 0 is an empty entry) of the last
+        // sequence seen with each hash
+        size_t table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+        const unsigned char* match_limit = in_end - LAST_LITERALS;
+
+        while (ip + MIN_MATCH <= match_limit) {
+            size_t index = hash4(read32(ip));
+            size_t candidate = table[index];
+            table[index] = ip - base + 1;
+            const unsigned char* ref = base + candidate - 1;
+            if (candidate == 0 || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                // the longer there are no matches, the faster the input is
+                // skipped, so that incompressible data costs little
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            size_t offset = ip - ref;
+            const unsigned char* match_end = ip + MIN_MATCH;
+            ref += MIN_MATCH;
+            while (match_end < match_limit && *match_end == *ref) {
+                ++match_end;
+                ++ref;
+            }
+            op = write_sequence(op, out_end, anchor, ip - anchor, offset, match_end - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    op = write_sequence(op, out_end, anchor, in_end - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (unsigned char*)dst;
+}
+
+/**
+ * Decompress the size bytes of src, that shall be the compression of
+ * original_size bytes, in dst, that shall have room for them
+ * Returns -1 on error and errno is set appropriately (EINVAL if src is not
+ * a valid compression of original_size bytes)
+*/
+int decompress_buffer(const void* src, size_t size, void* dst, size_t original_size)
+{
+    if (src == NULL || (dst == NULL && original_size > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    const unsigned char* ip = src;
+    const unsigned char* in_end = ip + size;
+    unsigned char* base = dst;
+    unsigned char* op = base;
+    unsigned char* out_end = base + original_size;
+
+    while (ip < in_end) {
+        unsigned char token = *ip++;
+
+        size_t num_literals = token >> 4;
+        if (read_length(&ip, in_end, &num_literals) == -1
+                || num_literals > (size_t)(in_end - ip) || num_literals > (size_t)(out_end - op)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(op, ip, num_literals);
+        op += num_literals;
+        ip += num_literals;
+        if (ip == in_end) {
+            // the last sequence has only literals
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            errno = EINVAL;
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_length = token & 0x0f;
+        if (offset == 0 || offset > (size_t)(op - base) || read_length(&ip, in_end, &match_length) == -1
+                || match_length + MIN_MATCH > (size_t)(out_end - op)) {
+            errno = EINVAL;
+            return -1;
+        }
+        match_length += MIN_MATCH;
+        // the reference can overlap the bytes being written, so the copy is
+        // done byte by byte
+        const unsigned char* ref = op - offset;
+        for (size_t i = 0; i < match_length; ++i) {
+            op[i] = ref[i];
+        }
+        op += match_length;
+    }
+
+    if (op != out_end) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
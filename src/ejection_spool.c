@@ -0,0 +1,234 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "ejection_spool.h"
+
+/**
+ * Create an empty spool that holds at most max_size bytes of files that are not pinned
+ * The spool shall be destroyed with destroy_ejection_spool
+ * Returns NULL on error and errno is set appropriately
+*/
+ejection_spool_t* create_ejection_spool(size_t max_size)
+{
+    ejection_spool_t* spool = malloc(sizeof(ejection_spool_t));
+    if (spool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    spool->first = NULL;
+    spool->last = NULL;
+    spool->total_size = 0;
+    spool->max_size = max_size;
+    spool->statistics.num_spooled = 0;
+    spool->statistics.num_dropped = 0;
+    spool->statistics.maximum_size_reached = 0;
+
+    int init_res = pthread_mutex_init(&spool->mutex, NULL);
+    if (init_res != 0) {
+        free(spool);
+        errno = init_res;
+        return NULL;
+    }
+    return spool;
+}
+
+/**
+ * Destroy the spool and all the files contained in it
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_ejection_spool(ejection_spool_t* spool)
+{
+    if (spool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    destroy_ejected_files(spool->first);
+    int destroy_res = pthread_mutex_destroy(&spool->mutex);
+    if (destroy_res != 0) {
+        errno = destroy_res;
+        return -1;
+    }
+    free(spool);
+    return 0;
+}
+
+/**
+ * Drop the oldest files that are not pinned until the spool is not full. The
+ * dropped files are added to the list dropped
+ * Must be called holding the mutex of the spool
+*/
+static void drop_oldest_files(ejection_spool_t* spool, ejected_file_t** dropped)
+{
+    ejected_file_t** curr = &spool->first;
+    ejected_file_t* prev = NULL;
+    while (spool->total_size > spool->max_size && *curr != NULL) {
+        ejected_file_t* f = *curr;
+        if (f->pinned) {
+            prev = f;
+            curr = &f->next;
+            continue;
+        }
+        *curr = f->next;
+        if (spool->last == f) {
+            spool->last = prev;
+        }
+        spool->total_size -= f->size;
+        ++spool->statistics.num_dropped;
+
+        f->next = *dropped;
+        *dropped = f;
+    }
+}
+
+/**
+ * Put in the spool a file ejected for client_fd. The spool takes the ownership
+ * of filename, that shall be allocated on the heap, and the content of data is
+ * moved to the spool (data is left empty).
+ * If the file is not pinned and the spool is full, the oldest files that are
+ * not pinned are dropped (possibly the file itself, if it is bigger than the spool).
+ * The dropped files are not destroyed but added to the list dropped, so that
+ * the caller can destroy them with destroy_ejected_files after releasing its
+ * locks.
+ * Returns -1 on error and errno is set appropriately
+*/
+int ejection_spool_put(ejection_spool_t* spool, int client_fd, bool pinned, char* filename, file_data_t* data,
+    ejected_file_t** dropped)
+{
+    if (spool == NULL || filename == NULL || data == NULL || dropped == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    ejected_file_t* f = malloc(sizeof(ejected_file_t));
+    if (f == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    f->client_fd = client_fd;
+    f->pinned = pinned;
+    f->filename = filename;
+    f->size = data->size;
+    f->next = NULL;
+    // the content can be in the inline buffer of the file, that is destroyed
+    // with the file, so it is moved and not simply copied
+    init_file_data(&f->data);
+    if (file_data_move(&f->data, data) == -1) {
+        free(f);
+        return -1;
+    }
+
+    int lock_res = pthread_mutex_lock(&spool->mutex);
+    if (lock_res != 0) {
+        // give back the content, so that data is not modified on error
+        file_data_move(data, &f->data);
+        free(f);
+        errno = lock_res;
+        return -1;
+    }
+
+    // append the file at the end of the list, so the list is ordered from the
+    // oldest to the newest file
+    if (spool->first == NULL) {
+        spool->first = f;
+    } else {
+        spool->last->next = f;
+    }
+    spool->last = f;
+    spool->total_size += f->size;
+    ++spool->statistics.num_spooled;
+    if (spool->total_size > spool->statistics.maximum_size_reached) {
+        spool->statistics.maximum_size_reached = spool->total_size;
+    }
+
+    drop_oldest_files(spool, dropped);
+
+    int unlock_res = pthread_mutex_unlock(&spool->mutex);
+    if (unlock_res != 0) {
+        errno = unlock_res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove from the spool all the files of client_fd and return them as a list,
+ * in the order they were ejected. The list is NULL if there are no files.
+ * The list shall be destroyed with destroy_ejected_files
+*/
+ejected_file_t* ejection_spool_take(ejection_spool_t* spool, int client_fd)
+{
+    if (spool == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ejected_file_t* taken_first = NULL;
+    ejected_file_t* taken_last = NULL;
+
+    if (pthread_mutex_lock(&spool->mutex) != 0) {
+        return NULL;
+    }
+
+    ejected_file_t** curr = &spool->first;
+    ejected_file_t* prev = NULL;
+    while (*curr != NULL) {
+        ejected_file_t* f = *curr;
+        if (f->client_fd != client_fd) {
+            prev = f;
+            curr = &f->next;
+            continue;
+        }
+        // unlink the file from the spool and append it to the taken list
+        *curr = f->next;
+        if (spool->last == f) {
+            spool->last = prev;
+        }
+        spool->total_size -= f->size;
+
+        f->next = NULL;
+        if (taken_first == NULL) {
+            taken_first = f;
+        } else {
+            taken_last->next = f;
+        }
+        taken_last = f;
+    }
+
+    pthread_mutex_unlock(&spool->mutex);
+    return taken_first;
+}
+
+/**
+ * Destroy a list of files returned by ejection_spool_take, or dropped by
+ * ejection_spool_put
+*/
+void destroy_ejected_files(ejected_file_t* list)
+{
+    while (list != NULL) {
+        ejected_file_t* tmp = list;
+        list = list->next;
+        free(tmp->filename);
+        destroy_file_data(&tmp->data);
+        free(tmp);
+    }
+}
+
+/**
+ * Copy the statistics of the spool in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int ejection_spool_get_statistics(ejection_spool_t* spool, struct ejection_spool_statistics* stats)
+{
+    if (spool == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int lock_res = pthread_mutex_lock(&spool->mutex);
+    if (lock_res != 0) {
+        errno = lock_res;
+        return -1;
+    }
+    *stats = spool->statistics;
+    pthread_mutex_unlock(&spool->mutex);
+    return 0;
+}
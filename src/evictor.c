@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "evictor.h"
+#include "logger.h"
+#include "protocol.h"
+#include "server_worker.h"
+#include "utils.h"
+
+static bool above_high_watermark(evictor_t* evictor)
+{
+    return evictor->storage->total_size > evictor->high_size
+        || evictor->storage->num_files > evictor->high_num_files
+        || (evictor->high_memory > 0 && get_storage_memory(evictor->storage) > evictor->high_memory);
+}
+
+static bool above_low_watermark(evictor_t* evictor)
+{
+    return evictor->storage->total_size > evictor->low_size
+        || evictor->storage->num_files > evictor->low_num_files
+        || (evictor->low_memory > 0 && get_storage_memory(evictor->storage) > evictor->low_memory);
+}
+
+/**
+ * Eject files until the usage of the storage is below the low watermark. If
+ * the compression is enabled, and the number of files is not above the low
+ * watermark, the cold files are compressed before any file is ejected.
+ * The storage lock is released every EVICTOR_BATCH_FILES files
+*/
+static void evict_to_low_watermark(evictor_t* evictor)
+{
+    file_storage_t* storage = evictor->storage;
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+    unsigned long num_ejected = 0;
+    unsigned long num_compressed = 0;
+    vfile_t* retired = NULL;
+
+    DIE_NEG1(write_lock(storage_lock), "write_lock");
+    ++storage->statistics.num_evictor_runs;
+    bool done = false;
+    while (!done) {
+        for (int i = 0; i < EVICTOR_BATCH_FILES && above_low_watermark(evictor) && storage->first != NULL; ++i) {
+            // the compression does not reduce the number of files
+            if (storage->compression && storage->num_files <= evictor->low_num_files
+                && compress_one_file(storage, evictor->logger_buffer, NULL, -1, -1, "evictor")) {
+                ++num_compressed;
+                continue;
+            }
+            eject_one_file(-1, EJECT_DISCARD, storage, NULL, &retired, NULL, evictor->logger_buffer, NULL, -1, "evictor");
+            ++storage->statistics.num_background_replacements;
+            ++num_ejected;
+        }
+        done = !above_low_watermark(evictor) || storage->first == NULL;
+
+        // give the workers a chance to run between two batches, and destroy
+        // the ejected files out of the critical section
+        DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+        destroy_retired_vfiles(storage, &retired);
+        if (!done) {
+            DIE_NEG1(write_lock(storage_lock), "write_lock");
+        }
+    }
+    LOG(evictor->logger_buffer, "[evictor] INFO ejected %lu files, compressed %lu files", num_ejected, num_compressed);
+}
+
+static void* evictor_entry_point(void* arg)
+{
+    evictor_t* evictor = arg;
+
+    DIE_NEG1(pthread_mutex_lock(&evictor->mutex), "pthread_mutex_lock");
+    for (;;) {
+        while (!evictor->wakeup_requested && !evictor->terminate) {
+            DIE_NEG1(pthread_cond_wait(&evictor->wakeup_cond, &evictor->mutex), "pthread_cond_wait");
+        }
+        if (evictor->terminate) {
+            break;
+        }
+        evictor->wakeup_requested = false;
+
+        // the storage lock is never acquired while holding the evictor mutex
+        DIE_NEG1(pthread_mutex_unlock(&evictor->mutex), "pthread_mutex_unlock");
+        evict_to_low_watermark(evictor);
+        DIE_NEG1(pthread_mutex_lock(&evictor->mutex), "pthread_mutex_lock");
+    }
+    DIE_NEG1(pthread_mutex_unlock(&evictor->mutex), "pthread_mutex_unlock");
+    return NULL;
+}
+
+/**
+ * Start the evictor thread on storage. high_watermark and low_watermark are
+ * percentages of max_storage_size, max_num_files and of the memory budget of
+ * the storage (if it has one), and it must be
+ * 0 < low_watermark < high_watermark <= 100.
+ * The evictor shall be stopped with evictor_stop
+ * Returns NULL on error and errno is set appropriately
+*/
+evictor_t* evictor_start(file_storage_t* storage, usbuf_t* logger_buffer, long max_storage_size, long max_num_files,
+    long high_watermark, long low_watermark)
+{
+    if (storage == NULL || logger_buffer == NULL || low_watermark <= 0
+        || low_watermark >= high_watermark || high_watermark > 100) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    evictor_t* evictor = malloc(sizeof(evictor_t));
+    if (evictor == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    evictor->storage = storage;
+    evictor->logger_buffer = logger_buffer;
+    evictor->wakeup_requested = false;
+    evictor->terminate = false;
+    evictor->high_size = max_storage_size * high_watermark / 100;
+    evictor->low_size = max_storage_size * low_watermark / 100;
+    evictor->high_num_files = max_num_files * high_watermark / 100;
+    evictor->low_num_files = max_num_files * low_watermark / 100;
+    evictor->high_memory = storage->max_memory * high_watermark / 100;
+    evictor->low_memory = storage->max_memory * low_watermark / 100;
+
+    int res = pthread_mutex_init(&evictor->mutex, NULL);
+    if (res != 0) {
+        free(evictor);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_cond_init(&evictor->wakeup_cond, NULL);
+    if (res != 0) {
+        pthread_mutex_destroy(&evictor->mutex);
+        free(evictor);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_create(&evictor->tid, NULL, evictor_entry_point, evictor);
+    if (res != 0) {
+        pthread_cond_destroy(&evictor->wakeup_cond);
+        pthread_mutex_destroy(&evictor->mutex);
+        free(evictor);
+        errno = res;
+        return NULL;
+    }
+    return evictor;
+}
+
+/**
+ * Wake up the evictor if the usage of the storage is above the high watermark.
+ * Must be called while holding the storage lock (in read or write mode), after
+ * an operation that increased the usage of the storage.
+ * Returns -1 on error and errno is set appropriately
+*/
+int evictor_notify(evictor_t* evictor)
+{
+    if (evictor == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!above_high_watermark(evictor)) {
+        return 0;
+    }
+
+    int res = pthread_mutex_lock(&evictor->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    evictor->wakeup_requested = true;
+    pthread_cond_signal(&evictor->wakeup_cond);
+    res = pthread_mutex_unlock(&evictor->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop the evictor thread and free its resources
+ * Returns -1 on error and errno is set appropriately
+*/
+int evictor_stop(evictor_t* evictor)
+{
+    if (evictor == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = pthread_mutex_lock(&evictor->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    evictor->terminate = true;
+    pthread_cond_signal(&evictor->wakeup_cond);
+    pthread_mutex_unlock(&evictor->mutex);
+
+    res = pthread_join(evictor->tid, NULL);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    pthread_cond_destroy(&evictor->wakeup_cond);
+    pthread_mutex_destroy(&evictor->mutex);
+    free(evictor);
+    return 0;
+}
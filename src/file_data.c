@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_data.h"
+
+// number of iovecs allocated the first time a segment is added
+#define INITIAL_SEGMENTS 4
+
+/**
+ * Leave data empty, without freeing anything. The inline buffer is kept
+*/
+static void reset_file_data(file_data_t* data)
+{
+    data->segments = NULL;
+    data->num_segments = 0;
+    data->max_segments = 0;
+    data->last_capacity = 0;
+    data->reserved_capacity = 0;
+    data->capacity = 0;
+    data->size = 0;
+}
+
+/**
+ * Initialize data to an empty content
+*/
+void init_file_data(file_data_t* data)
+{
+    init_file_data_inline(data, NULL, 0);
+}
+
+/**
+ * Initialize data to an empty content, with buffer of capacity bytes as inline
+ * buffer. The buffer is never freed by data
+*/
+void init_file_data_inline(file_data_t* data, void* buffer, size_t capacity)
+{
+    reset_file_data(data);
+    data->inline_buffer = buffer;
+    data->inline_capacity = buffer != NULL ? capacity : 0;
+}
+
+/**
+ * Returns true if the first segment of data is its inline buffer
+*/
+bool file_data_uses_inline(const file_data_t* data)
+{
+    return data->inline_buffer != NULL && data->num_segments > 0 && data->segments[0].iov_base == data->inline_buffer;
+}
+
+/**
+ * Free all the segments of data, and leave it empty. The inline buffer is kept
+*/
+void destroy_file_data(file_data_t* data)
+{
+    for (size_t i = 0; i < data->num_segments; ++i) {
+        if (data->segments[i].iov_base != data->inline_buffer) {
+            free(data->segments[i].iov_base);
+        }
+    }
+    if (data->segments != &data->inline_segment) {
+        free(data->segments);
+    }
+    reset_file_data(data);
+}
+
+/**
+ * Move the content of src to dst, that shall be empty, leaving src empty. The
+ * inline buffer of dst is not used, and if src uses its inline buffer the
+ * bytes in it are copied to a new segment.
+ * Returns -1 on error and errno is set appropriately, in this case src is not
+ * modified
+*/
+int file_data_move(file_data_t* dst, file_data_t* src)
+{
+    if (dst == NULL || src == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    reset_file_data(dst);
+    if (!file_data_uses_inline(src)) {
+        // the segments of a content that does not use the inline buffer are
+        // all on the heap, so they are simply taken
+        if (src->segments != &src->inline_segment) {
+            dst->segments = src->segments;
+            dst->num_segments = src->num_segments;
+            dst->max_segments = src->max_segments;
+            dst->last_capacity = src->last_capacity;
+            dst->capacity = src->capacity;
+            dst->size = src->size;
+        }
+        reset_file_data(src);
+        return 0;
+    }
+
+    size_t inline_size = src->segments[0].iov_len;
+    struct iovec* segments = malloc(src->num_segments * sizeof(struct iovec));
+    void* first = malloc(inline_size);
+    if (segments == NULL || first == NULL) {
+        free(segments);
+        free(first);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(segments, src->segments, src->num_segments * sizeof(struct iovec));
+    memcpy(first, src->inline_buffer, inline_size);
+    segments[0].iov_base = first;
+
+    dst->segments = segments;
+    dst->num_segments = src->num_segments;
+    dst->max_segments = src->num_segments;
+    // the copy of the inline buffer has no free space
+    dst->last_capacity = src->num_segments == 1 ? inline_size : src->last_capacity;
+    dst->capacity = src->capacity + inline_size;
+    dst->size = src->size;
+
+    if (src->segments != &src->inline_segment) {
+        free(src->segments);
+    }
+    reset_file_data(src);
+    return 0;
+}
+
+/**
+ * Make sure that there is room for count more segments in data, that are not
+ * the inline buffer. The inline iovec is used only to describe the inline
+ * buffer, so it is replaced by an array on the heap
+ * Returns -1 on error and errno is set appropriately
+*/
+static int reserve_segments(file_data_t* data, size_t count)
+{
+    if (data->segments == &data->inline_segment || data->num_segments + count > data->max_segments) {
+        size_t new_max = data->max_segments <= 1 ? INITIAL_SEGMENTS : data->max_segments * 2;
+        while (new_max < data->num_segments + count) {
+            new_max *= 2;
+        }
+        struct iovec* new_segments;
+        if (data->segments == &data->inline_segment) {
+            new_segments = malloc(new_max * sizeof(struct iovec));
+            if (new_segments != NULL) {
+                memcpy(new_segments, data->segments, data->num_segments * sizeof(struct iovec));
+            }
+        } else {
+            new_segments = realloc(data->segments, new_max * sizeof(struct iovec));
+        }
+        if (new_segments == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        data->segments = new_segments;
+        data->max_segments = new_max;
+    }
+    return 0;
+}
+
+/**
+ * Add the segment buf, of size used bytes and capacity allocated bytes, at
+ * the end of data. There shall be room for it, see reserve_segments
+*/
+static void push_segment(file_data_t* data, void* buf, size_t used, size_t capacity)
+{
+    data->segments[data->num_segments].iov_base = buf;
+    data->segments[data->num_segments].iov_len = used;
+    ++data->num_segments;
+    data->last_capacity = capacity;
+    if (buf != data->inline_buffer) {
+        data->capacity += capacity;
+    }
+    data->size += used;
+}
+
+/**
+ * Returns the free space of the last segment of data
+*/
+static size_t free_space(const file_data_t* data)
+{
+    if (data->num_segments == 0) {
+        return 0;
+    }
+    return data->last_capacity - data->segments[data->num_segments - 1].iov_len;
+}
+
+/**
+ * Returns the capacity of the segment that is allocated to contain size bytes
+ * that do not fit in the last segment
+*/
+static size_t new_segment_capacity(const file_data_t* data, size_t size)
+{
+    // the new segment is as big as the file, within the bounds, and it is
+    // always big enough to contain the rest of the bytes
+    size_t capacity = data->size;
+    if (capacity < MIN_SEGMENT_SIZE) {
+        capacity = MIN_SEGMENT_SIZE;
+    } else if (capacity > MAX_SEGMENT_SIZE) {
+        capacity = MAX_SEGMENT_SIZE;
+    }
+    if (capacity < size) {
+        capacity = size;
+    }
+    return capacity;
+}
+
+/**
+ * Reserve space for size bytes at the end of data. reserved is filled with the
+ * two buffers where the bytes shall be written, in order: the free space of
+ * the last segment and a new segment (either of them can be empty).
+ * The content of data does not change until the reservation is committed with
+ * file_data_commit, or released with file_data_rollback.
+ * No other operation shall be done on data while a reservation is pending.
+ * Returns -1 on error and errno is set appropriately
+*/
+int file_data_reserve(file_data_t* data, size_t size, struct iovec reserved[2])
+{
+    if (data == NULL || reserved == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    reserved[0].iov_base = NULL;
+    reserved[0].iov_len = 0;
+    reserved[1].iov_base = NULL;
+    reserved[1].iov_len = 0;
+
+    // free space of the last segment
+    if (data->num_segments > 0) {
+        struct iovec* last = &data->segments[data->num_segments - 1];
+        size_t last_free_space = free_space(data);
+        reserved[0].iov_base = (char*)last->iov_base + last->iov_len;
+        reserved[0].iov_len = last_free_space < size ? last_free_space : size;
+        size -= reserved[0].iov_len;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    if (data->num_segments == 0 && size <= data->inline_capacity) {
+        // the inline buffer becomes the first segment, described by the
+        // inline iovec
+        if (data->segments == NULL) {
+            data->segments = &data->inline_segment;
+            data->max_segments = 1;
+        }
+        reserved[1].iov_base = data->inline_buffer;
+        reserved[1].iov_len = size;
+        data->reserved_capacity = data->inline_capacity;
+        return 0;
+    }
+
+    // make room for the new segment now, so that committing cannot fail
+    if (reserve_segments(data, 1) == -1) {
+        return -1;
+    }
+    size_t capacity = new_segment_capacity(data, size);
+    reserved[1].iov_base = malloc(capacity);
+    if (reserved[1].iov_base == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    reserved[1].iov_len = size;
+    data->reserved_capacity = capacity;
+    return 0;
+}
+
+/**
+ * Add to the content of data the bytes written in the space reserved with
+ * file_data_reserve
+*/
+void file_data_commit(file_data_t* data, struct iovec reserved[2])
+{
+    if (reserved[0].iov_len > 0) {
+        data->segments[data->num_segments - 1].iov_len += reserved[0].iov_len;
+        data->size += reserved[0].iov_len;
+    }
+    if (reserved[1].iov_base != NULL) {
+        push_segment(data, reserved[1].iov_base, reserved[1].iov_len, data->reserved_capacity);
+    }
+}
+
+/**
+ * Release the space reserved with file_data_reserve, the content of data is
+ * not changed
+*/
+void file_data_rollback(file_data_t* data, struct iovec reserved[2])
+{
+    if (reserved[1].iov_base != data->inline_buffer) {
+        free(reserved[1].iov_base);
+    }
+    reserved[1].iov_base = NULL;
+}
+
+/**
+ * Append size bytes, copied from buf, at the end of data. The free space of
+ * the last segment is filled first, then a new segment is allocated.
+ * Returns -1 on error and errno is set appropriately
+*/
+int file_data_append(file_data_t* data, const void* buf, size_t size)
+{
+    if (data == NULL || (buf == NULL && size > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct iovec reserved[2];
+    if (file_data_reserve(data, size, reserved) == -1) {
+        return -1;
+    }
+    if (reserved[0].iov_len > 0) {
+        memcpy(reserved[0].iov_base, buf, reserved[0].iov_len);
+    }
+    if (reserved[1].iov_len > 0) {
+        memcpy(reserved[1].iov_base, (const char*)buf + reserved[0].iov_len, reserved[1].iov_len);
+    }
+    file_data_commit(data, reserved);
+    return 0;
+}
+
+/**
+ * Returns the number of bytes that file_data_reserve or file_data_append
+ * allocate to append size bytes at the end of data
+*/
+size_t file_data_append_capacity(const file_data_t* data, size_t size)
+{
+    if (data->num_segments == 0 && size <= data->inline_capacity) {
+        return 0;
+    }
+    size_t last_free_space = free_space(data);
+    if (size <= last_free_space) {
+        return 0;
+    }
+    return new_segment_capacity(data, size - last_free_space);
+}
+
+/**
+ * Append buf, that is size bytes long, at the end of data as a new segment.
+ * buf is not copied: data takes the ownership of it, so it shall be allocated
+ * on the heap. If data is empty and buf fits in the inline buffer, buf is
+ * copied there and freed.
+ * Returns -1 on error and errno is set appropriately, in this case buf is not
+ * taken by data
+*/
+int file_data_append_buffer(file_data_t* data, void* buf, size_t size)
+{
+    if (data == NULL || (buf == NULL && size > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (size == 0) {
+        free(buf);
+        return 0;
+    }
+    if (data->num_segments == 0 && size <= data->inline_capacity) {
+        if (file_data_append(data, buf, size) == -1) {
+            return -1;
+        }
+        free(buf);
+        return 0;
+    }
+    if (reserve_segments(data, 1) == -1) {
+        return -1;
+    }
+    push_segment(data, buf, size, size);
+    return 0;
+}
+
+/**
+ * Append the count buffers described by buffers at the end of data, each as a
+ * new segment. The buffers are not copied, as in file_data_append_buffer, and
+ * the inline buffer is never used.
+ * Returns -1 on error and errno is set appropriately, in this case no buffer
+ * is taken by data
+*/
+int file_data_append_buffers(file_data_t* data, const struct iovec* buffers, size_t count)
+{
+    if (data == NULL || (buffers == NULL && count > 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (reserve_segments(data, count) == -1) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        push_segment(data, buffers[i].iov_base, buffers[i].iov_len, buffers[i].iov_len);
+    }
+    return 0;
+}
+
+/**
+ * Copy the whole content of data in buf, that shall be at least data->size
+ * bytes long
+*/
+void file_data_copy(const file_data_t* data, void* buf)
+{
+    char* dest = buf;
+    for (size_t i = 0; i < data->num_segments; ++i) {
+        memcpy(dest, data->segments[i].iov_base, data->segments[i].iov_len);
+        dest += data->segments[i].iov_len;
+    }
+}
@@ -30,7 +30,145 @@ bool FILE_STORAGE_API_PRINTS_ENABLED = false;
         print_error_code(err_code, context);    \
     }
 
-static int receive_files_from_server(const char* dirname, const char* error_context)
+// handles returned by the server for the files opened with O_HANDLE.
+// Operations on a file with a cached handle send the handle instead of the name
+struct handle_entry {
+    char* pathname;
+    uint64_t handle;
+    struct handle_entry* next;
+};
+static struct handle_entry* handle_cache = NULL;
+
+/**
+ * Returns the handle cached for pathname, 0 if there is none
+*/
+static uint64_t cached_handle(const char* pathname)
+{
+    for (struct handle_entry* e = handle_cache; e != NULL; e = e->next) {
+        if (strcmp(e->pathname, pathname) == 0) {
+            return e->handle;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Remove the handle cached for pathname, if any
+*/
+static void forget_handle(const char* pathname)
+{
+    for (struct handle_entry** e = &handle_cache; *e != NULL; e = &(*e)->next) {
+        if (strcmp((*e)->pathname, pathname) == 0) {
+            struct handle_entry* tmp = *e;
+            *e = tmp->next;
+            free(tmp->pathname);
+            free(tmp);
+            return;
+        }
+    }
+}
+
+/**
+ * Cache the handle of pathname. If there is no memory the handle is simply
+ * not cached, since the operations can always be done by name
+*/
+static void cache_handle(const char* pathname, uint64_t handle)
+{
+    forget_handle(pathname);
+    struct handle_entry* e = malloc(sizeof(struct handle_entry));
+    if (e == NULL) {
+        return;
+    }
+    e->pathname = malloc(strlen(pathname) + 1);
+    if (e->pathname == NULL) {
+        free(e);
+        return;
+    }
+    strcpy(e->pathname, pathname);
+    e->handle = handle;
+    e->next = handle_cache;
+    handle_cache = e;
+}
+
+/**
+ * Fill the request of an operation on pathname. If there is a cached handle for
+ * pathname then the request uses handle_op and the handle, otherwise it uses
+ * name_op and a copy of the name, that shall be freed by the caller.
+ * Returns -1 on error and errno is set appropriately.
+*/
+static int fill_file_request(struct packet* request, char name_op, char handle_op, const char* pathname)
+{
+    request->handle = cached_handle(pathname);
+    if (request->handle != 0) {
+        request->op = handle_op;
+        return 0;
+    }
+    request->op = name_op;
+    request->name_length = strlen(pathname);
+    request->filename = malloc((strlen(pathname) + 1) * sizeof(char));
+    if (request->filename == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(request->filename, pathname);
+    return 0;
+}
+
+/**
+ * Drop the cached handle of pathname if the server does not know it anymore,
+ * e.g. because the file has been ejected
+*/
+static void check_handle_error(struct packet* response, const char* pathname)
+{
+    if (response->op == ERROR && response->err_code == FILE_DOES_NOT_EXIST) {
+        forget_handle(pathname);
+    }
+}
+
+static void file_info_from_packet(struct file_info* info, struct packet* info_packet)
+{
+    // the filename is already allocated on the heap by the call to receive_packet
+    info->filename = info_packet->filename;
+    info->size = info_packet->data_size;
+    info->version = info_packet->version;
+    info->locked = (info_packet->flags & INFO_LOCKED) != 0;
+    info->locked_by_me = (info_packet->flags & INFO_LOCKED_BY_YOU) != 0;
+    info->opened_by_me = (info_packet->flags & INFO_OPENED_BY_YOU) != 0;
+}
+
+/**
+ * Send a request of a batch operation on n files
+*/
+static int send_batch_request(char op, size_t n, const char* pathnames[])
+{
+    if (n == 0 || n > MAX_BATCH_FILES || pathnames == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct packet request;
+    clear_packet(&request);
+    request.op = op;
+    request.count = n;
+    request.name_lengths = malloc(n * sizeof(uint64_t));
+    if (request.name_lengths == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        request.name_lengths[i] = strlen(pathnames[i]);
+    }
+    // the names are not copied, the packet only points to them
+    request.filenames = (char**)pathnames;
+    int send_res = send_packet(socket_fd, &request);
+    free(request.name_lengths);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int receive_files_from_server(const char* dirname, const char* error_context, const char* pathname)
 {
     for (;;) {
         // receive the response
@@ -48,6 +186,9 @@ static int receive_files_from_server(const char* dirname, const char* error_cont
 
         // if the response is an error then print it to stderr
         if (response.op == ERROR) {
+            if (pathname != NULL) {
+                check_handle_error(&response, pathname);
+            }
             PRINT_ERR_CODE_IF_EN(response.err_code, error_context);
             errno = EBADE;
             return -1;
@@ -61,6 +202,11 @@ static int receive_files_from_server(const char* dirname, const char* error_cont
             }
             destroy_packet(&response);
         }
+        if (response.op == FILE_NAME) {
+            // the client asked only for the names of the ejected files
+            PRINT_IF_EN("file %s was ejected\n", response.filename);
+            destroy_packet(&response);
+        }
     }
 }
 
@@ -115,6 +261,10 @@ int closeConnection(const char* sockname)
         return -1;
     }
     PRINT_IF_EN("close the connection to %s\n", sockname);
+    // the handles are valid only for this connection
+    while (handle_cache != NULL) {
+        forget_handle(handle_cache->pathname);
+    }
     int close_res = close(socket_fd);
     return close_res;
 }
@@ -125,8 +275,8 @@ int openFile(const char* pathname, int flags)
         errno = EINVAL;
         return -1;
     }
-    PRINT_IF_EN("open file %s with flag O_CREATE %d and O_LOCK %d\n", pathname,
-        (flags & O_CREATE) != 0, (flags & O_LOCK) != 0);
+    PRINT_IF_EN("open file %s with flag O_CREATE %d, O_LOCK %d and O_HANDLE %d\n", pathname,
+        (flags & O_CREATE) != 0, (flags & O_LOCK) != 0, (flags & O_HANDLE) != 0);
 
     // send the request to the server
     struct packet request;
@@ -159,6 +309,11 @@ int openFile(const char* pathname, int flags)
     if (response.op == COMP) {
         return 0;
     }
+    if (response.op == HANDLE) {
+        // from now on the operations on the file use the handle
+        cache_handle(pathname, response.handle);
+        return 0;
+    }
 
     // if the response is an error then print it to stderr
     if (response.op == ERROR) {
@@ -179,7 +334,55 @@ int readFile(const char* pathname, void** buf, size_t* size)
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = READ_FILE;
+    if (fill_file_request(&request, READ_FILE, READ_HANDLE, pathname) == -1) {
+        return -1;
+    }
+    int send_res = send_packet(socket_fd, &request);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    free(request.filename);
+
+    // receive the response
+    struct packet response;
+    clear_packet(&response);
+    int receive_res = receive_packet(socket_fd, &response);
+    if (receive_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    // if the response is COMP then the operation terminated successfully
+    if (response.op == DATA) {
+        // the buffer is already allocated on the head by the call to receive_packet
+        *buf = response.data;
+        *size = response.data_size;
+
+        PRINT_IF_EN("read %zd bytes of the file %s\n", response.data_size, pathname);
+        return 0;
+    }
+
+    // if the response is an error then print it to stderr
+    if (response.op == ERROR) {
+        check_handle_error(&response, pathname);
+        PRINT_ERR_CODE_IF_EN(response.err_code, "readFile");
+    }
+    errno = EBADE;
+    return -1;
+}
+
+int readFileIfModified(const char* pathname, void** buf, size_t* size, uint64_t* version)
+{
+    if (pathname == NULL || version == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    PRINT_IF_EN("read the file %s if its version is not %lu\n", pathname, (unsigned long)*version);
+
+    // send the request to the server
+    struct packet request;
+    clear_packet(&request);
+    request.op = READ_FILE_IF_MODIFIED;
     request.name_length = strlen(pathname);
     request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
     if (request.filename == NULL) {
@@ -187,6 +390,7 @@ int readFile(const char* pathname, void** buf, size_t* size)
         return -1;
     }
     strcpy(request.filename, pathname);
+    request.version = *version;
     int send_res = send_packet(socket_fd, &request);
     if (send_res <= 0) {
         errno = EIO;
@@ -202,19 +406,24 @@ int readFile(const char* pathname, void** buf, size_t* size)
         errno = EIO;
         return -1;
     }
-    // if the response is COMP then the operation terminated successfully
-    if (response.op == DATA) {
+    // the cached copy is still valid
+    if (response.op == NOT_MODIFIED) {
+        PRINT_IF_EN("the file %s is not modified\n", pathname);
+        return 1;
+    }
+    if (response.op == VERSIONED_DATA) {
         // the buffer is already allocated on the head by the call to receive_packet
         *buf = response.data;
         *size = response.data_size;
+        *version = response.version;
 
-        PRINT_IF_EN("read %zd bytes of the file %s\n", response.data_size, pathname);
+        PRINT_IF_EN("read %zd bytes of the file %s (version %lu)\n", response.data_size, pathname, (unsigned long)response.version);
         return 0;
     }
 
     // if the response is an error then print it to stderr
     if (response.op == ERROR) {
-        PRINT_ERR_CODE_IF_EN(response.err_code, "readFile");
+        PRINT_ERR_CODE_IF_EN(response.err_code, "readFileIfModified");
     }
     errno = EBADE;
     return -1;
@@ -235,7 +444,7 @@ int readNFiles(int n, const char* dirname)
         return -1;
     }
 
-    return receive_files_from_server(dirname, "readNFiles");
+    return receive_files_from_server(dirname, "readNFiles", NULL);
 }
 
 int writeFile(const char* pathname, const char* dirname)
@@ -266,18 +475,12 @@ int writeFile(const char* pathname, const char* dirname)
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = WRITE_FILE;
     request.data_size = fsize;
     request.data = buf;
-    request.name_length = strlen(pathname);
-    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
-    if (request.filename == NULL) {
-        errno = ENOMEM;
+    if (fill_file_request(&request, WRITE_FILE, WRITE_HANDLE, pathname) == -1) {
         free(buf);
-        free(request.filename);
         return -1;
     }
-    strcpy(request.filename, pathname);
     int send_res = send_packet(socket_fd, &request);
     if (send_res <= 0) {
         errno = EIO;
@@ -288,7 +491,7 @@ int writeFile(const char* pathname, const char* dirname)
 
     free(buf);
     free(request.filename);
-    return receive_files_from_server(dirname, "writeFile");
+    return receive_files_from_server(dirname, "writeFile", pathname);
 }
 
 int appendToFile(const char* pathname, void* buf, size_t size, const char* dirname)
@@ -302,24 +505,20 @@ int appendToFile(const char* pathname, void* buf, size_t size, const char* dirna
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = APPEND_TO_FILE;
     request.data_size = size;
     request.data = buf;
-    request.name_length = strlen(pathname);
-    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
-    if (request.filename == NULL) {
-        errno = ENOMEM;
+    if (fill_file_request(&request, APPEND_TO_FILE, APPEND_HANDLE, pathname) == -1) {
         free(buf);
         return -1;
     }
-    strcpy(request.filename, pathname);
     int send_res = send_packet(socket_fd, &request);
+    free(request.filename);
     if (send_res <= 0) {
         errno = EIO;
         return -1;
     }
 
-    return receive_files_from_server(dirname, "writeFile");
+    return receive_files_from_server(dirname, "appendToFile", pathname);
 }
 
 int lockFile(const char* pathname)
@@ -332,14 +531,9 @@ int lockFile(const char* pathname)
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = LOCK_FILE;
-    request.name_length = strlen(pathname);
-    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
-    if (request.filename == NULL) {
-        errno = ENOMEM;
+    if (fill_file_request(&request, LOCK_FILE, LOCK_HANDLE, pathname) == -1) {
         return -1;
     }
-    strcpy(request.filename, pathname);
     int send_res = send_packet(socket_fd, &request);
     if (send_res <= 0) {
         errno = EIO;
@@ -362,6 +556,7 @@ int lockFile(const char* pathname)
 
     // if the response is an error then print it to stderr
     if (response.op == ERROR) {
+        check_handle_error(&response, pathname);
         PRINT_ERR_CODE_IF_EN(response.err_code, "lockFile");
     }
     errno = EBADE;
@@ -377,14 +572,9 @@ int unlockFile(const char* pathname)
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = UNLOCK_FILE;
-    request.name_length = strlen(pathname);
-    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
-    if (request.filename == NULL) {
-        errno = ENOMEM;
+    if (fill_file_request(&request, UNLOCK_FILE, UNLOCK_HANDLE, pathname) == -1) {
         return -1;
     }
-    strcpy(request.filename, pathname);
     int send_res = send_packet(socket_fd, &request);
     if (send_res <= 0) {
         errno = EIO;
@@ -407,7 +597,8 @@ int unlockFile(const char* pathname)
 
     // if the response is an error then print it to stderr
     if (response.op == ERROR) {
-        PRINT_ERR_CODE_IF_EN(response.err_code, "lockFile");
+        check_handle_error(&response, pathname);
+        PRINT_ERR_CODE_IF_EN(response.err_code, "unlockFile");
     }
     errno = EBADE;
     return -1;
@@ -423,14 +614,9 @@ int closeFile(const char* pathname)
     // send the request to the server
     struct packet request;
     clear_packet(&request);
-    request.op = CLOSE_FILE;
-    request.name_length = strlen(pathname);
-    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
-    if (request.filename == NULL) {
-        errno = ENOMEM;
+    if (fill_file_request(&request, CLOSE_FILE, CLOSE_HANDLE, pathname) == -1) {
         return -1;
     }
-    strcpy(request.filename, pathname);
     int send_res = send_packet(socket_fd, &request);
     if (send_res <= 0) {
         errno = EIO;
@@ -448,11 +634,13 @@ int closeFile(const char* pathname)
     }
     // if the response is COMP then the operation terminated successfully
     if (response.op == COMP) {
+        forget_handle(pathname);
         return 0;
     }
 
     // if the response is an error then print it to stderr
     if (response.op == ERROR) {
+        check_handle_error(&response, pathname);
         PRINT_ERR_CODE_IF_EN(response.err_code, "closeFile");
     }
     errno = EBADE;
@@ -494,6 +682,7 @@ int removeFile(const char* pathname)
     }
     // if the response is COMP then the operation terminated successfully
     if (response.op == COMP) {
+        forget_handle(pathname);
         return 0;
     }
 
@@ -503,4 +692,283 @@ int removeFile(const char* pathname)
     }
     errno = EBADE;
     return -1;
-}
\ No newline at end of file
+}
+
+int statFile(const char* pathname, struct file_info* info)
+{
+    if (pathname == NULL || info == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    PRINT_IF_EN("stat the file %s\n", pathname);
+    // send the request to the server
+    struct packet request;
+    clear_packet(&request);
+    request.op = STAT_FILE;
+    request.name_length = strlen(pathname);
+    request.filename = malloc((strlen(pathname) + 1) * sizeof(char));
+    if (request.filename == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(request.filename, pathname);
+    int send_res = send_packet(socket_fd, &request);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    free(request.filename);
+
+    // receive the response
+    struct packet response;
+    clear_packet(&response);
+    int receive_res = receive_packet(socket_fd, &response);
+    if (receive_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    if (response.op == FILE_INFO) {
+        file_info_from_packet(info, &response);
+        return 0;
+    }
+
+    // if the response is an error then print it to stderr
+    if (response.op == ERROR) {
+        PRINT_ERR_CODE_IF_EN(response.err_code, "statFile");
+    }
+    errno = EBADE;
+    return -1;
+}
+
+int listFiles(const char* prefix, uint64_t* cursor, int max, struct file_info** entries, size_t* num_entries)
+{
+    if (cursor == NULL || entries == NULL || num_entries == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (prefix == NULL) {
+        prefix = "";
+    }
+    PRINT_IF_EN("list at most %d files with prefix '%s'\n", max, prefix);
+
+    // send the request to the server
+    struct packet request;
+    clear_packet(&request);
+    request.op = LIST_FILES;
+    request.name_length = strlen(prefix);
+    request.filename = malloc((strlen(prefix) + 1) * sizeof(char));
+    if (request.filename == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    strcpy(request.filename, prefix);
+    request.cursor = *cursor;
+    request.count = max;
+    int send_res = send_packet(socket_fd, &request);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    free(request.filename);
+
+    // receive the entries until COMP, growing the array geometrically
+    size_t capacity = 0;
+    *entries = NULL;
+    *num_entries = 0;
+    for (;;) {
+        struct packet response;
+        clear_packet(&response);
+        int receive_res = receive_packet(socket_fd, &response);
+        if (receive_res <= 0) {
+            freeFileInfo(*entries, *num_entries);
+            errno = EIO;
+            return -1;
+        }
+        if (response.op == COMP) {
+            return 0;
+        }
+        if (response.op != FILE_INFO) {
+            if (response.op == ERROR) {
+                PRINT_ERR_CODE_IF_EN(response.err_code, "listFiles");
+            }
+            destroy_packet(&response);
+            freeFileInfo(*entries, *num_entries);
+            errno = EBADE;
+            return -1;
+        }
+        if (*num_entries == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            struct file_info* new_entries = realloc(*entries, capacity * sizeof(struct file_info));
+            if (new_entries == NULL) {
+                destroy_packet(&response);
+                freeFileInfo(*entries, *num_entries);
+                errno = ENOMEM;
+                return -1;
+            }
+            *entries = new_entries;
+        }
+        file_info_from_packet(&(*entries)[*num_entries], &response);
+        ++*num_entries;
+        *cursor = response.cursor;
+    }
+}
+
+void freeFileInfo(struct file_info* entries, size_t num_entries)
+{
+    if (entries == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < num_entries; ++i) {
+        free(entries[i].filename);
+    }
+    free(entries);
+}
+
+int readFiles(size_t n, const char* pathnames[], void* bufs[], size_t sizes[])
+{
+    if (bufs == NULL || sizes == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    PRINT_IF_EN("read %zu files with a single request\n", n);
+    if (send_batch_request(READ_FILES, n, pathnames) == -1) {
+        return -1;
+    }
+
+    // the server sends exactly one packet for each file
+    int num_read = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct packet response;
+        clear_packet(&response);
+        int receive_res = receive_packet(socket_fd, &response);
+        if (receive_res <= 0) {
+            errno = EIO;
+            return -1;
+        }
+        bufs[i] = NULL;
+        sizes[i] = 0;
+        if (response.op == FILE_P) {
+            // the buffer is already allocated on the heap by the call to receive_packet
+            bufs[i] = response.data;
+            sizes[i] = response.data_size;
+            response.data = NULL;
+            ++num_read;
+            PRINT_IF_EN("read %zd bytes of the file %s\n", sizes[i], pathnames[i]);
+        } else if (response.op == ERROR) {
+            PRINT_ERR_CODE_IF_EN(response.err_code, pathnames[i]);
+        }
+        destroy_packet(&response);
+    }
+    return num_read;
+}
+
+int removeFiles(size_t n, const char* pathnames[])
+{
+    PRINT_IF_EN("remove %zu files with a single request\n", n);
+    if (send_batch_request(REMOVE_FILES, n, pathnames) == -1) {
+        return -1;
+    }
+
+    // the server sends exactly one packet for each file
+    int num_removed = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct packet response;
+        clear_packet(&response);
+        int receive_res = receive_packet(socket_fd, &response);
+        if (receive_res <= 0) {
+            errno = EIO;
+            return -1;
+        }
+        if (response.op == COMP) {
+            ++num_removed;
+        } else if (response.op == ERROR) {
+            PRINT_ERR_CODE_IF_EN(response.err_code, pathnames[i]);
+        }
+    }
+    return num_removed;
+}
+
+int lockFiles(size_t n, const char* pathnames[])
+{
+    PRINT_IF_EN("lock %zu files with a single request\n", n);
+    if (send_batch_request(LOCK_FILES, n, pathnames) == -1) {
+        return -1;
+    }
+
+    // receive the response
+    struct packet response;
+    clear_packet(&response);
+    int receive_res = receive_packet(socket_fd, &response);
+    if (receive_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    // if the response is COMP then the operation terminated successfully
+    if (response.op == COMP) {
+        return 0;
+    }
+
+    // if the response is an error then print it to stderr
+    if (response.op == ERROR) {
+        PRINT_ERR_CODE_IF_EN(response.err_code, "lockFiles");
+    }
+    errno = EBADE;
+    return -1;
+}
+
+int setEjectionMode(int mode)
+{
+    if (mode != EJECT_SEND_FILES && mode != EJECT_SEND_NAMES && mode != EJECT_DISCARD && mode != EJECT_DEFERRED) {
+        errno = EINVAL;
+        return -1;
+    }
+    PRINT_IF_EN("set the ejection mode to %d\n", mode);
+
+    // send the request to the server
+    struct packet request;
+    clear_packet(&request);
+    request.op = SET_OPTIONS;
+    request.flags = mode;
+    int send_res = send_packet(socket_fd, &request);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    // receive the response
+    struct packet response;
+    clear_packet(&response);
+    int receive_res = receive_packet(socket_fd, &response);
+    if (receive_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+    // if the response is COMP then the operation terminated successfully
+    if (response.op == COMP) {
+        return 0;
+    }
+
+    // if the response is an error then print it to stderr
+    if (response.op == ERROR) {
+        PRINT_ERR_CODE_IF_EN(response.err_code, "setEjectionMode");
+    }
+    errno = EBADE;
+    return -1;
+}
+
+int drainEjected(const char* dirname)
+{
+    PRINT_IF_EN("receive the ejected files kept by the server\n");
+
+    // send the request to the server
+    struct packet request;
+    clear_packet(&request);
+    request.op = DRAIN_EJECTED;
+    int send_res = send_packet(socket_fd, &request);
+    if (send_res <= 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return receive_files_from_server(dirname, "drainEjected", NULL);
+}
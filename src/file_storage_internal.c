@@ -1,20 +1,35 @@
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <unistd.h>
 
+#include "compression.h"
 #include "file_storage_internal.h"
 
+// marks the end of the list of free handle slots
+#define NO_FREE_SLOT UINT32_MAX
+#define INITIAL_HANDLE_SLOTS 64
+
+// a handle is the generation of the slot in the upper 32 bits and the index
+// of the slot in the lower 32 bits
+#define HANDLE_SLOT(handle) ((uint32_t)((handle)&0xffffffff))
+#define HANDLE_GENERATION(handle) ((uint32_t)((handle) >> 32))
+#define MAKE_HANDLE(generation, slot) (((uint64_t)(generation) << 32) | (slot))
+
 /*
  * Creates an empty file storage with given replacement policy.
+ * The content of the files up to inline_file_size bytes is stored inline in the
+ * vfile structure, without any other allocation (0 disables the inline storage).
  * The storage shall be destroyed using destoy_file_storage
  * Returns NULL on error and errno is set appropriately
 */
-file_storage_t* create_file_storage(enum file_replacement_policy replacement_policy)
+file_storage_t* create_file_storage(enum file_replacement_policy replacement_policy, size_t inline_file_size)
 {
     file_storage_t* storage = malloc(sizeof(file_storage_t));
     if (storage == NULL) {
@@ -29,14 +44,46 @@ file_storage_t* create_file_storage(enum file_replacement_policy replacement_pol
     if (storage->rw_lock == NULL) {
         return NULL;
     }
+    storage->vfile_pool = create_object_pool(sizeof(vfile_t) + inline_file_size);
+    if (storage->vfile_pool == NULL) {
+        destroy_rw_lock(storage->rw_lock);
+        free(storage);
+        return NULL;
+    }
+    storage->inline_file_size = inline_file_size;
+    storage->blobs = NULL;
+    storage->deduplicated_size = 0;
+    storage->compression = false;
+    storage->compression_savings = 0;
+    storage->spill = NULL;
+    storage->snapshot = NULL;
+    storage->wal = NULL;
+    storage->snapshot_size = 0;
     storage->num_files = 0;
     storage->total_size = 0;
+    storage->memory.data = 0;
+    storage->memory.metadata = 0;
+    storage->memory.names = 0;
+    storage->max_memory = 0;
+    storage->version_clock = 0;
+    storage->next_id = 1;
+    storage->handle_slots = NULL;
+    storage->handle_slots_size = 0;
+    storage->first_free_slot = NO_FREE_SLOT;
     storage->replacement_policy = replacement_policy;
 
     //initialize the statistics values
     storage->statistics.maximum_num_files = 0;
     storage->statistics.maximum_size_reached = 0;
     storage->statistics.num_replacements = 0;
+    storage->statistics.num_background_replacements = 0;
+    storage->statistics.num_evictor_runs = 0;
+    storage->statistics.maximum_memory_reached = 0;
+    storage->statistics.num_deduplicated_chunks = 0;
+    storage->statistics.num_compressions = 0;
+    storage->statistics.num_decompressions = 0;
+    storage->statistics.num_ram_hits = 0;
+    storage->statistics.num_ram_misses = 0;
 
     return storage;
 }
@@ -57,7 +104,16 @@ int destroy_file_storage(file_storage_t* storage)
     for (vfile_t* f = storage->first; f != NULL;) {
         vfile_t* tmp = f;
         f = f->next;
-        destroy_vfile(tmp);
+        destroy_vfile(storage, tmp);
+    }
+
+    free(storage->handle_slots);
+    destroy_object_pool(storage->vfile_pool);
+    if (storage->blobs != NULL) {
+        destroy_blob_store(storage->blobs);
+    }
+    if (storage->snapshot != NULL && munmap(storage->snapshot, storage->snapshot_size) == -1) {
+        return -1;
     }
 
     // destroy the mutex
@@ -70,13 +126,13 @@ int destroy_file_storage(file_storage_t* storage)
 }
 
 /*
- * Creates an empty vfile
+ * Creates an empty vfile, that can be added to storage
  * The vfile shall be destroyed using destroy_vfile
  * Returns NULL on error and errno is set appropriately
 */
-vfile_t* create_vfile()
+vfile_t* create_vfile(file_storage_t* storage)
 {
-    vfile_t* vfile = malloc(sizeof(vfile_t));
+    vfile_t* vfile = object_pool_alloc(storage->vfile_pool);
     if (vfile == NULL) {
         errno = ENOMEM;
         return NULL;
@@ -85,17 +141,32 @@ vfile_t* create_vfile()
     // initialize all the fields
     vfile->filename = NULL;
     vfile->size = 0;
+    vfile->id = 0;
+    vfile->handle = 0;
     vfile->next = NULL;
     vfile->prev = NULL;
     FD_ZERO(&vfile->opened_by);
     vfile->locked_by = -1;
     FD_ZERO(&vfile->lock_queue);
     vfile->lock_queue_max = 0;
-    vfile->data = NULL;
+    init_file_data_inline(&vfile->data, vfile->inline_data, storage->inline_file_size);
+    vfile->chunks = NULL;
+    vfile->num_chunks = 0;
+    vfile->chunk_segments = NULL;
+    vfile->compressed = NULL;
+    vfile->compressed_size = 0;
+    vfile->incompressible = false;
+    vfile->mapped.iov_base = NULL;
+    vfile->mapped.iov_len = 0;
+    vfile->memory.data = 0;
+    vfile->memory.metadata = 0;
+    vfile->memory.names = 0;
+    vfile->version = 0;
     vfile->used_counter = 0;
     vfile->last_used = time(NULL);
 
-    if (pthread_mutex_init(&vfile->replacement_mutex, NULL) == -1) {
+    if (pthread_mutex_init(&vfile->replacement_mutex, NULL) != 0) {
+        object_pool_free(storage->vfile_pool, vfile);
         return NULL;
     }
 
@@ -103,24 +174,566 @@ vfile_t* create_vfile()
 }
 
 /**
- * Destroy a vfile object.
+ * Destroy a vfile object created for storage.
  * Returns -1 on error and errno is set appropriately
 */
-int destroy_vfile(vfile_t* vfile)
+int destroy_vfile(file_storage_t* storage, vfile_t* vfile)
 {
     if (vfile == NULL) {
         errno = EINVAL;
         return -1;
     }
-    free(vfile->data);
+    destroy_file_data(&vfile->data);
+    free(vfile->chunks);
+    free(vfile->chunk_segments);
+    free(vfile->compressed);
     free(vfile->filename);
     if (pthread_mutex_destroy(&vfile->replacement_mutex) == -1) {
         return -1;
     }
-    free(vfile);
+    object_pool_free(storage->vfile_pool, vfile);
+    return 0;
+}
+
+/**
+ * Compute the memory used by vfile, and update the memory charged to the
+ * storage. Shall be called after the content of a file in the storage changes
+ * (add_vfile_to_storage and remove_file_from_storage do it by themselves).
+ * Must be called while holding the storage lock in write mode.
+*/
+void update_file_memory(file_storage_t* storage, vfile_t* vfile)
+{
+    // the inline buffer and its iovec are part of the vfile structure
+    file_data_t* data = &vfile->data;
+    size_t num_allocated_segments = data->num_segments - (file_data_uses_inline(data) ? 1 : 0);
+    struct file_memory memory;
+    memory.data = data->capacity + num_allocated_segments * ALLOCATION_OVERHEAD;
+    if (vfile->compressed != NULL) {
+        memory.data += vfile->compressed_size + ALLOCATION_OVERHEAD;
+    }
+    // a mapped content is not charged: its pages are in the page cache, and
+    // the kernel can drop them since they are backed by the snapshot file
+    memory.metadata = storage->vfile_pool->object_size;
+    if (data->segments != NULL && data->segments != &data->inline_segment) {
+        memory.metadata += data->max_segments * sizeof(struct iovec) + ALLOCATION_OVERHEAD;
+    }
+    // the chunks are charged when they enter the storage, the file is charged
+    // only for its arrays of chunks
+    if (vfile->chunks != NULL) {
+        memory.metadata += vfile->num_chunks * (sizeof(blob_t*) + sizeof(struct iovec)) + 2 * ALLOCATION_OVERHEAD;
+    }
+    memory.names = vfile->filename == NULL ? 0 : strlen(vfile->filename) + 1 + ALLOCATION_OVERHEAD;
+
+    storage->memory.data += memory.data - vfile->memory.data;
+    storage->memory.metadata += memory.metadata - vfile->memory.metadata;
+    storage->memory.names += memory.names - vfile->memory.names;
+    vfile->memory = memory;
+
+    size_t total = get_storage_memory(storage);
+    if (total > storage->statistics.maximum_memory_reached) {
+        storage->statistics.maximum_memory_reached = total;
+    }
+}
+
+/**
+ * Returns the total memory charged to the storage
+*/
+size_t get_storage_memory(const file_storage_t* storage)
+{
+    return storage->memory.data + storage->memory.metadata + storage->memory.names;
+}
+
+/**
+ * Returns true if the storage has a memory budget and memory_needed more bytes
+ * would exceed it
+*/
+bool is_memory_exceeded(const file_storage_t* storage, size_t memory_needed)
+{
+    return storage->max_memory > 0 && get_storage_memory(storage) + memory_needed > storage->max_memory;
+}
+
+// memory charged for a chunk: its buffer and its blob structure
+#define CHUNK_DATA_MEMORY(size) ((size) + ALLOCATION_OVERHEAD)
+#define CHUNK_METADATA_MEMORY (sizeof(blob_t) + ALLOCATION_OVERHEAD)
+
+/**
+ * Enable the deduplication of the contents of the files: the files are
+ * stored as sequences of chunks, and the chunks with the same data are shared
+ * (see share_file_chunks)
+ * Returns -1 on error and errno is set appropriately
+*/
+int enable_file_deduplication(file_storage_t* storage)
+{
+    if (storage == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (storage->blobs == NULL) {
+        storage->blobs = create_blob_store();
+        if (storage->blobs == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the segments of the content of vfile, either its own, its chunks or
+ * its mapped content, and stores their number in num_segments
+*/
+const struct iovec* get_file_segments(const vfile_t* vfile, size_t* num_segments)
+{
+    if (vfile->mapped.iov_base != NULL) {
+        *num_segments = 1;
+        return &vfile->mapped;
+    }
+    if (vfile->chunks != NULL) {
+        *num_segments = vfile->num_chunks;
+        return vfile->chunk_segments;
+    }
+    *num_segments = vfile->data.num_segments;
+    return vfile->data.segments;
+}
+
+/**
+ * Returns the size of the i-th chunk of a content of size bytes
+*/
+static size_t chunk_size(size_t size, size_t i)
+{
+    size_t offset = i * FILE_CHUNK_SIZE;
+    return size - offset < FILE_CHUNK_SIZE ? size - offset : FILE_CHUNK_SIZE;
+}
+
+/**
+ * Compute the hashes of the chunks of the size bytes of buf. hashes shall
+ * have room for NUM_FILE_CHUNKS(size) hashes
+*/
+void hash_file_chunks(const void* buf, size_t size, uint64_t* hashes)
+{
+    for (size_t i = 0; i < NUM_FILE_CHUNKS(size); ++i) {
+        struct iovec chunk = { (char*)buf + i * FILE_CHUNK_SIZE, chunk_size(size, i) };
+        hashes[i] = hash_content(&chunk, 1);
+    }
+}
+
+/**
+ * Compute the storage space and the memory needed to store the size bytes of
+ * buf in chunks, whose hashes are hashes: only the chunks that are not in the
+ * storage are counted.
+ * Must be called while holding the storage lock.
+*/
+void estimate_file_chunks(file_storage_t* storage, const void* buf, size_t size, const uint64_t* hashes,
+    size_t* space_needed, size_t* memory_needed)
+{
+    size_t num_chunks = NUM_FILE_CHUNKS(size);
+    // the arrays of the chunks of the file
+    *space_needed = 0;
+    *memory_needed = num_chunks * (sizeof(blob_t*) + sizeof(struct iovec)) + 2 * ALLOCATION_OVERHEAD;
+    for (size_t i = 0; i < num_chunks; ++i) {
+        size_t len = chunk_size(size, i);
+        if (blob_store_find(storage->blobs, hashes[i], (const char*)buf + i * FILE_CHUNK_SIZE, len) == NULL) {
+            *space_needed += len;
+            *memory_needed += CHUNK_DATA_MEMORY(len) + CHUNK_METADATA_MEMORY;
+        }
+    }
+}
+
+/**
+ * Drop a reference to chunk, that is in the storage. If the chunk is still
+ * referenced its bytes are not duplicated anymore, otherwise it leaves the
+ * storage and it is returned, so that the caller can destroy it
+*/
+static blob_t* release_chunk(file_storage_t* storage, blob_t* chunk)
+{
+    if (!blob_store_release(storage->blobs, chunk)) {
+        storage->deduplicated_size -= chunk->size;
+        return NULL;
+    }
+    storage->total_size -= chunk->size;
+    storage->memory.data -= CHUNK_DATA_MEMORY(chunk->size);
+    storage->memory.metadata -= CHUNK_METADATA_MEMORY;
+    return chunk;
+}
+
+/**
+ * Drop the references to the chunks of vfile, and free its arrays of chunks.
+ * The buffers of the chunks that leave the storage are given to the content
+ * of the file if keep_buffers is true, so that they are freed with it out of
+ * the critical section, otherwise they are freed now
+*/
+static void release_file_chunks(file_storage_t* storage, vfile_t* vfile, bool keep_buffers)
+{
+    for (size_t i = 0; i < vfile->num_chunks; ++i) {
+        // the chunks not filled yet are NULL, see share_file_chunks
+        blob_t* chunk = vfile->chunks[i] != NULL ? release_chunk(storage, vfile->chunks[i]) : NULL;
+        if (chunk == NULL) {
+            continue;
+        }
+        if (keep_buffers && file_data_append_buffer(&vfile->data, chunk->data, chunk->size) == 0) {
+            chunk->data = NULL;
+        }
+        destroy_blob(chunk);
+    }
+    free(vfile->chunks);
+    free(vfile->chunk_segments);
+    vfile->chunks = NULL;
+    vfile->chunk_segments = NULL;
+    vfile->num_chunks = 0;
+}
+
+/**
+ * First step to make the size bytes of buf, whose chunks have the given
+ * hashes (see hash_file_chunks), the content of the empty vfile that is in the
+ * storage: the file takes a reference to the chunks that are already in the
+ * storage, so that they are not freed if other files are ejected before the
+ * second step, see fill_file_chunks.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int share_file_chunks(file_storage_t* storage, vfile_t* vfile, const void* buf, size_t size, const uint64_t* hashes)
+{
+    if (storage->blobs == NULL || vfile->chunks != NULL || vfile->data.size != 0 || size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    size_t num_chunks = NUM_FILE_CHUNKS(size);
+    vfile->chunks = calloc(num_chunks, sizeof(blob_t*));
+    vfile->chunk_segments = malloc(num_chunks * sizeof(struct iovec));
+    if (vfile->chunks == NULL || vfile->chunk_segments == NULL) {
+        release_file_chunks(storage, vfile, false);
+        errno = ENOMEM;
+        return -1;
+    }
+    vfile->num_chunks = num_chunks;
+
+    for (size_t i = 0; i < num_chunks; ++i) {
+        const char* data = (const char*)buf + i * FILE_CHUNK_SIZE;
+        size_t len = chunk_size(size, i);
+        blob_t* chunk = blob_store_find(storage->blobs, hashes[i], data, len);
+        if (chunk != NULL) {
+            ++chunk->refcount;
+            storage->deduplicated_size += len;
+            ++storage->statistics.num_deduplicated_chunks;
+            vfile->chunks[i] = chunk;
+            vfile->chunk_segments[i].iov_base = chunk->data;
+        }
+        vfile->chunk_segments[i].iov_len = len;
+    }
+    return 0;
+}
+
+/**
+ * Second step to make the size bytes of buf the content of vfile, after
+ * share_file_chunks: the chunks that were not in the storage are copied in
+ * new chunks. total_size is incremented only by the bytes of the new chunks.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately, in this case vfile is
+ * left empty
+*/
+int fill_file_chunks(file_storage_t* storage, vfile_t* vfile, const void* buf, const uint64_t* hashes)
+{
+    for (size_t i = 0; i < vfile->num_chunks; ++i) {
+        if (vfile->chunks[i] != NULL) {
+            continue;
+        }
+        const char* data = (const char*)buf + i * FILE_CHUNK_SIZE;
+        size_t len = vfile->chunk_segments[i].iov_len;
+        // the same chunk can be more than once in the file
+        blob_t* chunk = blob_store_find(storage->blobs, hashes[i], data, len);
+        if (chunk != NULL) {
+            ++chunk->refcount;
+            storage->deduplicated_size += len;
+            ++storage->statistics.num_deduplicated_chunks;
+        } else {
+            void* copy = malloc(len);
+            if (copy == NULL || (chunk = blob_store_insert(storage->blobs, hashes[i], copy, len)) == NULL) {
+                free(copy);
+                release_file_chunks(storage, vfile, false);
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(copy, data, len);
+            storage->total_size += len;
+            storage->memory.data += CHUNK_DATA_MEMORY(len);
+            storage->memory.metadata += CHUNK_METADATA_MEMORY;
+        }
+        vfile->chunks[i] = chunk;
+        vfile->chunk_segments[i].iov_base = chunk->data;
+    }
+    return 0;
+}
+
+/**
+ * Move the content of the chunks of vfile, that is in the storage, to its own
+ * data: a chunk is taken without a copy where the file drops its last
+ * reference, it is copied everywhere else (the same chunk can be more than
+ * once in the file). The memory of the file is not updated.
+ * Returns -1 on error and errno is set appropriately
+*/
+static int move_chunks_to_data(file_storage_t* storage, vfile_t* vfile)
+{
+    struct iovec* buffers = malloc(vfile->num_chunks * sizeof(struct iovec));
+    if (buffers == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // drop the references of the file in order without releasing the chunks
+    // yet, so that the copies are made before anything leaves the storage
+    size_t i;
+    for (i = 0; i < vfile->num_chunks; ++i) {
+        blob_t* chunk = vfile->chunks[i];
+        buffers[i].iov_len = chunk->size;
+        buffers[i].iov_base = --chunk->refcount == 0 ? chunk->data : malloc(chunk->size);
+        if (buffers[i].iov_base == NULL) {
+            ++chunk->refcount;
+            break;
+        }
+        if (chunk->refcount > 0) {
+            memcpy(buffers[i].iov_base, chunk->data, chunk->size);
+        }
+    }
+    size_t num_dropped = i;
+    for (i = 0; i < num_dropped; ++i) {
+        ++vfile->chunks[i]->refcount;
+    }
+    if (num_dropped < vfile->num_chunks
+        || file_data_append_buffers(&vfile->data, buffers, vfile->num_chunks) == -1) {
+        for (i = 0; i < num_dropped; ++i) {
+            if (buffers[i].iov_base != vfile->chunks[i]->data) {
+                free(buffers[i].iov_base);
+            }
+        }
+        free(buffers);
+        errno = ENOMEM;
+        return -1;
+    }
+    free(buffers);
+
+    // the file owns its content now: the chunks whose last reference is
+    // released leave the storage without their buffers, the copies are new space
+    for (i = 0; i < vfile->num_chunks; ++i) {
+        blob_t* chunk = release_chunk(storage, vfile->chunks[i]);
+        if (chunk != NULL) {
+            chunk->data = NULL;
+            destroy_blob(chunk);
+        }
+    }
+    storage->total_size += vfile->size;
+    vfile->num_chunks = 0;
+    release_file_chunks(storage, vfile, false);
+    return 0;
+}
+
+/**
+ * Copy the mapped content of vfile to its own data. The memory of the file is
+ * not updated.
+ * Returns -1 on error and errno is set appropriately
+*/
+static int move_mapped_to_data(vfile_t* vfile)
+{
+    void* content = malloc(vfile->size);
+    if (content == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(content, vfile->mapped.iov_base, vfile->size);
+    if (file_data_append_buffer(&vfile->data, content, vfile->size) == -1) {
+        free(content);
+        return -1;
+    }
+    vfile->mapped.iov_base = NULL;
+    vfile->mapped.iov_len = 0;
+    return 0;
+}
+
+/**
+ * Give to vfile, that is in the storage, its own copy of the content of its
+ * chunks or of its mapped content, so that it can be modified (copy on write).
+ * The chunks referenced only by vfile are taken without copies.
+ * Nothing is done if the content of vfile is not in chunks and not mapped.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int unshare_file_content(file_storage_t* storage, vfile_t* vfile)
+{
+    if (vfile->mapped.iov_base != NULL) {
+        if (move_mapped_to_data(vfile) == -1) {
+            return -1;
+        }
+        update_file_memory(storage, vfile);
+        return 0;
+    }
+    if (vfile->chunks == NULL) {
+        return 0;
+    }
+    if (move_chunks_to_data(storage, vfile) == -1) {
+        return -1;
+    }
+    update_file_memory(storage, vfile);
+    return 0;
+}
+
+/**
+ * Compress the content of vfile, that is in the storage. If the content does
+ * not compress well the file is left as it is, and it is marked as
+ * incompressible. The content of a compressed file is not in data, it shall
+ * be read with decompress_file_to_buffer, or decompressed in place with
+ * decompress_file before it is modified.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int compress_file(file_storage_t* storage, vfile_t* vfile)
+{
+    if (storage == NULL || vfile == NULL || vfile->compressed != NULL || vfile->chunks != NULL || vfile->size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    // the compressor needs the content in a single buffer, so a content made
+    // of many segments is copied. A mapped content is already contiguous
+    const void* content = vfile->mapped.iov_base != NULL ? vfile->mapped.iov_base : vfile->data.segments[0].iov_base;
+    void* copy = NULL;
+    if (vfile->mapped.iov_base == NULL && vfile->data.num_segments > 1) {
+        copy = malloc(vfile->size);
+        if (copy == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        file_data_copy(&vfile->data, copy);
+        content = copy;
+    }
+
+    // the output buffer is only as big as a compression worth keeping
+    size_t capacity = vfile->size - vfile->size / COMPRESSION_MIN_GAIN;
+    void* compressed = malloc(capacity);
+    if (compressed == NULL) {
+        free(copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t compressed_size = compress_buffer(content, vfile->size, compressed, capacity);
+    free(copy);
+    if (compressed_size == 0) {
+        free(compressed);
+        vfile->incompressible = true;
+        return 0;
+    }
+    void* shrunk = realloc(compressed, compressed_size);
+    if (shrunk != NULL) {
+        compressed = shrunk;
+    }
+
+    destroy_file_data(&vfile->data);
+    init_file_data_inline(&vfile->data, vfile->inline_data, storage->inline_file_size);
+    vfile->mapped.iov_base = NULL;
+    vfile->mapped.iov_len = 0;
+    vfile->compressed = compressed;
+    vfile->compressed_size = compressed_size;
+    storage->total_size -= vfile->size - compressed_size;
+    storage->compression_savings += vfile->size - compressed_size;
+    ++storage->statistics.num_compressions;
+    update_file_memory(storage, vfile);
+    return 0;
+}
+
+/**
+ * Decompress the content of the compressed vfile in buf, that shall have room
+ * for vfile->size bytes. The file is not modified, so the storage lock can be
+ * held in read mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int decompress_file_to_buffer(const vfile_t* vfile, void* buf)
+{
+    if (vfile == NULL || vfile->compressed == NULL || buf == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return decompress_buffer(vfile->compressed, vfile->compressed_size, buf, vfile->size);
+}
+
+/**
+ * Move the decompressed content of vfile, that is in the storage, to its own
+ * data. The memory of the file is not updated.
+ * Returns -1 on error and errno is set appropriately
+*/
+static int move_compressed_to_data(file_storage_t* storage, vfile_t* vfile)
+{
+    void* content = malloc(vfile->size);
+    if (content == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (decompress_file_to_buffer(vfile, content) == -1 || file_data_append_buffer(&vfile->data, content, vfile->size) == -1) {
+        free(content);
+        return -1;
+    }
+    storage->total_size += vfile->size - vfile->compressed_size;
+    storage->compression_savings -= vfile->size - vfile->compressed_size;
+    ++storage->statistics.num_decompressions;
+    free(vfile->compressed);
+    vfile->compressed = NULL;
+    vfile->compressed_size = 0;
     return 0;
 }
 
+/**
+ * Decompress the content of vfile, that is in the storage, in its data.
+ * Nothing is done if vfile is not compressed.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately
+*/
+int decompress_file(file_storage_t* storage, vfile_t* vfile)
+{
+    if (storage == NULL || vfile == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vfile->compressed == NULL) {
+        return 0;
+    }
+    if (move_compressed_to_data(storage, vfile) == -1) {
+        return -1;
+    }
+    update_file_memory(storage, vfile);
+    return 0;
+}
+
+/**
+ * Returns the size of the contents of all the files in the storage, counting
+ * the shared chunks once for every reference and the compressed files with
+ * their original size. total_size is the physical size
+*/
+size_t get_logical_size(const file_storage_t* storage)
+{
+    return storage->total_size + storage->deduplicated_size + storage->compression_savings;
+}
+
+/**
+ * Put a vfile, already removed from the storage, in the list of retired files.
+ * Destroying a file can take a long time for big files, so it should not be
+ * done while holding the storage lock: the file is retired instead, and the
+ * list is destroyed with destroy_retired_vfiles after the lock is released.
+ * The list is linked through the next field of the files, so no memory is
+ * allocated. *retired shall be NULL for an empty list.
+*/
+void retire_vfile(vfile_t** retired, vfile_t* vfile)
+{
+    vfile->prev = NULL;
+    vfile->next = *retired;
+    *retired = vfile;
+}
+
+/**
+ * Destroy all the files in the list of retired files, and empty the list
+*/
+void destroy_retired_vfiles(file_storage_t* storage, vfile_t** retired)
+{
+    while (*retired != NULL) {
+        vfile_t* tmp = *retired;
+        *retired = tmp->next;
+        destroy_vfile(storage, tmp);
+    }
+}
+
 /**
  * Get the rw lock contained in the storage
  * Each read operation to the storage must be done between read_lock() and read_unlock()
@@ -136,6 +749,113 @@ rw_lock_t* get_rw_lock_from_storage(file_storage_t* storage)
     return storage->rw_lock;
 }
 
+/**
+ * Take a free slot of the handle table and assign it to vfile, the table is
+ * doubled if there are no free slots.
+ * Returns -1 on error and errno is set appropriately.
+*/
+static int assign_handle(file_storage_t* storage, vfile_t* vfile)
+{
+    if (storage->first_free_slot == NO_FREE_SLOT) {
+        uint32_t old_size = storage->handle_slots_size;
+        uint32_t new_size = old_size == 0 ? INITIAL_HANDLE_SLOTS : old_size * 2;
+        if (new_size <= old_size || new_size == NO_FREE_SLOT) {
+            errno = ENOMEM;
+            return -1;
+        }
+        struct handle_slot* new_slots = realloc(storage->handle_slots, new_size * sizeof(struct handle_slot));
+        if (new_slots == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        // put all the new slots in the free list, generations start from 1 so
+        // that 0 is never a valid handle
+        for (uint32_t i = old_size; i < new_size; ++i) {
+            new_slots[i].file = NULL;
+            new_slots[i].generation = 1;
+            new_slots[i].next_free = i + 1 < new_size ? i + 1 : NO_FREE_SLOT;
+        }
+        storage->handle_slots = new_slots;
+        storage->handle_slots_size = new_size;
+        storage->first_free_slot = old_size;
+    }
+
+    uint32_t slot = storage->first_free_slot;
+    storage->first_free_slot = storage->handle_slots[slot].next_free;
+    storage->handle_slots[slot].file = vfile;
+    vfile->handle = MAKE_HANDLE(storage->handle_slots[slot].generation, slot);
+    return 0;
+}
+
+/**
+ * Invalidate the handle of vfile and put its slot back in the free list
+*/
+static void release_handle(file_storage_t* storage, vfile_t* vfile)
+{
+    uint32_t slot = HANDLE_SLOT(vfile->handle);
+    storage->handle_slots[slot].file = NULL;
+    // skip the generation 0 when the counter wraps around
+    if (++storage->handle_slots[slot].generation == 0) {
+        storage->handle_slots[slot].generation = 1;
+    }
+    storage->handle_slots[slot].next_free = storage->first_free_slot;
+    storage->first_free_slot = slot;
+    vfile->handle = 0;
+}
+
+/**
+ * Rebuild the handle table of the storage from the generations of the
+ * num_slots slots of the table of another storage, so that the handles given
+ * out by that storage stay valid: vfile->handle of each file shall be set to
+ * the handle the file had there, or to 0. The files whose handle does not fit
+ * in the table are given a new handle.
+ * Must be called before the storage is shared with other threads.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int restore_file_handles(file_storage_t* storage, const uint32_t* generations, uint32_t num_slots)
+{
+    if (storage == NULL || (generations == NULL && num_slots > 0) || num_slots == NO_FREE_SLOT) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct handle_slot* slots = NULL;
+    if (num_slots > 0 && (slots = malloc(num_slots * sizeof(struct handle_slot))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_slots; ++i) {
+        slots[i].file = NULL;
+        slots[i].generation = generations[i] != 0 ? generations[i] : 1;
+    }
+    free(storage->handle_slots);
+    storage->handle_slots = slots;
+    storage->handle_slots_size = num_slots;
+
+    // the files take back their slots, then the free list is made of the
+    // slots left, and the other files take a slot from it
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        uint32_t slot = HANDLE_SLOT(f->handle);
+        if (slot < num_slots && slots[slot].generation == HANDLE_GENERATION(f->handle) && slots[slot].file == NULL) {
+            slots[slot].file = f;
+        } else {
+            f->handle = 0;
+        }
+    }
+    storage->first_free_slot = NO_FREE_SLOT;
+    for (uint32_t i = num_slots; i > 0; --i) {
+        if (slots[i - 1].file == NULL) {
+            slots[i - 1].next_free = storage->first_free_slot;
+            storage->first_free_slot = i - 1;
+        }
+    }
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        if (f->handle == 0 && assign_handle(storage, f) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /**
  * Add a vfile to a file storage.
  * It is up to the caller to ensure that a file with the same filename does not
@@ -154,9 +874,24 @@ int add_vfile_to_storage(file_storage_t* storage, vfile_t* vfile)
         return -1;
     }
 
+    if (assign_handle(storage, vfile) == -1) {
+        return -1;
+    }
+
     // update storage metadata
     storage->num_files++;
-    storage->total_size += vfile->size;
+    if (vfile->chunks == NULL) {
+        storage->total_size += vfile->size;
+    }
+    update_file_memory(storage, vfile);
+
+    // files are always appended at the end of the list, so the identifiers
+    // are increasing along the list
+    vfile->id = storage->next_id++;
+
+    // the creation counts as the first version of the file, so that the
+    // version 0 is never assigned and can be used as "no version"
+    vfile->version = ++storage->version_clock;
 
     // initialize the next and prev fields (should not be necessary but can be
     // useful in the event that the file has been removed from a storage and next
@@ -189,9 +924,27 @@ int remove_file_from_storage(file_storage_t* storage, vfile_t* vfile)
         return -1;
     }
 
+    // the handles of the file are not valid anymore
+    release_handle(storage, vfile);
+
     // update storage metadata
     storage->num_files--;
-    storage->total_size -= vfile->size;
+    if (vfile->compressed != NULL) {
+        storage->total_size -= vfile->compressed_size;
+        storage->compression_savings -= vfile->size - vfile->compressed_size;
+    } else if (vfile->chunks == NULL) {
+        storage->total_size -= vfile->size;
+    } else {
+        // the chunks that are not referenced anymore are destroyed with the
+        // file, out of the critical section
+        release_file_chunks(storage, vfile, true);
+    }
+    storage->memory.data -= vfile->memory.data;
+    storage->memory.metadata -= vfile->memory.metadata;
+    storage->memory.names -= vfile->memory.names;
+    vfile->memory.data = 0;
+    vfile->memory.metadata = 0;
+    vfile->memory.names = 0;
 
     // since the list is duobly linked, the remove operation is trivial
     // and can be done in constant time
@@ -208,6 +961,67 @@ int remove_file_from_storage(file_storage_t* storage, vfile_t* vfile)
     return 0;
 }
 
+/**
+ * Remove a file from the storage, as remove_file_from_storage, but the file
+ * keeps the whole content of its chunks (the ones shared with other files are
+ * copied), its decompressed content or a copy of its mapped content, so that
+ * the content can outlive the file in the storage. The copies are not charged
+ * to the storage.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int take_file_from_storage(file_storage_t* storage, vfile_t* vfile)
+{
+    if (storage == NULL || vfile == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (vfile->chunks != NULL && move_chunks_to_data(storage, vfile) == -1) {
+        return -1;
+    }
+    if (vfile->compressed != NULL && move_compressed_to_data(storage, vfile) == -1) {
+        return -1;
+    }
+    if (vfile->mapped.iov_base != NULL && move_mapped_to_data(vfile) == -1) {
+        return -1;
+    }
+    return remove_file_from_storage(storage, vfile);
+}
+
+/**
+ * Returns the file chosen by the policy of the storage among the files for
+ * which is_candidate is true (all of them if it is NULL), except file_to_exclude
+ * Returns NULL if there is no such file
+*/
+static vfile_t* choose_file_by_policy(file_storage_t* storage, vfile_t* file_to_exclude, bool (*is_candidate)(const vfile_t*))
+{
+    vfile_t* min_file = NULL;
+    for (vfile_t* curr_file = storage->first; curr_file != NULL; curr_file = curr_file->next) {
+        if (curr_file == file_to_exclude || (is_candidate != NULL && !is_candidate(curr_file))) {
+            continue;
+        }
+        if (min_file == NULL) {
+            min_file = curr_file;
+            // for the FIFO policy it is trivial to choose the file: it is
+            // just the first one in the list
+            if (storage->replacement_policy == FIFO_REPLACEMENT) {
+                break;
+            }
+        } else if (storage->replacement_policy == LFU_REPLACEMENT) {
+            // for the LFU policy we need to calculate the file that has the
+            // minimum value for used_counter. If there are multiple files that have
+            // an equal value of used_counter, then return one of them
+            if (curr_file->used_counter < min_file->used_counter) {
+                min_file = curr_file;
+            }
+        } else if (curr_file->last_used < min_file->last_used) {
+            // for the LRU policy we need to calculate the file that has the
+            // minimum value for last_used
+            min_file = curr_file;
+        }
+    }
+    return min_file;
+}
+
 /**
  * Returns a pointer to a victim file, chosen using the policy of the storage
  * Returns NULL on error and errno is set appropriately.
@@ -218,52 +1032,11 @@ vfile_t* choose_victim_file(file_storage_t* storage, vfile_t* file_to_exclude)
         errno = EINVAL;
         return NULL;
     }
-
-    vfile_t* min_file;
     switch (storage->replacement_policy) {
     case FIFO_REPLACEMENT:
-        // for the FIFO policy it is trivial to choose the victim file: it is
-        // just the first one in the list, if it is not the file_to_exclude, then
-        // the second is returned
-        if (file_to_exclude != NULL && storage->first == file_to_exclude) {
-            return storage->first->next;
-        } else {
-            return storage->first;
-        }
     case LFU_REPLACEMENT:
-        // for the LFU policy we need to calculate the file that has the
-        // minimum value for used_counter. If there are multiple files that have
-        // an equal value of used_counter, then return one of them
-        if (file_to_exclude != NULL && storage->first == file_to_exclude) {
-            min_file = storage->first->next;
-        } else {
-            min_file = storage->first;
-        }
-
-        for (vfile_t* curr_file = min_file; curr_file != NULL; curr_file = curr_file->next) {
-            if (curr_file != file_to_exclude && curr_file->used_counter < min_file->used_counter) {
-                min_file = curr_file;
-            }
-        }
-
-        return min_file;
     case LRU_REPLACEMENT:
-        // for the LRU policy we need to calculate the file that has the
-        // minimum value for last_used. If there are multiple files that have
-        // an equal value of last_used, then return one of them
-        if (file_to_exclude != NULL && storage->first == file_to_exclude) {
-            min_file = storage->first->next;
-        } else {
-            min_file = storage->first;
-        }
-
-        for (vfile_t* curr_file = min_file; curr_file != NULL; curr_file = curr_file->next) {
-            if (curr_file != file_to_exclude && curr_file->last_used < min_file->last_used) {
-                min_file = curr_file;
-            }
-        }
-
-        return min_file;
+        return choose_file_by_policy(storage, file_to_exclude, NULL);
     default:
         fprintf(stderr, "error: replacmenent policy code is not valid\n");
         break;
@@ -271,6 +1044,26 @@ vfile_t* choose_victim_file(file_storage_t* storage, vfile_t* file_to_exclude)
     return NULL;
 }
 
+static bool is_compressible(const vfile_t* vfile)
+{
+    return vfile->compressed == NULL && vfile->chunks == NULL && !vfile->incompressible
+        && vfile->size >= MIN_COMPRESSIBLE_SIZE;
+}
+
+/**
+ * Returns a pointer to the file to compress, chosen among the files that can
+ * be compressed using the policy of the storage, as choose_victim_file.
+ * Returns NULL if no file can be compressed
+*/
+vfile_t* choose_compression_candidate(file_storage_t* storage, vfile_t* file_to_exclude)
+{
+    if (storage == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return choose_file_by_policy(storage, file_to_exclude, is_compressible);
+}
+
 /**
  * Return a pointer to the file in the storage with given filename. If the file
  * is not found then the function returns NULL and errno is set to ENOENT
@@ -295,6 +1088,52 @@ vfile_t* get_file_from_name(file_storage_t* storage, size_t filename_len, const
     return NULL;
 }
 
+/**
+ * Return a pointer to the file in the storage with given handle. A handle is
+ * assigned to a file when it is added to the storage and it is not valid anymore
+ * after the file is removed, even if the slot is reused by another file.
+ * If the handle is not valid then the function returns NULL and errno is set
+ * to ENOENT. Handle 0 is never valid.
+ * Returns NULL on error and errno is set appropriately.
+*/
+vfile_t* get_file_from_handle(file_storage_t* storage, uint64_t handle)
+{
+    if (storage == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the lookup is done in constant time, the generation tells apart the
+    // current file of the slot from the files that used it before
+    uint32_t slot = HANDLE_SLOT(handle);
+    if (slot >= storage->handle_slots_size
+        || storage->handle_slots[slot].generation != HANDLE_GENERATION(handle)
+        || storage->handle_slots[slot].file == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    return storage->handle_slots[slot].file;
+}
+
+/**
+ * Assign a new version to vfile. Versions are taken from a clock that is
+ * global to the storage, so a version is never reused, not even by a file that
+ * is removed and then created again with the same name.
+ * Must be called while holding the storage lock in write mode.
+ * Returns -1 on error and errno is set appropriately.
+*/
+int bump_file_version(file_storage_t* storage, vfile_t* vfile)
+{
+    if (storage == NULL || vfile == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    vfile->version = ++storage->version_clock;
+    // the new content may compress better
+    vfile->incompressible = false;
+    return 0;
+}
+
 /**
  * Atomically increment the used counter in vfile
  * This is safe to use even when the mutual exclusion of the entire storage
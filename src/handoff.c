@@ -0,0 +1,739 @@
+// memfd_create and the CMSG macros are extensions
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "rw_lock.h"
+#include "snapshot.h"
+
+// fds passed with the first message: listening socket, snapshot and session
+#define NUM_STATE_FDS 3
+
+/**
+ * Fill addr with the address of the control socket in path
+ * Returns -1 on error and errno is set appropriately
+*/
+static int control_address(const char* path, struct sockaddr_un* addr)
+{
+    if (path == NULL || strlen(path) >= sizeof(addr->sun_path)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/**
+ * Create the control socket of the handoff, listening in path. An old socket
+ * in path, left by the server that handed off to this one, is replaced
+ * Returns the socket, or -1 on error and errno is set appropriately
+*/
+int handoff_listen(const char* path)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) == -1) {
+        return -1;
+    }
+    if (unlink(path) == -1 && errno != ENOENT) {
+        return -1;
+    }
+    // the messages keep their boundaries, so each batch of fds comes with
+    // its own payload
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Connect to the control socket in path of a running server, to take it over
+ * with handoff_receive
+ * Returns the connection, or -1 on error and errno is set appropriately
+ * (ENOENT or ECONNREFUSED if no server is running)
+*/
+int handoff_connect(const char* path)
+{
+    struct sockaddr_un addr;
+    if (control_address(path, &addr) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Send a message with len bytes of buf, passing the num_fds fds
+ * Returns -1 on error and errno is set appropriately
+*/
+static int send_with_fds(int fd, const void* buf, size_t len, const int* fds, size_t num_fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = { (void*)buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (num_fds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+    ssize_t sent;
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) { }
+    if (sent == -1) {
+        return -1;
+    }
+    if ((size_t)sent != len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Receive a message of len bytes in buf, together with at most max_fds fds,
+ * that are stored in fds and counted in num_fds
+ * Returns -1 on error and errno is set appropriately (ECONNRESET if the peer
+ * closed the connection)
+*/
+static int recv_with_fds(int fd, void* buf, size_t len, int* fds, size_t max_fds, size_t* num_fds)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { buf, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t received;
+    while ((received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) { }
+    if (received == -1) {
+        return -1;
+    }
+
+    *num_fds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < n; ++i) {
+                int received_fd;
+                memcpy(&received_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                // the fds that do not fit are not leaked
+                if (*num_fds < max_fds) {
+                    fds[(*num_fds)++] = received_fd;
+                } else {
+                    close(received_fd);
+                }
+            }
+        }
+    }
+    if (received == 0) {
+        errno = ECONNRESET;
+    } else if ((size_t)received != len || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+        errno = EPROTO;
+    } else {
+        return 0;
+    }
+    for (size_t i = 0; i < *num_fds; ++i) {
+        close(fds[i]);
+    }
+    *num_fds = 0;
+    return -1;
+}
+
+/**
+ * Write the fds of fd_set up to fd_max to the stream
+*/
+static void write_fd_set(FILE* stream, const fd_set* set, int fd_max)
+{
+    for (int fd = 0; fd <= fd_max && fd < FD_SETSIZE; ++fd) {
+        if (FD_ISSET(fd, set)) {
+            int32_t n = fd;
+            fwrite(&n, sizeof(n), 1, stream);
+        }
+    }
+}
+
+/**
+ * Returns the number of fds in fd_set up to fd_max
+*/
+static uint32_t count_fd_set(const fd_set* set, int fd_max)
+{
+    uint32_t count = 0;
+    for (int fd = 0; fd <= fd_max && fd < FD_SETSIZE; ++fd) {
+        if (FD_ISSET(fd, set)) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Write the session of the clients and of the files of the storage to fd, see
+ * handoff.h for the format
+ * Returns -1 on error and errno is set appropriately
+*/
+static int write_session(int fd, file_storage_t* storage, const fd_set* clients, int clients_max,
+    const connection_state_t* connections, uint64_t wal_sequence)
+{
+    int stream_fd = dup(fd);
+    if (stream_fd == -1) {
+        return -1;
+    }
+    FILE* stream = fdopen(stream_fd, "w");
+    if (stream == NULL) {
+        close(stream_fd);
+        return -1;
+    }
+
+    struct handoff_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH);
+    header.num_clients = count_fd_set(clients, clients_max);
+    header.num_slots = storage->handle_slots_size;
+    header.num_files = storage->num_files;
+    header.version_clock = storage->version_clock;
+    header.wal_sequence = wal_sequence;
+    fwrite(&header, sizeof(header), 1, stream);
+
+    for (int fd = 0; fd <= clients_max && fd < FD_SETSIZE; ++fd) {
+        if (FD_ISSET(fd, clients)) {
+            struct handoff_client client;
+            memset(&client, 0, sizeof(client));
+            client.fd = fd;
+            client.eject_mode = connections[fd].eject_mode;
+            fwrite(&client, sizeof(client), 1, stream);
+        }
+    }
+    for (uint32_t i = 0; i < storage->handle_slots_size; ++i) {
+        fwrite(&storage->handle_slots[i].generation, sizeof(uint32_t), 1, stream);
+    }
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        struct handoff_file file;
+        memset(&file, 0, sizeof(file));
+        file.handle = f->handle;
+        file.version = f->version;
+        file.name_length = strlen(f->filename);
+        file.locked_by = f->locked_by;
+        file.num_opened = count_fd_set(&f->opened_by, FD_SETSIZE - 1);
+        file.num_queued = count_fd_set(&f->lock_queue, f->lock_queue_max);
+        fwrite(&file, sizeof(file), 1, stream);
+        fwrite(f->filename, 1, file.name_length, stream);
+        write_fd_set(stream, &f->opened_by, FD_SETSIZE - 1);
+        write_fd_set(stream, &f->lock_queue, f->lock_queue_max);
+    }
+
+    // the errors of the writes are sticky, and the flush reports them
+    if (ferror(stream) || fflush(stream) == EOF) {
+        int saved_errno = errno != 0 ? errno : EIO;
+        fclose(stream);
+        errno = saved_errno;
+        return -1;
+    }
+    return fclose(stream) == EOF ? -1 : 0;
+}
+
+/**
+ * Start writing a snapshot of the storage for a handoff in a memory file. The
+ * storage lock is taken in write mode only to prepare the snapshot and to
+ * fork the child that writes it, then the storage can change: the mutations
+ * after the snapshot are in the write-ahead log of the storage, that shall
+ * be enabled, and no records shall be discarded from the log until the
+ * handoff. The snapshot is completed by handoff_finish_snapshot and released
+ * by handoff_discard_snapshot.
+ * Must be called without holding the storage lock.
+ * Returns -1 on error and errno is set appropriately
+*/
+int handoff_start_snapshot(file_storage_t* storage, handoff_snapshot_t* snapshot)
+{
+    if (storage == NULL || snapshot == NULL || storage->wal == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((snapshot->fd = memfd_create("snapshot", MFD_CLOEXEC)) == -1) {
+        return -1;
+    }
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+    if (write_lock(storage_lock) == -1) {
+        int saved_errno = errno;
+        close(snapshot->fd);
+        snapshot->fd = -1;
+        errno = saved_errno;
+        return -1;
+    }
+    // no record is appended to the log while the lock is held, and the child
+    // only writes to the memory file, as the child of a checkpoint
+    prepared_snapshot_t prepared;
+    snapshot->pid = -1;
+    if (prepare_snapshot(storage, wal_get_last_sequence(storage->wal), &prepared) == 0) {
+        snapshot->pid = fork();
+        if (snapshot->pid == 0) {
+            if (write_prepared_snapshot(storage, snapshot->fd, &prepared) == -1) {
+                _exit(errno != 0 ? errno : EIO);
+            }
+            _exit(0);
+        }
+        int saved_errno = errno;
+        free_prepared_snapshot(&prepared);
+        errno = saved_errno;
+    }
+    int saved_errno = errno;
+    if (write_unlock(storage_lock) == -1) {
+        return -1;
+    }
+    if (snapshot->pid == -1) {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Complete the snapshot if it is written, or wait for it if wait is true.
+ * Returns 1 if the snapshot is written, 0 if it is still running, -1 if it
+ * failed and errno is set to the error of the snapshot (the memory file is
+ * released)
+*/
+int handoff_finish_snapshot(handoff_snapshot_t* snapshot, bool wait)
+{
+    if (snapshot == NULL || snapshot->fd == -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (snapshot->pid == -1) {
+        return 1;
+    }
+    int status;
+    pid_t res;
+    while ((res = waitpid(snapshot->pid, &status, wait ? 0 : WNOHANG)) == -1 && errno == EINTR) { }
+    if (res == 0) {
+        return 0;
+    }
+    snapshot->pid = -1;
+    if (res == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        int saved_errno = res == -1 ? errno : WIFEXITED(status) ? WEXITSTATUS(status) : EINTR;
+        close(snapshot->fd);
+        snapshot->fd = -1;
+        errno = saved_errno;
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Release the snapshot, stopping the child that writes it if it is running
+*/
+void handoff_discard_snapshot(handoff_snapshot_t* snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+    if (snapshot->pid != -1) {
+        kill(snapshot->pid, SIGKILL);
+        while (waitpid(snapshot->pid, NULL, 0) == -1 && errno == EINTR) { }
+        snapshot->pid = -1;
+    }
+    if (snapshot->fd != -1) {
+        close(snapshot->fd);
+        snapshot->fd = -1;
+    }
+}
+
+/**
+ * Send the server to the process connected to control_fd: the listening
+ * socket listen_fd, the connections of the clients in clients (up to
+ * clients_max) with their state in connections, and the storage, with
+ * wal_sequence as the last record of the write-ahead log in it. snapshot_fd
+ * is a snapshot written by handoff_start_snapshot, whose missing mutations
+ * are in the write-ahead log up to wal_sequence, or -1 to write the snapshot
+ * now. The function returns when the new process has loaded the storage:
+ * from then on the new process serves the clients, and the caller shall not
+ * read or write the connections, nor modify the storage or the write-ahead
+ * log.
+ * Must be called when no other thread uses the storage or the connections.
+ * Returns -1 on error and errno is set appropriately: the new process did not
+ * take over, and the caller can keep serving the clients
+*/
+int handoff_send(int control_fd, file_storage_t* storage, int snapshot_fd, int listen_fd, const fd_set* clients,
+    int clients_max, const connection_state_t* connections, uint64_t wal_sequence)
+{
+    if (control_fd < 0 || storage == NULL || listen_fd < 0 || clients == NULL || connections == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the memory files live as long as one of the processes keeps them open.
+    // A snapshot written in background belongs to the caller
+    int state_fds[NUM_STATE_FDS] = { listen_fd, snapshot_fd, -1 };
+    int res = -1;
+    if ((snapshot_fd == -1
+            && ((state_fds[1] = memfd_create("snapshot", MFD_CLOEXEC)) == -1
+                || save_snapshot_fd(storage, state_fds[1], wal_sequence) == -1))
+        || (state_fds[2] = memfd_create("session", MFD_CLOEXEC)) == -1
+        || write_session(state_fds[2], storage, clients, clients_max, connections, wal_sequence) == -1
+        || send_with_fds(control_fd, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH, state_fds, NUM_STATE_FDS) == -1) {
+        goto cleanup;
+    }
+
+    // the connections follow in batches, in the order of the session
+    int batch[HANDOFF_FDS_PER_MESSAGE];
+    uint32_t batch_size = 0;
+    for (int fd = 0; fd <= clients_max + 1 && fd <= FD_SETSIZE; ++fd) {
+        bool last = fd > clients_max || fd == FD_SETSIZE;
+        if (!last && FD_ISSET(fd, clients)) {
+            batch[batch_size++] = fd;
+        }
+        if (batch_size == HANDOFF_FDS_PER_MESSAGE || (last && batch_size > 0)) {
+            if (send_with_fds(control_fd, &batch_size, sizeof(batch_size), batch, batch_size) == -1) {
+                goto cleanup;
+            }
+            batch_size = 0;
+        }
+        if (last) {
+            break;
+        }
+    }
+
+    // the new process acknowledges when it has taken over
+    char ack;
+    size_t num_fds;
+    if (recv_with_fds(control_fd, &ack, sizeof(ack), NULL, 0, &num_fds) == 0) {
+        res = 0;
+    }
+
+cleanup:;
+    int saved_errno = errno;
+    if (snapshot_fd == -1 && state_fds[1] != -1) {
+        close(state_fds[1]);
+    }
+    if (state_fds[2] != -1) {
+        close(state_fds[2]);
+    }
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Cursor over the session
+*/
+struct session_reader {
+    const char* pos;
+    const char* end;
+};
+
+/**
+ * Copy the next size bytes of the session in dst
+ * Returns false if the session ends before
+*/
+static bool read_session(struct session_reader* reader, void* dst, size_t size)
+{
+    if ((size_t)(reader->end - reader->pos) < size) {
+        return false;
+    }
+    memcpy(dst, reader->pos, size);
+    reader->pos += size;
+    return true;
+}
+
+/**
+ * Read count fds of the session, and return in set the corresponding fds of
+ * this process, given by fd_map. The fds that are not in fd_map are skipped.
+ * The highest fd is stored in fd_max (0 if set is empty)
+ * Returns false if the session ends before
+*/
+static bool read_session_fds(struct session_reader* reader, uint32_t count, const int* fd_map, fd_set* set, int* fd_max)
+{
+    FD_ZERO(set);
+    *fd_max = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t old_fd;
+        if (!read_session(reader, &old_fd, sizeof(old_fd))) {
+            return false;
+        }
+        if (old_fd >= 0 && old_fd < FD_SETSIZE && fd_map[old_fd] != -1) {
+            FD_SET(fd_map[old_fd], set);
+            if (fd_map[old_fd] > *fd_max) {
+                *fd_max = fd_map[old_fd];
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Apply the session in the size bytes of session to the files of the storage
+ * and to connections. client_fds are the connections of the clients, in the
+ * order of the session
+ * Returns -1 on error and errno is set appropriately (EPROTO if the session is
+ * not valid)
+*/
+static int apply_session(const char* session, size_t size, file_storage_t* storage, const int* client_fds,
+    connection_state_t* connections)
+{
+    struct session_reader reader = { session, session + size };
+    struct handoff_header header;
+    read_session(&reader, &header, sizeof(header));
+
+    // the fds of the old process are translated to the fds of this process
+    int fd_map[FD_SETSIZE];
+    for (int i = 0; i < FD_SETSIZE; ++i) {
+        fd_map[i] = -1;
+    }
+    for (uint64_t i = 0; i < header.num_clients; ++i) {
+        struct handoff_client client;
+        if (!read_session(&reader, &client, sizeof(client)) || client.fd < 0 || client.fd >= FD_SETSIZE) {
+            errno = EPROTO;
+            return -1;
+        }
+        fd_map[client.fd] = client_fds[i];
+        connections[client_fds[i]].eject_mode = client.eject_mode;
+    }
+
+    if (header.num_slots > (size_t)(reader.end - reader.pos) / sizeof(uint32_t)) {
+        errno = EPROTO;
+        return -1;
+    }
+    uint32_t* generations = malloc(header.num_slots > 0 ? header.num_slots * sizeof(uint32_t) : 1);
+    if (generations == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    read_session(&reader, generations, header.num_slots * sizeof(uint32_t));
+
+    // the files that are not in the session, if any, get a new handle
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        f->handle = 0;
+    }
+    for (uint64_t i = 0; i < header.num_files; ++i) {
+        struct handoff_file file;
+        if (!read_session(&reader, &file, sizeof(file)) || file.name_length == 0
+            || file.name_length > (size_t)(reader.end - reader.pos)) {
+            free(generations);
+            errno = EPROTO;
+            return -1;
+        }
+        // the terminator is compared too, so that the name does not match the
+        // names it is a prefix of
+        char* filename = malloc(file.name_length + 1);
+        if (filename == NULL) {
+            free(generations);
+            errno = ENOMEM;
+            return -1;
+        }
+        read_session(&reader, filename, file.name_length);
+        filename[file.name_length] = '\0';
+
+        // the files skipped by the limits of this server are not in the storage
+        vfile_t* vfile = get_file_from_name(storage, file.name_length + 1, filename);
+        free(filename);
+        fd_set opened_by, lock_queue;
+        int opened_max, lock_queue_max;
+        if (!read_session_fds(&reader, file.num_opened, fd_map, &opened_by, &opened_max)
+            || !read_session_fds(&reader, file.num_queued, fd_map, &lock_queue, &lock_queue_max)) {
+            free(generations);
+            errno = EPROTO;
+            return -1;
+        }
+        if (vfile == NULL) {
+            continue;
+        }
+        vfile->handle = file.handle;
+        vfile->version = file.version;
+        vfile->opened_by = opened_by;
+        vfile->lock_queue = lock_queue;
+        vfile->lock_queue_max = lock_queue_max;
+        vfile->locked_by = file.locked_by >= 0 && file.locked_by < FD_SETSIZE ? fd_map[file.locked_by] : -1;
+    }
+
+    if (header.version_clock > storage->version_clock) {
+        storage->version_clock = header.version_clock;
+    }
+    int res = restore_file_handles(storage, generations, header.num_slots);
+    free(generations);
+    return res;
+}
+
+/**
+ * Receive the server sent by handoff_send on control_fd. The files are loaded
+ * in the storage, that shall be empty, within max_num_files and
+ * max_storage_size (see load_snapshot_fd), then catch_up (if not NULL) is
+ * called with catch_up_arg to apply the mutations after the snapshot, then
+ * the files take their handles and the sessions of the clients are applied to
+ * the files and to connections (FD_SETSIZE elements). The listening socket
+ * and the connections are stored in state.
+ * Must be called before the storage is shared with other threads.
+ * Returns -1 on error and errno is set appropriately (EPROTO if the storage
+ * misses mutations after the snapshot): the old process keeps serving the
+ * clients, and the files loaded so far stay in the storage
+*/
+int handoff_receive(int control_fd, file_storage_t* storage, unsigned int max_num_files, size_t max_storage_size,
+    connection_state_t* connections, handoff_catch_up_t catch_up, void* catch_up_arg, handoff_state_t* state)
+{
+    if (control_fd < 0 || storage == NULL || connections == NULL || state == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char magic[HANDOFF_MAGIC_LENGTH];
+    int state_fds[NUM_STATE_FDS];
+    size_t num_state_fds;
+    if (recv_with_fds(control_fd, magic, sizeof(magic), state_fds, NUM_STATE_FDS, &num_state_fds) == -1) {
+        return -1;
+    }
+    if (num_state_fds != NUM_STATE_FDS || memcmp(magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH) != 0) {
+        for (size_t i = 0; i < num_state_fds; ++i) {
+            close(state_fds[i]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    int res = -1;
+    int* client_fds = NULL;
+    size_t num_clients = 0;
+    char* session = MAP_FAILED;
+    struct stat st;
+    struct handoff_header header;
+    if (fstat(state_fds[2], &st) == -1) {
+        goto cleanup;
+    }
+    if ((size_t)st.st_size < sizeof(header)) {
+        errno = EPROTO;
+        goto cleanup;
+    }
+    if ((session = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, state_fds[2], 0)) == MAP_FAILED) {
+        goto cleanup;
+    }
+    memcpy(&header, session, sizeof(header));
+    if (memcmp(header.magic, HANDOFF_MAGIC, HANDOFF_MAGIC_LENGTH) != 0
+        || header.num_clients > (st.st_size - sizeof(header)) / sizeof(struct handoff_client)) {
+        errno = EPROTO;
+        goto cleanup;
+    }
+
+    // the connections, in the order of the session
+    if ((client_fds = malloc((header.num_clients > 0 ? header.num_clients : 1) * sizeof(int))) == NULL) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+    while (num_clients < header.num_clients) {
+        uint32_t batch_size;
+        size_t num_fds;
+        size_t max_fds = header.num_clients - num_clients;
+        if (max_fds > HANDOFF_FDS_PER_MESSAGE) {
+            max_fds = HANDOFF_FDS_PER_MESSAGE;
+        }
+        if (recv_with_fds(control_fd, &batch_size, sizeof(batch_size), client_fds + num_clients, max_fds, &num_fds)
+            == -1) {
+            goto cleanup;
+        }
+        num_clients += num_fds;
+        if (num_fds != batch_size || num_fds == 0) {
+            errno = EPROTO;
+            goto cleanup;
+        }
+    }
+    for (size_t i = 0; i < num_clients; ++i) {
+        if (client_fds[i] >= FD_SETSIZE) {
+            errno = EMFILE;
+            goto cleanup;
+        }
+    }
+
+    if ((state->num_files = load_snapshot_fd(storage, state_fds[1], max_num_files, max_storage_size,
+             &state->wal_sequence))
+        == -1) {
+        goto cleanup;
+    }
+    // the session refers to the files as they are at the end of the log
+    if (state->wal_sequence < header.wal_sequence && catch_up != NULL
+        && catch_up(catch_up_arg, storage, &state->wal_sequence) == -1) {
+        goto cleanup;
+    }
+    if (state->wal_sequence < header.wal_sequence) {
+        errno = EPROTO;
+        goto cleanup;
+    }
+    state->num_files = storage->num_files;
+    if (apply_session(session, st.st_size, storage, client_fds, connections) == -1) {
+        goto cleanup;
+    }
+
+    // from now on the old process does not touch the clients
+    char ack = 0;
+    if (send_with_fds(control_fd, &ack, sizeof(ack), NULL, 0) == -1) {
+        goto cleanup;
+    }
+
+    state->listen_fd = state_fds[0];
+    FD_ZERO(&state->clients);
+    state->clients_max = -1;
+    state->num_clients = num_clients;
+    for (size_t i = 0; i < num_clients; ++i) {
+        FD_SET(client_fds[i], &state->clients);
+        if (client_fds[i] > state->clients_max) {
+            state->clients_max = client_fds[i];
+        }
+    }
+    res = 0;
+
+cleanup:;
+    int saved_errno = errno;
+    if (res == -1) {
+        close(state_fds[0]);
+        for (size_t i = 0; i < num_clients; ++i) {
+            close(client_fds[i]);
+        }
+    }
+    close(state_fds[1]);
+    close(state_fds[2]);
+    free(client_fds);
+    if (session != MAP_FAILED) {
+        munmap(session, st.st_size);
+    }
+    errno = saved_errno;
+    return res;
+}
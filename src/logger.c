@@ -1,17 +1,30 @@
 #define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "logger.h"
+#include "object_pool.h"
 #include "unbounded_shared_buffer.h"
 #include "utils.h"
 
+// pool of the log messages, NULL if they are allocated with malloc
+static object_pool_t* log_message_pool = NULL;
+// true if the log file is not truncated when it is opened
+static bool keep_log = false;
+
 static int logger(usbuf_t* buf)
 {
-    // open the log file
+    // open the log file, in append mode so that the lines of the server that
+    // handed off to this one, still running, are not overwritten
     FILE* fd;
-    DIE_NULL(fd = fopen("log.txt", "w+"), "log.txt file fopen");
+    DIE_NULL(fd = fopen("log.txt", "a"), "log.txt file fopen");
+    if (!keep_log) {
+        DIE_NEG1(ftruncate(fileno(fd), 0), "log.txt file ftruncate");
+    }
 
     for (;;) {
         // wait for the producers to put in the buffer a string
@@ -40,7 +53,7 @@ static int logger(usbuf_t* buf)
         DIE_NEG(fprintf(fd, "[%s] %s\n", time_buf, result), "log fprintf");
 
         // free the allocated string
-        free(result);
+        free_log_message(result);
     }
 
     DIE_NEG1(fclose(fd), "log fclose");
@@ -61,4 +74,73 @@ void* logger_entry_point(void* arg)
     usbuf_t* buf = arg;
     logger(buf);
     return NULL;
-}
\ No newline at end of file
+}
+
+/**
+ * Keep the content of the log file when the logger opens it, instead of
+ * truncating it. It shall be called before the logger is started
+*/
+void keep_previous_log(void)
+{
+    keep_log = true;
+}
+
+/**
+ * Create the pool of the log messages, shared by all the loggers of the
+ * process. If the pool is not created the messages are allocated with malloc.
+ * It shall be called before any message is logged, and the pool shall be
+ * destroyed with destroy_log_message_pool after all the loggers terminated
+ * Returns -1 on error and errno is set appropriately
+*/
+int create_log_message_pool(void)
+{
+    log_message_pool = create_object_pool(LOG_MESSAGE_SIZE);
+    if (log_message_pool == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Destroy the pool of the log messages
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_log_message_pool(void)
+{
+    int res = destroy_object_pool(log_message_pool);
+    log_message_pool = NULL;
+    return res;
+}
+
+/**
+ * Allocate a log message of LOG_MESSAGE_SIZE bytes
+ * Returns NULL on error and errno is set appropriately
+*/
+char* alloc_log_message(void)
+{
+    if (log_message_pool == NULL) {
+        return malloc(LOG_MESSAGE_SIZE * sizeof(char));
+    }
+    return object_pool_alloc(log_message_pool);
+}
+
+/**
+ * Free a log message allocated with alloc_log_message
+*/
+void free_log_message(char* message)
+{
+    if (log_message_pool == NULL) {
+        free(message);
+    } else {
+        object_pool_free(log_message_pool, message);
+    }
+}
+
+/**
+ * Copy the statistics of the pool of the log messages in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int get_log_message_pool_statistics(struct object_pool_statistics* stats)
+{
+    return object_pool_get_statistics(log_message_pool, stats);
+}
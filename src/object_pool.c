@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "object_pool.h"
+
+// the objects are aligned like the memory returned by malloc
+#define OBJECT_ALIGNMENT 16
+
+// the first word of a free object (or of a slab) is the pointer to the next one
+#define NEXT(object) (*(void**)(object))
+
+/**
+ * Free objects private to a thread
+*/
+struct object_pool_cache {
+    object_pool_t* pool;
+    void* free_list;
+    unsigned int num_free;
+    struct object_pool_cache* prev;
+    struct object_pool_cache* next;
+};
+
+/**
+ * Move at most count objects from the list *from to the list *to
+ * Returns the number of objects moved
+*/
+static unsigned int move_objects(void** from, void** to, unsigned int count)
+{
+    unsigned int moved = 0;
+    while (moved < count && *from != NULL) {
+        void* object = *from;
+        *from = NEXT(object);
+        NEXT(object) = *to;
+        *to = object;
+        ++moved;
+    }
+    return moved;
+}
+
+/**
+ * Destructor of the cache, called when the thread terminates: the free objects
+ * are given back to the pool
+*/
+static void release_cache(void* arg)
+{
+    struct object_pool_cache* cache = arg;
+    object_pool_t* pool = cache->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->statistics.num_taken -= move_objects(&cache->free_list, &pool->free_list, cache->num_free);
+    if (cache->prev == NULL) {
+        pool->caches = cache->next;
+    } else {
+        cache->prev->next = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    free(cache);
+}
+
+/**
+ * Get the cache of the calling thread, creating it if needed
+ * Returns NULL on error and errno is set appropriately
+*/
+static struct object_pool_cache* get_cache(object_pool_t* pool)
+{
+    struct object_pool_cache* cache = pthread_getspecific(pool->cache_key);
+    if (cache != NULL) {
+        return cache;
+    }
+    cache = malloc(sizeof(struct object_pool_cache));
+    if (cache == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    cache->pool = pool;
+    cache->free_list = NULL;
+    cache->num_free = 0;
+    cache->prev = NULL;
+
+    int res = pthread_mutex_lock(&pool->mutex);
+    if (res != 0) {
+        free(cache);
+        errno = res;
+        return NULL;
+    }
+    cache->next = pool->caches;
+    if (pool->caches != NULL) {
+        pool->caches->prev = cache;
+    }
+    pool->caches = cache;
+    pthread_mutex_unlock(&pool->mutex);
+
+    res = pthread_setspecific(pool->cache_key, cache);
+    if (res != 0) {
+        release_cache(cache);
+        errno = res;
+        return NULL;
+    }
+    return cache;
+}
+
+/**
+ * Allocate a new slab and put its objects in the free list of the pool
+ * Must be called holding the mutex of the pool
+ * Returns -1 on error and errno is set appropriately
+*/
+static int allocate_slab(object_pool_t* pool)
+{
+    char* slab = malloc(OBJECT_ALIGNMENT + OBJECT_POOL_SLAB_OBJECTS * pool->object_size);
+    if (slab == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    NEXT(slab) = pool->slabs;
+    pool->slabs = slab;
+    ++pool->statistics.num_slabs;
+
+    for (int i = 0; i < OBJECT_POOL_SLAB_OBJECTS; ++i) {
+        void* object = slab + OBJECT_ALIGNMENT + i * pool->object_size;
+        NEXT(object) = pool->free_list;
+        pool->free_list = object;
+    }
+    return 0;
+}
+
+/**
+ * Create a pool of objects of object_size bytes
+ * The pool shall be destroyed with destroy_object_pool
+ * Returns NULL on error and errno is set appropriately
+*/
+object_pool_t* create_object_pool(size_t object_size)
+{
+    if (object_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    object_pool_t* pool = malloc(sizeof(object_pool_t));
+    if (pool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // every object must be able to contain the pointer of the free list
+    pool->object_size = (object_size + OBJECT_ALIGNMENT - 1) / OBJECT_ALIGNMENT * OBJECT_ALIGNMENT;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->caches = NULL;
+    pool->statistics.object_size = pool->object_size;
+    pool->statistics.num_slabs = 0;
+    pool->statistics.num_refills = 0;
+    pool->statistics.num_flushes = 0;
+    pool->statistics.num_taken = 0;
+    pool->statistics.maximum_taken = 0;
+
+    int res = pthread_mutex_init(&pool->mutex, NULL);
+    if (res != 0) {
+        free(pool);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_key_create(&pool->cache_key, release_cache);
+    if (res != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool);
+        errno = res;
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+ * Destroy the pool and free all the objects, including the ones that are in use.
+ * No thread shall use the pool during and after this call
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_object_pool(object_pool_t* pool)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    // after the key is deleted the destructors of the caches are not called
+    // anymore, so the caches still alive are freed here
+    pthread_key_delete(pool->cache_key);
+    while (pool->caches != NULL) {
+        struct object_pool_cache* tmp = pool->caches;
+        pool->caches = tmp->next;
+        free(tmp);
+    }
+    while (pool->slabs != NULL) {
+        void* tmp = pool->slabs;
+        pool->slabs = NEXT(tmp);
+        free(tmp);
+    }
+    int res = pthread_mutex_destroy(&pool->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    free(pool);
+    return 0;
+}
+
+/**
+ * Get an object from the pool. The content of the object is undefined
+ * Returns NULL on error and errno is set appropriately
+*/
+void* object_pool_alloc(object_pool_t* pool)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct object_pool_cache* cache = get_cache(pool);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    // refill the cache from the pool
+    if (cache->free_list == NULL) {
+        int res = pthread_mutex_lock(&pool->mutex);
+        if (res != 0) {
+            errno = res;
+            return NULL;
+        }
+        if (pool->free_list == NULL && allocate_slab(pool) == -1) {
+            pthread_mutex_unlock(&pool->mutex);
+            return NULL;
+        }
+        cache->num_free = move_objects(&pool->free_list, &cache->free_list, OBJECT_POOL_CACHE_BATCH);
+        ++pool->statistics.num_refills;
+        pool->statistics.num_taken += cache->num_free;
+        if (pool->statistics.num_taken > pool->statistics.maximum_taken) {
+            pool->statistics.maximum_taken = pool->statistics.num_taken;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    void* object = cache->free_list;
+    cache->free_list = NEXT(object);
+    --cache->num_free;
+    return object;
+}
+
+/**
+ * Give back to the pool an object obtained with object_pool_alloc
+*/
+void object_pool_free(object_pool_t* pool, void* object)
+{
+    if (pool == NULL || object == NULL) {
+        return;
+    }
+    struct object_pool_cache* cache = get_cache(pool);
+    if (cache == NULL) {
+        // the cache cannot be created, so the object goes directly to the pool
+        pthread_mutex_lock(&pool->mutex);
+        NEXT(object) = pool->free_list;
+        pool->free_list = object;
+        --pool->statistics.num_taken;
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+
+    NEXT(object) = cache->free_list;
+    cache->free_list = object;
+    ++cache->num_free;
+
+    // a thread that frees more than it allocates (e.g. the consumer of a
+    // queue) gives back the objects to the pool
+    if (cache->num_free > 2 * OBJECT_POOL_CACHE_BATCH) {
+        pthread_mutex_lock(&pool->mutex);
+        unsigned int moved = move_objects(&cache->free_list, &pool->free_list, OBJECT_POOL_CACHE_BATCH);
+        cache->num_free -= moved;
+        ++pool->statistics.num_flushes;
+        pool->statistics.num_taken -= moved;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+/**
+ * Copy the statistics of the pool in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int object_pool_get_statistics(object_pool_t* pool, struct object_pool_statistics* stats)
+{
+    if (pool == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = pthread_mutex_lock(&pool->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    *stats = pool->statistics;
+    stats->object_size = pool->object_size;
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
@@ -0,0 +1,321 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "preloader.h"
+#include "protocol.h"
+#include "rw_lock.h"
+#include "server_worker.h"
+#include "thread_pool.h"
+#include "utils.h"
+
+/**
+ * State shared by the walker and the readers of a preload
+*/
+struct preloader {
+    file_storage_t* storage;
+    long max_num_files;
+    long max_storage_size;
+    // access hints of the files, NULL if there are none
+    const access_hints_t* hints;
+    usbuf_t* logger_buffer;
+    // paths of the files to read, allocated on the heap
+    usbuf_t* paths;
+    pthread_mutex_t mutex;
+    struct preload_statistics statistics;
+};
+
+/**
+ * Add the counters of from to the ones of to
+*/
+static void add_statistics(struct preload_statistics* to, const struct preload_statistics* from)
+{
+    to->num_found += from->num_found;
+    to->num_loaded += from->num_loaded;
+    to->num_skipped += from->num_skipped;
+    to->num_errors += from->num_errors;
+    to->loaded_size += from->loaded_size;
+    to->num_ejected += from->num_ejected;
+    to->num_hinted += from->num_hinted;
+}
+
+/**
+ * Read the file in path and add it to the storage, making room for it as for
+ * a new file written by a client: the same files are ejected, and with the
+ * deduplication the chunks already in the storage are shared. path becomes
+ * the name of the file, and it is taken by the storage if the file is loaded
+ * Returns true if path is taken by the storage
+*/
+static bool preload_file(struct preloader* preloader, char* path, struct preload_statistics* stats)
+{
+    file_storage_t* storage = preloader->storage;
+
+    // the content is read before taking the storage lock, so the readers
+    // wait for the disk in parallel
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        LOG(preloader->logger_buffer, "[preload] ERROR unable to read the file {file:%s; error:%s}", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        ++stats->num_errors;
+        return false;
+    }
+    size_t size = st.st_size;
+    size_t name_length = strlen(path);
+    size_t metadata_memory = storage->vfile_pool->object_size + name_length + 1 + ALLOCATION_OVERHEAD;
+    size_t memory_needed = metadata_memory + size + ALLOCATION_OVERHEAD;
+    if (size > (size_t)preloader->max_storage_size || (storage->max_memory > 0 && memory_needed > storage->max_memory)) {
+        close(fd);
+        ++stats->num_skipped;
+        return false;
+    }
+    void* content = NULL;
+    if (size > 0) {
+        DIE_NULL(content = malloc(size), "malloc");
+        if (readn(fd, content, size) != (ssize_t)size) {
+            LOG(preloader->logger_buffer, "[preload] ERROR unable to read the file {file:%s; error:%s}", path,
+                strerror(errno != 0 ? errno : EIO));
+            free(content);
+            close(fd);
+            ++stats->num_errors;
+            return false;
+        }
+    }
+    close(fd);
+    // the small files are stored inline, so they are never in chunks
+    uint64_t* chunk_hashes = NULL;
+    if (storage->blobs != NULL && size > storage->inline_file_size) {
+        DIE_NULL(chunk_hashes = malloc(NUM_FILE_CHUNKS(size) * sizeof(uint64_t)), "malloc");
+        hash_file_chunks(content, size, chunk_hashes);
+    }
+
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+    vfile_t* retired = NULL;
+    DIE_NEG1(write_lock(storage_lock), "write_lock");
+    // the terminator is compared too, so that a name does not match the names
+    // it is a prefix of
+    if (get_file_from_name(storage, name_length + 1, path) != NULL) {
+        DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+        free(chunk_hashes);
+        free(content);
+        ++stats->num_skipped;
+        return false;
+    }
+
+    // the files chosen by the replacement policy make room for the new one.
+    // Every file takes its hint as it is loaded, so that the victims are
+    // chosen with the hints of the files loaded before
+    vfile_t* vfile;
+    DIE_NULL(vfile = create_vfile(storage), "create_vfile");
+    vfile->filename = path;
+    if (preloader->hints != NULL && apply_file_access_hint(preloader->hints, vfile)) {
+        ++stats->num_hinted;
+    }
+    unsigned long num_replacements = storage->statistics.num_replacements;
+    while (storage->first != NULL && storage->num_files + 1 > preloader->max_num_files) {
+        eject_one_file(-1, EJECT_DISCARD, storage, NULL, &retired, NULL, preloader->logger_buffer, NULL, -1, "preload");
+    }
+    if (chunk_hashes != NULL) {
+        // the file is in the storage while the others are ejected, so that
+        // the chunks it shares are not freed, as for a write of a client
+        eject_files(-1, EJECT_DISCARD, 0, metadata_memory, preloader->max_storage_size, storage, NULL, &retired, NULL,
+            preloader->logger_buffer, NULL, -1, "preload");
+        DIE_NEG1(add_vfile_to_storage(storage, vfile), "add_vfile_to_storage");
+        size_t space_needed, chunks_memory;
+        estimate_file_chunks(storage, content, size, chunk_hashes, &space_needed, &chunks_memory);
+        DIE_NEG1(share_file_chunks(storage, vfile, content, size, chunk_hashes), "share_file_chunks");
+        eject_files(-1, EJECT_DISCARD, space_needed, chunks_memory, preloader->max_storage_size, storage, NULL, &retired,
+            NULL, preloader->logger_buffer, vfile, -1, "preload");
+        DIE_NEG1(fill_file_chunks(storage, vfile, content, chunk_hashes), "fill_file_chunks");
+        vfile->size = size;
+        update_file_memory(storage, vfile);
+    } else {
+        eject_files(-1, EJECT_DISCARD, size, memory_needed, preloader->max_storage_size, storage, NULL, &retired, NULL,
+            preloader->logger_buffer, NULL, -1, "preload");
+        if (content != NULL) {
+            DIE_NEG1(file_data_append_buffer(&vfile->data, content, size), "file_data_append_buffer");
+            content = NULL;
+        }
+        vfile->size = size;
+        DIE_NEG1(add_vfile_to_storage(storage, vfile), "add_vfile_to_storage");
+    }
+    stats->num_ejected += storage->statistics.num_replacements - num_replacements;
+    if (storage->num_files > storage->statistics.maximum_num_files) {
+        storage->statistics.maximum_num_files = storage->num_files;
+    }
+    if (storage->total_size > storage->statistics.maximum_size_reached) {
+        storage->statistics.maximum_size_reached = storage->total_size;
+    }
+    DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+    destroy_retired_vfiles(storage, &retired);
+    // the chunks are copies of the content
+    free(chunk_hashes);
+    free(content);
+
+    ++stats->num_loaded;
+    stats->loaded_size += size;
+    return true;
+}
+
+static void* reader_entry_point(void* arg)
+{
+    struct preloader* preloader = ((thread_pool_arg_t*)arg)->common_arg;
+    struct preload_statistics stats;
+    memset(&stats, 0, sizeof(stats));
+
+    void* path;
+    int res;
+    while ((res = usbuf_get(preloader->paths, &path)) == 0) {
+        if (!preload_file(preloader, path, &stats)) {
+            free(path);
+        }
+    }
+    DIE_NEG1(res, "usbuf_get");
+
+    DIE_NEG1(pthread_mutex_lock(&preloader->mutex), "pthread_mutex_lock");
+    add_statistics(&preloader->statistics, &stats);
+    DIE_NEG1(pthread_mutex_unlock(&preloader->mutex), "pthread_mutex_unlock");
+    return NULL;
+}
+
+/**
+ * Put in the queue of the readers the paths of the regular files of the tree
+ * rooted at dirname. The directories that cannot be read are logged and
+ * skipped, except the root
+ * Returns -1 on error and errno is set appropriately
+*/
+static int walk_directory(struct preloader* preloader, const char* dirname, bool root)
+{
+    DIR* dir = opendir(dirname);
+    if (dir == NULL) {
+        if (root) {
+            return -1;
+        }
+        LOG(preloader->logger_buffer, "[preload] ERROR unable to read the directory {dir:%s; error:%s}", dirname,
+            strerror(errno));
+        ++preloader->statistics.num_errors;
+        return 0;
+    }
+
+    struct dirent* entry;
+    while ((errno = 0, entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        // the same path of the client, the name of the directory followed by
+        // the name of the entry
+        char* path;
+        DIE_NULL(path = malloc(strlen(dirname) + strlen(entry->d_name) + 2), "malloc");
+        sprintf(path, "%s/%s", dirname, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) == -1 || (S_ISLNK(st.st_mode) && stat(path, &st) == -1)) {
+            LOG(preloader->logger_buffer, "[preload] ERROR unable to read the file {file:%s; error:%s}", path,
+                strerror(errno));
+            ++preloader->statistics.num_errors;
+            free(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            // lstat tells apart the links, that are not followed
+            struct stat link_st;
+            if (lstat(path, &link_st) == 0 && !S_ISLNK(link_st.st_mode)) {
+                walk_directory(preloader, path, false);
+            }
+            free(path);
+        } else if (S_ISREG(st.st_mode)) {
+            ++preloader->statistics.num_found;
+            DIE_NEG1(usbuf_put(preloader->paths, path), "usbuf_put");
+        } else {
+            free(path);
+        }
+    }
+    int saved_errno = errno;
+    closedir(dir);
+    if (saved_errno != 0) {
+        LOG(preloader->logger_buffer, "[preload] ERROR unable to read the directory {dir:%s; error:%s}", dirname,
+            strerror(saved_errno));
+        ++preloader->statistics.num_errors;
+    }
+    return 0;
+}
+
+/**
+ * Load in the storage all the regular files of the directory tree rooted at
+ * dirname, with the names that `client -w dirname` would give them (the path
+ * of the file starting with dirname). The tree is walked by the calling
+ * thread while num_readers threads read the files and add them to the
+ * storage, so that the disk is kept busy. The storage stays within
+ * max_num_files, max_storage_size and its memory budget: when it is full the
+ * files chosen by the replacement policy are ejected (or compressed, if the
+ * compression is enabled), as for the files written by the clients. The files
+ * already in the storage are not replaced, and the files loaded are not
+ * recorded in the write-ahead log. Symbolic links to directories are not
+ * followed. The files that cannot be read are logged and skipped. If hints is
+ * not NULL every file loaded takes its access hint (see
+ * apply_file_access_hint) before the files are ejected to make room for it.
+ * Must be called before the storage is shared with the workers.
+ * Returns -1 on error and errno is set appropriately, the statistics of the
+ * preload are stored in stats
+*/
+int preload_directory(file_storage_t* storage, const char* dirname, unsigned int num_readers, long max_num_files,
+    long max_storage_size, const access_hints_t* hints, usbuf_t* logger_buffer, struct preload_statistics* stats)
+{
+    if (storage == NULL || dirname == NULL || num_readers == 0 || max_num_files <= 0 || max_storage_size <= 0
+        || logger_buffer == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct preloader preloader;
+    memset(&preloader, 0, sizeof(preloader));
+    preloader.storage = storage;
+    preloader.max_num_files = max_num_files;
+    preloader.max_storage_size = max_storage_size;
+    preloader.hints = hints;
+    preloader.logger_buffer = logger_buffer;
+    if ((preloader.paths = usbuf_create(FIFO_POLICY)) == NULL) {
+        return -1;
+    }
+    int res = pthread_mutex_init(&preloader.mutex, NULL);
+    if (res != 0) {
+        usbuf_free(preloader.paths);
+        errno = res;
+        return -1;
+    }
+    thread_pool_t* readers = thread_pool_create(num_readers, reader_entry_point, &preloader);
+    if (readers == NULL) {
+        int saved_errno = errno;
+        pthread_mutex_destroy(&preloader.mutex);
+        usbuf_free(preloader.paths);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // the readers start as soon as the first paths are found
+    int walk_res = walk_directory(&preloader, dirname, true);
+    int saved_errno = errno;
+    DIE_NEG1(usbuf_close(preloader.paths), "usbuf_close");
+    DIE_NEG1(thread_pool_join(readers), "thread_pool_join");
+    DIE_NEG1(usbuf_free(preloader.paths), "usbuf_free");
+    pthread_mutex_destroy(&preloader.mutex);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    preloader.statistics.duration = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+    *stats = preloader.statistics;
+    errno = saved_errno;
+    return walk_res;
+}
@@ -1,7 +1,9 @@
 #include <errno.h>
 #include <inttypes.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "protocol.h"
@@ -21,18 +23,26 @@ int clear_packet(struct packet* packet)
     packet->op = NIL;
     packet->data = NULL;
     packet->data_size = 0;
+    packet->data_segments = NULL;
+    packet->num_data_segments = 0;
     packet->name_length = 0;
     packet->filename = NULL;
     packet->err_code = 0;
     packet->flags = 0;
     packet->count = 0;
+    packet->version = 0;
+    packet->cursor = 0;
+    packet->handle = 0;
+    packet->name_lengths = NULL;
+    packet->filenames = NULL;
+    packet->arena = NULL;
     return 0;
 }
 
 /**
  * Destroy the packet.
  * This shall be called only on a packet in which all the pointers either point
- * to a vaild location on the heap or are NULL. If the packet's fields contain
+ * to a vaild location on the heap (or in the arena of the packet) or are NULL. If the packet's fields contain
  * garbage pointers calling this function is U.B and might lead to segfault.
 */
 int destroy_packet(struct packet* packet)
@@ -41,12 +51,78 @@ int destroy_packet(struct packet* packet)
         errno = EINVAL;
         return -1;
     }
-    // this works because free(NULL) is specified to be a NO-OP
-    free(packet->data);
+    if (!packet_data_in_arena(packet)) {
+        // this works because free(NULL) is specified to be a NO-OP
+        free(packet->data);
+    }
+    if (packet->arena != NULL) {
+        // the names are freed with the arena
+        return 0;
+    }
     free(packet->filename);
+    if (packet->filenames != NULL) {
+        for (int64_t i = 0; i < packet->count; ++i) {
+            free(packet->filenames[i]);
+        }
+    }
+    free(packet->filenames);
+    free(packet->name_lengths);
     return 0;
 }
 
+/**
+ * Returns true if the data of the packet has been received in the arena of the
+ * packet, so it cannot be taken as a heap buffer
+*/
+bool packet_data_in_arena(const struct packet* packet)
+{
+    return packet->arena != NULL && packet->data_size <= PACKET_ARENA_MAX_DATA;
+}
+
+/**
+ * Allocate size bytes for a name of the packet, from its arena if it has one
+ * Returns NULL on error and errno is set appropriately
+*/
+static void* alloc_name(struct packet* packet, size_t size)
+{
+    if (packet->arena != NULL) {
+        return arena_alloc(packet->arena, size);
+    }
+    void* name = malloc(size);
+    if (name == NULL) {
+        errno = ENOMEM;
+    }
+    return name;
+}
+
+/**
+ * Allocate the data_size bytes of the data of the packet, from its arena if
+ * the data is small enough
+ * Returns NULL on error and errno is set appropriately
+*/
+static void* alloc_data(struct packet* packet)
+{
+    if (packet_data_in_arena(packet)) {
+        return arena_alloc(packet->arena, packet->data_size);
+    }
+    void* data = malloc(packet->data_size);
+    if (data == NULL) {
+        errno = ENOMEM;
+    }
+    return data;
+}
+
+/**
+ * Send the data of the packet, either from data or from data_segments
+*/
+static ssize_t send_data(int fd, struct packet* packet)
+{
+    if (packet->data_segments != NULL) {
+        return writevn(fd, packet->data_segments, packet->num_data_segments);
+    }
+    return writen(fd, packet->data, packet->data_size);
+}
+
 /**
  * Send a packet through fd
  * The information is contained in packet. The packet type is deduced by
@@ -72,6 +148,8 @@ ssize_t send_packet(int fd, struct packet* packet)
         return -1;
 
     case COMP:
+    case NOT_MODIFIED:
+    case DRAIN_EJECTED:
         write_res = writen(fd, &packet->op, 1);
         return write_res;
 
@@ -92,7 +170,25 @@ ssize_t send_packet(int fd, struct packet* packet)
         if (write_res <= 0) {
             return write_res;
         }
-        write_res = writen(fd, packet->data, packet->data_size);
+        write_res = send_data(fd, packet);
+        return write_res;
+
+    case VERSIONED_DATA:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->version, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->data_size, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        if (packet->data_size > 0) {
+            write_res = send_data(fd, packet);
+        }
         return write_res;
 
     case APPEND_TO_FILE:
@@ -115,8 +211,47 @@ ssize_t send_packet(int fd, struct packet* packet)
             return write_res;
         }
         if (packet->data_size > 0) {
-            write_res = writen(fd, packet->data, packet->data_size);
+            write_res = send_data(fd, packet);
+        }
+        return write_res;
+
+    case WRITE_HANDLE:
+    case APPEND_HANDLE:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->handle, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->data_size, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        if (packet->data_size > 0) {
+            write_res = send_data(fd, packet);
+        }
+        return write_res;
+
+    case HANDLE:
+    case READ_HANDLE:
+    case LOCK_HANDLE:
+    case UNLOCK_HANDLE:
+    case CLOSE_HANDLE:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
         }
+        write_res = writen(fd, &packet->handle, 8);
+        return write_res;
+
+    case SET_OPTIONS:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->flags, 1);
         return write_res;
 
     case READ_N_FILES:
@@ -143,11 +278,103 @@ ssize_t send_packet(int fd, struct packet* packet)
         write_res = writen(fd, &packet->flags, 1);
         return write_res;
 
+    case READ_FILE_IF_MODIFIED:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->name_length, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, packet->filename, packet->name_length);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->version, 8);
+        return write_res;
+
+    case LIST_FILES:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->name_length, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        // the prefix can be empty
+        if (packet->name_length > 0) {
+            write_res = writen(fd, packet->filename, packet->name_length);
+            if (write_res <= 0) {
+                return write_res;
+            }
+        }
+        write_res = writen(fd, &packet->cursor, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->count, 8);
+        return write_res;
+
+    case FILE_INFO:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->name_length, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, packet->filename, packet->name_length);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->data_size, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->version, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->cursor, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->flags, 1);
+        return write_res;
+
+    case READ_FILES:
+    case REMOVE_FILES:
+    case LOCK_FILES:
+        write_res = writen(fd, &packet->op, 1);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        write_res = writen(fd, &packet->count, 8);
+        if (write_res <= 0) {
+            return write_res;
+        }
+        for (int64_t i = 0; i < packet->count; ++i) {
+            write_res = writen(fd, &packet->name_lengths[i], 8);
+            if (write_res <= 0) {
+                return write_res;
+            }
+            write_res = writen(fd, packet->filenames[i], packet->name_lengths[i]);
+            if (write_res <= 0) {
+                return write_res;
+            }
+        }
+        return write_res;
+
     case CLOSE_FILE:
     case READ_FILE:
     case LOCK_FILE:
     case UNLOCK_FILE:
     case REMOVE_FILE:
+    case STAT_FILE:
+    case FILE_NAME:
         write_res = writen(fd, &packet->op, 1);
         if (write_res <= 0) {
             return write_res;
@@ -163,16 +390,10 @@ ssize_t send_packet(int fd, struct packet* packet)
 }
 
 /**
- * Receive a packet through fd
- * The information is returned in res_packet, which shall point to a valid packet
- * structure location. Memory is allocated as needed, so the packet shall be destroyed
- * using destroy_packet. It is recommended to clear the packet before receiving data,
- * but it is not strictly required. See destroy_package description to get a full
- * explaination of this.
- * Return -1 on error and errno is set appropriately, returns 0 on fd closed,
- * returns a positive value on success.
+ * Receive a packet through fd. The payload of the requests that carry data is
+ * received only if receive_payload is true, see receive_packet_header
 */
-int receive_packet(int fd, struct packet* res_packet)
+static int receive_packet_internal(int fd, struct packet* res_packet, bool receive_payload)
 {
     if (res_packet == NULL) {
         errno = EINVAL;
@@ -191,6 +412,8 @@ int receive_packet(int fd, struct packet* res_packet)
         return -1;
 
     case COMP:
+    case NOT_MODIFIED:
+    case DRAIN_EJECTED:
         return read_res;
 
     case ERROR:
@@ -203,14 +426,31 @@ int receive_packet(int fd, struct packet* res_packet)
             return read_res;
         }
 
-        res_packet->data = malloc(res_packet->data_size);
+        res_packet->data = alloc_data(res_packet);
         if (res_packet->data == NULL) {
-            errno = ENOMEM;
             return -1;
         }
         read_res = readn(fd, res_packet->data, res_packet->data_size);
         return read_res;
 
+    case VERSIONED_DATA:
+        read_res = readn(fd, &res_packet->version, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->data_size, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        if (res_packet->data_size > 0) {
+            res_packet->data = alloc_data(res_packet);
+            if (res_packet->data == NULL) {
+                return -1;
+            }
+            read_res = readn(fd, res_packet->data, res_packet->data_size);
+        }
+        return read_res;
+
     case APPEND_TO_FILE:
     case WRITE_FILE:
     case FILE_P:
@@ -218,9 +458,8 @@ int receive_packet(int fd, struct packet* res_packet)
         if (read_res <= 0) {
             return read_res;
         }
-        res_packet->filename = malloc(res_packet->name_length + 1);
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
         if (res_packet->filename == NULL) {
-            errno = ENOMEM;
             return -1;
         }
         read_res = readn(fd, res_packet->filename, res_packet->name_length);
@@ -232,15 +471,36 @@ int receive_packet(int fd, struct packet* res_packet)
         if (read_res <= 0) {
             return read_res;
         }
-        if (res_packet->data_size > 0) {
-            res_packet->data = malloc(res_packet->data_size);
-            if (res_packet->data == NULL) {
-                free(res_packet->filename);
-                errno = ENOMEM;
-                return -1;
-            }
-            read_res = readn(fd, res_packet->data, res_packet->data_size);
+        if (receive_payload && res_packet->data_size > 0) {
+            read_res = receive_packet_payload(fd, res_packet);
+        }
+        return read_res;
+
+    case WRITE_HANDLE:
+    case APPEND_HANDLE:
+        read_res = readn(fd, &res_packet->handle, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->data_size, 8);
+        if (read_res <= 0) {
+            return read_res;
         }
+        if (receive_payload && res_packet->data_size > 0) {
+            read_res = receive_packet_payload(fd, res_packet);
+        }
+        return read_res;
+
+    case HANDLE:
+    case READ_HANDLE:
+    case LOCK_HANDLE:
+    case UNLOCK_HANDLE:
+    case CLOSE_HANDLE:
+        read_res = readn(fd, &res_packet->handle, 8);
+        return read_res;
+
+    case SET_OPTIONS:
+        read_res = readn(fd, &res_packet->flags, 1);
         return read_res;
 
     case READ_N_FILES:
@@ -252,9 +512,8 @@ int receive_packet(int fd, struct packet* res_packet)
         if (read_res <= 0) {
             return read_res;
         }
-        res_packet->filename = malloc(res_packet->name_length + 1);
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
         if (res_packet->filename == NULL) {
-            errno = ENOMEM;
             return -1;
         }
         read_res = readn(fd, res_packet->filename, res_packet->name_length);
@@ -265,27 +524,200 @@ int receive_packet(int fd, struct packet* res_packet)
         read_res = readn(fd, &res_packet->flags, 1);
         return read_res;
 
+    case READ_FILE_IF_MODIFIED:
+        read_res = readn(fd, &res_packet->name_length, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
+        if (res_packet->filename == NULL) {
+            return -1;
+        }
+        read_res = readn(fd, res_packet->filename, res_packet->name_length);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        res_packet->filename[res_packet->name_length] = '\0';
+        read_res = readn(fd, &res_packet->version, 8);
+        return read_res;
+
+    case LIST_FILES:
+        read_res = readn(fd, &res_packet->name_length, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
+        if (res_packet->filename == NULL) {
+            return -1;
+        }
+        // the prefix can be empty
+        if (res_packet->name_length > 0) {
+            read_res = readn(fd, res_packet->filename, res_packet->name_length);
+            if (read_res <= 0) {
+                return read_res;
+            }
+        }
+        res_packet->filename[res_packet->name_length] = '\0';
+        read_res = readn(fd, &res_packet->cursor, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->count, 8);
+        return read_res;
+
+    case FILE_INFO:
+        read_res = readn(fd, &res_packet->name_length, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
+        if (res_packet->filename == NULL) {
+            return -1;
+        }
+        read_res = readn(fd, res_packet->filename, res_packet->name_length);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        res_packet->filename[res_packet->name_length] = '\0';
+        read_res = readn(fd, &res_packet->data_size, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->version, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->cursor, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        read_res = readn(fd, &res_packet->flags, 1);
+        return read_res;
+
+    case READ_FILES:
+    case REMOVE_FILES:
+    case LOCK_FILES:
+        read_res = readn(fd, &res_packet->count, 8);
+        if (read_res <= 0) {
+            return read_res;
+        }
+        if (res_packet->count <= 0 || res_packet->count > MAX_BATCH_FILES) {
+            res_packet->count = 0;
+            errno = EBADMSG;
+            return -1;
+        }
+        // the names are cleared, so that destroy_packet can be called even if
+        // the packet is received only partially
+        res_packet->name_lengths = alloc_name(res_packet, res_packet->count * sizeof(uint64_t));
+        res_packet->filenames = alloc_name(res_packet, res_packet->count * sizeof(char*));
+        if (res_packet->name_lengths == NULL || res_packet->filenames == NULL) {
+            return -1;
+        }
+        memset(res_packet->name_lengths, 0, res_packet->count * sizeof(uint64_t));
+        memset(res_packet->filenames, 0, res_packet->count * sizeof(char*));
+        for (int64_t i = 0; i < res_packet->count; ++i) {
+            read_res = readn(fd, &res_packet->name_lengths[i], 8);
+            if (read_res <= 0) {
+                return read_res;
+            }
+            res_packet->filenames[i] = alloc_name(res_packet, res_packet->name_lengths[i] + 1);
+            if (res_packet->filenames[i] == NULL) {
+                return -1;
+            }
+            read_res = readn(fd, res_packet->filenames[i], res_packet->name_lengths[i]);
+            if (read_res <= 0) {
+                return read_res;
+            }
+            res_packet->filenames[i][res_packet->name_lengths[i]] = '\0';
+        }
+        return read_res;
+
     case CLOSE_FILE:
     case READ_FILE:
     case LOCK_FILE:
     case UNLOCK_FILE:
     case REMOVE_FILE:
+    case STAT_FILE:
+    case FILE_NAME:
         read_res = readn(fd, &res_packet->name_length, 8);
         if (read_res <= 0) {
             return read_res;
         }
-        res_packet->filename = malloc(res_packet->name_length + 1);
+        res_packet->filename = alloc_name(res_packet, res_packet->name_length + 1);
         if (res_packet->filename == NULL) {
-            errno = ENOMEM;
             return -1;
         }
         res_packet->filename[res_packet->name_length] = '\0';
         read_res = readn(fd, res_packet->filename, res_packet->name_length);
         return read_res;
     }
+    // the opcode is not known
+    errno = EBADMSG;
     return -1;
 }
 
+/**
+ * Receive a packet through fd
+ * The information is returned in res_packet, which shall point to a valid packet
+ * structure location. Memory is allocated as needed, so the packet shall be destroyed
+ * using destroy_packet. It is recommended to clear the packet before receiving data,
+ * but it is not strictly required. See destroy_package description to get a full
+ * explaination of this.
+ * Return -1 on error and errno is set appropriately (EBADMSG if the packet is
+ * malformed, e.g. the opcode is not known or the count of a batch is out of
+ * range: the rest of the packet is left in fd), returns 0 on fd closed,
+ * returns a positive value on success.
+*/
+int receive_packet(int fd, struct packet* res_packet)
+{
+    return receive_packet_internal(fd, res_packet, true);
+}
+
+/**
+ * Receive a packet through fd like receive_packet, but the payload of the
+ * requests that carry data (WRITE_FILE, APPEND_TO_FILE, WRITE_HANDLE,
+ * APPEND_HANDLE) is left in fd: data_size is set, but data is NULL.
+ * The caller shall then receive the data_size bytes of the payload, either
+ * with receive_packet_payload or by reading them directly from fd.
+ * Return -1 on error and errno is set appropriately (EBADMSG if the packet is
+ * malformed, as in receive_packet), returns 0 on fd closed,
+ * returns a positive value on success.
+*/
+int receive_packet_header(int fd, struct packet* res_packet)
+{
+    return receive_packet_internal(fd, res_packet, false);
+}
+
+/**
+ * Receive the payload of a packet received with receive_packet_header in a
+ * buffer allocated on the heap (or in the arena of the packet), that is
+ * stored in packet->data.
+ * Nothing is received if the packet has no payload, or if it has been
+ * received already.
+ * Return -1 on error and errno is set appropriately, returns 0 on fd closed,
+ * returns a positive value on success.
+*/
+int receive_packet_payload(int fd, struct packet* packet)
+{
+    if (packet == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (packet->data_size == 0 || packet->data != NULL) {
+        return 1;
+    }
+    packet->data = alloc_data(packet);
+    if (packet->data == NULL) {
+        return -1;
+    }
+    ssize_t read_res = readn(fd, packet->data, packet->data_size);
+    if (read_res > 0 && (size_t)read_res < packet->data_size) {
+        // the fd was closed before the whole payload was sent
+        return 0;
+    }
+    return read_res;
+}
+
 /**
  * Print a human readable error on stderr
 */
@@ -316,6 +748,12 @@ void print_error_code(char error_code, const char* context)
     case FILE_IS_NOT_LOCKED:
         fprintf(stderr, "%s: file is not locked\n", context);
         break;
+    case INVALID_OPTION:
+        fprintf(stderr, "%s: invalid option\n", context);
+        break;
+    case INVALID_REQUEST:
+        fprintf(stderr, "%s: invalid request\n", context);
+        break;
     default:
         fprintf(stderr, "%s: invalid error code\n", context);
         break;
@@ -7,18 +7,37 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "access_hints.h"
+#include "checkpoint.h"
 #include "configparser.h"
+#include "ejection_spool.h"
+#include "evictor.h"
 #include "file_storage_internal.h"
+#include "handoff.h"
 #include "logger.h"
+#include "preloader.h"
+#include "rw_lock.h"
+#include "protocol.h"
 #include "server_worker.h"
+#include "snapshot.h"
 #include "thread_pool.h"
 #include "unbounded_shared_buffer.h"
 #include "utils.h"
+#include "wal.h"
 
 #define CONFIG_FILENAME "config.txt"
 
+// default maximum size of the files kept in the ejection spool
+#define DEFAULT_MAX_SPOOL_SIZE (64L * 1024 * 1024)
+#define DEFAULT_INLINE_FILE_SIZE 256
+// default maximum size of the files kept in the spill directory
+#define DEFAULT_MAX_SPILL_SIZE (1024L * 1024 * 1024)
+// default number of threads reading the files of the preload directory
+#define DEFAULT_PRELOAD_THREADS 4
+
 static int max(int a, int b)
 {
     return (a > b) ? a : b;
@@ -26,15 +45,54 @@ static int max(int a, int b)
 
 enum termination_code {
     HARD_EXIT,
-    SOFT_EXIT
+    SOFT_EXIT,
+    // not a termination, a snapshot of the storage is requested
+    SAVE_SNAPSHOT,
+    // not a termination, the child writing a checkpoint or the snapshot of a
+    // handoff terminated
+    CHECKPOINT_DONE
 };
 
 struct server_config {
     long num_workers;
     long max_num_files;
     long max_storage_size;
+    // memory budget of the files, including their metadata. 0 if not limited
+    long max_memory;
+    // files up to this size are stored inline in the file record
+    long inline_file_size;
+    // 1 if the files are stored in chunks shared by the files with the same data
+    long dedup;
+    // 1 if the cold files are compressed before any file is ejected
+    long compression;
+    // directory where the ejected files are spilled, NULL if they are not
+    char* spill_dir;
+    long max_spill_size;
+    // snapshot saved on exit and loaded on startup, NULL if there is none
+    char* snapshot_file;
+    // seconds between two background checkpoints of the snapshot, 0 if they
+    // are taken only on request
+    long checkpoint_interval;
+    // write-ahead log of the mutations, replayed on startup. NULL if there is
+    // none
+    char* wal_file;
+    enum wal_durability wal_durability;
+    // milliseconds between a write and its sync, with WAL_DURABILITY_BATCH
+    long wal_batch_interval;
+    // control socket where a new process takes over the server, NULL if the
+    // handoff is disabled
+    char* handoff_socket;
+    // directory tree loaded in the storage on startup, NULL if there is none
+    char* preload_dir;
+    long preload_threads;
+    // access hints saved on exit and applied to the files loaded on startup,
+    // NULL if there are none
+    char* hints_file;
     char* socketname;
     enum file_replacement_policy replacement_policy;
+    long max_spool_size;
+    long evictor_high_watermark;
+    long evictor_low_watermark;
 };
 
 struct signal_handler_arg {
@@ -68,6 +126,14 @@ static void* signal_handler_entry_point(void* arg)
             termination_code = SOFT_EXIT;
             write(fd_pipe, &termination_code, sizeof(char));
             return NULL;
+        case SIGUSR1:
+            termination_code = SAVE_SNAPSHOT;
+            write(fd_pipe, &termination_code, sizeof(char));
+            break;
+        case SIGCHLD:
+            termination_code = CHECKPOINT_DONE;
+            write(fd_pipe, &termination_code, sizeof(char));
+            break;
         default:;
         }
     }
@@ -84,6 +150,26 @@ int parse_config(const char* config_filename, struct server_config* res)
     config_t* config;
     DIE_NULL(config = get_config_from_file(config_filename), "get_config_from_file");
 
+    // default values of the optional keys
+    res->max_spool_size = DEFAULT_MAX_SPOOL_SIZE;
+    res->max_memory = 0;
+    res->inline_file_size = DEFAULT_INLINE_FILE_SIZE;
+    res->dedup = 0;
+    res->compression = 0;
+    res->spill_dir = NULL;
+    res->max_spill_size = DEFAULT_MAX_SPILL_SIZE;
+    res->snapshot_file = NULL;
+    res->checkpoint_interval = 0;
+    res->wal_file = NULL;
+    res->wal_durability = WAL_DURABILITY_BATCH;
+    res->wal_batch_interval = WAL_DEFAULT_BATCH_INTERVAL;
+    res->handoff_socket = NULL;
+    res->preload_dir = NULL;
+    res->preload_threads = DEFAULT_PRELOAD_THREADS;
+    res->hints_file = NULL;
+    res->evictor_high_watermark = 0;
+    res->evictor_low_watermark = 0;
+
     char *key, *value;
     while (config_get_next_entry(config, &key, &value)) {
         if (strcmp(key, "num_workers") == 0) {
@@ -119,6 +205,149 @@ int parse_config(const char* config_filename, struct server_config* res)
                 goto cleanup;
             }
             res->max_storage_size = n;
+        } else if (strcmp(key, "max_memory") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n < 0) {
+                fprintf(stderr, "error: %s must be a non negative integer\n", key);
+                goto cleanup;
+            }
+            res->max_memory = n;
+        } else if (strcmp(key, "inline_file_size") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n < 0 || n > MIN_SEGMENT_SIZE) {
+                fprintf(stderr, "error: %s must be between 0 and %d\n", key, MIN_SEGMENT_SIZE);
+                goto cleanup;
+            }
+            res->inline_file_size = n;
+        } else if (strcmp(key, "dedup") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n != 0 && n != 1) {
+                fprintf(stderr, "error: %s must be either 0 or 1\n", key);
+                goto cleanup;
+            }
+            res->dedup = n;
+        } else if (strcmp(key, "compression") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n != 0 && n != 1) {
+                fprintf(stderr, "error: %s must be either 0 or 1\n", key);
+                goto cleanup;
+            }
+            res->compression = n;
+        } else if (strcmp(key, "max_spool_size") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n < 0) {
+                fprintf(stderr, "error: %s must be a non negative integer\n", key);
+                goto cleanup;
+            }
+            res->max_spool_size = n;
+        } else if (strcmp(key, "evictor_high_watermark") == 0 || strcmp(key, "evictor_low_watermark") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n < 0 || n > 100) {
+                fprintf(stderr, "error: %s must be a percentage between 0 and 100\n", key);
+                goto cleanup;
+            }
+            if (strcmp(key, "evictor_high_watermark") == 0) {
+                res->evictor_high_watermark = n;
+            } else {
+                res->evictor_low_watermark = n;
+            }
+        } else if (strcmp(key, "max_spill_size") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "error: %s must be a positive integer\n", key);
+                goto cleanup;
+            }
+            res->max_spill_size = n;
+        } else if (strcmp(key, "checkpoint_interval") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n < 0) {
+                fprintf(stderr, "error: %s must be a non negative integer\n", key);
+                goto cleanup;
+            }
+            res->checkpoint_interval = n;
+        } else if (strcmp(key, "wal_batch_interval") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "error: %s must be a positive integer\n", key);
+                goto cleanup;
+            }
+            res->wal_batch_interval = n;
+        } else if (strcmp(key, "preload_threads") == 0) {
+            long n;
+            if (string_to_long(value, &n) == -1) {
+                fprintf(stderr, "error: unable to convert %s to a long\n", value);
+                goto cleanup;
+            }
+            if (n <= 0) {
+                fprintf(stderr, "error: %s must be a positive integer\n", key);
+                goto cleanup;
+            }
+            res->preload_threads = n;
+        } else if (strcmp(key, "wal_durability") == 0) {
+            if (strcmp(value, "none") == 0) {
+                res->wal_durability = WAL_DURABILITY_NONE;
+            } else if (strcmp(value, "batch") == 0) {
+                res->wal_durability = WAL_DURABILITY_BATCH;
+            } else if (strcmp(value, "always") == 0) {
+                res->wal_durability = WAL_DURABILITY_ALWAYS;
+            } else {
+                fprintf(stderr, "error: %s must be one of none, batch, always\n", key);
+                goto cleanup;
+            }
+        } else if (strcmp(key, "wal_file") == 0) {
+            DIE_NULL(res->wal_file = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->wal_file, value);
+        } else if (strcmp(key, "spill_dir") == 0) {
+            DIE_NULL(res->spill_dir = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->spill_dir, value);
+        } else if (strcmp(key, "snapshot_file") == 0) {
+            DIE_NULL(res->snapshot_file = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->snapshot_file, value);
+        } else if (strcmp(key, "handoff_socket") == 0) {
+            DIE_NULL(res->handoff_socket = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->handoff_socket, value);
+        } else if (strcmp(key, "preload_dir") == 0) {
+            DIE_NULL(res->preload_dir = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->preload_dir, value);
+        } else if (strcmp(key, "hints_file") == 0) {
+            DIE_NULL(res->hints_file = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
+            strcpy(res->hints_file, value);
         } else if (strcmp(key, "socketname") == 0) {
             DIE_NULL(res->socketname = malloc((strlen(value) + 1) * sizeof(char)), "malloc");
             strcpy(res->socketname, value);
@@ -133,6 +362,13 @@ int parse_config(const char* config_filename, struct server_config* res)
         }
     }
     destroy_config(config);
+
+    // the evictor is enabled only if the high watermark is set
+    if (res->evictor_high_watermark > 0 && (res->evictor_low_watermark <= 0 || res->evictor_low_watermark >= res->evictor_high_watermark)) {
+        fprintf(stderr, "error: evictor_low_watermark must be positive and lower than evictor_high_watermark\n");
+        errno = EINVAL;
+        return -1;
+    }
     return 0;
 cleanup:
     destroy_config(config);
@@ -140,9 +376,27 @@ cleanup:
     return -1;
 }
 
-int print_statistics(file_storage_t* storage, usbuf_t* logger_buf)
+/**
+ * Print the statistics of an object pool
+*/
+static void print_pool_statistics(const char* name, struct object_pool_statistics* stats)
+{
+    printf("Pool of %s: %lu slabs, %lu refills, %lu flushes, maximum objects taken: %lu\n", name,
+        stats->num_slabs, stats->num_refills, stats->num_flushes, stats->maximum_taken);
+}
+
+/**
+ * Returns the memory allocated by a pool, given its statistics
+*/
+static size_t pool_memory(struct object_pool_statistics* stats)
+{
+    return stats->num_slabs * OBJECT_POOL_SLAB_OBJECTS * stats->object_size;
+}
+
+int print_statistics(file_storage_t* storage, ejection_spool_t* spool, checkpoint_t* checkpoint, usbuf_t* master_to_workers_buf,
+    usbuf_t* logger_buf)
 {
-    if (storage == NULL) {
+    if (storage == NULL || spool == NULL) {
         errno = EINVAL;
         return -1;
     }
@@ -150,6 +404,90 @@ int print_statistics(file_storage_t* storage, usbuf_t* logger_buf)
     printf("Maximum number of files on the server: %d\n", storage->statistics.maximum_num_files);
     printf("Maximum size reached: %.6f MB (%ld byte)\n", (double)storage->statistics.maximum_size_reached / 1E6, storage->statistics.maximum_size_reached);
     printf("Number of times the replacement algorithms ran: %ld\n", storage->statistics.num_replacements);
+    printf("Number of files ejected by the background evictor: %lu (in %lu runs)\n",
+        storage->statistics.num_background_replacements, storage->statistics.num_evictor_runs);
+
+    struct ejection_spool_statistics spool_stats;
+    if (ejection_spool_get_statistics(spool, &spool_stats) == -1) {
+        return -1;
+    }
+    printf("Ejected files spooled: %lu, dropped: %lu\n", spool_stats.num_spooled, spool_stats.num_dropped);
+    printf("Maximum spool size reached: %.6f MB (%zu byte)\n", (double)spool_stats.maximum_size_reached / 1E6, spool_stats.maximum_size_reached);
+
+    struct object_pool_statistics pool_stats;
+    if (object_pool_get_statistics(storage->vfile_pool, &pool_stats) == -1) {
+        return -1;
+    }
+    print_pool_statistics("files", &pool_stats);
+    if (get_log_message_pool_statistics(&pool_stats) == -1) {
+        return -1;
+    }
+    print_pool_statistics("log messages", &pool_stats);
+    size_t log_backlog_memory = pool_memory(&pool_stats);
+    if (usbuf_get_pool_statistics(logger_buf, &pool_stats) == -1) {
+        return -1;
+    }
+    print_pool_statistics("log queue nodes", &pool_stats);
+    size_t queues_memory = spool_stats.maximum_size_reached + pool_memory(&pool_stats);
+    if (usbuf_get_pool_statistics(master_to_workers_buf, &pool_stats) == -1) {
+        return -1;
+    }
+    queues_memory += pool_memory(&pool_stats);
+
+    // memory breakdown: the files are charged to the memory budget, the
+    // queues and the log backlog are only reported
+    printf("Memory used by the files: data %zu byte, metadata %zu byte, names %zu byte\n",
+        storage->memory.data, storage->memory.metadata, storage->memory.names);
+    printf("Maximum memory used by the files: %.6f MB (%zu byte)", (double)storage->statistics.maximum_memory_reached / 1E6,
+        storage->statistics.maximum_memory_reached);
+    if (storage->max_memory > 0) {
+        printf(", budget %zu byte", storage->max_memory);
+    }
+    printf("\n");
+    printf("Maximum memory used by the queues: %zu byte, by the log backlog: %zu byte\n", queues_memory, log_backlog_memory);
+    if (storage->blobs != NULL) {
+        // the logical size counts the shared chunks once for every file
+        size_t logical_size = get_logical_size(storage);
+        printf("Deduplicated chunks: %lu, chunks in the storage: %zu\n", storage->statistics.num_deduplicated_chunks,
+            storage->blobs->num_blobs);
+        printf("Logical size: %zu byte, physical size: %zu byte, dedup ratio: %.2f\n", logical_size, storage->total_size,
+            storage->total_size > 0 ? (double)logical_size / storage->total_size : 1.0);
+    }
+    if (storage->spill != NULL) {
+        struct spill_store_statistics spill_stats;
+        if (spill_store_get_statistics(storage->spill, &spill_stats) == -1) {
+            return -1;
+        }
+        printf("Memory tier: hits %lu, misses %lu\n", storage->statistics.num_ram_hits, storage->statistics.num_ram_misses);
+        printf("Disk tier: hits %lu, misses %lu, files spilled: %lu, dropped: %lu, write errors: %lu\n",
+            spill_stats.num_hits, spill_stats.num_misses, spill_stats.num_spilled, spill_stats.num_dropped,
+            spill_stats.num_write_errors);
+        printf("Maximum size of the disk tier: %.6f MB (%zu byte), limit %zu byte\n",
+            (double)spill_stats.maximum_size_reached / 1E6, spill_stats.maximum_size_reached, storage->spill->max_size);
+    }
+    if (storage->wal != NULL) {
+        struct wal_statistics wal_stats;
+        if (wal_get_statistics(storage->wal, &wal_stats) == -1) {
+            return -1;
+        }
+        printf("Write-ahead log: records %lu, bytes %zu, syncs %lu, records per sync %.2f\n", wal_stats.num_records,
+            wal_stats.bytes_written, wal_stats.num_syncs,
+            wal_stats.num_syncs > 0 ? (double)wal_stats.num_records / wal_stats.num_syncs : 0.0);
+    }
+    if (checkpoint != NULL) {
+        struct checkpoint_statistics* cp_stats = &checkpoint->statistics;
+        unsigned long num_started = cp_stats->num_checkpoints + cp_stats->num_failures;
+        printf("Checkpoints: %lu, failed: %lu, last size: %zu byte\n", cp_stats->num_checkpoints, cp_stats->num_failures,
+            cp_stats->last_size);
+        printf("Checkpoint duration: last %.3f ms, maximum %.3f ms\n", cp_stats->last_duration / 1E3,
+            cp_stats->maximum_duration / 1E3);
+        printf("Checkpoint pause of the clients: average %.3f ms, maximum %.3f ms\n",
+            num_started > 0 ? cp_stats->total_pause / 1E3 / num_started : 0.0, cp_stats->maximum_pause / 1E3);
+    }
+    if (storage->compression) {
+        printf("Compressed files: %lu, decompressed in place: %lu, bytes saved by the compression: %zu\n",
+            storage->statistics.num_compressions, storage->statistics.num_decompressions, storage->compression_savings);
+    }
 
     // log the maximum number of files and the maximum size reached
     LOG(logger_buf, "[STATISTICS] Maximum number of files on the server: %d", storage->statistics.maximum_num_files);
@@ -166,12 +504,235 @@ int print_statistics(file_storage_t* storage, usbuf_t* logger_buf)
     return 0;
 }
 
+/**
+ * Save a snapshot of the storage in path, and log the outcome. The records of
+ * the write-ahead log are in the snapshot, so the log is emptied.
+ * Must be called while holding the storage lock in read mode, or when the
+ * storage is not shared anymore
+*/
+static void save_snapshot_and_log(file_storage_t* storage, const char* path, usbuf_t* logger_buf)
+{
+    // no record is appended while the lock is held
+    uint64_t wal_sequence = storage->wal != NULL ? wal_get_last_sequence(storage->wal) : 0;
+    if (save_snapshot(storage, path, wal_sequence) == -1) {
+        LOG(logger_buf, "ERROR unable to save the snapshot {file:%s; error:%s}", path, strerror(errno));
+        return;
+    }
+    LOG(logger_buf, "Snapshot saved {file:%s; num_files:%u; size:%zu}", path, storage->num_files,
+        get_logical_size(storage));
+    if (storage->wal != NULL && wal_discard(storage->wal, wal_sequence) == -1) {
+        // the records are skipped at the next replay, since they are older
+        // than the snapshot
+        LOG(logger_buf, "ERROR unable to truncate the write-ahead log {error:%s}", strerror(errno));
+    }
+}
+
+/**
+ * Start a background checkpoint of the storage, and log the outcome
+*/
+static void start_checkpoint_and_log(checkpoint_t* checkpoint, file_storage_t* storage, usbuf_t* logger_buf)
+{
+    if (checkpoint_start(checkpoint, storage) == -1) {
+        if (errno == EBUSY) {
+            LOG(logger_buf, "Checkpoint requested, but one is already running");
+        } else {
+            LOG(logger_buf, "ERROR unable to start the checkpoint {error:%s}", strerror(errno));
+        }
+        return;
+    }
+    LOG(logger_buf, "Checkpoint started {file:%s; pause_us:%lu}", checkpoint->path, checkpoint->statistics.last_pause);
+}
+
+/**
+ * Complete the running checkpoint, waiting for it if wait is true, and log the
+ * outcome
+*/
+static void finish_checkpoint_and_log(checkpoint_t* checkpoint, file_storage_t* storage, bool wait, usbuf_t* logger_buf)
+{
+    int res = checkpoint_finish(checkpoint, storage, wait);
+    if (res == 1) {
+        LOG(logger_buf, "Checkpoint completed {file:%s; size:%zu; duration_us:%lu}", checkpoint->path,
+            checkpoint->statistics.last_size, checkpoint->statistics.last_duration);
+    } else if (res == -1) {
+        LOG(logger_buf, "ERROR checkpoint failed {file:%s; error:%s}", checkpoint->path, strerror(errno));
+    }
+}
+
+/**
+ * Start writing in background the snapshot of a handoff, see
+ * handoff_start_snapshot, and log the outcome
+ * Returns -1 on error and errno is set appropriately
+*/
+static int start_handoff_snapshot_and_log(file_storage_t* storage, handoff_snapshot_t* snapshot, usbuf_t* logger_buf)
+{
+    if (handoff_start_snapshot(storage, snapshot) == -1) {
+        LOG(logger_buf, "ERROR unable to start the handoff snapshot, the clients wait for it {error:%s}",
+            strerror(errno));
+        return -1;
+    }
+    LOG(logger_buf, "Handoff snapshot started, serving the clients meanwhile {num_files:%u; size:%zu}",
+        storage->num_files, storage->total_size);
+    return 0;
+}
+
+/**
+ * Hand off the server to the process connected to control_fd, see handoff.h.
+ * The storage is locked in write mode, so that the evictor does not modify
+ * it, the running checkpoint is completed and the write-ahead log and the
+ * spill directory are closed, so that the new process can open them. If the
+ * handoff fails they are opened again, and the server goes on. snapshot_fd is
+ * the snapshot written in background, or -1 to write it now.
+ * Must be called when the workers are not serving any request
+ * Returns true if the new process took over the server
+*/
+static bool hand_off_server(int control_fd, struct server_config* cfg, file_storage_t* storage, checkpoint_t* checkpoint,
+    int snapshot_fd, int socket_fd, const fd_set* clients, int clients_max, connection_state_t* connections,
+    usbuf_t* logger_buf)
+{
+    if (checkpoint != NULL) {
+        finish_checkpoint_and_log(checkpoint, storage, true, logger_buf);
+    }
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+    DIE_NEG1(write_lock(storage_lock), "write_lock");
+
+    uint64_t wal_sequence = 0;
+    if (storage->wal != NULL) {
+        wal_sequence = wal_get_last_sequence(storage->wal);
+        DIE_NEG1(wal_close(storage->wal), "wal_close");
+        storage->wal = NULL;
+    }
+    // the spilled files are not handed off, the new process removes them
+    if (storage->spill != NULL) {
+        DIE_NEG1(destroy_spill_store(storage->spill), "destroy_spill_store");
+        storage->spill = NULL;
+    }
+
+    bool handed_off
+        = handoff_send(control_fd, storage, snapshot_fd, socket_fd, clients, clients_max, connections, wal_sequence) == 0;
+    if (handed_off) {
+        LOG(logger_buf, "Server handed off {num_files:%u; size:%zu}", storage->num_files, storage->total_size);
+        // the clients belong to the new process, so the files ejected by the
+        // evictor until the exit do not answer the clients waiting for them
+        for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+            FD_ZERO(&f->lock_queue);
+            f->lock_queue_max = 0;
+        }
+    } else {
+        LOG(logger_buf, "ERROR unable to hand off the server, going on {error:%s}", strerror(errno));
+        if (cfg->wal_file != NULL) {
+            DIE_NULL(storage->wal = wal_open(cfg->wal_file, cfg->wal_durability, cfg->wal_batch_interval, wal_sequence + 1),
+                "wal_open");
+        }
+        if (cfg->spill_dir != NULL) {
+            DIE_NULL(storage->spill = create_spill_store(cfg->spill_dir, cfg->max_spill_size), "create_spill_store");
+        }
+    }
+
+    DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+    return handed_off;
+}
+
+struct wal_replay_arg {
+    const char* wal_file;
+    file_storage_t* storage;
+    usbuf_t* logger_buffer;
+};
+
+static int apply_wal_record(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size);
+
+/**
+ * Apply to the storage the records of the write-ahead log of arg (a struct
+ * wal_replay_arg) after the record *wal_sequence, see handoff_catch_up_t
+ * Returns -1 on error and errno is set appropriately
+*/
+static int catch_up_wal(void* arg, file_storage_t* storage, uint64_t* wal_sequence)
+{
+    struct wal_replay_arg* replay_arg = arg;
+    replay_arg->storage = storage;
+    uint64_t last_sequence;
+    if (wal_replay(replay_arg->wal_file, *wal_sequence, apply_wal_record, replay_arg, &last_sequence) == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    *wal_sequence = last_sequence;
+    return 0;
+}
+
+/**
+ * Apply a record of the write-ahead log to the storage of arg (a struct
+ * wal_replay_arg), see wal_replay. The content is stored plain, as if the
+ * file had just been written, and the file takes the version of the record.
+ * An append to a file that is not in the storage is ignored: the file was
+ * not loaded because of the limits, and its tail alone is not the file
+ * Returns -1 on error and errno is set appropriately
+*/
+static int apply_wal_record(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size)
+{
+    struct wal_replay_arg* replay_arg = arg;
+    file_storage_t* storage = replay_arg->storage;
+    vfile_t* vfile = get_file_from_name(storage, strlen(filename), filename);
+    if (vfile == NULL && errno != ENOENT) {
+        return -1;
+    }
+    if (vfile == NULL && op == WAL_APPEND) {
+        LOG(replay_arg->logger_buffer, "Append to a file not in the storage ignored {filename:%s; size:%zu}", filename,
+            size);
+        return 0;
+    }
+    if (vfile != NULL && (op == WAL_REMOVE || (op == WAL_WRITE && vfile->size > 0))) {
+        // a file is written only when it is empty, so a write of a file with
+        // a content comes from a file that was removed and created again
+        if (remove_file_from_storage(storage, vfile) == -1 || destroy_vfile(storage, vfile) == -1) {
+            return -1;
+        }
+        vfile = NULL;
+    }
+    if (op == WAL_REMOVE) {
+        return 0;
+    }
+
+    if (vfile == NULL) {
+        if ((vfile = create_vfile(storage)) == NULL) {
+            return -1;
+        }
+        if ((vfile->filename = malloc(strlen(filename) + 1)) == NULL) {
+            destroy_vfile(storage, vfile);
+            errno = ENOMEM;
+            return -1;
+        }
+        strcpy(vfile->filename, filename);
+        if (add_vfile_to_storage(storage, vfile) == -1) {
+            destroy_vfile(storage, vfile);
+            return -1;
+        }
+    }
+    if (size > 0) {
+        if (unshare_file_content(storage, vfile) == -1 || decompress_file(storage, vfile) == -1
+            || file_data_append(&vfile->data, data, size) == -1) {
+            return -1;
+        }
+        vfile->size += size;
+        storage->total_size += size;
+        if (bump_file_version(storage, vfile) == -1) {
+            return -1;
+        }
+        update_file_memory(storage, vfile);
+    }
+    // the versions assigned after the replay are newer than the ones of the
+    // log, that the clients may already have
+    vfile->version = version;
+    if (version > storage->version_clock) {
+        storage->version_clock = version;
+    }
+    return 0;
+}
+
 int main(void)
 {
     int sig_handler_to_master_pipe[2];
     int workers_to_master_pipe[2];
     usbuf_t* master_to_workers_buffer;
     usbuf_t* logger_buffer;
+    object_pool_t* client_fd_pool;
     file_storage_t* file_storage;
 
     // mask the desired signals
@@ -180,6 +741,8 @@ int main(void)
     sigaddset(&signal_mask, SIGINT);
     sigaddset(&signal_mask, SIGQUIT);
     sigaddset(&signal_mask, SIGHUP);
+    sigaddset(&signal_mask, SIGUSR1);
+    sigaddset(&signal_mask, SIGCHLD);
 
     if (pthread_sigmask(SIG_BLOCK, &signal_mask, NULL) != 0) {
         perror("sigmask");
@@ -192,9 +755,13 @@ int main(void)
     s.sa_handler = SIG_IGN;
     DIE_NEG1((sigaction(SIGPIPE, &s, NULL)), "sigaction");
 
+    // the log messages are allocated from a pool
+    DIE_NEG1(create_log_message_pool(), "create_log_message_pool");
+
     // initalize the shared buffers
     DIE_NULL(master_to_workers_buffer = usbuf_create(FIFO_POLICY), "usbuf create");
     DIE_NULL(logger_buffer = usbuf_create(FIFO_POLICY), "usbuf create");
+    DIE_NULL(client_fd_pool = create_object_pool(sizeof(int)), "create_object_pool");
 
     // create the pipes
     DIE_NEG1(pipe(workers_to_master_pipe), "pipe");
@@ -211,11 +778,161 @@ int main(void)
     LOG(logger_buffer, "Server config: num_workers=%ld", cfg.num_workers);
     LOG(logger_buffer, "Server config: max_num_files=%ld", cfg.max_num_files);
     LOG(logger_buffer, "Server config: max_storage_size=%ld", cfg.max_storage_size);
+    LOG(logger_buffer, "Server config: max_memory=%ld", cfg.max_memory);
+    LOG(logger_buffer, "Server config: inline_file_size=%ld", cfg.inline_file_size);
+    LOG(logger_buffer, "Server config: dedup=%ld", cfg.dedup);
+    LOG(logger_buffer, "Server config: compression=%ld", cfg.compression);
+    LOG(logger_buffer, "Server config: spill_dir=%s", cfg.spill_dir != NULL ? cfg.spill_dir : "(none)");
+    LOG(logger_buffer, "Server config: max_spill_size=%ld", cfg.max_spill_size);
+    LOG(logger_buffer, "Server config: snapshot_file=%s", cfg.snapshot_file != NULL ? cfg.snapshot_file : "(none)");
+    LOG(logger_buffer, "Server config: checkpoint_interval=%ld", cfg.checkpoint_interval);
+    LOG(logger_buffer, "Server config: wal_file=%s", cfg.wal_file != NULL ? cfg.wal_file : "(none)");
+    LOG(logger_buffer, "Server config: wal_durability=%d", cfg.wal_durability);
+    LOG(logger_buffer, "Server config: wal_batch_interval=%ld", cfg.wal_batch_interval);
+    LOG(logger_buffer, "Server config: handoff_socket=%s", cfg.handoff_socket != NULL ? cfg.handoff_socket : "(none)");
+    LOG(logger_buffer, "Server config: preload_dir=%s", cfg.preload_dir != NULL ? cfg.preload_dir : "(none)");
+    LOG(logger_buffer, "Server config: preload_threads=%ld", cfg.preload_threads);
+    LOG(logger_buffer, "Server config: hints_file=%s", cfg.hints_file != NULL ? cfg.hints_file : "(none)");
     LOG(logger_buffer, "Server config: socketname=%s", cfg.socketname);
     LOG(logger_buffer, "Server config: replacement_policy=%d", cfg.replacement_policy);
+    LOG(logger_buffer, "Server config: max_spool_size=%ld", cfg.max_spool_size);
+    LOG(logger_buffer, "Server config: evictor_high_watermark=%ld", cfg.evictor_high_watermark);
+    LOG(logger_buffer, "Server config: evictor_low_watermark=%ld", cfg.evictor_low_watermark);
 
     // create the file storage
-    DIE_NULL(file_storage = create_file_storage(cfg.replacement_policy), "create_file_storage");
+    DIE_NULL(file_storage = create_file_storage(cfg.replacement_policy, cfg.inline_file_size), "create_file_storage");
+    file_storage->max_memory = cfg.max_memory;
+    file_storage->compression = cfg.compression;
+    if (cfg.dedup) {
+        DIE_NEG1(enable_file_deduplication(file_storage), "enable_file_deduplication");
+    }
+
+    // all the connections start with the default options (EJECT_SEND_FILES = 0)
+    connection_state_t* connections;
+    DIE_NULL(connections = calloc(FD_SETSIZE, sizeof(connection_state_t)), "calloc");
+
+    // upgrade: if a server is running with the same control socket, this
+    // process takes it over, with its storage and its clients
+    bool taken_over = false;
+    handoff_state_t handoff_state;
+    struct wal_replay_arg wal_replay_arg = { cfg.wal_file, file_storage, logger_buffer };
+    // sequence of the last record of the write-ahead log in the snapshot
+    uint64_t wal_sequence = 0;
+    if (cfg.handoff_socket != NULL) {
+        int control_fd = handoff_connect(cfg.handoff_socket);
+        if (control_fd != -1) {
+            DIE_NEG1(handoff_receive(control_fd, file_storage, cfg.max_num_files, cfg.max_storage_size, connections,
+                         cfg.wal_file != NULL ? catch_up_wal : NULL, &wal_replay_arg, &handoff_state),
+                "handoff_receive");
+            close(control_fd);
+            taken_over = true;
+            wal_sequence = handoff_state.wal_sequence;
+            // the old process is still logging its termination
+            keep_previous_log();
+            LOG(logger_buffer, "Server taken over {num_clients:%u; num_files:%ld; size:%zu}", handoff_state.num_clients,
+                handoff_state.num_files, file_storage->total_size);
+        } else if (errno != ENOENT && errno != ECONNREFUSED) {
+            perror("handoff_connect");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // the spill directory is cleared, so it is created only after the server
+    // that handed off has closed it
+    if (cfg.spill_dir != NULL) {
+        DIE_NULL(file_storage->spill = create_spill_store(cfg.spill_dir, cfg.max_spill_size), "create_spill_store");
+    }
+
+    // warm restart: the files of the last snapshot are loaded, but their
+    // content is read only when it is accessed
+    if (cfg.snapshot_file != NULL && !taken_over) {
+        long num_loaded = load_snapshot(file_storage, cfg.snapshot_file, cfg.max_num_files, cfg.max_storage_size,
+            &wal_sequence);
+        if (num_loaded >= 0) {
+            LOG(logger_buffer, "Snapshot loaded {file:%s; num_files:%ld; size:%zu}", cfg.snapshot_file, num_loaded,
+                file_storage->total_size);
+        } else if (errno == ENOENT) {
+            LOG(logger_buffer, "No snapshot to load, starting with an empty storage {file:%s}", cfg.snapshot_file);
+        } else {
+            LOG(logger_buffer, "ERROR unable to load the snapshot, starting with an empty storage {file:%s; error:%s}",
+                cfg.snapshot_file, strerror(errno));
+        }
+    }
+
+    // the mutations after the snapshot are replayed from the write-ahead log,
+    // then the log is reopened to record the next ones
+    if (cfg.wal_file != NULL) {
+        uint64_t last_sequence;
+        long num_replayed = wal_replay(cfg.wal_file, wal_sequence, apply_wal_record, &wal_replay_arg, &last_sequence);
+        if (num_replayed >= 0) {
+            LOG(logger_buffer, "Write-ahead log replayed {file:%s; num_records:%ld; num_files:%u; size:%zu}", cfg.wal_file,
+                num_replayed, file_storage->num_files, file_storage->total_size);
+        } else if (errno == ENOENT) {
+            last_sequence = wal_sequence;
+        } else {
+            perror("wal_replay");
+            exit(EXIT_FAILURE);
+        }
+        DIE_NULL(file_storage->wal = wal_open(cfg.wal_file, cfg.wal_durability, cfg.wal_batch_interval, last_sequence + 1),
+            "wal_open");
+
+        // the replayed files can exceed the limits, the oldest ones are ejected
+        vfile_t* retired = NULL;
+        while (file_storage->num_files > cfg.max_num_files || file_storage->total_size > cfg.max_storage_size) {
+            eject_one_file(-1, EJECT_DISCARD, file_storage, NULL, &retired, NULL, logger_buffer, NULL, -1, "replay");
+        }
+        destroy_retired_vfiles(file_storage, &retired);
+    }
+
+    // the files restored take the access metadata of the last run, so that
+    // the replacement policy does not start cold. A server taken over keeps
+    // the metadata of the old process
+    access_hints_t* hints = NULL;
+    if (cfg.hints_file != NULL && !taken_over) {
+        hints = load_access_hints(cfg.hints_file);
+        if (hints != NULL) {
+            long num_applied;
+            DIE_NEG1(num_applied = apply_access_hints(file_storage, hints), "apply_access_hints");
+            LOG(logger_buffer, "Access hints loaded {file:%s; num_hints:%zu; num_applied:%ld}", cfg.hints_file,
+                hints->num_hints, num_applied);
+        } else if (errno == ENOENT) {
+            LOG(logger_buffer, "No access hints to load {file:%s}", cfg.hints_file);
+        } else {
+            LOG(logger_buffer, "ERROR unable to load the access hints {file:%s; error:%s}", cfg.hints_file,
+                strerror(errno));
+        }
+    }
+
+    // the files of the preload directory are added to the ones restored, in
+    // parallel and within the limits of the storage, with their hints
+    if (cfg.preload_dir != NULL && !taken_over) {
+        struct preload_statistics stats;
+        if (preload_directory(file_storage, cfg.preload_dir, cfg.preload_threads, cfg.max_num_files,
+                cfg.max_storage_size, hints, logger_buffer, &stats)
+            == 0) {
+            double seconds = stats.duration / 1e6;
+            LOG(logger_buffer,
+                "Directory preloaded {dir:%s; num_found:%lu; num_loaded:%lu; num_skipped:%lu; num_errors:%lu; "
+                "num_ejected:%lu; num_hinted:%lu; size:%zu; time:%.3fs; throughput:%.2fMB/s}",
+                cfg.preload_dir, stats.num_found, stats.num_loaded, stats.num_skipped, stats.num_errors,
+                stats.num_ejected, stats.num_hinted, stats.loaded_size, seconds,
+                seconds > 0 ? stats.loaded_size / seconds / (1024 * 1024) : 0.0);
+        } else {
+            LOG(logger_buffer, "ERROR unable to preload the directory {dir:%s; error:%s}", cfg.preload_dir,
+                strerror(errno));
+        }
+    }
+    free_access_hints(hints);
+
+    // the snapshot is saved in background by the checkpoints
+    checkpoint_t* checkpoint = NULL;
+    if (cfg.snapshot_file != NULL) {
+        DIE_NULL(checkpoint = create_checkpoint(cfg.snapshot_file), "create_checkpoint");
+    }
+
+    // create the spool of the ejected files
+    ejection_spool_t* spool;
+    DIE_NULL(spool = create_ejection_spool(cfg.max_spool_size), "create_ejection_spool");
 
     // create the logger thread
     pthread_t logger_tid;
@@ -225,25 +942,46 @@ int main(void)
     // set up the common argument that will be passed to all the workers
     worker_arg_t* worker_arg = malloc(sizeof(worker_arg_t));
     worker_arg->master_to_workers_buffer = master_to_workers_buffer;
+    worker_arg->client_fd_pool = client_fd_pool;
     worker_arg->worker_to_master_pipe_write_fd = workers_to_master_pipe[1];
     worker_arg->logger_buffer = logger_buffer;
     worker_arg->max_num_files = cfg.max_num_files;
     worker_arg->max_storage_size = cfg.max_storage_size;
     worker_arg->file_storage = file_storage;
+    worker_arg->spool = spool;
+
+    // start the background evictor if it is enabled
+    worker_arg->evictor = NULL;
+    if (cfg.evictor_high_watermark > 0) {
+        DIE_NULL(worker_arg->evictor = evictor_start(file_storage, logger_buffer, cfg.max_storage_size, cfg.max_num_files,
+                     cfg.evictor_high_watermark, cfg.evictor_low_watermark),
+            "evictor_start");
+    }
+    worker_arg->connections = connections;
 
     // create the workers thread pool
     thread_pool_t* workers_pool;
     DIE_NULL(workers_pool = thread_pool_create(cfg.num_workers, server_worker_entry_point, worker_arg), "thread_pool_create");
 
-    // set up the socket
+    // set up the socket, a server taken over keeps the one of the old process
     int socket_fd;
-    DIE_NEG1(socket_fd = socket(AF_UNIX, SOCK_STREAM, 0), "socket");
-    struct sockaddr_un serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sun_family = AF_UNIX;
-    strncpy(serv_addr.sun_path, cfg.socketname, strlen(cfg.socketname) + 1);
-    DIE_NEG1(bind(socket_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)), "bind");
-    DIE_NEG1(listen(socket_fd, SOMAXCONN), "listen");
+    if (taken_over) {
+        socket_fd = handoff_state.listen_fd;
+    } else {
+        DIE_NEG1(socket_fd = socket(AF_UNIX, SOCK_STREAM, 0), "socket");
+        struct sockaddr_un serv_addr;
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sun_family = AF_UNIX;
+        strncpy(serv_addr.sun_path, cfg.socketname, strlen(cfg.socketname) + 1);
+        DIE_NEG1(bind(socket_fd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)), "bind");
+        DIE_NEG1(listen(socket_fd, SOMAXCONN), "listen");
+    }
+
+    // the control socket replaces the one of the old process, if any
+    int handoff_fd = -1;
+    if (cfg.handoff_socket != NULL) {
+        DIE_NEG1(handoff_fd = handoff_listen(cfg.handoff_socket), "handoff_listen");
+    }
 
     // set up the file descriptors sets for the select call
     fd_set listen_set, tmp_set;
@@ -254,15 +992,98 @@ int main(void)
     FD_SET(socket_fd, &listen_set);
 
     int fd_max = max(max(sig_handler_to_master_pipe[0], workers_to_master_pipe[0]), socket_fd);
+    if (handoff_fd != -1) {
+        FD_SET(handoff_fd, &listen_set);
+        fd_max = max(fd_max, handoff_fd);
+    }
+
+    unsigned int num_clients_connected = 0;
+    if (taken_over) {
+        for (int fd = 0; fd <= handoff_state.clients_max; ++fd) {
+            if (FD_ISSET(fd, &handoff_state.clients)) {
+                FD_SET(fd, &listen_set);
+            }
+        }
+        fd_max = max(fd_max, handoff_state.clients_max);
+        num_clients_connected = handoff_state.num_clients;
+    }
 
     // main loop
     bool hard_terminate = false;
     bool soft_terminate = false;
-    unsigned int num_clients_connected = 0;
-    while ((!hard_terminate) && !(soft_terminate && num_clients_connected == 0)) {
+    // connection of the process taking over the server, -1 if there is none
+    int control_fd = -1;
+    // with the write-ahead log the snapshot of the handoff is written in
+    // background, and the server is handed off when it is ready
+    handoff_snapshot_t handoff_snapshot = { -1, -1 };
+    bool handoff_ready = false;
+    bool handed_off = false;
+    // requests dispatched to the workers that are not completed yet
+    unsigned int num_requests_running = 0;
+    time_t next_checkpoint = time(NULL) + cfg.checkpoint_interval;
+    while ((!hard_terminate) && !handed_off && !(soft_terminate && num_clients_connected == 0)) {
+        if (control_fd != -1 && !handoff_ready && handoff_snapshot.fd == -1) {
+            // a running checkpoint completes first, then its child is reaped
+            // before the one of the snapshot
+            if (cfg.wal_file == NULL) {
+                handoff_ready = true;
+            } else if ((checkpoint == NULL || !checkpoint_is_running(checkpoint))
+                && start_handoff_snapshot_and_log(file_storage, &handoff_snapshot, logger_buffer) == -1) {
+                handoff_ready = true;
+            }
+        }
+
+        // the server is handed off as soon as the snapshot is ready and the
+        // workers are idle, the clients waiting for a lock are idle too
+        if (control_fd != -1 && handoff_ready && num_requests_running == 0) {
+            fd_set clients = listen_set;
+            FD_CLR(socket_fd, &clients);
+            FD_CLR(sig_handler_to_master_pipe[0], &clients);
+            FD_CLR(workers_to_master_pipe[0], &clients);
+            if (handoff_fd != -1) {
+                FD_CLR(handoff_fd, &clients);
+            }
+            handed_off = hand_off_server(control_fd, &cfg, file_storage, checkpoint, handoff_snapshot.fd, socket_fd,
+                &clients, fd_max, connections, logger_buffer);
+            close(control_fd);
+            control_fd = -1;
+            handoff_discard_snapshot(&handoff_snapshot);
+            handoff_ready = false;
+            continue;
+        }
+
         tmp_set = listen_set;
+        if (control_fd != -1 && handoff_ready) {
+            // during a handoff only the workers completing their requests and
+            // the signals are served, the new requests wait for the new process
+            FD_ZERO(&tmp_set);
+            FD_SET(sig_handler_to_master_pipe[0], &tmp_set);
+            FD_SET(workers_to_master_pipe[0], &tmp_set);
+        } else if (control_fd != -1) {
+            // while the snapshot is written the clients are served, but
+            // another process cannot take over
+            FD_CLR(handoff_fd, &tmp_set);
+        }
+
+        // with periodic checkpoints the select wakes up for the next one. No
+        // checkpoint starts during a handoff, it would discard the records of
+        // the log after the snapshot of the handoff
+        struct timeval timeout;
+        struct timeval* select_timeout = NULL;
+        if (checkpoint != NULL && cfg.checkpoint_interval > 0) {
+            time_t now = time(NULL);
+            if (now >= next_checkpoint) {
+                if (control_fd == -1) {
+                    start_checkpoint_and_log(checkpoint, file_storage, logger_buffer);
+                }
+                next_checkpoint = now + cfg.checkpoint_interval;
+            }
+            timeout.tv_sec = next_checkpoint - now;
+            timeout.tv_usec = 0;
+            select_timeout = &timeout;
+        }
 
-        DIE_NEG1(select(fd_max + 1, &tmp_set, NULL, NULL, NULL), "select");
+        DIE_NEG1(select(fd_max + 1, &tmp_set, NULL, NULL, select_timeout), "select");
         for (int fd = 0; fd <= fd_max; ++fd) {
             if (FD_ISSET(fd, &tmp_set)) {
                 if (fd == socket_fd) {
@@ -275,6 +1096,11 @@ int main(void)
                     }
                     ++num_clients_connected;
                     LOG(logger_buffer, "client %d connected, clients connected:%d", client_fd, num_clients_connected);
+                } else if (fd == handoff_fd) {
+                    // a new process is taking over the server, no more
+                    // requests are dispatched to the workers
+                    DIE_NEG1(control_fd = accept(handoff_fd, NULL, 0), "accept");
+                    LOG(logger_buffer, "Handoff requested");
                 } else if (fd == sig_handler_to_master_pipe[0]) {
                     char exit_code;
                     DIE_NEG1(read(sig_handler_to_master_pipe[0], &exit_code, sizeof(char)), "read");
@@ -287,11 +1113,37 @@ int main(void)
                         LOG(logger_buffer, "Soft exit signal received, waiting for all the clients to disconnect...");
                         FD_CLR(socket_fd, &listen_set);
                         soft_terminate = true;
+                    } else if (exit_code == SAVE_SNAPSHOT) {
+                        // the clients are not blocked while the snapshot is saved
+                        if (checkpoint != NULL && control_fd != -1) {
+                            LOG(logger_buffer, "Snapshot requested, but a handoff is running");
+                        } else if (checkpoint != NULL) {
+                            start_checkpoint_and_log(checkpoint, file_storage, logger_buffer);
+                        } else {
+                            LOG(logger_buffer, "Snapshot requested, but no snapshot_file is configured");
+                        }
+                    } else if (exit_code == CHECKPOINT_DONE) {
+                        if (checkpoint != NULL) {
+                            finish_checkpoint_and_log(checkpoint, file_storage, false, logger_buffer);
+                        }
+                        if (handoff_snapshot.pid != -1) {
+                            int res = handoff_finish_snapshot(&handoff_snapshot, false);
+                            if (res == 1) {
+                                LOG(logger_buffer, "Handoff snapshot written, waiting for %u running requests...",
+                                    num_requests_running);
+                                handoff_ready = true;
+                            } else if (res == -1) {
+                                LOG(logger_buffer, "ERROR handoff snapshot failed, the clients wait for it {error:%s}",
+                                    strerror(errno));
+                                handoff_ready = true;
+                            }
+                        }
                     }
                 } else if (fd == workers_to_master_pipe[0]) {
                     // handle worker request to put back into the set the fd
                     int put_back_fd;
                     DIE_NEG1(readn(workers_to_master_pipe[0], &put_back_fd, sizeof(int)), "readn");
+                    --num_requests_running;
 
                     if (put_back_fd < 0) {
                         // the client disconnected
@@ -306,10 +1158,11 @@ int main(void)
                         }
                     }
 
-                } else {
+                } else if (control_fd == -1) {
                     // handle client's new request
+                    ++num_requests_running;
                     int* client_fd;
-                    DIE_NULL(client_fd = malloc(sizeof(int)), "malloc");
+                    DIE_NULL(client_fd = object_pool_alloc(client_fd_pool), "object_pool_alloc");
                     *client_fd = fd;
                     DIE_NEG1(usbuf_put(master_to_workers_buffer, client_fd), "usbuf_put");
 
@@ -328,28 +1181,89 @@ int main(void)
         }
     }
 
-    DIE_NEG1(print_statistics(file_storage, logger_buffer), "print_statistics");
+    // the snapshot of an interrupted handoff is not needed, and the running
+    // checkpoint, if any, is completed before the final snapshot
+    handoff_discard_snapshot(&handoff_snapshot);
+    if (checkpoint != NULL) {
+        finish_checkpoint_and_log(checkpoint, file_storage, true, logger_buffer);
+    }
+
+    DIE_NEG1(print_statistics(file_storage, spool, checkpoint, master_to_workers_buffer, logger_buffer), "print_statistics");
 
     // close the master workers buffer and join the workers pool
     DIE_NEG1(usbuf_close(master_to_workers_buffer), "usbuf close");
     DIE_NEG1(thread_pool_join(workers_pool), "thread_pool_join");
 
-    // join the signal handler thread
+    // stop the evictor after the workers, since they can wake it up
+    if (worker_arg->evictor != NULL) {
+        DIE_NEG1(evictor_stop(worker_arg->evictor), "evictor_stop");
+    }
+
+    // the workers are done, so the snapshot is saved without the storage lock.
+    // After a handoff the storage belongs to the new process
+    if (cfg.snapshot_file != NULL) {
+        if (!handed_off) {
+            save_snapshot_and_log(file_storage, cfg.snapshot_file, logger_buffer);
+        }
+        DIE_NEG1(destroy_checkpoint(checkpoint, file_storage), "destroy_checkpoint");
+    }
+    if (cfg.hints_file != NULL && !handed_off) {
+        long num_hints = save_access_hints(file_storage, cfg.hints_file);
+        if (num_hints >= 0) {
+            LOG(logger_buffer, "Access hints saved {file:%s; num_hints:%ld}", cfg.hints_file, num_hints);
+        } else {
+            LOG(logger_buffer, "ERROR unable to save the access hints {file:%s; error:%s}", cfg.hints_file,
+                strerror(errno));
+        }
+    }
+
+    // all the mutations are done, and they are in the snapshot if there is one
+    if (file_storage->wal != NULL) {
+        DIE_NEG1(wal_close(file_storage->wal), "wal_close");
+        file_storage->wal = NULL;
+    }
+
+    // join the signal handler thread, that after a handoff is still waiting
+    // for a termination signal
+    if (handed_off) {
+        pthread_kill(signal_handler_tid, SIGHUP);
+    }
     DIE_NEG1(pthread_join(signal_handler_tid, NULL), "pthread_join");
 
     // close the logger buffer and join the logger thread
     DIE_NEG1(usbuf_close(logger_buffer), "usbuf close");
     DIE_NEG1(pthread_join(logger_tid, NULL), "pthread_join");
 
-    DIE_NEG1(unlink(cfg.socketname), "unlink");
+    // the sockets are still used by the new process after a handoff
+    if (!handed_off) {
+        DIE_NEG1(unlink(cfg.socketname), "unlink");
+        if (handoff_fd != -1) {
+            close(handoff_fd);
+            DIE_NEG1(unlink(cfg.handoff_socket), "unlink");
+        }
+    }
 
+    free(worker_arg->connections);
     free(worker_arg);
     free(cfg.socketname);
+    free(cfg.spill_dir);
+    free(cfg.snapshot_file);
+    free(cfg.wal_file);
+    free(cfg.handoff_socket);
+    free(cfg.preload_dir);
+    free(cfg.hints_file);
 
+    spill_store_t* spill = file_storage->spill;
     DIE_NEG1(destroy_file_storage(file_storage), "destroy_file_storage");
+    if (spill != NULL) {
+        DIE_NEG1(destroy_spill_store(spill), "destroy_spill_store");
+    }
+    DIE_NEG1(destroy_ejection_spool(spool), "destroy_ejection_spool");
 
     DIE_NEG1(usbuf_free(master_to_workers_buffer), "usbuf_free");
     DIE_NEG1(usbuf_free(logger_buffer), "usbuf_free");
+    DIE_NEG1(destroy_object_pool(client_fd_pool), "destroy_object_pool");
+    DIE_NEG1(destroy_log_message_pool(), "destroy_log_message_pool");
 
     return 0;
 }
\ No newline at end of file
@@ -1,7 +1,10 @@
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
 
 #include "file_storage_internal.h"
 #include "logger.h"
@@ -11,6 +14,10 @@
 #include "unbounded_shared_buffer.h"
 #include "utils.h"
 
+// maximum number of files and bytes sent by read_n before releasing the lock
+#define READ_N_FILES_BATCH_FILES 8
+#define READ_N_FILES_BATCH_SIZE (1024 * 1024)
+
 static void send_error(int client_fd, char err_code)
 {
     struct packet err_packet;
@@ -30,6 +37,114 @@ static void send_comp(int client_fd)
     DIE_NEG_IGN_EPIPE(send_packet(client_fd, &err_packet), "send packet");
 }
 
+/**
+ * Returns true if the request addresses the file by handle instead of by name
+*/
+static bool is_handle_request(char op)
+{
+    switch (op) {
+    case READ_HANDLE:
+    case WRITE_HANDLE:
+    case APPEND_HANDLE:
+    case LOCK_HANDLE:
+    case UNLOCK_HANDLE:
+    case CLOSE_HANDLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Returns true if the request appends data to a file
+*/
+static bool is_append_request(char op)
+{
+    return op == APPEND_TO_FILE || op == APPEND_HANDLE;
+}
+
+/**
+ * Returns true if at least size bytes can be read from fd without blocking
+*/
+static bool is_payload_available(int fd, size_t size)
+{
+    int available;
+    if (ioctl(fd, FIONREAD, &available) == -1) {
+        return false;
+    }
+    return (size_t)available >= size;
+}
+
+/**
+ * Receive the payload of an append directly in the space reserved in the file
+ * Returns false if the client disconnected before sending all the payload
+*/
+static bool receive_payload_in_file(int client_fd, struct iovec reserved[2])
+{
+    for (int i = 0; i < 2; ++i) {
+        if (readn(client_fd, reserved[i].iov_base, reserved[i].iov_len) != (ssize_t)reserved[i].iov_len) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Read and discard size bytes from fd, used for the payloads of the requests
+ * that failed before receiving it
+*/
+static void discard_payload(int fd, size_t size)
+{
+    char buf[4096];
+    while (size > 0) {
+        size_t to_read = size < sizeof(buf) ? size : sizeof(buf);
+        ssize_t read_res = readn(fd, buf, to_read);
+        if (read_res <= 0) {
+            // the client disconnected, it is detected by the next receive
+            return;
+        }
+        size -= read_res;
+    }
+}
+
+/**
+ * Find the file addressed by the request, either by name or by handle.
+ * If the file does not exist, returns NULL and errno is set to ENOENT
+*/
+static vfile_t* get_request_file(file_storage_t* storage, struct packet* request)
+{
+    if (is_handle_request(request->op)) {
+        return get_file_from_handle(storage, request->handle);
+    }
+    return get_file_from_name(storage, request->name_length, request->filename);
+}
+
+/**
+ * Send to the client the metadata of a file, as seen by client_fd
+*/
+static void send_file_info(int client_fd, vfile_t* file)
+{
+    struct packet info_packet;
+    clear_packet(&info_packet);
+
+    info_packet.op = FILE_INFO;
+    info_packet.name_length = strlen(file->filename);
+    info_packet.filename = file->filename;
+    info_packet.data_size = file->size;
+    info_packet.version = file->version;
+    info_packet.cursor = file->id;
+    if (file->locked_by != -1) {
+        info_packet.flags |= INFO_LOCKED;
+    }
+    if (file->locked_by == client_fd) {
+        info_packet.flags |= INFO_LOCKED_BY_YOU;
+    }
+    if (FD_ISSET(client_fd, &file->opened_by)) {
+        info_packet.flags |= INFO_OPENED_BY_YOU;
+    }
+    DIE_NEG_IGN_EPIPE(send_packet(client_fd, &info_packet), "send_packet");
+}
+
 /**
  * Fail all the lock operations blocked on a lock_queue
 */
@@ -43,54 +158,535 @@ static void flush_lock_queue(fd_set* queue, int fd_max, usbuf_t* logger_buffer,
     }
 }
 
+/**
+ * Record in the write-ahead log of the storage, if it is enabled, the
+ * operation op on vfile. The records of WAL_WRITE and WAL_APPEND contain the
+ * content of vfile from offset to its end.
+ * Must be called while holding the storage lock in write mode, so that the
+ * records are in the same order as the mutations
+*/
+static void log_mutation(file_storage_t* storage, char op, const vfile_t* vfile, size_t offset)
+{
+    if (storage->wal == NULL) {
+        return;
+    }
+    struct iovec* data = NULL;
+    size_t iovcnt = 0;
+    if (op == WAL_WRITE || op == WAL_APPEND) {
+        size_t num_segments;
+        const struct iovec* segments = get_file_segments(vfile, &num_segments);
+        // skip the segments before offset
+        size_t first = 0;
+        while (first < num_segments && offset >= segments[first].iov_len) {
+            offset -= segments[first].iov_len;
+            ++first;
+        }
+        iovcnt = num_segments - first;
+        if (iovcnt > 0) {
+            DIE_NULL(data = malloc(iovcnt * sizeof(struct iovec)), "malloc");
+            memcpy(data, segments + first, iovcnt * sizeof(struct iovec));
+            data[0].iov_base = (char*)data[0].iov_base + offset;
+            data[0].iov_len -= offset;
+        }
+    }
+    uint64_t sequence;
+    DIE_NEG1(wal_append(storage->wal, op, vfile->filename, vfile->version, data, iovcnt, &sequence), "wal_append");
+    free(data);
+}
+
+/**
+ * Returns the sequence of the last record of the write-ahead log of the
+ * storage, 0 if the log is disabled
+*/
+static uint64_t last_logged_mutation(file_storage_t* storage)
+{
+    return storage->wal != NULL ? wal_get_last_sequence(storage->wal) : 0;
+}
+
+/**
+ * Wait until the mutations logged by a request are durable, before the client
+ * is answered. logged_before and logged_after are the last records of the log
+ * when the request took and released the storage lock in write mode, so the
+ * log is synced only if the request logged something
+*/
+static void wait_for_logged_mutations(file_storage_t* storage, uint64_t logged_before, uint64_t logged_after)
+{
+    if (logged_after > logged_before) {
+        // a mutation that cannot be made durable is never acknowledged
+        DIE_NEG1(wal_sync(storage->wal, logged_after), "wal_sync");
+    }
+}
+
+/**
+ * Put in the spill directory a copy of the name and of the content of vfile
+*/
+static void spill_copy_of_file(spill_store_t* spill, vfile_t* vfile)
+{
+    file_data_t copy;
+    init_file_data(&copy);
+    if (vfile->size > 0) {
+        void* buf;
+        DIE_NULL(buf = malloc(vfile->size), "malloc");
+        file_data_copy(&vfile->data, buf);
+        DIE_NEG1(file_data_append_buffer(&copy, buf, vfile->size), "file_data_append_buffer");
+    }
+    size_t name_size = strlen(vfile->filename) + 1;
+    char* filename;
+    DIE_NULL(filename = malloc(name_size), "malloc");
+    memcpy(filename, vfile->filename, name_size);
+    DIE_NEG1(spill_store_put(spill, filename, &copy), "spill_store_put");
+}
+
 /**
  * Eject one victim file from the storage.
- * If client_fd is negative, then the file is deleted, otherwise is sent to client_fd
+ * eject_mode tells what happens to the file: with EJECT_SEND_FILES and
+ * EJECT_DEFERRED the file is moved to the spool, to be sent to client_fd
+ * after the storage lock is released or when the client asks for it. With
+ * EJECT_SEND_NAMES only the name is sent, with EJECT_DISCARD nothing (if
+ * client_fd is negative the file is simply deleted). If the storage has a
+ * spill directory, the file is also spilled to it (a file moved to the
+ * spool is copied). The ejection is logged as a removal, since neither the
+ * spool nor the spill directory survive a restart.
+ * The victim is not destroyed but put in the retired list, see retire_vfile,
+ * and the files dropped by the spool are put in the list dropped
 */
-static void eject_one_file(int client_fd, file_storage_t* storage, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker, const char* op)
+void eject_one_file(int client_fd, char eject_mode, file_storage_t* storage, ejection_spool_t* spool, vfile_t** retired,
+    ejected_file_t** dropped, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker, const char* op)
 {
     vfile_t* victim;
     DIE_NULL(victim = choose_victim_file(storage, file_to_exclude), "choose_victim_file");
 
     // increment statistics for number of replacements
     ++storage->statistics.num_replacements;
+    log_mutation(storage, WAL_REMOVE, victim, 0);
 
     // fail any lock operation on the file
     flush_lock_queue(&victim->lock_queue, victim->lock_queue_max, logger_buffer, num_worker, client_fd, op);
 
-    remove_file_from_storage(storage, victim);
+    // the spool or the spill directory take the content, so the victim keeps
+    // all its chunks
+    bool to_spool = client_fd >= 0 && (eject_mode == EJECT_SEND_FILES || eject_mode == EJECT_DEFERRED);
+    bool to_spill = storage->spill != NULL;
+    if (to_spool || to_spill) {
+        DIE_NEG1(take_file_from_storage(storage, victim), "take_file_from_storage");
+    } else {
+        remove_file_from_storage(storage, victim);
+    }
+
+    if (to_spill && to_spool) {
+        // the file goes also to the spool, so the spill directory gets a copy
+        spill_copy_of_file(storage->spill, victim);
+    }
 
-    if (client_fd >= 0) {
-        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO REPLACEMENT {op:send, file:%s, new_size:%zd, num_files:%d}", num_worker, client_fd, op,
+    if (to_spool) {
+        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO REPLACEMENT {op:%s, file:%s, new_size:%zd, num_files:%d}", num_worker, client_fd, op,
+            to_spill ? "spool_spill" : "spool", victim->filename, storage->total_size, storage->num_files);
+
+        // move the name and the content to the spool, they are not copied.
+        // The files that are sent at the end of the request are pinned, so
+        // that they are not dropped before being sent
+        DIE_NEG1(ejection_spool_put(spool, client_fd, eject_mode == EJECT_SEND_FILES, victim->filename, &victim->data,
+                     dropped),
+            "ejection_spool_put");
+        victim->filename = NULL;
+    } else if (client_fd >= 0 && eject_mode == EJECT_SEND_NAMES) {
+        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO REPLACEMENT {op:send_name, file:%s, new_size:%zd, num_files:%d}", num_worker, client_fd, op,
             victim->filename, storage->total_size, storage->num_files);
 
-        // send the file to the client
+        // send only the name of the file, the content is not transferred
+        struct packet name_packet;
+        clear_packet(&name_packet);
+        name_packet.op = FILE_NAME;
+        name_packet.name_length = strlen(victim->filename);
+        name_packet.filename = victim->filename;
+
+        DIE_NEG_IGN_EPIPE(send_packet(client_fd, &name_packet), "send_packet");
+    } else {
+        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO REPLACEMENT {op:%s, file:%s, new_size:%zd, num_files:%d}", num_worker, client_fd, op,
+            to_spill ? "spill" : "delete", victim->filename, storage->total_size, storage->num_files);
+    }
+
+    if (to_spill && !to_spool) {
+        // the name and the content are moved to the spill directory, the
+        // content is written by its writer thread
+        DIE_NEG1(spill_store_put(storage->spill, victim->filename, &victim->data), "spill_store_put");
+        victim->filename = NULL;
+    }
+
+    retire_vfile(retired, victim);
+}
+
+/**
+ * Compress the coldest file of the storage that can be compressed, chosen by
+ * the replacement policy. If file_to_exclude is not NULL it is never chosen.
+ * Must be called while holding the storage lock in write mode
+ * Returns false if no file can be compressed
+*/
+bool compress_one_file(file_storage_t* storage, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker,
+    int client_fd, const char* op)
+{
+    vfile_t* candidate = choose_compression_candidate(storage, file_to_exclude);
+    if (candidate == NULL) {
+        return false;
+    }
+    DIE_NEG1(compress_file(storage, candidate), "compress_file");
+    if (candidate->compressed != NULL) {
+        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO COMPRESSION {file:%s, size:%zu, compressed_size:%zu, new_size:%zd}",
+            num_worker, client_fd, op, candidate->filename, candidate->size, candidate->compressed_size, storage->total_size);
+    }
+    return true;
+}
+
+/**
+ * Eject files (possibly 0) until space_needed bytes are available to use in
+ * the storage, and memory_needed bytes are available in the memory budget of
+ * the storage. If the compression is enabled, the cold files are compressed
+ * before any file is ejected. What happens to the ejected files depends on
+ * eject_mode, see eject_one_file. If file_to_exclude is not NULL it is never
+ * ejected nor compressed.
+ * Must be called while holding the storage lock in write mode
+*/
+void eject_files(int client_fd, char eject_mode, long space_needed, size_t memory_needed, long max_storage_size,
+    file_storage_t* storage, ejection_spool_t* spool, vfile_t** retired, ejected_file_t** dropped, usbuf_t* logger_buffer,
+    vfile_t* file_to_exclude, int num_worker, const char* op)
+{
+    unsigned int num_files_to_keep = file_to_exclude != NULL ? 1 : 0;
+    while (storage->total_size + space_needed > max_storage_size
+        || (is_memory_exceeded(storage, memory_needed) && storage->num_files > num_files_to_keep)) {
+        if (storage->compression
+            && compress_one_file(storage, logger_buffer, file_to_exclude, num_worker, client_fd, op)) {
+            continue;
+        }
+        eject_one_file(client_fd, eject_mode, storage, spool, retired, dropped, logger_buffer, file_to_exclude, num_worker, op);
+    }
+}
+
+/**
+ * Take the file with the given name out of the spill directory of the storage,
+ * and store its content in data. The file is read from the disk, so the
+ * storage lock shall not be held.
+ * Returns false if the file is not in the spill directory
+*/
+static bool take_spilled_file(file_storage_t* storage, const char* filename, file_data_t* data, usbuf_t* logger_buffer,
+    int num_worker, int client_fd)
+{
+    init_file_data(data);
+    if (spill_store_take(storage->spill, filename, data) == -1) {
+        if (errno != ENOENT) {
+            // the file is lost, as if it had been deleted
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [open] ERROR unable to read back the spilled file {file:%s; error:%s}",
+                num_worker, client_fd, filename, strerror(errno));
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Bring back in the storage the file with the given name and content data,
+ * taken from the spill directory of the storage with take_spilled_file,
+ * ejecting other files to make room for it as for a new file. The content is
+ * moved to the file.
+ * Must be called while holding the storage lock in write mode
+*/
+static vfile_t* fault_in_file(const char* filename, size_t name_length, file_data_t* data, long max_num_files,
+    long max_storage_size, file_storage_t* storage, ejection_spool_t* spool, vfile_t** retired, ejected_file_t** dropped,
+    usbuf_t* logger_buffer, int num_worker, int client_fd)
+{
+    if (storage->num_files + 1 > max_num_files) {
+        eject_one_file(-1, EJECT_DISCARD, storage, spool, retired, dropped, logger_buffer, NULL, num_worker, "open");
+    }
+    size_t memory_needed = storage->vfile_pool->object_size + name_length + 1 + ALLOCATION_OVERHEAD
+        + data->size + data->num_segments * ALLOCATION_OVERHEAD;
+    eject_files(-1, EJECT_DISCARD, data->size, memory_needed, max_storage_size, storage, spool, retired, dropped, logger_buffer, NULL,
+        num_worker, "open");
+
+    vfile_t* vfile;
+    DIE_NULL(vfile = create_vfile(storage), "create vfile");
+    // the name is in the arena, so the file gets its own copy
+    DIE_NULL(vfile->filename = arena_promote(filename, name_length + 1), "arena_promote");
+    DIE_NEG1(file_data_move(&vfile->data, data), "file_data_move");
+    vfile->size = vfile->data.size;
+    DIE_NEG1(add_vfile_to_storage(storage, vfile), "add file to storage");
+    log_mutation(storage, WAL_CREATE, vfile, 0);
+    if (vfile->size > 0) {
+        log_mutation(storage, WAL_WRITE, vfile, 0);
+    }
+
+    if (storage->num_files > storage->statistics.maximum_num_files) {
+        storage->statistics.maximum_num_files = storage->num_files;
+    }
+    if (storage->total_size > storage->statistics.maximum_size_reached) {
+        storage->statistics.maximum_size_reached = storage->total_size;
+    }
+    LOG(logger_buffer, "[W:%02d] [C:%02d] [open] INFO file read back from the spill directory {file:%s; size:%zu}",
+        num_worker, client_fd, filename, vfile->size);
+    return vfile;
+}
+
+/**
+ * Returns true if vfile cannot grow by memory_needed bytes within the memory
+ * budget of the storage, not even by ejecting all the other files
+*/
+static bool is_too_big_for_memory(file_storage_t* storage, vfile_t* vfile, size_t memory_needed)
+{
+    size_t file_memory = vfile->memory.data + vfile->memory.metadata + vfile->memory.names;
+    return storage->max_memory > 0 && file_memory + memory_needed > storage->max_memory;
+}
+
+/**
+ * Returns the memory allocated to add the data of packet at the end of vfile:
+ * the buffer of the data becomes a segment of the file if adopt_data is true,
+ * otherwise the data is copied
+*/
+static size_t memory_needed_for_data(vfile_t* vfile, struct packet* packet, bool adopt_data)
+{
+    if (adopt_data) {
+        return packet->data_size + ALLOCATION_OVERHEAD;
+    }
+    size_t capacity = file_data_append_capacity(&vfile->data, packet->data_size);
+    return capacity > 0 ? capacity + ALLOCATION_OVERHEAD : 0;
+}
+
+/**
+ * Set the content of packet to the content of file. A compressed file is
+ * decompressed in buffer, that is allocated here and shall be freed by the
+ * caller after the packet is sent (NULL is returned for the other files): the
+ * file stays compressed, since the readers hold the storage lock in read mode
+*/
+static void* set_packet_content(struct packet* packet, const vfile_t* file, struct iovec* buffer)
+{
+    packet->data_size = file->size;
+    if (file->compressed == NULL) {
+        packet->data_segments = get_file_segments(file, &packet->num_data_segments);
+        return NULL;
+    }
+    DIE_NULL(buffer->iov_base = malloc(file->size), "malloc");
+    buffer->iov_len = file->size;
+    DIE_NEG1(decompress_file_to_buffer(file, buffer->iov_base), "decompress_file_to_buffer");
+    packet->data_segments = buffer;
+    packet->num_data_segments = 1;
+    return buffer->iov_base;
+}
+
+/**
+ * Send to the client all the files that are in the spool for it
+*/
+static void send_spooled_files(int client_fd, ejection_spool_t* spool, usbuf_t* logger_buffer, int num_worker, const char* op)
+{
+    ejected_file_t* files = ejection_spool_take(spool, client_fd);
+    for (ejected_file_t* f = files; f != NULL; f = f->next) {
         struct packet file_packet;
+        clear_packet(&file_packet);
         file_packet.op = FILE_P;
-        file_packet.name_length = strlen(victim->filename);
-        file_packet.filename = victim->filename;
-        file_packet.data_size = victim->size;
-        file_packet.data = victim->data;
+        file_packet.name_length = strlen(f->filename);
+        file_packet.filename = f->filename;
+        file_packet.data_size = f->size;
+        file_packet.data_segments = f->data.segments;
+        file_packet.num_data_segments = f->data.num_segments;
 
         DIE_NEG_IGN_EPIPE(send_packet(client_fd, &file_packet), "send_packet");
-    } else {
-        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO REPLACEMENT {op:delete, file:%s, new_size:%zd, num_files:%d}", num_worker, client_fd, op,
-            victim->filename, storage->total_size, storage->num_files);
+        LOG(logger_buffer, "[W:%02d] [C:%02d] [%s] INFO sent ejected file {filename:%s; size:%zd}",
+            num_worker, client_fd, op, f->filename, f->size);
     }
+    destroy_ejected_files(files);
+}
 
-    DIE_NEG1(destroy_vfile(victim), "destroy_vfile");
+/**
+ * Complete a write or append request, after the storage lock is released.
+ * If the client wants the ejected files, they are sent before the completion
+*/
+static void complete_write_request(int client_fd, char eject_mode, ejection_spool_t* spool,
+    usbuf_t* logger_buffer, int num_worker, const char* op)
+{
+    if (eject_mode == EJECT_SEND_FILES) {
+        send_spooled_files(client_fd, spool, logger_buffer, num_worker, op);
+    }
+    send_comp(client_fd);
+}
+
+static int compare_ids(const void* a, const void* b)
+{
+    uint64_t id_a = *(const uint64_t*)a;
+    uint64_t id_b = *(const uint64_t*)b;
+    return (id_a > id_b) - (id_a < id_b);
 }
 
 /**
- * Send to the client ejected files (possibly 0) until space_needed
- * bytes are available to use in the storage
+ * Choose uniformly at random count files of the storage (reservoir sampling)
+ * The ids of the chosen files are returned sorted in an array allocated from
+ * arena.
+ * Must be called while holding the storage lock.
 */
-static void eject_files(int client_fd, long space_needed, long max_storage_size,
-    file_storage_t* storage, usbuf_t* logger_buffer, vfile_t* file_to_exclude, int num_worker, const char* op)
+static uint64_t* sample_file_ids(file_storage_t* storage, long count, unsigned int* rand_state, arena_t* arena)
 {
-    while (storage->total_size + space_needed > max_storage_size) {
-        eject_one_file(client_fd, storage, logger_buffer, file_to_exclude, num_worker, op);
+    uint64_t* sample;
+    DIE_NULL(sample = arena_alloc(arena, count * sizeof(uint64_t)), "arena_alloc");
+
+    long i = 0;
+    for (vfile_t* curr_file = storage->first; curr_file != NULL; curr_file = curr_file->next, ++i) {
+        if (i < count) {
+            sample[i] = curr_file->id;
+        } else {
+            // the i-th file replaces a sampled one with probability count/(i+1)
+            long j = rand_r(rand_state) % (i + 1);
+            if (j < count) {
+                sample[j] = curr_file->id;
+            }
+        }
     }
+
+    // the list is ordered by id, so the sorted sample can be visited with a
+    // single scan of the list
+    qsort(sample, count, sizeof(uint64_t), compare_ids);
+    return sample;
+}
+
+/**
+ * Send to the client count files chosen at random, or all the files if count <= 0
+ * The storage lock is released and acquired again every batch of files, so that
+ * writers do not have to wait for the entire transfer. The files are visited with
+ * a cursor on the file ids, that stays valid even if files are removed in between.
+ * Each batch resumes from the handle of the file where the previous one stopped,
+ * and the list is scanned from the start only if that file has been removed.
+ * Files that are removed while the transfer is in progress are skipped, files
+ * that are created after the beginning of the transfer are not sent.
+*/
+static void send_n_files(int client_fd, long count, file_storage_t* storage,
+    usbuf_t* logger_buffer, int num_worker, unsigned int* rand_state, arena_t* arena)
+{
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+
+    DIE_NEG1(read_lock(storage_lock), "read_lock");
+    uint64_t last_id = storage->next_id;
+    uint64_t* sample = NULL;
+    if (count > 0 && count < storage->num_files) {
+        sample = sample_file_ids(storage, count, rand_state, arena);
+    }
+    DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+
+    uint64_t cursor = 0;
+    // handle of the first file of the next batch, 0 if the batch starts from
+    // the beginning of the list
+    uint64_t resume_handle = 0;
+    long sample_index = 0;
+    long num_sent = 0;
+    bool done = false;
+    while (!done) {
+        DIE_NEG1(read_lock(storage_lock), "read_lock");
+        unsigned int batch_files = 0;
+        size_t batch_size = 0;
+        vfile_t* curr_file = NULL;
+        if (resume_handle != 0) {
+            curr_file = get_file_from_handle(storage, resume_handle);
+        }
+        if (curr_file == NULL) {
+            curr_file = storage->first;
+        }
+        // skip the files that have already been visited
+        while (curr_file != NULL && curr_file->id <= cursor) {
+            curr_file = curr_file->next;
+        }
+        for (; curr_file != NULL; curr_file = curr_file->next) {
+            if (curr_file->id >= last_id) {
+                // the file has been created after the request
+                curr_file = NULL;
+                break;
+            }
+            if (batch_files >= READ_N_FILES_BATCH_FILES || batch_size >= READ_N_FILES_BATCH_SIZE) {
+                // continue from this file after releasing the lock
+                resume_handle = curr_file->handle;
+                break;
+            }
+            cursor = curr_file->id;
+            if (sample != NULL) {
+                // skip the sampled files that have been removed meanwhile
+                while (sample_index < count && sample[sample_index] < curr_file->id) {
+                    ++sample_index;
+                }
+                if (sample_index == count) {
+                    curr_file = NULL;
+                    break;
+                }
+                if (sample[sample_index] != curr_file->id) {
+                    continue;
+                }
+                ++sample_index;
+            }
+
+            struct packet file_packet;
+            clear_packet(&file_packet);
+            file_packet.op = FILE_P;
+            file_packet.name_length = strlen(curr_file->filename);
+            file_packet.filename = curr_file->filename;
+            struct iovec decompressed;
+            void* decompressed_buf = set_packet_content(&file_packet, curr_file, &decompressed);
+            DIE_NEG_IGN_EPIPE(send_packet(client_fd, &file_packet), "send_packet");
+            free(decompressed_buf);
+
+            // increment the used counter
+            DIE_NEG1(atomic_update_replacement_info(curr_file), "atomic update replacement info");
+
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [read_n] INFO sent file {filename:%s; sent_bytes:%zd}",
+                num_worker, client_fd, curr_file->filename, curr_file->size);
+            ++batch_files;
+            batch_size += curr_file->size;
+            ++num_sent;
+        }
+        // the end of the list has been reached
+        if (curr_file == NULL) {
+            done = true;
+        }
+        DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+    }
+
+    send_comp(client_fd);
+    LOG(logger_buffer, "[W:%02d] [C:%02d] [read_n] SUCCESS {files_sent:%ld}", num_worker, client_fd, num_sent);
+}
+
+static const char* error_name(char err_code)
+{
+    switch (err_code) {
+    case FILE_DOES_NOT_EXIST:
+        return "FILE_DOES_NOT_EXIST";
+    case FILE_IS_NOT_OPENED:
+        return "FILE_IS_NOT_OPENED";
+    case FILE_IS_LOCKED_BY_ANOTHER_CLIENT:
+        return "FILE_IS_LOCKED_BY_ANOTHER_CLIENT";
+    case FILE_IS_NOT_LOCKED:
+        return "FILE_IS_NOT_LOCKED";
+    default:
+        return "UNKNOWN_ERROR";
+    }
+}
+
+/**
+ * Resolve the i-th name of a batch request and check that the client can
+ * operate on it. Returns the file on success, otherwise returns NULL and the
+ * error code is put in err_code.
+ * If lock_required is true, then the file must be locked by the client,
+ * otherwise it must not be locked by another client.
+*/
+static vfile_t* resolve_batch_file(file_storage_t* storage, struct packet* request, int64_t i,
+    int client_fd, bool lock_required, char* err_code)
+{
+    vfile_t* file = get_file_from_name(storage, request->name_lengths[i], request->filenames[i]);
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            perror("get file from name");
+            exit(EXIT_FAILURE);
+        }
+        *err_code = FILE_DOES_NOT_EXIST;
+    } else if (!FD_ISSET(client_fd, &file->opened_by)) {
+        *err_code = FILE_IS_NOT_OPENED;
+    } else if (lock_required && file->locked_by != client_fd) {
+        *err_code = FILE_IS_NOT_LOCKED;
+    } else if (!lock_required && file->locked_by != -1 && file->locked_by != client_fd) {
+        *err_code = FILE_IS_LOCKED_BY_ANOTHER_CLIENT;
+    } else {
+        return file;
+    }
+    return NULL;
 }
 
 static void unlock_file(vfile_t* file_to_unlock, usbuf_t* logger_buffer, int num_worker, int client_fd, const char* op)
@@ -163,12 +759,29 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
     usbuf_t* master_to_workers_buf = worker_args->master_to_workers_buffer;
     usbuf_t* logger_buffer = worker_args->logger_buffer;
     file_storage_t* file_storage = worker_args->file_storage;
+    ejection_spool_t* spool = worker_args->spool;
+    evictor_t* evictor = worker_args->evictor;
     int worker_to_master_pipe = worker_args->worker_to_master_pipe_write_fd;
     long max_num_files = worker_args->max_num_files;
     long max_storage_size = worker_args->max_storage_size;
 
+    // files removed from the storage while serving a request, they are
+    // destroyed after the request is completed, out of the critical section
+    vfile_t* retired = NULL;
+    // files dropped from the spool while serving a request, destroyed with
+    // the retired files
+    ejected_file_t* dropped = NULL;
+
     unsigned int num_served_requests = 0;
 
+    // state of the random generator used to choose the files in read_n
+    unsigned int rand_state = time(NULL) + num_worker;
+
+    // memory that lives until the end of the request: the names and the small
+    // payloads of the received packet, and the temporary arrays
+    arena_t* arena;
+    DIE_NULL(arena = create_arena(WORKER_ARENA_CHUNK_SIZE), "create_arena");
+
     rw_lock_t* storage_lock = get_rw_lock_from_storage(file_storage);
 
     LOG(logger_buffer, "Worker #%d started", num_worker);
@@ -178,24 +791,43 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
         int get_res;
         DIE_NEG1(get_res = usbuf_get(master_to_workers_buf, &client_fd_ptr), "usbuf get");
         if (get_res == -2) {
-            LOG(logger_buffer, "Terminated worker %d requests served: %d", num_worker, num_served_requests);
+            LOG(logger_buffer, "Terminated worker %d requests served: %d arena chunks: %lu",
+                num_worker, num_served_requests, arena->statistics.num_chunks);
+            DIE_NEG1(destroy_arena(arena), "destroy_arena");
             // the buffer is closed, so the worker should terminate
             return;
         }
         int client_fd = *(int*)client_fd_ptr;
-        free(client_fd_ptr);
+        object_pool_free(worker_args->client_fd_pool, client_fd_ptr);
+        connection_state_t* connection = &worker_args->connections[client_fd];
 
         // initialize the first client packet
         struct packet client_packet;
         clear_packet(&client_packet);
+        client_packet.arena = arena;
 
-        // receive the client request
+        // receive the client request. If the request is an append and the
+        // payload is already in the socket, it is received later directly in
+        // the file. Otherwise it is received now, so that the storage lock is
+        // never held while waiting for the client
         int receive_res;
-        receive_res = receive_packet(client_fd, &client_packet);
-        if (receive_res == -1 && errno != ECONNRESET) {
+        receive_res = receive_packet_header(client_fd, &client_packet);
+        if (receive_res > 0
+            && !(is_append_request(client_packet.op) && is_payload_available(client_fd, client_packet.data_size))) {
+            receive_res = receive_packet_payload(client_fd, &client_packet);
+        }
+        // a malformed request leaves the connection in an unknown state, so
+        // the client is told and then disconnected like a client that left
+        bool malformed = receive_res == -1 && errno == EBADMSG;
+        if (malformed) {
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [receive] ERROR INVALID_REQUEST {op:%d}", num_worker, client_fd,
+                client_packet.op);
+            send_error(client_fd, INVALID_REQUEST);
+        } else if (receive_res == -1 && errno != ECONNRESET) {
             perror("receive packet");
             exit(EXIT_FAILURE);
-        } else if (receive_res == 0 || (receive_res == -1 && errno == ECONNRESET)) {
+        }
+        if (receive_res == 0 || receive_res == -1) {
             // the client disconnected
             DIE_NEG1(write_lock(storage_lock), "write_lock");
 
@@ -206,14 +838,24 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             // caused by another client connecting with the same fd.
             client_cleanup(file_storage, client_fd, logger_buffer, num_worker);
 
+            // the next client with the same fd starts with the default options
+            // and the files ejected for this client are not needed anymore
+            connection->eject_mode = EJECT_SEND_FILES;
+            ejected_file_t* abandoned = ejection_spool_take(spool, client_fd);
+
             LOG(logger_buffer, "[W:%02d] [C:%02d] [cleanup] SUCCESS", num_worker, client_fd);
 
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            destroy_ejected_files(abandoned);
 
             // send back -client_fd to the main thread so that we con notify that the client disconnected
             int neg1 = -client_fd;
             DIE_NEG1(writen(worker_to_master_pipe, &neg1, sizeof(int)), "writen");
 
+            // the packet may have been received partially
+            destroy_packet(&client_packet);
+            arena_reset(arena);
+
             // return to listening on the buffer
             continue;
         }
@@ -221,13 +863,64 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
         // increment number of requests served by the worker
         ++num_served_requests;
 
+        // name of the file used in the logs, the requests by handle do not
+        // contain the name of the file
+        char handle_name[32];
+        const char* request_name = client_packet.filename;
+        if (is_handle_request(client_packet.op)) {
+            snprintf(handle_name, sizeof(handle_name), "#%lu", (unsigned long)client_packet.handle);
+            request_name = handle_name;
+        }
+
+        // hashes of the chunks of the data of a write, when the content is
+        // stored in chunks. They are computed before taking the storage lock
+        uint64_t* chunk_hashes = NULL;
+
+        // last records of the write-ahead log when the storage lock is taken
+        // and released by a request that can mutate the storage: the client
+        // is answered after the records logged meanwhile are durable
+        uint64_t logged_before;
+        uint64_t logged_after;
+
         switch (client_packet.op) {
         case OPEN_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
+            logged_before = last_logged_mutation(file_storage);
             LOG(logger_buffer, "[W:%02d] [C:%02d] [open] REQUEST {file:%s; lock:%d; create:%d}",
                 num_worker, client_fd, client_packet.filename, (client_packet.flags & O_LOCK) > 0, (client_packet.flags & O_CREATE) > 0);
             bool completed = false;
+            uint64_t open_handle = 0;
             vfile_t* file_to_open = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            if (file_to_open != NULL) {
+                ++file_storage->statistics.num_ram_hits;
+            } else if (errno == ENOENT) {
+                ++file_storage->statistics.num_ram_misses;
+                // a file ejected to the spill directory still exists, it is
+                // brought back in the storage. It is read without the storage
+                // lock, so the name is looked up again: if the file has been
+                // created meanwhile, the spilled content is older and it is
+                // discarded
+                file_data_t spilled_data;
+                if (file_storage->spill != NULL) {
+                    DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+                    bool taken = take_spilled_file(file_storage, client_packet.filename, &spilled_data, logger_buffer,
+                        num_worker, client_fd);
+                    DIE_NEG1(write_lock(storage_lock), "write_lock");
+                    file_to_open = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+                    if (file_to_open == NULL && errno == ENOENT && taken) {
+                        file_to_open = fault_in_file(client_packet.filename, client_packet.name_length, &spilled_data,
+                            max_num_files, max_storage_size, file_storage, spool, &retired, &dropped, logger_buffer,
+                            num_worker, client_fd);
+                        if (evictor != NULL) {
+                            DIE_NEG1(evictor_notify(evictor), "evictor_notify");
+                        }
+                    }
+                    if (taken) {
+                        destroy_file_data(&spilled_data);
+                    }
+                }
+                errno = ENOENT;
+            }
             if (file_to_open == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -236,17 +929,28 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                     if (client_packet.flags & O_CREATE) {
                         if (file_storage->num_files + 1 > max_num_files) {
                             // delete one file from the storage
-                            eject_one_file(-1, file_storage, logger_buffer, NULL, num_worker, "open");
+                            eject_one_file(-1, EJECT_DISCARD, file_storage, spool, &retired, &dropped, logger_buffer, NULL, num_worker, "open");
                         }
-                        DIE_NULL(file_to_open = create_vfile(), "create vfile");
-                        file_to_open->filename = client_packet.filename;
-                        client_packet.filename = NULL;
+                        // make room for the metadata of the new file
+                        while (is_memory_exceeded(file_storage, file_storage->vfile_pool->object_size + client_packet.name_length + 1 + ALLOCATION_OVERHEAD)
+                            && file_storage->num_files > 0) {
+                            eject_one_file(-1, EJECT_DISCARD, file_storage, spool, &retired, &dropped, logger_buffer, NULL, num_worker, "open");
+                        }
+                        DIE_NULL(file_to_open = create_vfile(file_storage), "create vfile");
+                        // the name is in the arena, so the file gets its own copy
+                        DIE_NULL(file_to_open->filename = arena_promote(client_packet.filename, client_packet.name_length + 1),
+                            "arena_promote");
                         DIE_NEG1(add_vfile_to_storage(file_storage, file_to_open), "add file to storage");
+                        log_mutation(file_storage, WAL_CREATE, file_to_open, 0);
 
                         // increment max of num_files if needed
                         if (file_storage->num_files > file_storage->statistics.maximum_num_files) {
                             file_storage->statistics.maximum_num_files = file_storage->num_files;
                         }
+
+                        if (evictor != NULL) {
+                            DIE_NEG1(evictor_notify(evictor), "evictor_notify");
+                        }
                     } else {
                         LOG(logger_buffer, "[W:%02d] [C:%02d] [open] ERROR FILE_DOES_NOT_EXIST", num_worker, client_fd);
                         send_error(client_fd, FILE_DOES_NOT_EXIST);
@@ -282,15 +986,34 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             }
             if (!completed) {
                 LOG(logger_buffer, "[W:%02d] [C:%02d] [open] SUCCESS", num_worker, client_fd);
-                send_comp(client_fd);
+                open_handle = file_to_open->handle;
             }
 
+            logged_after = last_logged_mutation(file_storage);
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            if (!completed) {
+                // the request is completed after releasing the lock, when the
+                // created file is durable
+                wait_for_logged_mutations(file_storage, logged_before, logged_after);
+                if (client_packet.flags & O_HANDLE) {
+                    // the client asked for a handle to use in the next operations
+                    struct packet handle_packet;
+                    clear_packet(&handle_packet);
+                    handle_packet.op = HANDLE;
+                    handle_packet.handle = open_handle;
+                    DIE_NEG_IGN_EPIPE(send_packet(client_fd, &handle_packet), "send packet");
+                } else {
+                    send_comp(client_fd);
+                }
+            }
             break;
+        case READ_HANDLE:
         case READ_FILE:
+        case READ_FILE_IF_MODIFIED:
             DIE_NEG1(read_lock(storage_lock), "read_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [read] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
-            vfile_t* file_to_read = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [read] REQUEST {file:%s; if_modified:%d}",
+                num_worker, client_fd, request_name, client_packet.op == READ_FILE_IF_MODIFIED);
+            vfile_t* file_to_read = get_request_file(file_storage, &client_packet);
             if (file_to_read == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -310,13 +1033,28 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                         // the file is locked by another client
                         LOG(logger_buffer, "[W:%02d] [C:%02d] [read] ERROR FILE_IS_LOCKED_BY_ANOTHER_CLIENT", num_worker, client_fd);
                         send_error(client_fd, FILE_IS_LOCKED_BY_ANOTHER_CLIENT);
+                    } else if (client_packet.op == READ_FILE_IF_MODIFIED && client_packet.version == file_to_read->version) {
+                        // the client already has this version of the file, so
+                        // do not send the content again
+                        struct packet response;
+                        clear_packet(&response);
+                        response.op = NOT_MODIFIED;
+                        DIE_NEG_IGN_EPIPE(send_packet(client_fd, &response), "send packet");
+
+                        // increment the used counter
+                        DIE_NEG1(atomic_update_replacement_info(file_to_read), "atomic update replacement info");
+
+                        LOG(logger_buffer, "[W:%02d] [C:%02d] [read] SUCCESS {not_modified; version:%lu}",
+                            num_worker, client_fd, (unsigned long)file_to_read->version);
                     } else {
                         struct packet response;
                         clear_packet(&response);
-                        response.op = DATA;
-                        response.data_size = file_to_read->size;
-                        response.data = file_to_read->data;
+                        response.op = client_packet.op == READ_FILE_IF_MODIFIED ? VERSIONED_DATA : DATA;
+                        response.version = file_to_read->version;
+                        struct iovec decompressed;
+                        void* decompressed_buf = set_packet_content(&response, file_to_read, &decompressed);
                         DIE_NEG_IGN_EPIPE(send_packet(client_fd, &response), "send packet");
+                        free(decompressed_buf);
 
                         // increment the used counter
                         DIE_NEG1(atomic_update_replacement_info(file_to_read), "atomic update replacement info");
@@ -328,40 +1066,23 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             DIE_NEG1(read_unlock(storage_lock), "read_unlock");
             break;
         case READ_N_FILES:
-            DIE_NEG1(read_lock(storage_lock), "read_lock");
             LOG(logger_buffer, "[W:%02d] [C:%02d] [read_n] REQUEST {n:%ld}", num_worker, client_fd, client_packet.count);
             // the client only allows the values of cout to be either a positive
-            // integer or -1
-            if (client_packet.count <= 0) {
-                // count <= 0  means read all files
-                client_packet.count = file_storage->num_files;
-            }
-            vfile_t* curr_file = file_storage->first;
-            for (long i = 0; i < client_packet.count && curr_file != NULL; ++i) {
-                struct packet file_packet;
-                clear_packet(&file_packet);
-                file_packet.op = FILE_P;
-                file_packet.name_length = strlen(curr_file->filename);
-                file_packet.filename = curr_file->filename;
-                file_packet.data_size = curr_file->size;
-                file_packet.data = curr_file->data;
-                DIE_NEG_IGN_EPIPE(send_packet(client_fd, &file_packet), "send_packet");
-
-                // increment the used counter
-                DIE_NEG1(atomic_update_replacement_info(curr_file), "atomic update replacement info");
-
-                LOG(logger_buffer, "[W:%02d] [C:%02d] [read_n] INFO sent file {filename:%s; sent_bytes:%zd}",
-                    num_worker, client_fd, curr_file->filename, curr_file->size);
-                curr_file = curr_file->next;
-            }
-            send_comp(client_fd);
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [read_n] SUCCESS", num_worker, client_fd);
-            DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+            // integer or -1, count <= 0  means read all files
+            send_n_files(client_fd, client_packet.count, file_storage, logger_buffer, num_worker, &rand_state, arena);
             break;
+        case WRITE_HANDLE:
         case WRITE_FILE:
+            // the small files are stored inline, so they are never in chunks
+            if (file_storage->blobs != NULL && client_packet.data_size > file_storage->inline_file_size) {
+                DIE_NULL(chunk_hashes = arena_alloc(arena, NUM_FILE_CHUNKS(client_packet.data_size) * sizeof(uint64_t)), "arena_alloc");
+                hash_file_chunks(client_packet.data, client_packet.data_size, chunk_hashes);
+            }
             DIE_NEG1(write_lock(storage_lock), "write_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [write] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
-            vfile_t* file_to_write = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            logged_before = last_logged_mutation(file_storage);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [write] REQUEST {file:%s}", num_worker, client_fd, request_name);
+            bool write_succeeded = false;
+            vfile_t* file_to_write = get_request_file(file_storage, &client_packet);
             if (file_to_write == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -391,23 +1112,55 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                             LOG(logger_buffer, "[W:%02d] [C:%02d] [write] ERROR FILE_IS_NOT_LOCKED", num_worker, client_fd);
                             send_error(client_fd, FILE_IS_NOT_LOCKED);
                         } else {
-                            if (client_packet.data_size > max_storage_size) {
+                            // the received buffer becomes the only segment of
+                            // the file, unless it is in the arena and must be copied.
+                            // A content in chunks needs space only for the new chunks
+                            bool adopt_data = !packet_data_in_arena(&client_packet);
+                            size_t space_needed = client_packet.data_size;
+                            size_t memory_needed;
+                            if (chunk_hashes != NULL) {
+                                estimate_file_chunks(file_storage, client_packet.data, client_packet.data_size, chunk_hashes,
+                                    &space_needed, &memory_needed);
+                            } else {
+                                memory_needed = memory_needed_for_data(file_to_write, &client_packet, adopt_data);
+                            }
+                            if (client_packet.data_size > max_storage_size
+                                || is_too_big_for_memory(file_storage, file_to_write, memory_needed)) {
                                 // the file is locked by another client
                                 LOG(logger_buffer, "[W:%02d] [C:%02d] [write] ERROR FILE_IS_TOO_BIG", num_worker, client_fd);
                                 send_error(client_fd, FILE_IS_TOO_BIG);
                             } else {
-                                // eject files
-                                eject_files(client_fd, client_packet.data_size, max_storage_size, file_storage, logger_buffer, NULL, num_worker, "write");
+                                // the chunks already in the storage are referenced by the
+                                // file, so that they are not freed by the ejections
+                                if (chunk_hashes != NULL) {
+                                    DIE_NEG1(share_file_chunks(file_storage, file_to_write, client_packet.data, client_packet.data_size, chunk_hashes),
+                                        "share_file_chunks");
+                                }
+
+                                // eject files, but never the file that is written
+                                eject_files(client_fd, connection->eject_mode, space_needed, memory_needed, max_storage_size,
+                                    file_storage, spool, &retired, &dropped, logger_buffer, file_to_write, num_worker, "write");
 
                                 // write the data to the file
+                                if (chunk_hashes != NULL) {
+                                    DIE_NEG1(fill_file_chunks(file_storage, file_to_write, client_packet.data, chunk_hashes), "fill_file_chunks");
+                                } else if (adopt_data) {
+                                    DIE_NEG1(file_data_append_buffer(&file_to_write->data, client_packet.data, client_packet.data_size),
+                                        "file_data_append_buffer");
+                                    client_packet.data = NULL;
+                                    file_storage->total_size += client_packet.data_size;
+                                } else {
+                                    DIE_NEG1(file_data_append(&file_to_write->data, client_packet.data, client_packet.data_size),
+                                        "file_data_append");
+                                    file_storage->total_size += client_packet.data_size;
+                                }
                                 file_to_write->size = client_packet.data_size;
-                                file_to_write->data = client_packet.data;
-                                client_packet.data = NULL;
+                                DIE_NEG1(bump_file_version(file_storage, file_to_write), "bump_file_version");
+                                update_file_memory(file_storage, file_to_write);
+                                log_mutation(file_storage, WAL_WRITE, file_to_write, 0);
 
-                                // increment the total storage size
-                                file_storage->total_size += client_packet.data_size;
-
-                                send_comp(client_fd);
+                                // the request is completed after releasing the lock
+                                write_succeeded = true;
 
                                 // increment the used counter
                                 DIE_NEG1(atomic_update_replacement_info(file_to_write), "atomic update replacement info");
@@ -423,12 +1176,24 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                     }
                 }
             }
+            if (write_succeeded && evictor != NULL) {
+                DIE_NEG1(evictor_notify(evictor), "evictor_notify");
+            }
+            logged_after = last_logged_mutation(file_storage);
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            if (write_succeeded) {
+                wait_for_logged_mutations(file_storage, logged_before, logged_after);
+                complete_write_request(client_fd, connection->eject_mode, spool, logger_buffer, num_worker, "write");
+            }
             break;
+        case APPEND_HANDLE:
         case APPEND_TO_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [append] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
-            vfile_t* file_to_append = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            logged_before = last_logged_mutation(file_storage);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [append] REQUEST {file:%s}", num_worker, client_fd, request_name);
+            bool append_succeeded = false;
+            bool payload_pending = client_packet.data == NULL && client_packet.data_size > 0;
+            vfile_t* file_to_append = get_request_file(file_storage, &client_packet);
             if (file_to_append == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -449,25 +1214,63 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                         LOG(logger_buffer, "[W:%02d] [C:%02d] [append] ERROR FILE_IS_LOCKED_BY_ANOTHER_CLIENT", num_worker, client_fd);
                         send_error(client_fd, FILE_IS_LOCKED_BY_ANOTHER_CLIENT);
                     } else {
-                        if (client_packet.data_size + file_to_append->size > max_storage_size) {
+                        // a shared, mapped or compressed content is never modified, so
+                        // the file gets its own plain copy before the data is appended
+                        DIE_NEG1(unshare_file_content(file_storage, file_to_append), "unshare_file_content");
+                        DIE_NEG1(decompress_file(file_storage, file_to_append), "decompress_file");
+
+                        // a payload received in its own buffer becomes a segment
+                        // of the file if it is big, otherwise it is copied
+                        bool adopt_data = !payload_pending && client_packet.data_size >= MIN_SEGMENT_SIZE
+                            && !packet_data_in_arena(&client_packet);
+                        size_t memory_needed = memory_needed_for_data(file_to_append, &client_packet, adopt_data);
+                        if (client_packet.data_size + file_to_append->size > max_storage_size
+                            || is_too_big_for_memory(file_storage, file_to_append, memory_needed)) {
                             // the file is locked by another client
                             LOG(logger_buffer, "[W:%02d] [C:%02d] [append] ERROR FILE_IS_TOO_BIG", num_worker, client_fd);
                             send_error(client_fd, FILE_IS_TOO_BIG);
+                        } else if (payload_pending) {
+                            // receive the payload directly at the end of the file
+                            struct iovec reserved[2];
+                            DIE_NEG1(file_data_reserve(&file_to_append->data, client_packet.data_size, reserved), "file_data_reserve");
+                            payload_pending = false;
+                            if (receive_payload_in_file(client_fd, reserved)) {
+                                // eject files, the reservation is not touched
+                                // because the file is excluded
+                                eject_files(client_fd, connection->eject_mode, client_packet.data_size, memory_needed, max_storage_size,
+                                    file_storage, spool, &retired, &dropped, logger_buffer, file_to_append, num_worker, "append");
+                                file_data_commit(&file_to_append->data, reserved);
+                                append_succeeded = true;
+                            } else {
+                                // the file is left as it was, and the disconnection
+                                // is handled at the next receive
+                                file_data_rollback(&file_to_append->data, reserved);
+                                LOG(logger_buffer, "[W:%02d] [C:%02d] [append] ERROR client disconnected while sending the data", num_worker, client_fd);
+                            }
                         } else {
                             // eject files
-                            eject_files(client_fd, client_packet.data_size, max_storage_size, file_storage, logger_buffer, file_to_append, num_worker, "append");
+                            eject_files(client_fd, connection->eject_mode, client_packet.data_size, memory_needed, max_storage_size,
+                                file_storage, spool, &retired, &dropped, logger_buffer, file_to_append, num_worker, "append");
 
-                            // append the data to the file
-                            size_t offset = file_to_append->size;
+                            if (adopt_data) {
+                                DIE_NEG1(file_data_append_buffer(&file_to_append->data, client_packet.data, client_packet.data_size),
+                                    "file_data_append_buffer");
+                                client_packet.data = NULL;
+                            } else {
+                                DIE_NEG1(file_data_append(&file_to_append->data, client_packet.data, client_packet.data_size),
+                                    "file_data_append");
+                            }
+                            append_succeeded = true;
+                        }
+
+                        if (append_succeeded) {
                             file_to_append->size += client_packet.data_size;
-                            DIE_NULL(file_to_append->data = realloc(file_to_append->data, file_to_append->size), "realloc");
-                            void* location_to_write = (char*)file_to_append->data + offset;
-                            memcpy(location_to_write, client_packet.data, client_packet.data_size);
+                            DIE_NEG1(bump_file_version(file_storage, file_to_append), "bump_file_version");
 
-                            // increment the total storage size
+                            // increment the total storage size and memory
                             file_storage->total_size += client_packet.data_size;
-
-                            send_comp(client_fd);
+                            update_file_memory(file_storage, file_to_append);
+                            log_mutation(file_storage, WAL_APPEND, file_to_append, file_to_append->size - client_packet.data_size);
 
                             // increment the used counter
                             DIE_NEG1(atomic_update_replacement_info(file_to_append), "atomic update replacement info");
@@ -483,12 +1286,25 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                 }
             }
 
+            if (append_succeeded && evictor != NULL) {
+                DIE_NEG1(evictor_notify(evictor), "evictor_notify");
+            }
+            logged_after = last_logged_mutation(file_storage);
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            if (append_succeeded) {
+                // the request is completed after releasing the lock
+                wait_for_logged_mutations(file_storage, logged_before, logged_after);
+                complete_write_request(client_fd, connection->eject_mode, spool, logger_buffer, num_worker, "append");
+            } else if (payload_pending) {
+                // the request failed before receiving the payload
+                discard_payload(client_fd, client_packet.data_size);
+            }
             break;
+        case LOCK_HANDLE:
         case LOCK_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [lock] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
-            vfile_t* file_to_lock = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [lock] REQUEST {file:%s}", num_worker, client_fd, request_name);
+            vfile_t* file_to_lock = get_request_file(file_storage, &client_packet);
             if (file_to_lock == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -531,11 +1347,12 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             }
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
             break;
+        case UNLOCK_HANDLE:
         case UNLOCK_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [unlock] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [unlock] REQUEST {file:%s}", num_worker, client_fd, request_name);
             fflush(stdout);
-            vfile_t* file_to_unlock = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            vfile_t* file_to_unlock = get_request_file(file_storage, &client_packet);
             if (file_to_unlock == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -564,10 +1381,11 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             }
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
             break;
+        case CLOSE_HANDLE:
         case CLOSE_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
-            LOG(logger_buffer, "[W:%02d] [C:%02d] [close] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
-            vfile_t* file_to_close = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [close] REQUEST {file:%s}", num_worker, client_fd, request_name);
+            vfile_t* file_to_close = get_request_file(file_storage, &client_packet);
             if (file_to_close == NULL) {
                 if (errno == ENOENT) {
                     // file does not exists in the storage
@@ -602,7 +1420,9 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
             break;
         case REMOVE_FILE:
             DIE_NEG1(write_lock(storage_lock), "write_lock");
+            logged_before = last_logged_mutation(file_storage);
             LOG(logger_buffer, "[W:%02d] [C:%02d] [remove] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
+            bool remove_succeeded = false;
             vfile_t* file_to_remove = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
             if (file_to_remove == NULL) {
                 if (errno == ENOENT) {
@@ -624,26 +1444,206 @@ static void server_worker(unsigned int num_worker, worker_arg_t* worker_args)
                         LOG(logger_buffer, "[W:%02d] [C:%02d] [remove] ERROR FILE_IS_NOT_OPENED", num_worker, client_fd);
                         send_error(client_fd, FILE_IS_NOT_OPENED);
                     } else {
-                        // remove the file from the storage and then free the associated memoty
-                        // then send completion packet
+                        // remove the file from the storage, the memory is freed
+                        // and the completion is sent after releasing the lock
+                        log_mutation(file_storage, WAL_REMOVE, file_to_remove, 0);
                         DIE_NEG1(remove_file_from_storage(file_storage, file_to_remove), "remove_file_from_storage");
 
                         // fail any pending locks for this file
                         flush_lock_queue(&file_to_remove->lock_queue, file_to_remove->lock_queue_max, logger_buffer, num_worker, client_fd, "remove");
-                        destroy_vfile(file_to_remove);
-                        send_comp(client_fd);
+                        retire_vfile(&retired, file_to_remove);
+                        remove_succeeded = true;
                         LOG(logger_buffer, "[W:%02d] [C:%02d] [remove] SUCCESS", num_worker, client_fd);
                     }
                 }
             }
+            logged_after = last_logged_mutation(file_storage);
             DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            if (remove_succeeded) {
+                wait_for_logged_mutations(file_storage, logged_before, logged_after);
+                send_comp(client_fd);
+            }
+            break;
+        case LIST_FILES:
+            DIE_NEG1(read_lock(storage_lock), "read_lock");
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [list] REQUEST {prefix:%s; cursor:%lu; n:%ld}",
+                num_worker, client_fd, client_packet.filename, (unsigned long)client_packet.cursor, client_packet.count);
+            // only the metadata is sent, so the cost of the operation does
+            // not depend on the size of the files.
+            // The ids are increasing along the list, so every file with an id
+            // greater than the cursor has not been listed yet
+            long num_listed = 0;
+            for (vfile_t* curr_file = file_storage->first;
+                 curr_file != NULL && (client_packet.count <= 0 || num_listed < client_packet.count);
+                 curr_file = curr_file->next) {
+                if (curr_file->id <= client_packet.cursor) {
+                    continue;
+                }
+                if (strncmp(curr_file->filename, client_packet.filename, client_packet.name_length) != 0) {
+                    continue;
+                }
+                send_file_info(client_fd, curr_file);
+                ++num_listed;
+            }
+            send_comp(client_fd);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [list] SUCCESS {entries:%ld}", num_worker, client_fd, num_listed);
+            DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+            break;
+        case STAT_FILE:
+            DIE_NEG1(read_lock(storage_lock), "read_lock");
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [stat] REQUEST {file:%s}", num_worker, client_fd, client_packet.filename);
+            vfile_t* file_to_stat = get_file_from_name(file_storage, client_packet.name_length, client_packet.filename);
+            if (file_to_stat == NULL) {
+                if (errno == ENOENT) {
+                    // file does not exists in the storage
+                    LOG(logger_buffer, "[W:%02d] [C:%02d] [stat] ERROR FILE_DOES_NOT_EXIST", num_worker, client_fd);
+                    send_error(client_fd, FILE_DOES_NOT_EXIST);
+                } else {
+                    perror("get file from name");
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                send_file_info(client_fd, file_to_stat);
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [stat] SUCCESS", num_worker, client_fd);
+            }
+            DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+            break;
+        case READ_FILES:
+            // all the names are resolved in a single critical section, and the
+            // client gets exactly one packet (FILE_P or ERROR) for each name
+            DIE_NEG1(read_lock(storage_lock), "read_lock");
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [read_files] REQUEST {n:%ld}", num_worker, client_fd, client_packet.count);
+            for (int64_t i = 0; i < client_packet.count; ++i) {
+                char err_code;
+                vfile_t* file = resolve_batch_file(file_storage, &client_packet, i, client_fd, false, &err_code);
+                if (file == NULL) {
+                    LOG(logger_buffer, "[W:%02d] [C:%02d] [read_files] INFO {file:%s; error:%s}",
+                        num_worker, client_fd, client_packet.filenames[i], error_name(err_code));
+                    send_error(client_fd, err_code);
+                    continue;
+                }
+                struct packet file_packet;
+                clear_packet(&file_packet);
+                file_packet.op = FILE_P;
+                file_packet.name_length = strlen(file->filename);
+                file_packet.filename = file->filename;
+                struct iovec decompressed;
+                void* decompressed_buf = set_packet_content(&file_packet, file, &decompressed);
+                DIE_NEG_IGN_EPIPE(send_packet(client_fd, &file_packet), "send_packet");
+                free(decompressed_buf);
+
+                // increment the used counter
+                DIE_NEG1(atomic_update_replacement_info(file), "atomic update replacement info");
+
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [read_files] INFO sent file {filename:%s; sent_bytes:%zd}",
+                    num_worker, client_fd, file->filename, file->size);
+            }
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [read_files] SUCCESS", num_worker, client_fd);
+            DIE_NEG1(read_unlock(storage_lock), "read_unlock");
+            break;
+        case REMOVE_FILES:
+            // the client gets exactly one packet (COMP or ERROR) for each name,
+            // sent after releasing the lock: the error codes are collected in
+            // remove_results, -1 for the files removed
+            DIE_NEG1(write_lock(storage_lock), "write_lock");
+            logged_before = last_logged_mutation(file_storage);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [remove_files] REQUEST {n:%ld}", num_worker, client_fd, client_packet.count);
+            int* remove_results;
+            DIE_NULL(remove_results = arena_alloc(arena, (client_packet.count > 0 ? client_packet.count : 1) * sizeof(int)), "arena_alloc");
+            for (int64_t i = 0; i < client_packet.count; ++i) {
+                char err_code;
+                vfile_t* file = resolve_batch_file(file_storage, &client_packet, i, client_fd, true, &err_code);
+                if (file == NULL) {
+                    LOG(logger_buffer, "[W:%02d] [C:%02d] [remove_files] INFO {file:%s; error:%s}",
+                        num_worker, client_fd, client_packet.filenames[i], error_name(err_code));
+                    remove_results[i] = err_code;
+                    continue;
+                }
+                log_mutation(file_storage, WAL_REMOVE, file, 0);
+                DIE_NEG1(remove_file_from_storage(file_storage, file), "remove_file_from_storage");
+
+                // fail any pending locks for this file
+                flush_lock_queue(&file->lock_queue, file->lock_queue_max, logger_buffer, num_worker, client_fd, "remove_files");
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [remove_files] INFO removed file {filename:%s}", num_worker, client_fd, file->filename);
+                retire_vfile(&retired, file);
+                remove_results[i] = -1;
+            }
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [remove_files] SUCCESS", num_worker, client_fd);
+            logged_after = last_logged_mutation(file_storage);
+            DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            wait_for_logged_mutations(file_storage, logged_before, logged_after);
+            for (int64_t i = 0; i < client_packet.count; ++i) {
+                if (remove_results[i] == -1) {
+                    send_comp(client_fd);
+                } else {
+                    send_error(client_fd, remove_results[i]);
+                }
+            }
+            break;
+        case LOCK_FILES:
+            // all-or-nothing: either all the files are locked by the client, or
+            // none of them is. Unlike LOCK_FILE the operation never waits, if
+            // a file is locked by another client then the whole request fails
+            DIE_NEG1(write_lock(storage_lock), "write_lock");
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [lock_files] REQUEST {n:%ld}", num_worker, client_fd, client_packet.count);
+            bool can_lock_all = true;
+            vfile_t** files_to_lock;
+            DIE_NULL(files_to_lock = arena_alloc(arena, client_packet.count * sizeof(vfile_t*)), "arena_alloc");
+            for (int64_t i = 0; i < client_packet.count && can_lock_all; ++i) {
+                char err_code;
+                files_to_lock[i] = resolve_batch_file(file_storage, &client_packet, i, client_fd, false, &err_code);
+                if (files_to_lock[i] == NULL) {
+                    LOG(logger_buffer, "[W:%02d] [C:%02d] [lock_files] ERROR {file:%s; error:%s}",
+                        num_worker, client_fd, client_packet.filenames[i], error_name(err_code));
+                    send_error(client_fd, err_code);
+                    can_lock_all = false;
+                }
+            }
+            if (can_lock_all) {
+                for (int64_t i = 0; i < client_packet.count; ++i) {
+                    files_to_lock[i]->locked_by = client_fd;
+                    DIE_NEG1(atomic_update_replacement_info(files_to_lock[i]), "atomic update replacement info");
+                }
+                send_comp(client_fd);
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [lock_files] SUCCESS", num_worker, client_fd);
+            }
+            DIE_NEG1(write_unlock(storage_lock), "write_unlock");
+            break;
+        case DRAIN_EJECTED:
+            // the files are taken from the spool, so the storage lock is not needed
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [drain] REQUEST", num_worker, client_fd);
+            send_spooled_files(client_fd, spool, logger_buffer, num_worker, "drain");
+            send_comp(client_fd);
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [drain] SUCCESS", num_worker, client_fd);
+            break;
+        case SET_OPTIONS:
+            // the options only affect this connection, so the storage lock
+            // is not needed
+            LOG(logger_buffer, "[W:%02d] [C:%02d] [options] REQUEST {eject_mode:%d}", num_worker, client_fd, client_packet.flags);
+            if (client_packet.flags == EJECT_SEND_FILES || client_packet.flags == EJECT_SEND_NAMES
+                || client_packet.flags == EJECT_DISCARD || client_packet.flags == EJECT_DEFERRED) {
+                connection->eject_mode = client_packet.flags;
+                send_comp(client_fd);
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [options] SUCCESS", num_worker, client_fd);
+            } else {
+                // the client asked for an option that the server does not know
+                LOG(logger_buffer, "[W:%02d] [C:%02d] [options] ERROR INVALID_OPTION", num_worker, client_fd);
+                send_error(client_fd, INVALID_OPTION);
+            }
             break;
         default:
             break;
         }
 
-        // destroy the received packet
+        // the request is completed and no lock is held, so the removed files
+        // can be destroyed now
+        destroy_retired_vfiles(file_storage, &retired);
+        destroy_ejected_files(dropped);
+        dropped = NULL;
+
+        // destroy the received packet, and everything allocated for the request
         destroy_packet(&client_packet);
+        arena_reset(arena);
         // the request terminated, so return to the main thread the fd of the client
         DIE_NEG1(writen(worker_to_master_pipe, &client_fd, sizeof(int)), "writen");
     }
@@ -0,0 +1,394 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "utils.h"
+
+// extension of the temporary file where the snapshot is written
+#define SNAPSHOT_TMP_EXTENSION ".tmp"
+
+// the names are padded so that the entries are aligned to 8 bytes
+#define PADDED_NAME_LENGTH(length) (((length) + 7) & ~(size_t)7)
+
+/**
+ * Write the content of vfile to fd. A compressed file is written decompressed
+ * in buffer, so that its content can be mapped when the snapshot is loaded
+ * Returns -1 on error and errno is set appropriately
+*/
+static int write_file_content(int fd, const vfile_t* vfile, void* buffer)
+{
+    ssize_t written;
+    if (vfile->compressed == NULL) {
+        size_t num_segments;
+        const struct iovec* segments = get_file_segments(vfile, &num_segments);
+        written = writevn(fd, segments, num_segments);
+    } else {
+        if (decompress_file_to_buffer(vfile, buffer) == -1) {
+            return -1;
+        }
+        written = writen(fd, buffer, vfile->size);
+    }
+    if (written == -1) {
+        return -1;
+    }
+    if ((size_t)written != vfile->size) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prepare a snapshot of all the files of the storage, with their metadata:
+ * the header and the index are built, and the memory needed to write the
+ * contents is allocated. wal_sequence is stored in the snapshot as in
+ * save_snapshot. The snapshot shall be freed with free_prepared_snapshot.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int prepare_snapshot(file_storage_t* storage, uint64_t wal_sequence, prepared_snapshot_t* snapshot)
+{
+    if (storage == NULL || snapshot == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct snapshot_header* header = &snapshot->header;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH);
+    header->wal_sequence = wal_sequence;
+    header->version_clock = storage->version_clock;
+    // the compressed files are decompressed one at a time in the same buffer
+    size_t buffer_size = 0;
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        ++header->num_files;
+        header->index_size += sizeof(struct snapshot_entry) + PADDED_NAME_LENGTH(strlen(f->filename));
+        header->data_size += f->size;
+        if (f->compressed != NULL && f->size > buffer_size) {
+            buffer_size = f->size;
+        }
+    }
+
+    // the index is built in memory, the contents are written directly from
+    // the files
+    snapshot->index = calloc(1, header->index_size > 0 ? header->index_size : 1);
+    snapshot->buffer = buffer_size > 0 ? malloc(buffer_size) : NULL;
+    if (snapshot->index == NULL || (buffer_size > 0 && snapshot->buffer == NULL)) {
+        free(snapshot->index);
+        free(snapshot->buffer);
+        errno = ENOMEM;
+        return -1;
+    }
+    char* pos = snapshot->index;
+    uint64_t offset = sizeof(*header) + header->index_size;
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        struct snapshot_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.size = f->size;
+        entry.name_length = strlen(f->filename);
+        entry.offset = offset;
+        entry.version = f->version;
+        pthread_mutex_lock(&f->replacement_mutex);
+        entry.last_used = f->last_used;
+        entry.used_counter = f->used_counter;
+        pthread_mutex_unlock(&f->replacement_mutex);
+        memcpy(pos, &entry, sizeof(entry));
+        memcpy(pos + sizeof(entry), f->filename, entry.name_length);
+        pos += sizeof(entry) + PADDED_NAME_LENGTH(entry.name_length);
+        offset += f->size;
+    }
+    return 0;
+}
+
+/**
+ * Write the snapshot prepared by prepare_snapshot to fd, from its current
+ * offset. The storage shall have the same files it had when the snapshot was
+ * prepared. The function only reads the storage and writes to fd: it does not
+ * allocate memory nor take locks, so it can be called by the child of a fork
+ * of a multithreaded process. The data is not synced to the disk.
+ * Returns -1 on error and errno is set appropriately
+*/
+int write_prepared_snapshot(file_storage_t* storage, int fd, prepared_snapshot_t* snapshot)
+{
+    if (storage == NULL || fd < 0 || snapshot == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct snapshot_header* header = &snapshot->header;
+    errno = 0;
+    if (writen(fd, header, sizeof(*header)) != (ssize_t)sizeof(*header)
+        || writen(fd, snapshot->index, header->index_size) != (ssize_t)header->index_size) {
+        if (errno == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    for (vfile_t* f = storage->first; f != NULL; f = f->next) {
+        if (write_file_content(fd, f, snapshot->buffer) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Free the memory of a snapshot prepared by prepare_snapshot
+*/
+void free_prepared_snapshot(prepared_snapshot_t* snapshot)
+{
+    if (snapshot == NULL) {
+        return;
+    }
+    free(snapshot->index);
+    free(snapshot->buffer);
+    snapshot->index = NULL;
+    snapshot->buffer = NULL;
+}
+
+/**
+ * Write a snapshot of all the files of the storage, with their metadata, to
+ * fd, from its current offset. wal_sequence is stored in the snapshot as in
+ * save_snapshot. The data is not synced to the disk.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int save_snapshot_fd(file_storage_t* storage, int fd, uint64_t wal_sequence)
+{
+    if (storage == NULL || fd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    prepared_snapshot_t snapshot;
+    if (prepare_snapshot(storage, wal_sequence, &snapshot) == -1) {
+        return -1;
+    }
+    int res = write_prepared_snapshot(storage, fd, &snapshot);
+    int saved_errno = errno;
+    free_prepared_snapshot(&snapshot);
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Save all the files of the storage, with their metadata, in a snapshot in
+ * path. The snapshot is written to a temporary file that then replaces path,
+ * so path always contains a complete snapshot, and a storage loaded from the
+ * previous snapshot can keep using its mapping. wal_sequence is the sequence
+ * of the last record of the write-ahead log of the storage (0 if there is no
+ * log), so that the records already in the snapshot are not replayed. When
+ * the function returns the snapshot is durable, rename included, so those
+ * records can be discarded.
+ * Must be called while holding the storage lock, the read mode is enough.
+ * Returns -1 on error and errno is set appropriately
+*/
+int save_snapshot(file_storage_t* storage, const char* path, uint64_t wal_sequence)
+{
+    if (storage == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char tmp_path[strlen(path) + sizeof(SNAPSHOT_TMP_EXTENSION)];
+    sprintf(tmp_path, "%s" SNAPSHOT_TMP_EXTENSION, path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (save_snapshot_fd(storage, fd, wal_sequence) == -1 || fsync(fd) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+    if (close(fd) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return rename_durable(tmp_path, path);
+}
+
+/**
+ * Returns true if the size bytes of snapshot are a well formed snapshot: all
+ * the entries are within its bounds, and the contents follow each other in
+ * the order of the entries, without gaps or overlaps, up to the end
+*/
+static bool is_valid_snapshot(const char* snapshot, size_t size)
+{
+    struct snapshot_header header;
+    memcpy(&header, snapshot, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LENGTH) != 0
+        || header.index_size > size - sizeof(header)
+        || header.data_size != size - sizeof(header) - header.index_size) {
+        return false;
+    }
+
+    const char* pos = snapshot + sizeof(header);
+    const char* index_end = pos + header.index_size;
+    // the content of the next entry starts where the previous one ends
+    uint64_t next_offset = sizeof(header) + header.index_size;
+    for (uint64_t i = 0; i < header.num_files; ++i) {
+        struct snapshot_entry entry;
+        if ((size_t)(index_end - pos) < sizeof(entry)) {
+            return false;
+        }
+        memcpy(&entry, pos, sizeof(entry));
+        pos += sizeof(entry);
+        // the length is checked before it is padded, that would wrap around
+        if (entry.name_length == 0 || entry.name_length > (size_t)(index_end - pos)
+            || PADDED_NAME_LENGTH(entry.name_length) > (size_t)(index_end - pos)
+            || memchr(pos, '\0', entry.name_length) != NULL
+            || entry.offset != next_offset || entry.size > size - entry.offset
+            || entry.version > header.version_clock) {
+            return false;
+        }
+        pos += PADDED_NAME_LENGTH(entry.name_length);
+        next_offset += entry.size;
+    }
+    return pos == index_end && next_offset == size;
+}
+
+/**
+ * Load the files of the snapshot in the file fd into the storage, like
+ * load_snapshot. The whole file is mapped, so fd can be closed afterwards.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files loaded, or -1 on error and errno is set
+ * appropriately (EINVAL if fd is not a valid snapshot)
+*/
+long load_snapshot_fd(file_storage_t* storage, int fd, unsigned int max_num_files, size_t max_storage_size,
+    uint64_t* wal_sequence)
+{
+    if (storage == NULL || fd < 0 || wal_sequence == NULL || storage->first != NULL || storage->snapshot != NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(struct snapshot_header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    char* snapshot = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (snapshot == MAP_FAILED) {
+        return -1;
+    }
+    if (!is_valid_snapshot(snapshot, size)) {
+        munmap(snapshot, size);
+        errno = EINVAL;
+        return -1;
+    }
+    storage->snapshot = snapshot;
+    storage->snapshot_size = size;
+
+    // the files are in the order of the storage, so the oldest ones are
+    // skipped if the snapshot does not fit in the limits
+    struct snapshot_header header;
+    memcpy(&header, snapshot, sizeof(header));
+    *wal_sequence = header.wal_sequence;
+    uint64_t num_to_load = header.num_files;
+    uint64_t size_to_load = header.data_size;
+    const char* pos = snapshot + sizeof(header);
+    uint64_t num_skipped = 0;
+    const char* first_loaded = pos;
+    while (num_to_load > 0 && (num_to_load > max_num_files || size_to_load > max_storage_size)) {
+        struct snapshot_entry entry;
+        memcpy(&entry, first_loaded, sizeof(entry));
+        first_loaded += sizeof(entry) + PADDED_NAME_LENGTH(entry.name_length);
+        --num_to_load;
+        size_to_load -= entry.size;
+        ++num_skipped;
+    }
+
+    pos = first_loaded;
+    for (uint64_t i = num_skipped; i < header.num_files; ++i) {
+        struct snapshot_entry entry;
+        memcpy(&entry, pos, sizeof(entry));
+        pos += sizeof(entry);
+
+        vfile_t* vfile = create_vfile(storage);
+        if (vfile == NULL) {
+            return -1;
+        }
+        vfile->filename = malloc(entry.name_length + 1);
+        if (vfile->filename == NULL) {
+            destroy_vfile(storage, vfile);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(vfile->filename, pos, entry.name_length);
+        vfile->filename[entry.name_length] = '\0';
+        pos += PADDED_NAME_LENGTH(entry.name_length);
+
+        vfile->size = entry.size;
+        if (entry.size > 0) {
+            vfile->mapped.iov_base = snapshot + entry.offset;
+            vfile->mapped.iov_len = entry.size;
+        }
+        vfile->last_used = entry.last_used;
+        vfile->used_counter = entry.used_counter;
+        if (add_vfile_to_storage(storage, vfile) == -1) {
+            destroy_vfile(storage, vfile);
+            return -1;
+        }
+        // the file keeps the version the clients know, not the one given by
+        // add_vfile_to_storage
+        vfile->version = entry.version;
+    }
+    // the versions assigned from now on are newer than all the versions
+    // assigned before the snapshot, also to the files that are not loaded
+    if (header.version_clock > storage->version_clock) {
+        storage->version_clock = header.version_clock;
+    }
+
+    if (storage->num_files > storage->statistics.maximum_num_files) {
+        storage->statistics.maximum_num_files = storage->num_files;
+    }
+    if (storage->total_size > storage->statistics.maximum_size_reached) {
+        storage->statistics.maximum_size_reached = storage->total_size;
+    }
+    return storage->num_files;
+}
+
+/**
+ * Load the files of the snapshot in path into the storage, that shall be
+ * empty. The snapshot is mapped in memory and the files are not read: the
+ * content of each file is read from the disk only when it is accessed, see
+ * the mapped field of vfile_t. The files that would exceed max_num_files or
+ * max_storage_size are not loaded. The files keep their versions, and the
+ * version clock of the storage goes on from the one of the snapshot. The
+ * sequence of the last record of the write-ahead log contained in the
+ * snapshot is stored in wal_sequence.
+ * Must be called before the storage is shared with other threads.
+ * Returns the number of files loaded, or -1 on error and errno is set
+ * appropriately (EINVAL if path is not a valid snapshot). If the error happens
+ * while the files are loaded, the files loaded so far stay in the storage
+*/
+long load_snapshot(file_storage_t* storage, const char* path, unsigned int max_num_files, size_t max_storage_size,
+    uint64_t* wal_sequence)
+{
+    if (storage == NULL || path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    long res = load_snapshot_fd(storage, fd, max_num_files, max_storage_size, wal_sequence);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return res;
+}
@@ -0,0 +1,484 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spill_store.h"
+#include "utils.h"
+
+// extension of the files written in the spill directory
+#define SPILL_EXTENSION ".spill"
+
+/**
+ * Store in path the path of the file of f, path shall have room for
+ * strlen(store->dirname) + 32 characters
+*/
+static void spilled_file_path(spill_store_t* store, spilled_file_t* f, char* path)
+{
+    sprintf(path, "%s/%lu" SPILL_EXTENSION, store->dirname, (unsigned long)f->id);
+}
+
+/**
+ * Unlink f from the list of the store, f is not destroyed
+ * Must be called holding the mutex of the store, f shall not be being written
+*/
+static void detach_spilled_file(spill_store_t* store, spilled_file_t* f)
+{
+    if (f->prev == NULL) {
+        store->first = f->next;
+    } else {
+        f->prev->next = f->next;
+    }
+    if (f->next == NULL) {
+        store->last = f->prev;
+    } else {
+        f->next->prev = f->prev;
+    }
+    store->total_size -= f->size;
+    if (!f->written) {
+        --store->num_pending;
+    }
+}
+
+/**
+ * Remove f from the disk if it has been written, and destroy it
+ * f shall not be in the list of the store
+*/
+static void destroy_spilled_file(spill_store_t* store, spilled_file_t* f)
+{
+    if (f->written) {
+        char path[strlen(store->dirname) + 32];
+        spilled_file_path(store, f, path);
+        unlink(path);
+    }
+    free(f->filename);
+    destroy_file_data(&f->data);
+    free(f);
+}
+
+/**
+ * Remove f from the list of the store, and from the disk if it has been
+ * written, and destroy it
+ * Must be called holding the mutex of the store, f shall not be being written
+*/
+static void remove_spilled_file(spill_store_t* store, spilled_file_t* f)
+{
+    detach_spilled_file(store, f);
+    destroy_spilled_file(store, f);
+}
+
+/**
+ * Drop the oldest files until the store is not full. The file being written
+ * is skipped
+ * Must be called holding the mutex of the store
+*/
+static void drop_oldest_files(spill_store_t* store)
+{
+    spilled_file_t* curr = store->first;
+    while (store->total_size > store->max_size && curr != NULL) {
+        spilled_file_t* next = curr->next;
+        if (curr != store->writing) {
+            remove_spilled_file(store, curr);
+            ++store->statistics.num_dropped;
+        }
+        curr = next;
+    }
+}
+
+/**
+ * Write the content of f in its file of the spill directory
+ * Returns -1 on error and errno is set appropriately
+*/
+static int write_spilled_file(spill_store_t* store, spilled_file_t* f)
+{
+    char path[strlen(store->dirname) + 32];
+    spilled_file_path(store, f, path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (writevn(fd, f->data.segments, f->data.num_segments) != (ssize_t)f->size) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(path);
+        errno = saved_errno != 0 ? saved_errno : EIO;
+        return -1;
+    }
+    return close(fd);
+}
+
+/**
+ * Writer thread: the pending files are written to the disk from the oldest to
+ * the newest. The mutex of the store is not held while a file is written, the
+ * file is protected by store->writing instead
+*/
+static void* spill_writer_entry_point(void* arg)
+{
+    spill_store_t* store = arg;
+
+    DIE_NEG1(pthread_mutex_lock(&store->mutex), "pthread_mutex_lock");
+    for (;;) {
+        while (store->num_pending == 0 && !store->terminate) {
+            DIE_NEG1(pthread_cond_wait(&store->pending_cond, &store->mutex), "pthread_cond_wait");
+        }
+        if (store->terminate) {
+            break;
+        }
+        spilled_file_t* f = store->first;
+        while (f->written) {
+            f = f->next;
+        }
+        store->writing = f;
+        DIE_NEG1(pthread_mutex_unlock(&store->mutex), "pthread_mutex_unlock");
+
+        int res = write_spilled_file(store, f);
+
+        DIE_NEG1(pthread_mutex_lock(&store->mutex), "pthread_mutex_lock");
+        store->writing = NULL;
+        if (res == 0) {
+            // the content is on the disk, so its memory is freed
+            f->written = true;
+            --store->num_pending;
+            destroy_file_data(&f->data);
+        } else {
+            // the file cannot be taken back from the disk
+            ++store->statistics.num_write_errors;
+            remove_spilled_file(store, f);
+        }
+        // the files put while the writer was busy may have to be dropped
+        drop_oldest_files(store);
+        pthread_cond_broadcast(&store->written_cond);
+    }
+    DIE_NEG1(pthread_mutex_unlock(&store->mutex), "pthread_mutex_unlock");
+    return NULL;
+}
+
+/**
+ * Remove from dirname the files left by a previous spill store
+*/
+static void remove_stale_files(const char* dirname)
+{
+    DIR* dir = opendir(dirname);
+    if (dir == NULL) {
+        return;
+    }
+    size_t extension_len = strlen(SPILL_EXTENSION);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len > extension_len && strcmp(entry->d_name + len - extension_len, SPILL_EXTENSION) == 0) {
+            char path[strlen(dirname) + len + 2];
+            sprintf(path, "%s/%s", dirname, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Create an empty spill store in the directory dirname, that is created if it
+ * does not exist, and start its writer thread. The files left in the directory
+ * by a previous spill store are removed. The store holds at most max_size bytes
+ * of files.
+ * The store shall be destroyed with destroy_spill_store
+ * Returns NULL on error and errno is set appropriately
+*/
+spill_store_t* create_spill_store(const char* dirname, size_t max_size)
+{
+    if (dirname == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (mkdir(dirname, 0700) == -1 && errno != EEXIST) {
+        return NULL;
+    }
+    remove_stale_files(dirname);
+
+    spill_store_t* store = malloc(sizeof(spill_store_t));
+    if (store == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    store->dirname = malloc(strlen(dirname) + 1);
+    if (store->dirname == NULL) {
+        free(store);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(store->dirname, dirname);
+    store->terminate = false;
+    store->first = NULL;
+    store->last = NULL;
+    store->writing = NULL;
+    store->num_pending = 0;
+    store->next_id = 1;
+    store->total_size = 0;
+    store->max_size = max_size;
+    store->statistics.num_spilled = 0;
+    store->statistics.num_dropped = 0;
+    store->statistics.num_hits = 0;
+    store->statistics.num_misses = 0;
+    store->statistics.num_write_errors = 0;
+    store->statistics.maximum_size_reached = 0;
+
+    int res = pthread_mutex_init(&store->mutex, NULL);
+    if (res != 0) {
+        free(store->dirname);
+        free(store);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_cond_init(&store->pending_cond, NULL);
+    if (res != 0) {
+        pthread_mutex_destroy(&store->mutex);
+        free(store->dirname);
+        free(store);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_cond_init(&store->written_cond, NULL);
+    if (res != 0) {
+        pthread_cond_destroy(&store->pending_cond);
+        pthread_mutex_destroy(&store->mutex);
+        free(store->dirname);
+        free(store);
+        errno = res;
+        return NULL;
+    }
+    res = pthread_create(&store->tid, NULL, spill_writer_entry_point, store);
+    if (res != 0) {
+        pthread_cond_destroy(&store->written_cond);
+        pthread_cond_destroy(&store->pending_cond);
+        pthread_mutex_destroy(&store->mutex);
+        free(store->dirname);
+        free(store);
+        errno = res;
+        return NULL;
+    }
+    return store;
+}
+
+/**
+ * Stop the writer thread, and destroy the store and all the files contained in
+ * it, removing them from the disk
+ * Returns -1 on error and errno is set appropriately
+*/
+int destroy_spill_store(spill_store_t* store)
+{
+    if (store == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = pthread_mutex_lock(&store->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    store->terminate = true;
+    pthread_cond_signal(&store->pending_cond);
+    pthread_mutex_unlock(&store->mutex);
+
+    res = pthread_join(store->tid, NULL);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    while (store->first != NULL) {
+        remove_spilled_file(store, store->first);
+    }
+    pthread_cond_destroy(&store->written_cond);
+    pthread_cond_destroy(&store->pending_cond);
+    pthread_mutex_destroy(&store->mutex);
+    free(store->dirname);
+    free(store);
+    return 0;
+}
+
+/**
+ * Put a file in the store, it is written to the disk later by the writer
+ * thread. The store takes the ownership of filename, that shall be allocated
+ * on the heap, and the content of data is moved to the store (data is left
+ * empty). If the store is full the oldest files are dropped (possibly the file
+ * itself, if it is bigger than the store).
+ * Returns -1 on error and errno is set appropriately
+*/
+int spill_store_put(spill_store_t* store, char* filename, file_data_t* data)
+{
+    if (store == NULL || filename == NULL || data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    spilled_file_t* f = malloc(sizeof(spilled_file_t));
+    if (f == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    f->filename = filename;
+    f->size = data->size;
+    f->written = false;
+    f->next = NULL;
+    // the content can be in the inline buffer of the file, that is destroyed
+    // with the file, so it is moved and not simply copied
+    init_file_data(&f->data);
+    if (file_data_move(&f->data, data) == -1) {
+        free(f);
+        return -1;
+    }
+
+    int res = pthread_mutex_lock(&store->mutex);
+    if (res != 0) {
+        // give back the content, so that data is not modified on error
+        file_data_move(data, &f->data);
+        free(f);
+        errno = res;
+        return -1;
+    }
+    f->id = store->next_id++;
+    f->prev = store->last;
+    if (store->first == NULL) {
+        store->first = f;
+    } else {
+        store->last->next = f;
+    }
+    store->last = f;
+    store->total_size += f->size;
+    ++store->num_pending;
+    ++store->statistics.num_spilled;
+    if (store->total_size > store->statistics.maximum_size_reached) {
+        store->statistics.maximum_size_reached = store->total_size;
+    }
+
+    drop_oldest_files(store);
+    pthread_cond_signal(&store->pending_cond);
+
+    res = pthread_mutex_unlock(&store->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the content of f from its file of the spill directory, and append it
+ * to data
+ * Returns -1 on error and errno is set appropriately
+*/
+static int read_spilled_file(spill_store_t* store, spilled_file_t* f, file_data_t* data)
+{
+    char path[strlen(store->dirname) + 32];
+    spilled_file_path(store, f, path);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    void* buf = malloc(f->size > 0 ? f->size : 1);
+    if (buf == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (readn(fd, buf, f->size) != (ssize_t)f->size) {
+        int saved_errno = errno;
+        free(buf);
+        close(fd);
+        errno = saved_errno != 0 ? saved_errno : EIO;
+        return -1;
+    }
+    close(fd);
+    if (f->size > 0 && file_data_append_buffer(data, buf, f->size) == -1) {
+        free(buf);
+        return -1;
+    }
+    if (f->size == 0) {
+        free(buf);
+    }
+    return 0;
+}
+
+/**
+ * Take the file with the given name out of the store: its content is appended
+ * to data, that shall be empty, and it is removed from the disk. The file is
+ * read from the disk without holding the mutex of the store. If the file is
+ * being written, the function waits for the write to complete.
+ * Returns -1 on error and errno is set appropriately (ENOENT if the file is
+ * not in the store). If the file cannot be read it is removed from the store
+*/
+int spill_store_take(spill_store_t* store, const char* filename, file_data_t* data)
+{
+    if (store == NULL || filename == NULL || data == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = pthread_mutex_lock(&store->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+
+    spilled_file_t* f;
+    for (;;) {
+        f = store->first;
+        while (f != NULL && strcmp(f->filename, filename) != 0) {
+            f = f->next;
+        }
+        if (f == NULL || f != store->writing) {
+            break;
+        }
+        // the file is being written, and it may be dropped if the write fails,
+        // so it is looked up again
+        pthread_cond_wait(&store->written_cond, &store->mutex);
+    }
+    if (f == NULL) {
+        ++store->statistics.num_misses;
+        pthread_mutex_unlock(&store->mutex);
+        errno = ENOENT;
+        return -1;
+    }
+
+    // once out of the list the file belongs to the caller, so the store is
+    // not blocked while it is read
+    detach_spilled_file(store, f);
+    ++store->statistics.num_hits;
+    pthread_mutex_unlock(&store->mutex);
+
+    // a file not written yet is still in memory
+    if (f->written) {
+        res = read_spilled_file(store, f, data);
+    } else {
+        res = file_data_move(data, &f->data);
+    }
+    int saved_errno = errno;
+    destroy_spilled_file(store, f);
+    if (res == -1) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy the statistics of the store in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int spill_store_get_statistics(spill_store_t* store, struct spill_store_statistics* stats)
+{
+    if (store == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int res = pthread_mutex_lock(&store->mutex);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    *stats = store->statistics;
+    pthread_mutex_unlock(&store->mutex);
+    return 0;
+}
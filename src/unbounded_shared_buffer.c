@@ -2,6 +2,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 
+#include "object_pool.h"
 #include "unbounded_shared_buffer.h"
 
 struct node {
@@ -16,6 +17,9 @@ struct usbuf_s {
     pthread_mutex_t mutex;
     pthread_cond_t not_anymore_empty;
     int closed;
+    // the nodes are allocated from a pool, that avoids calling malloc (and
+    // contending its locks) for every element
+    object_pool_t* node_pool;
 };
 
 /**
@@ -47,8 +51,14 @@ usbuf_t* usbuf_create(buf_policy policy)
     buf->start = NULL;
     buf->end = NULL;
     buf->closed = 0;
+    buf->node_pool = create_object_pool(sizeof(struct node));
+    if (buf->node_pool == NULL) {
+        free(buf);
+        return NULL;
+    }
     int init_res = pthread_mutex_init(&buf->mutex, NULL);
     if (init_res != 0) {
+        destroy_object_pool(buf->node_pool);
         free(buf);
         return NULL;
     }
@@ -56,6 +66,7 @@ usbuf_t* usbuf_create(buf_policy policy)
     init_res = pthread_cond_init(&buf->not_anymore_empty, NULL);
     if (init_res != 0) {
         pthread_mutex_destroy(&buf->mutex);
+        destroy_object_pool(buf->node_pool);
         free(buf);
         return NULL;
     }
@@ -75,23 +86,26 @@ usbuf_t* usbuf_create(buf_policy policy)
 */
 int usbuf_put(usbuf_t* buf, void* item)
 {
+    // create the new node, before acquiring the mutex
+    struct node* new_node = object_pool_alloc(buf->node_pool);
+    if (new_node == NULL) {
+        return -1;
+    }
+
     int lock_res = pthread_mutex_lock(&buf->mutex);
     if (lock_res != 0) {
+        object_pool_free(buf->node_pool, new_node);
         return -1;
     }
 
     if (buf->closed) {
+        object_pool_free(buf->node_pool, new_node);
         int unlock_res = pthread_mutex_unlock(&buf->mutex);
         if (unlock_res != 0) {
             return -1;
         }
         return -2;
     }
-    // create the new node
-    struct node* new_node = malloc(sizeof(struct node));
-    if (new_node == NULL) {
-        return -1;
-    }
 
     // put the data in the newly created node
     new_node->data = item;
@@ -181,12 +195,12 @@ int usbuf_get(usbuf_t* buf, void** res)
     if (buf->start == NULL) {
         buf->end = NULL;
     }
-    free(to_be_removed_node);
 
     int unlock_res = pthread_mutex_unlock(&buf->mutex);
     if (unlock_res != 0) {
         return -1;
     }
+    object_pool_free(buf->node_pool, to_be_removed_node);
     return 0;
 }
 
@@ -222,6 +236,15 @@ int usbuf_close(usbuf_t* buf)
     return 0;
 }
 
+/**
+ * Copy the statistics of the pool of the nodes of buf in stats
+ * Returns -1 on error
+*/
+int usbuf_get_pool_statistics(usbuf_t* buf, struct object_pool_statistics* stats)
+{
+    return object_pool_get_statistics(buf->node_pool, stats);
+}
+
 /**
  * free the shared buffer buf
  * if the buffer is non-empty, then the function returns -1 and the memory is not freed,
@@ -237,6 +260,7 @@ int usbuf_free(usbuf_t* buf)
     }
     pthread_cond_destroy(&buf->not_anymore_empty);
     pthread_mutex_destroy(&buf->mutex);
+    destroy_object_pool(buf->node_pool);
     free(buf);
     return 0;
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -61,6 +63,59 @@ ssize_t writen(int fd, void* ptr, size_t n)
     return (n - nleft);
 }
 
+/**
+ * Write all the buffers described by the iovcnt iovecs in iov to the file
+ * descriptor fd, with as few writev calls as possible.
+ * this function returns the number of bytes written, with the same guarantees
+ * of writen. iov is not modified
+*/
+ssize_t writevn(int fd, const struct iovec* iov, size_t iovcnt)
+{
+    // the iovecs are written in batches, copied here because a partial write
+    // requires to adjust the first iovec that is not completely written
+    struct iovec batch[WRITEVN_BATCH];
+    size_t batch_len = 0;
+    size_t next = 0;
+    size_t total = 0;
+
+    for (;;) {
+        // refill the batch, skipping the empty buffers
+        while (batch_len < WRITEVN_BATCH && next < iovcnt) {
+            if (iov[next].iov_len > 0) {
+                batch[batch_len++] = iov[next];
+            }
+            ++next;
+        }
+        if (batch_len == 0) {
+            break;
+        }
+
+        ssize_t nwritten = writev(fd, batch, batch_len);
+        if (nwritten < 0) {
+            if (total == 0)
+                return -1;
+            else
+                break;
+        } else if (nwritten == 0)
+            break;
+        total += nwritten;
+
+        // discard the iovecs completely written and adjust the partial one
+        size_t done = 0;
+        while (done < batch_len && (size_t)nwritten >= batch[done].iov_len) {
+            nwritten -= batch[done].iov_len;
+            ++done;
+        }
+        if (done < batch_len) {
+            batch[done].iov_base = (char*)batch[done].iov_base + nwritten;
+            batch[done].iov_len -= nwritten;
+        }
+        memmove(batch, batch + done, (batch_len - done) * sizeof(struct iovec));
+        batch_len -= done;
+    }
+    return total;
+}
+
 /**
  * Convert a string to a long
  * Return 0 on success and the resulting long is stored in n
@@ -84,6 +139,55 @@ int string_to_long(const char* s, long* n)
     return -1; // non e' un numero
 }
 
+/**
+ * Rename old_path to new_path, then sync the directory that contains
+ * new_path, so that the rename is durable: until the directory is synced, a
+ * crash of the machine can bring back the file that new_path replaced
+ * Returns -1 on error and errno is set appropriately
+*/
+int rename_durable(const char* old_path, const char* new_path)
+{
+    if (old_path == NULL || new_path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (rename(old_path, new_path) == -1) {
+        return -1;
+    }
+    const char* last_slash = strrchr(new_path, '/');
+    char* dirname;
+    if (last_slash == NULL) {
+        dirname = malloc(2);
+        if (dirname != NULL) {
+            strcpy(dirname, ".");
+        }
+    } else {
+        // the root keeps its slash
+        size_t length = last_slash == new_path ? 1 : (size_t)(last_slash - new_path);
+        dirname = malloc(length + 1);
+        if (dirname != NULL) {
+            memcpy(dirname, new_path, length);
+            dirname[length] = '\0';
+        }
+    }
+    if (dirname == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int dir_fd = open(dirname, O_RDONLY | O_DIRECTORY);
+    free(dirname);
+    if (dir_fd == -1) {
+        return -1;
+    }
+    if (fsync(dir_fd) == -1) {
+        int saved_errno = errno;
+        close(dir_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return close(dir_fd);
+}
+
 // recursively create directories to form a pathname
 // return 0 on success, -1 on failed creation
 // dir is modified but if the function returns 0 then
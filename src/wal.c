@@ -0,0 +1,568 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "blob_store.h"
+#include "utils.h"
+#include "wal.h"
+
+// extension of the temporary file where the records kept by wal_discard are
+// moved
+#define WAL_TMP_EXTENSION ".tmp"
+
+/**
+ * Returns the checksum of the record described by the iovcnt iovecs in
+ * record: the header, whose checksum field shall be 0, the name and the data
+*/
+static uint64_t record_checksum(const struct iovec* record, size_t iovcnt)
+{
+    return hash_content(record, iovcnt);
+}
+
+/**
+ * Read size bytes of a record from fd
+ * Returns 1 if they are read, 0 if the log ends before them, -1 on error and
+ * errno is set appropriately
+*/
+static int read_record_part(int fd, void* buf, size_t size)
+{
+    ssize_t r = readn(fd, buf, size);
+    if (r == -1) {
+        return -1;
+    }
+    return (size_t)r == size;
+}
+
+/**
+ * Read the log in path and call apply for every record with a sequence greater
+ * than after_sequence, in order. The sequence of the last record is stored in
+ * last_sequence (after_sequence if there are none). A truncated or corrupted
+ * record ends the log, so the log is truncated before it.
+ * Returns the number of records applied, or -1 on error and errno is set
+ * appropriately (ENOENT if there is no log)
+*/
+long wal_replay(const char* path, uint64_t after_sequence, wal_apply_t apply, void* arg, uint64_t* last_sequence)
+{
+    if (path == NULL || apply == NULL || last_sequence == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    *last_sequence = after_sequence;
+    long num_applied = 0;
+    // the sequences are increasing along the log
+    uint64_t previous_sequence = 0;
+    int read_res = 0;
+    // end of the last valid record
+    size_t valid_end = 0;
+    // the name, terminated by '\0', followed by the data
+    char* buf = NULL;
+    size_t buf_capacity = 0;
+    for (;;) {
+        struct wal_record_header header;
+        if ((read_res = read_record_part(fd, &header, sizeof(header))) != 1 || header.name_length == 0) {
+            break;
+        }
+        size_t remaining = st.st_size - valid_end - sizeof(header);
+        if (header.name_length > remaining || header.data_size > remaining - header.name_length) {
+            break;
+        }
+        size_t needed = header.name_length + 1 + header.data_size;
+        if (needed > buf_capacity) {
+            char* new_buf = realloc(buf, needed);
+            if (new_buf == NULL) {
+                free(buf);
+                close(fd);
+                errno = ENOMEM;
+                return -1;
+            }
+            buf = new_buf;
+            buf_capacity = needed;
+        }
+        char* data = buf + header.name_length + 1;
+        if ((read_res = read_record_part(fd, buf, header.name_length)) != 1
+            || (read_res = read_record_part(fd, data, header.data_size)) != 1) {
+            break;
+        }
+        uint64_t checksum = header.checksum;
+        header.checksum = 0;
+        struct iovec record[3] = {
+            { &header, sizeof(header) },
+            { buf, header.name_length },
+            { data, header.data_size }
+        };
+        if (record_checksum(record, 3) != checksum || header.sequence <= previous_sequence) {
+            break;
+        }
+        previous_sequence = header.sequence;
+        buf[header.name_length] = '\0';
+
+        // the records already in the snapshot are skipped
+        if (header.sequence > after_sequence) {
+            if (apply(arg, header.op, buf, header.version, header.data_size > 0 ? data : NULL, header.data_size) == -1) {
+                free(buf);
+                close(fd);
+                return -1;
+            }
+            ++num_applied;
+        }
+        if (header.sequence > *last_sequence) {
+            *last_sequence = header.sequence;
+        }
+        valid_end += sizeof(header) + header.name_length + header.data_size;
+    }
+    free(buf);
+    if (read_res == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // the records after the last valid one are lost, and they would hide the
+    // records appended from now on
+    if (valid_end < (size_t)st.st_size && ftruncate(fd, valid_end) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (close(fd) == -1) {
+        return -1;
+    }
+    return num_applied;
+}
+
+/**
+ * Sync all the records written so far. The mutex is released during the sync,
+ * so that the writers can append other records meanwhile.
+ * Must be called holding the mutex of the log, when no one is syncing it
+ * Returns -1 on error and errno is set appropriately
+*/
+static int sync_log(wal_t* wal)
+{
+    uint64_t target = wal->last_sequence;
+    wal->syncing = true;
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    int res = fdatasync(wal->fd);
+    int saved_errno = errno;
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    wal->syncing = false;
+    if (res == -1) {
+        wal->sync_error = saved_errno;
+    } else {
+        if (target > wal->durable_sequence) {
+            wal->durable_sequence = target;
+        }
+        ++wal->statistics.num_syncs;
+    }
+    pthread_cond_broadcast(&wal->synced_cond);
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Flusher thread: when a record is written, the flusher waits for the batch
+ * interval and then syncs all the records written meanwhile
+*/
+static void* wal_flusher_entry_point(void* arg)
+{
+    wal_t* wal = arg;
+
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    while (!wal->terminate) {
+        while (!wal->terminate && wal->last_sequence == wal->durable_sequence) {
+            DIE_NEG1(pthread_cond_wait(&wal->flusher_cond, &wal->mutex), "pthread_cond_wait");
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += wal->batch_interval / 1000;
+        deadline.tv_nsec += (wal->batch_interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int res = 0;
+        while (!wal->terminate && res != ETIMEDOUT) {
+            res = pthread_cond_timedwait(&wal->flusher_cond, &wal->mutex, &deadline);
+        }
+        if (!wal->terminate && wal->last_sequence > wal->durable_sequence && !wal->syncing) {
+            // the error is reported to the writers waiting for the sync
+            sync_log(wal);
+        }
+    }
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    return NULL;
+}
+
+/**
+ * Open the log in path, that is created if it does not exist, to append the
+ * records after the ones already in it. The first record gets the sequence
+ * first_sequence. With WAL_DURABILITY_BATCH the flusher thread syncs the log
+ * batch_interval milliseconds after a record is written.
+ * The log shall be closed with wal_close
+ * Returns NULL on error and errno is set appropriately
+*/
+wal_t* wal_open(const char* path, enum wal_durability durability, long batch_interval, uint64_t first_sequence)
+{
+    if (path == NULL || first_sequence == 0 || (durability == WAL_DURABILITY_BATCH && batch_interval <= 0)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    wal_t* wal = malloc(sizeof(wal_t));
+    if (wal == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    wal->path = malloc(strlen(path) + 1);
+    if (wal->path == NULL) {
+        free(wal);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(wal->path, path);
+    wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (wal->fd == -1) {
+        free(wal->path);
+        free(wal);
+        return NULL;
+    }
+    wal->terminate = false;
+    wal->durability = durability;
+    wal->batch_interval = batch_interval;
+    wal->last_sequence = first_sequence - 1;
+    wal->durable_sequence = first_sequence - 1;
+    wal->syncing = false;
+    wal->sync_error = 0;
+    wal->statistics.num_records = 0;
+    wal->statistics.num_syncs = 0;
+    wal->statistics.bytes_written = 0;
+
+    int res;
+    if ((res = pthread_mutex_init(&wal->mutex, NULL)) != 0) {
+        goto cleanup_fd;
+    }
+    if ((res = pthread_cond_init(&wal->synced_cond, NULL)) != 0) {
+        goto cleanup_mutex;
+    }
+    if ((res = pthread_cond_init(&wal->flusher_cond, NULL)) != 0) {
+        goto cleanup_synced_cond;
+    }
+    if (durability == WAL_DURABILITY_BATCH && (res = pthread_create(&wal->tid, NULL, wal_flusher_entry_point, wal)) != 0) {
+        goto cleanup_flusher_cond;
+    }
+    return wal;
+
+cleanup_flusher_cond:
+    pthread_cond_destroy(&wal->flusher_cond);
+cleanup_synced_cond:
+    pthread_cond_destroy(&wal->synced_cond);
+cleanup_mutex:
+    pthread_mutex_destroy(&wal->mutex);
+cleanup_fd:
+    close(wal->fd);
+    free(wal->path);
+    free(wal);
+    errno = res;
+    return NULL;
+}
+
+/**
+ * Sync the log, stop the flusher thread and close the log
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_close(wal_t* wal)
+{
+    if (wal == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (wal->durability == WAL_DURABILITY_BATCH) {
+        DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+        wal->terminate = true;
+        pthread_cond_signal(&wal->flusher_cond);
+        DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+        int res = pthread_join(wal->tid, NULL);
+        if (res != 0) {
+            errno = res;
+            return -1;
+        }
+    }
+    int res = fdatasync(wal->fd);
+    int saved_errno = errno;
+    close(wal->fd);
+    pthread_cond_destroy(&wal->flusher_cond);
+    pthread_cond_destroy(&wal->synced_cond);
+    pthread_mutex_destroy(&wal->mutex);
+    free(wal->path);
+    free(wal);
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Append a record of operation op on filename, that has the given version
+ * after the operation, with the data described by the iovcnt iovecs in data.
+ * The sequence of the record is stored in sequence, to wait for it with
+ * wal_sync.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_append(wal_t* wal, char op, const char* filename, uint64_t version, const struct iovec* data, size_t iovcnt,
+    uint64_t* sequence)
+{
+    if (wal == NULL || filename == NULL || (data == NULL && iovcnt > 0) || sequence == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct wal_record_header header;
+    memset(&header, 0, sizeof(header));
+    header.op = op;
+    header.version = version;
+    header.name_length = strlen(filename);
+    for (size_t i = 0; i < iovcnt; ++i) {
+        header.data_size += data[i].iov_len;
+    }
+
+    // the header and the name are written before the data, with one writev
+    struct iovec* iov = malloc((iovcnt + 2) * sizeof(struct iovec));
+    if (iov == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void*)filename;
+    iov[1].iov_len = header.name_length;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        iov[i + 2] = data[i];
+    }
+    size_t record_size = sizeof(header) + header.name_length + header.data_size;
+
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    header.sequence = wal->last_sequence + 1;
+    header.checksum = record_checksum(iov, iovcnt + 2);
+    struct stat st;
+    int res = fstat(wal->fd, &st);
+    if (res == 0) {
+        errno = 0;
+        ssize_t written = writevn(wal->fd, iov, iovcnt + 2);
+        if (written != (ssize_t)record_size) {
+            // a partial record would end the log at the next replay, so it
+            // is removed
+            int saved_errno = errno != 0 ? errno : EIO;
+            ftruncate(wal->fd, st.st_size);
+            errno = saved_errno;
+            res = -1;
+        }
+    }
+    if (res == 0) {
+        wal->last_sequence = header.sequence;
+        ++wal->statistics.num_records;
+        wal->statistics.bytes_written += record_size;
+        *sequence = header.sequence;
+        if (wal->durability == WAL_DURABILITY_BATCH) {
+            pthread_cond_signal(&wal->flusher_cond);
+        }
+    }
+    int saved_errno = errno;
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    free(iov);
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Wait until the record with the given sequence is durable, as required by the
+ * durability of the log. Sequence 0 is never written, so it returns at once.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_sync(wal_t* wal, uint64_t sequence)
+{
+    if (wal == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sequence == 0 || wal->durability == WAL_DURABILITY_NONE) {
+        return 0;
+    }
+
+    int res = 0;
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    while (wal->durable_sequence < sequence) {
+        if (wal->sync_error != 0) {
+            errno = wal->sync_error;
+            res = -1;
+            break;
+        }
+        if (wal->durability == WAL_DURABILITY_ALWAYS && !wal->syncing) {
+            // the first writer that finds no sync in progress syncs the
+            // records of all the writers
+            sync_log(wal);
+        } else {
+            DIE_NEG1(pthread_cond_wait(&wal->synced_cond, &wal->mutex), "pthread_cond_wait");
+        }
+    }
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    return res;
+}
+
+/**
+ * Returns the sequence of the last record appended
+*/
+uint64_t wal_get_last_sequence(wal_t* wal)
+{
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    uint64_t sequence = wal->last_sequence;
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    return sequence;
+}
+
+/**
+ * Returns the offset in the log in path of the first record with a sequence
+ * greater than the given one (the size of the log if there is none), or -1 on
+ * error and errno is set appropriately. Only the headers are read
+*/
+static off_t find_first_record_after(const char* path, uint64_t sequence)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    off_t offset = 0;
+    int read_res;
+    struct wal_record_header header;
+    while ((read_res = read_record_part(fd, &header, sizeof(header))) == 1 && header.sequence <= sequence) {
+        offset += sizeof(header) + header.name_length + header.data_size;
+        if (lseek(fd, offset, SEEK_SET) == -1) {
+            read_res = -1;
+            break;
+        }
+    }
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return read_res == -1 ? -1 : offset;
+}
+
+/**
+ * Copy the content of the file in path from offset to its end into a new
+ * file in tmp_path, that is synced
+ * Returns -1 on error and errno is set appropriately
+*/
+static int copy_log_tail(const char* path, off_t offset, const char* tmp_path)
+{
+    int in_fd = open(path, O_RDONLY);
+    if (in_fd == -1) {
+        return -1;
+    }
+    int out_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out_fd == -1) {
+        close(in_fd);
+        return -1;
+    }
+    char buf[64 * 1024];
+    ssize_t r = 0;
+    if (lseek(in_fd, offset, SEEK_SET) != -1) {
+        while ((r = readn(in_fd, buf, sizeof(buf))) > 0) {
+            if (writen(out_fd, buf, r) != r) {
+                r = -1;
+                break;
+            }
+        }
+    } else {
+        r = -1;
+    }
+    int res = r == -1 || fdatasync(out_fd) == -1 ? -1 : 0;
+    int saved_errno = errno;
+    close(in_fd);
+    if (close(out_fd) == -1) {
+        res = -1;
+    }
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Remove from the log the records up to the given sequence, after they have
+ * been saved in a snapshot that is already durable: they are considered
+ * durable. The records after it, appended while the snapshot was written, are
+ * moved to a new log that replaces the old one. The writers are blocked
+ * meanwhile, but usually there are no records to move.
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_discard(wal_t* wal, uint64_t sequence)
+{
+    if (wal == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    int res = 0;
+    struct stat st;
+    off_t offset = find_first_record_after(wal->path, sequence);
+    if (offset == -1 || fstat(wal->fd, &st) == -1) {
+        res = -1;
+    } else if (offset >= st.st_size) {
+        res = ftruncate(wal->fd, 0);
+    } else if (offset > 0) {
+        // the log is appended to, so the records to keep are moved to a new
+        // log that takes the place of the old one, with the same descriptor
+        char tmp_path[strlen(wal->path) + sizeof(WAL_TMP_EXTENSION)];
+        sprintf(tmp_path, "%s" WAL_TMP_EXTENSION, wal->path);
+        int new_fd = -1;
+        if (copy_log_tail(wal->path, offset, tmp_path) == -1 || (new_fd = open(tmp_path, O_WRONLY | O_APPEND)) == -1
+            || rename_durable(tmp_path, wal->path) == -1) {
+            int saved_errno = errno;
+            unlink(tmp_path);
+            errno = saved_errno;
+            res = -1;
+        } else {
+            // the old log is gone, the next records must go to the new one
+            DIE_NEG1(dup2(new_fd, wal->fd), "dup2");
+        }
+        if (new_fd != -1) {
+            close(new_fd);
+        }
+    }
+    int saved_errno = errno;
+    if (res == 0) {
+        if (sequence > wal->last_sequence) {
+            sequence = wal->last_sequence;
+        }
+        if (sequence > wal->durable_sequence) {
+            wal->durable_sequence = sequence;
+            pthread_cond_broadcast(&wal->synced_cond);
+        }
+    }
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    errno = saved_errno;
+    return res;
+}
+
+/**
+ * Copy the statistics of the log in stats
+ * Returns -1 on error and errno is set appropriately
+*/
+int wal_get_statistics(wal_t* wal, struct wal_statistics* stats)
+{
+    if (wal == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    DIE_NEG1(pthread_mutex_lock(&wal->mutex), "pthread_mutex_lock");
+    *stats = wal->statistics;
+    DIE_NEG1(pthread_mutex_unlock(&wal->mutex), "pthread_mutex_unlock");
+    return 0;
+}
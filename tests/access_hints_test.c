@@ -0,0 +1,105 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "access_hints.h"
+#include "storage_fixtures.h"
+
+static vfile_t* get_file(file_storage_t* storage, const char* filename)
+{
+    return get_file_from_name(storage, strlen(filename) + 1, filename);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/access_hints_testXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+
+    // not a hints file
+    assert(write(fd, "garbage", 7) == 7);
+    close(fd);
+    assert(load_access_hints(path) == NULL && errno == EINVAL);
+    assert(load_access_hints("/tmp/access_hints_test_missing") == NULL && errno == ENOENT);
+
+    // the hot file is used often and recently, the old one long ago
+    file_storage_t* storage = create_file_storage(LFU_REPLACEMENT, 0);
+    assert(storage != NULL);
+    vfile_t* hot = add_file(storage, "hot", 0, "");
+    hot->used_counter = 50;
+    hot->last_used = 1000;
+    vfile_t* old = add_file(storage, "old", 0, "");
+    old->used_counter = 2;
+    old->last_used = 100;
+    vfile_t* prefix = add_file(storage, "ho", 0, "");
+    prefix->used_counter = 0;
+    prefix->last_used = 500;
+    assert(save_access_hints(storage, path) == 3);
+    assert(destroy_file_storage(storage) == 0);
+
+    access_hints_t* hints = load_access_hints(path);
+    assert(hints != NULL && hints->num_hints == 3 && hints->oldest_access == 100);
+
+    // after a restart the files with a hint are warm again, while the new
+    // files are less recently used than all of them
+    storage = create_file_storage(LRU_REPLACEMENT, 0);
+    assert(storage != NULL);
+    vfile_t* new_file = add_file(storage, "new", 0, "");
+    hot = add_file(storage, "hot", 0, "");
+    prefix = add_file(storage, "ho", 0, "");
+    assert(apply_access_hints(storage, hints) == 2);
+    assert(hot->used_counter == 50 && hot->last_used == 1000);
+    assert(prefix->used_counter == 0 && prefix->last_used == 500);
+    assert(new_file->used_counter == 0 && new_file->last_used < 100);
+    assert(choose_victim_file(storage, NULL) == new_file);
+
+    // the files accessed after the restart keep their metadata
+    old = add_file(storage, "old", 0, "");
+    assert(atomic_update_replacement_info(old) == 0);
+    time_t accessed = old->last_used;
+    assert(apply_access_hints(storage, hints) == 1);
+    assert(old->used_counter == 1 && old->last_used == accessed);
+    assert(get_file(storage, "hot")->used_counter == 50);
+    assert(destroy_file_storage(storage) == 0);
+    free_access_hints(hints);
+
+    // a truncated file is not valid
+    assert(truncate(path, sizeof(struct access_hints_header) + sizeof(struct access_hints_entry) + 1) == 0);
+    assert(load_access_hints(path) == NULL && errno == EINVAL);
+
+    // a file with fewer hints than its header counts is not valid, even when
+    // the names fill the whole file
+    fd = open(path, O_WRONLY | O_TRUNC);
+    assert(fd != -1);
+    struct access_hints_header header;
+    memcpy(header.magic, ACCESS_HINTS_MAGIC, ACCESS_HINTS_MAGIC_LENGTH);
+    header.num_hints = 2;
+    struct access_hints_entry entry = { 100, 1, sizeof(struct access_hints_entry) + 4 };
+    assert(write(fd, &header, sizeof(header)) == sizeof(header));
+    assert(write(fd, &entry, sizeof(entry)) == sizeof(entry));
+    char name[sizeof(struct access_hints_entry) + 4];
+    memset(name, 'n', sizeof(name));
+    assert(write(fd, name, sizeof(name)) == sizeof(name));
+    close(fd);
+    assert(load_access_hints(path) == NULL && errno == EINVAL);
+
+    // no files, no hints
+    storage = create_file_storage(LRU_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(save_access_hints(storage, path) == 0);
+    hints = load_access_hints(path);
+    assert(hints != NULL && hints->num_hints == 0);
+    vfile_t* file = add_file(storage, "file", 0, "");
+    time_t last_used = file->last_used;
+    assert(apply_access_hints(storage, hints) == 0 && file->last_used == last_used);
+    free_access_hints(hints);
+    assert(destroy_file_storage(storage) == 0);
+
+    assert(unlink(path) == 0);
+    return 0;
+}
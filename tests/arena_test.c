@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+int main(void)
+{
+    assert(create_arena(0) == NULL);
+
+    arena_t* arena = create_arena(1024);
+    assert(arena != NULL);
+    assert(arena->statistics.num_chunks == 1);
+
+    // the allocations are distinct, aligned and usable
+    char* ptrs[100];
+    for (int i = 0; i < 100; ++i) {
+        ptrs[i] = arena_alloc(arena, i + 1);
+        assert(ptrs[i] != NULL);
+        assert((uintptr_t)ptrs[i] % 16 == 0);
+        memset(ptrs[i], i, i + 1);
+    }
+    for (int i = 0; i < 100; ++i) {
+        for (int j = 0; j <= i; ++j) {
+            assert(ptrs[i][j] == (char)i);
+        }
+    }
+    assert(arena->statistics.num_chunks > 1);
+
+    // a big allocation gets its own chunk
+    unsigned long num_chunks = arena->statistics.num_chunks;
+    char* big = arena_alloc(arena, 10000);
+    assert(big != NULL);
+    memset(big, 'x', 10000);
+    assert(arena->statistics.num_chunks == num_chunks + 1);
+
+    // after the reset only the first chunk is kept, and it is reused
+    size_t maximum_used = arena->used;
+    arena_reset(arena);
+    assert(arena->used == 0);
+    assert(arena->statistics.num_resets == 1);
+    assert(arena->statistics.maximum_used == maximum_used);
+    num_chunks = arena->statistics.num_chunks;
+    for (int i = 0; i < 10; ++i) {
+        assert(arena_alloc(arena, 64) != NULL);
+    }
+    assert(arena->statistics.num_chunks == num_chunks);
+
+    // the promoted memory outlives the arena
+    char* name = arena_alloc(arena, 6);
+    strcpy(name, "hello");
+    char* promoted = arena_promote(name, 6);
+    assert(promoted != NULL && promoted != name);
+    assert(destroy_arena(arena) == 0);
+    assert(strcmp(promoted, "hello") == 0);
+    free(promoted);
+
+    assert(arena_promote(NULL, 1) == NULL);
+    assert(destroy_arena(NULL) == -1);
+    return 0;
+}
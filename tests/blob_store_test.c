@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob_store.h"
+
+/**
+ * Returns a copy of str on the heap, without the terminator
+*/
+static void* copy_of(const char* str)
+{
+    void* copy = malloc(strlen(str));
+    assert(copy != NULL);
+    memcpy(copy, str, strlen(str));
+    return copy;
+}
+
+int main(void)
+{
+    // the hash depends only on the bytes, not on how they are split
+    struct iovec whole = { "hello world", 11 };
+    struct iovec parts[2] = { { "hello ", 6 }, { "world", 5 } };
+    assert(hash_content(&whole, 1) == hash_content(parts, 2));
+    struct iovec other = { "hello worle", 11 };
+    assert(hash_content(&whole, 1) != hash_content(&other, 1));
+
+    blob_store_t* store = create_blob_store();
+    assert(store != NULL);
+    uint64_t hash = hash_content(&whole, 1);
+    assert(blob_store_find(store, hash, "hello world", 11) == NULL);
+
+    // the buffer is taken by the blob
+    blob_t* blob = blob_store_insert(store, hash, copy_of("hello world"), 11);
+    assert(blob != NULL);
+    assert(blob->refcount == 1 && blob->size == 11);
+    assert(store->num_blobs == 1);
+
+    // the blob is found only with the same hash and the same content
+    assert(blob_store_find(store, hash, "hello world", 11) == blob);
+    assert(blob_store_find(store, hash, "hello worle", 11) == NULL);
+    assert(blob_store_find(store, hash, "hello", 5) == NULL);
+    assert(blob_store_find(store, hash + 1, "hello world", 11) == NULL);
+
+    // the blob is removed only with the last reference
+    ++blob->refcount;
+    assert(!blob_store_release(store, blob));
+    assert(store->num_blobs == 1);
+    assert(blob_store_release(store, blob));
+    assert(store->num_blobs == 0);
+    assert(memcmp(blob->data, "hello world", 11) == 0);
+    assert(blob_store_find(store, hash, "hello world", 11) == NULL);
+    destroy_blob(blob);
+
+    // the table grows and all the blobs are still found
+    char buf[32];
+    for (int i = 0; i < 1000; ++i) {
+        int len = snprintf(buf, sizeof(buf), "blob %d", i);
+        struct iovec iov = { buf, len };
+        assert(blob_store_insert(store, hash_content(&iov, 1), copy_of(buf), len) != NULL);
+    }
+    assert(store->num_blobs == 1000);
+    assert(store->num_buckets > BLOB_STORE_INITIAL_BUCKETS);
+    for (int i = 0; i < 1000; ++i) {
+        int len = snprintf(buf, sizeof(buf), "blob %d", i);
+        struct iovec iov = { buf, len };
+        blob_t* found = blob_store_find(store, hash_content(&iov, 1), buf, len);
+        assert(found != NULL && found->size == (size_t)len);
+    }
+
+    // the blobs still in the store are destroyed with it
+    assert(destroy_blob_store(store) == 0);
+    assert(destroy_blob_store(NULL) == -1);
+    assert(blob_store_insert(NULL, 0, NULL, 0) == NULL);
+
+    return 0;
+}
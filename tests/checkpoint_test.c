@@ -0,0 +1,113 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "snapshot.h"
+#include "storage_fixtures.h"
+
+static int count_apply(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size)
+{
+    ++*(long*)arg;
+    return 0;
+}
+
+int main(void)
+{
+    char path[] = "/tmp/checkpoint_testXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    char wal_path[sizeof(path) + 4];
+    sprintf(wal_path, "%s.wal", path);
+
+    assert(create_checkpoint(NULL) == NULL && errno == EINVAL);
+    checkpoint_t* checkpoint = create_checkpoint(path);
+    assert(checkpoint != NULL);
+    assert(!checkpoint_is_running(checkpoint));
+
+    file_storage_t* storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(storage != NULL);
+    assert((storage->wal = wal_open(wal_path, WAL_DURABILITY_NONE, 0, 1)) != NULL);
+    add_file(storage, "a", 100000, "a");
+    add_file(storage, "b", 10, "b");
+    uint64_t sequence;
+    assert(wal_append(storage->wal, WAL_CREATE, "a", 1, NULL, 0, &sequence) == 0);
+    assert(wal_append(storage->wal, WAL_CREATE, "b", 1, NULL, 0, &sequence) == 0);
+
+    // nothing to finish
+    assert(checkpoint_finish(checkpoint, storage, true) == 0);
+
+    // the storage can change while the snapshot is written, the snapshot
+    // has the files at the start of the checkpoint
+    assert(checkpoint_start(checkpoint, storage) == 0);
+    assert(checkpoint_is_running(checkpoint));
+    assert(checkpoint_start(checkpoint, storage) == -1 && errno == EBUSY);
+    add_file(storage, "c", 500, "c");
+    assert(wal_append(storage->wal, WAL_CREATE, "c", 1, NULL, 0, &sequence) == 0);
+    vfile_t* b = get_file_from_name(storage, 1, "b");
+    assert(remove_file_from_storage(storage, b) == 0 && destroy_vfile(storage, b) == 0);
+    assert(checkpoint_finish(checkpoint, storage, true) == 1);
+    assert(!checkpoint_is_running(checkpoint));
+    assert(checkpoint->statistics.num_checkpoints == 1 && checkpoint->statistics.num_failures == 0);
+    assert(checkpoint->statistics.last_size > 100010);
+    assert(checkpoint->statistics.maximum_duration >= checkpoint->statistics.last_pause);
+
+    // only the record appended after the start of the checkpoint is left
+    assert(wal_close(storage->wal) == 0);
+    long num_records = 0;
+    uint64_t last_sequence;
+    assert(wal_replay(wal_path, 0, count_apply, &num_records, &last_sequence) == 1 && last_sequence == 3);
+    storage->wal = NULL;
+    assert(destroy_file_storage(storage) == 0);
+
+    uint64_t wal_sequence;
+    storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(storage != NULL);
+    assert(load_snapshot(storage, path, 100, 1000000, &wal_sequence) == 2);
+    assert(wal_sequence == 2);
+    assert(get_file_from_name(storage, 1, "a") != NULL && get_file_from_name(storage, 1, "b") != NULL);
+    assert(get_file_from_name(storage, 1, "c") == NULL);
+    assert(destroy_file_storage(storage) == 0);
+
+    // a snapshot that cannot be written does not start the checkpoint
+    storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(storage != NULL);
+    checkpoint_t* failing = create_checkpoint("/tmp/checkpoint_test_missing_dir/snapshot");
+    assert(failing != NULL);
+    assert(checkpoint_start(failing, storage) == -1 && errno == ENOENT);
+    assert(!checkpoint_is_running(failing) && failing->statistics.num_checkpoints == 0);
+
+    // a snapshot that cannot replace the previous one fails the checkpoint,
+    // and the previous one is kept
+    char dir_path[] = "/tmp/checkpoint_test_dirXXXXXX";
+    assert(mkdtemp(dir_path) != NULL);
+    checkpoint_t* blocked = create_checkpoint(dir_path);
+    assert(blocked != NULL);
+    char blocker[sizeof(dir_path) + 8];
+    sprintf(blocker, "%s/file", dir_path);
+    fd = open(blocker, O_WRONLY | O_CREAT, 0600);
+    assert(fd != -1);
+    close(fd);
+    assert(checkpoint_start(blocked, storage) == 0);
+    assert(checkpoint_finish(blocked, storage, true) == -1 && errno == EISDIR);
+    assert(blocked->statistics.num_failures == 1 && blocked->statistics.num_checkpoints == 0);
+    assert(access(blocked->tmp_path, F_OK) == -1 && access(blocker, F_OK) == 0);
+    assert(destroy_checkpoint(blocked, storage) == 0);
+    assert(unlink(blocker) == 0 && rmdir(dir_path) == 0);
+
+    // a running checkpoint is waited for when the checkpoints are destroyed
+    assert(checkpoint_start(checkpoint, storage) == 0);
+    assert(destroy_checkpoint(checkpoint, storage) == 0);
+    assert(destroy_checkpoint(failing, storage) == 0);
+    assert(destroy_file_storage(storage) == 0);
+
+    assert(unlink(path) == 0);
+    assert(unlink(wal_path) == 0);
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compression.h"
+
+/**
+ * Compress and decompress size bytes of src, checking that the content is the
+ * same. Returns the size of the compressed data
+*/
+static size_t round_trip(const void* src, size_t size)
+{
+    size_t capacity = compress_bound(size);
+    void* compressed = malloc(capacity);
+    void* decompressed = malloc(size > 0 ? size : 1);
+    assert(compressed != NULL && decompressed != NULL);
+
+    size_t compressed_size = compress_buffer(src, size, compressed, capacity);
+    assert(compressed_size > 0 && compressed_size <= capacity);
+    assert(decompress_buffer(compressed, compressed_size, decompressed, size) == 0);
+    assert(memcmp(src, decompressed, size) == 0);
+
+    free(compressed);
+    free(decompressed);
+    return compressed_size;
+}
+
+int main(void)
+{
+    // inputs too small to contain a back reference
+    round_trip("", 0);
+    round_trip("a", 1);
+    round_trip("abcdefgh", 8);
+
+    // a repeated pattern compresses well, also with overlapping references
+    // and lengths that need more than one byte
+    size_t size = 100000;
+    char* buf = malloc(size);
+    assert(buf != NULL);
+    memset(buf, 'x', size);
+    assert(round_trip(buf, size) < 1000);
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = "the quick brown fox "[i % 20];
+    }
+    assert(round_trip(buf, size) < 1000);
+
+    // text with some repetitions
+    size_t len = 0;
+    for (int i = 0; len + 64 < size; ++i) {
+        len += snprintf(buf + len, size - len, "line %d of the test, value %d\n", i, i * 7 % 13);
+    }
+    assert(round_trip(buf, len) < len / 2);
+
+    // random data cannot be compressed, but the bound is respected
+    srand(42);
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = rand();
+    }
+    size_t random_size = round_trip(buf, size);
+    assert(random_size >= size && random_size <= compress_bound(size));
+
+    // the compression fails if the output does not fit
+    char small[64];
+    assert(compress_buffer(buf, size, small, sizeof(small)) == 0);
+    memset(buf, 'y', 1000);
+    assert(compress_buffer(buf, 1000, small, sizeof(small)) > 0);
+
+    // a corrupted or truncated input is detected
+    size_t compressed_size = compress_buffer(buf, 1000, small, sizeof(small));
+    char out[1000];
+    assert(decompress_buffer(small, compressed_size, out, 999) == -1 && errno == EINVAL);
+    assert(decompress_buffer(small, compressed_size - 1, out, 1000) == -1 && errno == EINVAL);
+    small[2] = 0;
+    small[3] = 0x10;
+    assert(decompress_buffer(small, compressed_size, out, 1000) == -1 && errno == EINVAL);
+
+    free(buf);
+    return 0;
+}
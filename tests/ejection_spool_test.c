@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ejection_spool.h"
+
+static char* make_string(const char* s)
+{
+    char* res = malloc(strlen(s) + 1);
+    assert(res != NULL);
+    strcpy(res, s);
+    return res;
+}
+
+// files dropped by the spool
+static ejected_file_t* dropped = NULL;
+
+static int put(ejection_spool_t* spool, int client_fd, bool pinned, const char* filename, const char* content)
+{
+    file_data_t data;
+    init_file_data(&data);
+    assert(file_data_append(&data, content, strlen(content)) == 0);
+    int res = ejection_spool_put(spool, client_fd, pinned, make_string(filename), &data, &dropped);
+    // the content is moved to the spool
+    assert(data.size == 0 && data.segments == NULL);
+    return res;
+}
+
+int main(void)
+{
+    ejection_spool_t* spool = create_ejection_spool(10);
+    assert(spool != NULL);
+
+    // files of different clients are kept apart, in ejection order
+    assert(put(spool, 4, false, "A", "aa") == 0);
+    assert(put(spool, 5, false, "B", "bb") == 0);
+    assert(put(spool, 4, false, "C", "cc") == 0);
+    assert(spool->total_size == 6);
+
+    ejected_file_t* taken = ejection_spool_take(spool, 4);
+    assert(taken != NULL);
+    assert(strcmp(taken->filename, "A") == 0);
+    assert(taken->next != NULL && strcmp(taken->next->filename, "C") == 0);
+    assert(taken->next->next == NULL);
+    destroy_ejected_files(taken);
+    assert(spool->total_size == 2);
+    assert(ejection_spool_take(spool, 4) == NULL);
+
+    // when the spool is full the oldest files are dropped
+    assert(put(spool, 5, false, "D", "dddddd") == 0);
+    assert(put(spool, 5, false, "E", "eeee") == 0);
+    assert(spool->total_size <= 10);
+    // the dropped files are given back to be destroyed by the caller
+    assert(dropped != NULL && strcmp(dropped->filename, "B") == 0 && dropped->next == NULL);
+    destroy_ejected_files(dropped);
+    dropped = NULL;
+    taken = ejection_spool_take(spool, 5);
+    assert(strcmp(taken->filename, "D") == 0);
+    assert(strcmp(taken->next->filename, "E") == 0);
+    assert(taken->next->next == NULL);
+    destroy_ejected_files(taken);
+
+    // the pinned files are never dropped, even if they are bigger than the spool
+    assert(put(spool, 6, true, "F", "ffffffffffff") == 0);
+    assert(put(spool, 7, false, "G", "g") == 0);
+    assert(ejection_spool_take(spool, 7) == NULL);
+    assert(dropped != NULL && strcmp(dropped->filename, "G") == 0);
+    destroy_ejected_files(dropped);
+    dropped = NULL;
+    taken = ejection_spool_take(spool, 6);
+    assert(taken != NULL && strcmp(taken->filename, "F") == 0);
+    destroy_ejected_files(taken);
+    assert(spool->total_size == 0);
+
+    struct ejection_spool_statistics stats;
+    assert(ejection_spool_get_statistics(spool, &stats) == 0);
+    assert(stats.num_spooled == 7);
+    assert(stats.num_dropped == 2);
+    assert(stats.maximum_size_reached == 13);
+
+    // the files still in the spool are destroyed with it
+    assert(put(spool, 8, false, "H", "h") == 0);
+    assert(destroy_ejection_spool(spool) == 0);
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "evictor.h"
+#include "file_storage_internal.h"
+#include "unbounded_shared_buffer.h"
+
+static void add_file(file_storage_t* storage, int i, size_t size)
+{
+    vfile_t* f = create_vfile(storage);
+    assert(f != NULL);
+    f->filename = malloc(16);
+    assert(f->filename != NULL);
+    sprintf(f->filename, "file%d", i);
+    f->size = size;
+    assert(add_vfile_to_storage(storage, f) == 0);
+}
+
+int main(void)
+{
+    file_storage_t* storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    usbuf_t* logger_buffer = usbuf_create(FIFO_POLICY);
+    assert(storage != NULL && logger_buffer != NULL);
+    rw_lock_t* storage_lock = get_rw_lock_from_storage(storage);
+
+    // invalid watermarks
+    assert(evictor_start(storage, logger_buffer, 100, 10, 50, 80) == NULL);
+    assert(evictor_start(storage, logger_buffer, 100, 10, 120, 50) == NULL);
+
+    evictor_t* evictor = evictor_start(storage, logger_buffer, 100, 10, 80, 50);
+    assert(evictor != NULL);
+
+    // below the high watermark nothing happens
+    assert(write_lock(storage_lock) == 0);
+    for (int i = 0; i < 8; ++i) {
+        add_file(storage, i, 10);
+    }
+    assert(evictor_notify(evictor) == 0);
+    assert(write_unlock(storage_lock) == 0);
+
+    // crossing the high watermark wakes up the evictor, that ejects files
+    // until the usage is at the low watermark
+    assert(write_lock(storage_lock) == 0);
+    add_file(storage, 8, 10);
+    assert(evictor_notify(evictor) == 0);
+    assert(write_unlock(storage_lock) == 0);
+
+    bool done = false;
+    for (int attempt = 0; attempt < 1000 && !done; ++attempt) {
+        assert(read_lock(storage_lock) == 0);
+        done = storage->statistics.num_evictor_runs == 1 && storage->num_files <= 5;
+        assert(read_unlock(storage_lock) == 0);
+        if (!done) {
+            struct timespec t = { 0, 1000000 };
+            nanosleep(&t, NULL);
+        }
+    }
+    assert(done);
+    assert(storage->total_size == 50);
+    assert(storage->statistics.num_background_replacements == 4);
+    // the files are ejected following the policy of the storage
+    assert(strcmp(storage->first->filename, "file4") == 0);
+
+    assert(evictor_stop(evictor) == 0);
+
+    // free the log messages
+    assert(usbuf_close(logger_buffer) == 0);
+    void* msg;
+    while (usbuf_get(logger_buffer, &msg) == 0) {
+        free(msg);
+    }
+    assert(usbuf_free(logger_buffer) == 0);
+    assert(destroy_file_storage(storage) == 0);
+    return 0;
+}
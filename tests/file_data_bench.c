@@ -0,0 +1,55 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file_data.h"
+
+// the file is built with NUM_APPENDS appends of APPEND_SIZE bytes each
+#define NUM_APPENDS 10000
+#define APPEND_SIZE 1024
+
+static double elapsed_ms(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e3 + (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Benchmark of the appends to a file: the old way (realloc of a contiguous
+ * buffer and copy) against the segmented file data
+*/
+int main(void)
+{
+    char chunk[APPEND_SIZE];
+    memset(chunk, 'x', APPEND_SIZE);
+    struct timespec start, end;
+
+    // contiguous buffer, grown at every append
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void* buf = NULL;
+    size_t size = 0;
+    for (int i = 0; i < NUM_APPENDS; ++i) {
+        buf = realloc(buf, size + APPEND_SIZE);
+        assert(buf != NULL);
+        memcpy((char*)buf + size, chunk, APPEND_SIZE);
+        size += APPEND_SIZE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("realloc:   %d appends of %d bytes in %8.3f ms\n", NUM_APPENDS, APPEND_SIZE, elapsed_ms(&start, &end));
+    free(buf);
+
+    // segmented file data
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    file_data_t data;
+    init_file_data(&data);
+    for (int i = 0; i < NUM_APPENDS; ++i) {
+        assert(file_data_append(&data, chunk, APPEND_SIZE) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("segmented: %d appends of %d bytes in %8.3f ms (%zu segments)\n", NUM_APPENDS, APPEND_SIZE,
+        elapsed_ms(&start, &end), data.num_segments);
+    destroy_file_data(&data);
+    return 0;
+}
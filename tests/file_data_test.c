@@ -0,0 +1,167 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_data.h"
+
+int main(void)
+{
+    file_data_t data;
+    init_file_data(&data);
+    assert(data.size == 0 && data.num_segments == 0);
+
+    // small appends fill the same segment
+    char chunk[1000];
+    for (int i = 0; i < 4; ++i) {
+        memset(chunk, 'a' + i, sizeof(chunk));
+        assert(file_data_append(&data, chunk, sizeof(chunk)) == 0);
+    }
+    assert(data.size == 4000);
+    assert(data.num_segments == 1);
+    assert(data.last_capacity == MIN_SEGMENT_SIZE);
+
+    // the fifth append fills the first segment and starts a new one
+    memset(chunk, 'e', sizeof(chunk));
+    assert(file_data_append(&data, chunk, sizeof(chunk)) == 0);
+    assert(data.size == 5000);
+    assert(data.num_segments == 2);
+    assert(data.segments[0].iov_len == MIN_SEGMENT_SIZE);
+    assert(data.segments[1].iov_len == 5000 - MIN_SEGMENT_SIZE);
+    assert(data.capacity == MIN_SEGMENT_SIZE + data.last_capacity);
+
+    char* content = malloc(data.size);
+    assert(content != NULL);
+    file_data_copy(&data, content);
+    for (int i = 0; i < 5000; ++i) {
+        assert(content[i] == 'a' + i / 1000);
+    }
+    free(content);
+
+    // a big append gets a segment big enough to contain it
+    char* big = calloc(3 * MAX_SEGMENT_SIZE, 1);
+    assert(big != NULL);
+    assert(file_data_append(&data, big, 3 * MAX_SEGMENT_SIZE) == 0);
+    assert(data.size == 5000 + 3 * MAX_SEGMENT_SIZE);
+    assert(data.segments[data.num_segments - 1].iov_len <= 3 * MAX_SEGMENT_SIZE);
+    free(big);
+
+    // appending a buffer does not copy it
+    char* buffer = malloc(10);
+    assert(buffer != NULL);
+    memcpy(buffer, "0123456789", 10);
+    size_t num_segments = data.num_segments;
+    assert(file_data_append_buffer(&data, buffer, 10) == 0);
+    assert(data.num_segments == num_segments + 1);
+    assert(data.segments[num_segments].iov_base == buffer);
+    assert(data.last_capacity == 10);
+    size_t capacity = data.capacity;
+
+    // a reservation does not change the content until it is committed
+    size_t old_size = data.size;
+    struct iovec reserved[2];
+    assert(file_data_reserve(&data, 6000, reserved) == 0);
+    assert(reserved[0].iov_len == 0);
+    assert(reserved[1].iov_len == 6000);
+    assert(data.size == old_size && data.num_segments == num_segments + 1);
+    file_data_rollback(&data, reserved);
+    assert(data.size == old_size && data.num_segments == num_segments + 1);
+    assert(data.capacity == capacity);
+
+    assert(file_data_reserve(&data, 6000, reserved) == 0);
+    memset(reserved[1].iov_base, 'z', 6000);
+    file_data_commit(&data, reserved);
+    assert(data.size == old_size + 6000 && data.num_segments == num_segments + 2);
+    assert(data.capacity == capacity + data.last_capacity);
+
+    // the free space of the last segment is reserved first
+    assert(file_data_reserve(&data, 10, reserved) == 0);
+    assert(reserved[0].iov_len == 10 && reserved[1].iov_base == NULL);
+    memcpy(reserved[0].iov_base, "abcdefghij", 10);
+    file_data_commit(&data, reserved);
+    assert(data.size == old_size + 6010 && data.num_segments == num_segments + 2);
+    struct iovec* last = &data.segments[data.num_segments - 1];
+    assert(memcmp((char*)last->iov_base + last->iov_len - 11, "zabcdefghij", 11) == 0);
+
+    destroy_file_data(&data);
+    assert(data.size == 0 && data.segments == NULL && data.capacity == 0);
+
+    // empty appends
+    assert(file_data_append(&data, NULL, 0) == 0);
+    assert(file_data_append_buffer(&data, NULL, 0) == 0);
+    assert(data.num_segments == 0);
+    destroy_file_data(&data);
+
+    // a small content is stored in the inline buffer, without allocations
+    char inline_buffer[64];
+    init_file_data_inline(&data, inline_buffer, sizeof(inline_buffer));
+    assert(file_data_append_capacity(&data, 10) == 0);
+    assert(file_data_append(&data, "0123456789", 10) == 0);
+    assert(file_data_uses_inline(&data));
+    assert(data.segments == &data.inline_segment && data.segments[0].iov_base == inline_buffer);
+    assert(data.capacity == 0);
+    // the free space of the inline buffer is filled first
+    assert(file_data_append(&data, "abc", 3) == 0);
+    assert(data.num_segments == 1 && data.size == 13);
+    assert(memcmp(inline_buffer, "0123456789abc", 13) == 0);
+
+    // then the content continues in segments allocated on the heap
+    memset(chunk, 'x', sizeof(chunk));
+    assert(file_data_append(&data, chunk, sizeof(chunk)) == 0);
+    assert(data.num_segments == 2 && data.segments != &data.inline_segment);
+    assert(file_data_uses_inline(&data));
+    assert(data.capacity == data.last_capacity);
+
+    // moving the content copies the inline buffer, that stays with data
+    file_data_t moved;
+    init_file_data(&moved);
+    assert(file_data_move(&moved, &data) == 0);
+    assert(data.size == 0 && data.num_segments == 0 && data.inline_buffer == inline_buffer);
+    assert(moved.size == 13 + sizeof(chunk) && !file_data_uses_inline(&moved));
+    content = malloc(moved.size);
+    assert(content != NULL);
+    file_data_copy(&moved, content);
+    assert(memcmp(content, "0123456789abc", 13) == 0 && content[13] == 'x');
+    free(content);
+    destroy_file_data(&moved);
+
+    // a rolled back reservation of the inline buffer does not free it, and a
+    // small buffer is copied in the inline buffer
+    assert(file_data_reserve(&data, 5, reserved) == 0);
+    assert(reserved[1].iov_base == inline_buffer);
+    file_data_rollback(&data, reserved);
+    buffer = malloc(5);
+    assert(buffer != NULL);
+    memcpy(buffer, "hello", 5);
+    assert(file_data_append_buffer(&data, buffer, 5) == 0);
+    assert(file_data_uses_inline(&data) && memcmp(inline_buffer, "hello", 5) == 0);
+    destroy_file_data(&data);
+    assert(data.inline_buffer == inline_buffer);
+
+    // a content bigger than the inline buffer does not use it
+    assert(file_data_append(&data, chunk, sizeof(chunk)) == 0);
+    assert(!file_data_uses_inline(&data));
+    init_file_data(&moved);
+    assert(file_data_move(&moved, &data) == 0);
+    assert(moved.size == sizeof(chunk) && data.segments == NULL);
+    destroy_file_data(&moved);
+    destroy_file_data(&data);
+
+    // many buffers are taken at once, each as a segment, even after the
+    // inline buffer
+    assert(file_data_append(&data, "ab", 2) == 0);
+    struct iovec buffers[10];
+    for (int i = 0; i < 10; ++i) {
+        buffers[i].iov_base = malloc(3);
+        assert(buffers[i].iov_base != NULL);
+        memcpy(buffers[i].iov_base, "xyz", 3);
+        buffers[i].iov_len = 3;
+    }
+    assert(file_data_append_buffers(&data, buffers, 10) == 0);
+    assert(data.num_segments == 11 && data.size == 32);
+    assert(data.segments[10].iov_base == buffers[9].iov_base);
+    char all[32];
+    file_data_copy(&data, all);
+    assert(memcmp(all, "abxyzxyz", 8) == 0);
+    destroy_file_data(&data);
+    return 0;
+}
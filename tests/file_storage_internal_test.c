@@ -9,13 +9,13 @@
 
 int main(void)
 {
-    file_storage_t* storage = create_file_storage(FIFO_REPLACEMENT);
+    file_storage_t* storage = create_file_storage(FIFO_REPLACEMENT, 0);
     assert(storage != NULL);
     assert(storage->replacement_policy == FIFO_REPLACEMENT);
 
-    vfile_t* f1 = create_vfile();
-    vfile_t* f2 = create_vfile();
-    vfile_t* f3 = create_vfile();
+    vfile_t* f1 = create_vfile(storage);
+    vfile_t* f2 = create_vfile(storage);
+    vfile_t* f3 = create_vfile(storage);
     assert(f1 != NULL && f2 != NULL && f3 != NULL);
 
     f1->filename = malloc(6 * sizeof(char));
@@ -48,10 +48,32 @@ int main(void)
     assert(get_file_from_name(storage, 5, "BBBBB") == f2);
     assert(get_file_from_name(storage, 5, "CCCCC") == f3);
 
+    // ids and versions are increasing in insertion order
+    assert(f1->id < f2->id && f2->id < f3->id);
+    assert(f1->version > 0 && f1->version < f2->version && f2->version < f3->version);
+    uint64_t old_version = f1->version;
+    assert(bump_file_version(storage, f1) == 0);
+    assert(f1->version > old_version && f1->version > f3->version);
+
+    // handles resolve to their files
+    uint64_t f2_handle = f2->handle;
+    assert(f1->handle != 0 && f2_handle != 0 && f3->handle != 0);
+    assert(get_file_from_handle(storage, f1->handle) == f1);
+    assert(get_file_from_handle(storage, f2_handle) == f2);
+    assert(get_file_from_handle(storage, 0) == NULL && errno == ENOENT);
+
     assert(remove_file_from_storage(storage, f2) == 0);
     assert(storage->first == f1);
     assert(storage->last == f3);
 
+    // the handle of a removed file is not valid, even if the slot is reused
+    assert(get_file_from_handle(storage, f2_handle) == NULL && errno == ENOENT);
+    assert(add_vfile_to_storage(storage, f2) == 0);
+    assert(f2->handle != f2_handle);
+    assert(get_file_from_handle(storage, f2_handle) == NULL && errno == ENOENT);
+    assert(get_file_from_handle(storage, f2->handle) == f2);
+    assert(remove_file_from_storage(storage, f2) == 0);
+
     assert(get_file_from_name(storage, 5, "AAAAA") == f1);
     assert(get_file_from_name(storage, 5, "BBBBB") == NULL && errno == ENOENT);
     assert(get_file_from_name(storage, 5, "CCCCC") == f3);
@@ -72,10 +94,295 @@ int main(void)
     assert(get_file_from_name(storage, 5, "BBBBB") == NULL && errno == ENOENT);
     assert(get_file_from_name(storage, 5, "CCCCC") == NULL && errno == ENOENT);
 
-    assert(destroy_vfile(f1) == 0);
-    assert(destroy_vfile(f2) == 0);
-    assert(destroy_vfile(f3) == 0);
+    // the memory of the files is charged to the storage while they are in it
+    assert(get_storage_memory(storage) == 0);
+    assert(!is_memory_exceeded(storage, 1000000));
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    size_t empty_file_memory = get_storage_memory(storage);
+    assert(storage->memory.metadata >= sizeof(vfile_t));
+    assert(storage->memory.names == 6 + ALLOCATION_OVERHEAD);
+    assert(storage->memory.data == 0);
+    assert(file_data_append(&f1->data, "hello", 5) == 0);
+    update_file_memory(storage, f1);
+    assert(storage->memory.data == f1->data.capacity + ALLOCATION_OVERHEAD);
+    assert(storage->memory.metadata > empty_file_memory - storage->memory.names);
+    assert(storage->statistics.maximum_memory_reached == get_storage_memory(storage));
+    storage->max_memory = get_storage_memory(storage) + 10;
+    assert(!is_memory_exceeded(storage, 10));
+    assert(is_memory_exceeded(storage, 11));
+    assert(remove_file_from_storage(storage, f1) == 0);
+    assert(get_storage_memory(storage) == 0);
+    assert(f1->memory.data == 0 && f1->memory.metadata == 0 && f1->memory.names == 0);
+
+    // the removed files are retired and destroyed all together
+    vfile_t* retired = NULL;
+    retire_vfile(&retired, f1);
+    retire_vfile(&retired, f2);
+    retire_vfile(&retired, f3);
+    assert(retired == f3 && f3->next == f2 && f2->next == f1 && f1->next == NULL);
+    destroy_retired_vfiles(storage, &retired);
+    assert(retired == NULL);
+    assert(destroy_file_storage(storage) == 0);
+
+    // the content of the small files is in the vfile structure, so it is
+    // charged only as metadata
+    storage = create_file_storage(LRU_REPLACEMENT, 128);
+    assert(storage != NULL);
+    f1 = create_vfile(storage);
+    assert(f1 != NULL);
+    assert(f1->data.inline_buffer == f1->inline_data && f1->data.inline_capacity == 128);
+    assert(file_data_append(&f1->data, "hello", 5) == 0);
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    assert(storage->memory.data == 0);
+    assert(storage->memory.metadata == storage->vfile_pool->object_size);
+    assert(storage->vfile_pool->object_size >= sizeof(vfile_t) + 128);
+    assert(remove_file_from_storage(storage, f1) == 0);
+    assert(destroy_vfile(storage, f1) == 0);
+    assert(destroy_file_storage(storage) == 0);
+
+    // the contents are stored in chunks, and the chunks with the same data
+    // are shared by the files and counted once in the size of the storage
+    storage = create_file_storage(LRU_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(enable_file_deduplication(storage) == 0);
+    f1 = create_vfile(storage);
+    f2 = create_vfile(storage);
+    assert(f1 != NULL && f2 != NULL);
+    f1->filename = malloc(6 * sizeof(char));
+    strcpy(f1->filename, "AAAAA");
+    f2->filename = malloc(6 * sizeof(char));
+    strcpy(f2->filename, "BBBBB");
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    assert(add_vfile_to_storage(storage, f2) == 0);
+    size_t empty_files_memory = get_storage_memory(storage);
+
+    // two versions of the same content, that differ only in the last chunk
+    size_t content_size = 2 * FILE_CHUNK_SIZE + 100;
+    char* v1 = malloc(content_size);
+    char* v2 = malloc(content_size);
+    assert(v1 != NULL && v2 != NULL);
+    for (size_t i = 0; i < content_size; ++i) {
+        v1[i] = (char)rand();
+    }
+    memcpy(v2, v1, content_size);
+    v2[content_size - 1] ^= 1;
+    assert(NUM_FILE_CHUNKS(content_size) == 3);
+    uint64_t h1[3], h2[3];
+    hash_file_chunks(v1, content_size, h1);
+    hash_file_chunks(v2, content_size, h2);
+    assert(h1[0] == h2[0] && h1[1] == h2[1] && h1[2] != h2[2]);
+
+    size_t space_needed, memory_needed;
+    estimate_file_chunks(storage, v1, content_size, h1, &space_needed, &memory_needed);
+    assert(space_needed == content_size);
+    assert(share_file_chunks(storage, f1, v1, content_size, h1) == 0);
+    assert(fill_file_chunks(storage, f1, v1, h1) == 0);
+    f1->size = content_size;
+    update_file_memory(storage, f1);
+    assert(f1->num_chunks == 3 && f1->data.size == 0);
+    assert(storage->total_size == content_size);
+    assert(get_storage_memory(storage) - empty_files_memory >= memory_needed);
+    size_t num_segments;
+    const struct iovec* segments = get_file_segments(f1, &num_segments);
+    assert(num_segments == 3 && segments[2].iov_len == 100);
+    assert(memcmp(segments[1].iov_base, v1 + FILE_CHUNK_SIZE, FILE_CHUNK_SIZE) == 0);
+
+    // only the last chunk of the second version is new
+    estimate_file_chunks(storage, v2, content_size, h2, &space_needed, &memory_needed);
+    assert(space_needed == 100);
+    assert(share_file_chunks(storage, f2, v2, content_size, h2) == 0);
+    assert(fill_file_chunks(storage, f2, v2, h2) == 0);
+    f2->size = content_size;
+    update_file_memory(storage, f2);
+    assert(f1->chunks[0] == f2->chunks[0] && f1->chunks[2] != f2->chunks[2]);
+    assert(storage->total_size == content_size + 100);
+    assert(get_logical_size(storage) == 2 * content_size);
+    assert(storage->statistics.num_deduplicated_chunks == 2);
+    assert(storage->blobs->num_blobs == 4);
+
+    // a file that is modified gets its own copy, but the chunks that are
+    // referenced only by the file are taken without copies
+    void* last_chunk = f2->chunks[2]->data;
+    assert(unshare_file_content(storage, f2) == 0);
+    assert(f2->chunks == NULL && f2->data.size == content_size);
+    segments = get_file_segments(f2, &num_segments);
+    assert(segments == f2->data.segments && num_segments == 3);
+    assert(segments[0].iov_base != f1->chunks[0]->data);
+    assert(segments[2].iov_base == last_chunk);
+    assert(storage->total_size == 2 * content_size);
+    assert(get_logical_size(storage) == 2 * content_size);
+    assert(storage->blobs->num_blobs == 3);
+    assert(unshare_file_content(storage, f2) == 0);
+
+    // the chunks are freed with the last file that references them
+    assert(remove_file_from_storage(storage, f2) == 0);
+    assert(storage->total_size == content_size);
+    assert(remove_file_from_storage(storage, f1) == 0);
+    assert(storage->total_size == 0);
+    assert(get_logical_size(storage) == 0);
+    assert(storage->blobs->num_blobs == 0);
+    assert(get_storage_memory(storage) == 0);
+    assert(f1->chunks == NULL && f1->data.size == content_size);
+    assert(destroy_vfile(storage, f1) == 0);
+    assert(destroy_vfile(storage, f2) == 0);
+
+    // the chunks shared in the first step are kept even if the files that
+    // contain them are removed before the second step
+    f1 = create_vfile(storage);
+    f2 = create_vfile(storage);
+    assert(f1 != NULL && f2 != NULL);
+    f1->filename = malloc(6 * sizeof(char));
+    strcpy(f1->filename, "AAAAA");
+    f2->filename = malloc(6 * sizeof(char));
+    strcpy(f2->filename, "BBBBB");
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    assert(add_vfile_to_storage(storage, f2) == 0);
+    assert(share_file_chunks(storage, f1, v1, content_size, h1) == 0);
+    assert(fill_file_chunks(storage, f1, v1, h1) == 0);
+    assert(share_file_chunks(storage, f2, v2, content_size, h2) == 0);
+    assert(f2->chunks[0] == f1->chunks[0] && f2->chunks[2] == NULL);
+    assert(remove_file_from_storage(storage, f1) == 0);
+    assert(destroy_vfile(storage, f1) == 0);
+    assert(storage->total_size == 2 * FILE_CHUNK_SIZE);
+    assert(fill_file_chunks(storage, f2, v2, h2) == 0);
+    assert(storage->total_size == content_size);
+    assert(get_logical_size(storage) == content_size);
+    segments = get_file_segments(f2, &num_segments);
+    assert(memcmp(segments[0].iov_base, v2, FILE_CHUNK_SIZE) == 0);
+
+    // a file taken from the storage keeps its whole content
+    assert(take_file_from_storage(storage, f2) == 0);
+    assert(f2->chunks == NULL && f2->data.size == content_size);
+    assert(storage->total_size == 0 && get_storage_memory(storage) == 0);
+    assert(destroy_vfile(storage, f2) == 0);
+
+    // the chunks that repeat in a file are copied until the file releases
+    // their last reference, where they are taken without copies
+    char* zeros = calloc(2, FILE_CHUNK_SIZE);
+    assert(zeros != NULL);
+    uint64_t hz[2];
+    hash_file_chunks(zeros, 2 * FILE_CHUNK_SIZE, hz);
+    f1 = create_vfile(storage);
+    assert(f1 != NULL);
+    f1->filename = malloc(6 * sizeof(char));
+    strcpy(f1->filename, "AAAAA");
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    assert(share_file_chunks(storage, f1, zeros, 2 * FILE_CHUNK_SIZE, hz) == 0);
+    assert(fill_file_chunks(storage, f1, zeros, hz) == 0);
+    f1->size = 2 * FILE_CHUNK_SIZE;
+    update_file_memory(storage, f1);
+    assert(f1->chunks[0] == f1->chunks[1] && f1->chunks[0]->refcount == 2);
+    assert(storage->total_size == FILE_CHUNK_SIZE && storage->blobs->num_blobs == 1);
+    void* zero_chunk = f1->chunks[0]->data;
+    assert(unshare_file_content(storage, f1) == 0);
+    assert(f1->chunks == NULL && f1->data.size == 2 * FILE_CHUNK_SIZE);
+    segments = get_file_segments(f1, &num_segments);
+    assert(num_segments == 2);
+    assert(segments[0].iov_base != zero_chunk && segments[1].iov_base == zero_chunk);
+    assert(memcmp(segments[0].iov_base, zeros, FILE_CHUNK_SIZE) == 0);
+    assert(storage->total_size == 2 * FILE_CHUNK_SIZE && storage->blobs->num_blobs == 0);
+    assert(get_logical_size(storage) == 2 * FILE_CHUNK_SIZE);
+    assert(remove_file_from_storage(storage, f1) == 0);
+    assert(storage->total_size == 0 && get_storage_memory(storage) == 0);
+    assert(destroy_vfile(storage, f1) == 0);
+    free(zeros);
+
+    // the files still in the storage are destroyed with their chunks
+    f1 = create_vfile(storage);
+    assert(f1 != NULL);
+    f1->filename = malloc(6 * sizeof(char));
+    strcpy(f1->filename, "AAAAA");
+    assert(add_vfile_to_storage(storage, f1) == 0);
+    assert(share_file_chunks(storage, f1, v1, content_size, h1) == 0);
+    assert(fill_file_chunks(storage, f1, v1, h1) == 0);
+    assert(destroy_file_storage(storage) == 0);
+    free(v1);
+    free(v2);
+
+    // the cold files are compressed in the order of the policy, and the size
+    // of the storage counts their compressed size
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    char* text = malloc(content_size);
+    char* noise = malloc(content_size);
+    char* check = malloc(content_size);
+    assert(text != NULL && noise != NULL && check != NULL);
+    for (size_t i = 0; i < content_size; ++i) {
+        text[i] = "compressible text "[i % 18];
+        noise[i] = (char)rand();
+    }
+    vfile_t* files[3];
+    const char* contents[3] = { text, noise, "tiny" };
+    size_t sizes[3] = { content_size, content_size, 4 };
+    for (int i = 0; i < 3; ++i) {
+        files[i] = create_vfile(storage);
+        assert(files[i] != NULL);
+        files[i]->filename = malloc(6 * sizeof(char));
+        sprintf(files[i]->filename, "FILE%d", i);
+        assert(file_data_append(&files[i]->data, contents[i], sizes[i]) == 0);
+        files[i]->size = sizes[i];
+        assert(add_vfile_to_storage(storage, files[i]) == 0);
+    }
+    size_t plain_size = storage->total_size;
+    size_t plain_memory = get_storage_memory(storage);
+
+    assert(choose_compression_candidate(storage, NULL) == files[0]);
+    assert(choose_compression_candidate(storage, files[0]) == files[1]);
+    assert(compress_file(storage, files[0]) == 0);
+    assert(files[0]->compressed != NULL && files[0]->data.size == 0);
+    assert(files[0]->compressed_size < content_size / 10);
+    assert(storage->total_size == plain_size - content_size + files[0]->compressed_size);
+    assert(get_logical_size(storage) == plain_size);
+    assert(get_storage_memory(storage) < plain_memory);
+    assert(decompress_file_to_buffer(files[0], check) == 0);
+    assert(memcmp(check, text, content_size) == 0);
+
+    // a content that does not compress is left as it is, and it is not tried
+    // again until it changes. Small files are never compressed
+    assert(choose_compression_candidate(storage, NULL) == files[1]);
+    assert(compress_file(storage, files[1]) == 0);
+    assert(files[1]->compressed == NULL && files[1]->incompressible);
+    assert(files[1]->data.size == content_size);
+    assert(choose_compression_candidate(storage, NULL) == NULL);
+    assert(bump_file_version(storage, files[1]) == 0);
+    assert(choose_compression_candidate(storage, NULL) == files[1]);
+
+    // the file is decompressed in place before it is modified
+    assert(decompress_file(storage, files[0]) == 0);
+    assert(files[0]->compressed == NULL && files[0]->data.size == content_size);
+    file_data_copy(&files[0]->data, check);
+    assert(memcmp(check, text, content_size) == 0);
+    assert(storage->total_size == plain_size && get_logical_size(storage) == plain_size);
+    assert(get_storage_memory(storage) == plain_memory);
+    assert(decompress_file(storage, files[0]) == 0);
+    assert(storage->statistics.num_compressions == 1 && storage->statistics.num_decompressions == 1);
+
+    // a compressed file taken from the storage keeps its whole content
+    assert(compress_file(storage, files[0]) == 0);
+    assert(take_file_from_storage(storage, files[0]) == 0);
+    assert(files[0]->compressed == NULL && files[0]->data.size == content_size);
+    assert(storage->total_size == plain_size - content_size);
+    assert(get_logical_size(storage) == storage->total_size);
+    assert(destroy_vfile(storage, files[0]) == 0);
+
+    // the compressed files are removed and destroyed with their content
+    for (int i = 1; i < 3; ++i) {
+        assert(remove_file_from_storage(storage, files[i]) == 0);
+        assert(destroy_vfile(storage, files[i]) == 0);
+    }
+    assert(storage->total_size == 0 && get_storage_memory(storage) == 0);
+    files[0] = create_vfile(storage);
+    assert(files[0] != NULL);
+    files[0]->filename = malloc(6 * sizeof(char));
+    strcpy(files[0]->filename, "AAAAA");
+    assert(file_data_append(&files[0]->data, text, content_size) == 0);
+    files[0]->size = content_size;
+    assert(add_vfile_to_storage(storage, files[0]) == 0);
+    assert(compress_file(storage, files[0]) == 0);
     assert(destroy_file_storage(storage) == 0);
+    free(text);
+    free(noise);
+    free(check);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,294 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "storage_fixtures.h"
+#include "wal.h"
+
+#define NUM_CLIENTS 3
+
+struct sender_arg {
+    int control_fd;
+    file_storage_t* storage;
+    int snapshot_fd;
+    int listen_fd;
+    fd_set* clients;
+    int clients_max;
+    connection_state_t* connections;
+    uint64_t wal_sequence;
+    int res;
+};
+
+static void* sender_entry_point(void* arg)
+{
+    struct sender_arg* sender = arg;
+    sender->res = handoff_send(sender->control_fd, sender->storage, sender->snapshot_fd, sender->listen_fd,
+        sender->clients, sender->clients_max, sender->connections, sender->wal_sequence);
+    return NULL;
+}
+
+/**
+ * Hand off the storage from a thread to this one, with the snapshot in
+ * snapshot_fd (-1 to write it in the send) and the log up to wal_sequence,
+ * and return the outcome of the receive, that is the one of the send too
+*/
+static int handoff(file_storage_t* old_storage, int snapshot_fd, int listen_fd, fd_set* clients, int clients_max,
+    connection_state_t* old_connections, uint64_t wal_sequence, file_storage_t* new_storage,
+    unsigned int max_num_files, connection_state_t* new_connections, handoff_catch_up_t catch_up,
+    handoff_state_t* state)
+{
+    int control[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, control) == 0);
+    struct sender_arg sender
+        = { control[0], old_storage, snapshot_fd, listen_fd, clients, clients_max, old_connections, wal_sequence, 0 };
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, sender_entry_point, &sender) == 0);
+    int res = handoff_receive(control[1], new_storage, max_num_files, 1000000, new_connections, catch_up, NULL, state);
+    // without the acknowledgement the sender fails
+    close(control[1]);
+    assert(pthread_join(tid, NULL) == 0);
+    close(control[0]);
+    assert(sender.res == res);
+    return res;
+}
+
+/**
+ * Catch up with the log of the pre-copy test, where the file "late" is
+ * written in record 8 after the snapshot
+*/
+static int catch_up_late(void* arg, file_storage_t* storage, uint64_t* wal_sequence)
+{
+    (void)arg;
+    assert(*wal_sequence == 7);
+    vfile_t* vfile = create_vfile(storage);
+    assert(vfile != NULL);
+    vfile->filename = malloc(sizeof("late"));
+    assert(vfile->filename != NULL);
+    strcpy(vfile->filename, "late");
+    assert(add_vfile_to_storage(storage, vfile) == 0);
+    *wal_sequence = 8;
+    return 0;
+}
+
+/**
+ * Close the connections received in state
+*/
+static void close_state(handoff_state_t* state)
+{
+    for (int fd = 0; fd <= state->clients_max; ++fd) {
+        if (FD_ISSET(fd, &state->clients)) {
+            close(fd);
+        }
+    }
+    close(state->listen_fd);
+}
+
+/**
+ * Returns the index of the client connected to fd, that is the byte sent by
+ * the other end of the connection
+*/
+static int client_of(int fd)
+{
+    char index;
+    assert(read(fd, &index, 1) == 1);
+    return index;
+}
+
+int main(void)
+{
+    // the connections of the clients, the server has the first ends
+    int pairs[NUM_CLIENTS][2];
+    fd_set clients;
+    FD_ZERO(&clients);
+    int clients_max = -1;
+    connection_state_t* old_connections = calloc(FD_SETSIZE, sizeof(connection_state_t));
+    assert(old_connections != NULL);
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == 0);
+        FD_SET(pairs[i][0], &clients);
+        if (pairs[i][0] > clients_max) {
+            clients_max = pairs[i][0];
+        }
+        old_connections[pairs[i][0]].eject_mode = i;
+    }
+    int listen_pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, listen_pair) == 0);
+
+    // a file locked by the first client and waited for by the second, and a
+    // file removed so that its handle is stale
+    file_storage_t* old_storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(old_storage != NULL);
+    vfile_t* removed = add_file(old_storage, "removed", 10, "r");
+    uint64_t stale_handle = removed->handle;
+    assert(remove_file_from_storage(old_storage, removed) == 0 && destroy_vfile(old_storage, removed) == 0);
+    vfile_t* ab = add_file(old_storage, "ab", 100, "b");
+    vfile_t* a = add_file(old_storage, "a", 100000, "a");
+    vfile_t* c = add_file(old_storage, "c", 0, "c");
+    FD_SET(pairs[0][0], &a->opened_by);
+    FD_SET(pairs[1][0], &a->opened_by);
+    a->locked_by = pairs[0][0];
+    FD_SET(pairs[1][0], &a->lock_queue);
+    a->lock_queue_max = pairs[1][0];
+    FD_SET(pairs[2][0], &ab->opened_by);
+    uint64_t a_handle = a->handle, ab_handle = ab->handle, c_handle = c->handle;
+    assert(bump_file_version(old_storage, a) == 0);
+    assert(a_handle != stale_handle && get_file_from_handle(old_storage, stale_handle) == NULL);
+
+    // the connections are received as new fds, and the state follows them
+    file_storage_t* new_storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(new_storage != NULL);
+    connection_state_t* new_connections = calloc(FD_SETSIZE, sizeof(connection_state_t));
+    assert(new_connections != NULL);
+    handoff_state_t state;
+    assert(handoff(old_storage, -1, listen_pair[0], &clients, clients_max, old_connections, 7, new_storage, 100,
+               new_connections, NULL, &state)
+        == 0);
+    assert(state.num_clients == NUM_CLIENTS && state.num_files == 3 && state.wal_sequence == 7);
+    assert(state.listen_fd != listen_pair[0]);
+    assert(write(listen_pair[1], "l", 1) == 1);
+    assert(client_of(state.listen_fd) == 'l');
+    int new_fds[NUM_CLIENTS];
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        char index = i;
+        assert(write(pairs[i][1], &index, 1) == 1);
+    }
+    for (int fd = 0; fd <= state.clients_max; ++fd) {
+        if (FD_ISSET(fd, &state.clients)) {
+            int i = client_of(fd);
+            assert(i >= 0 && i < NUM_CLIENTS);
+            new_fds[i] = fd;
+            assert(new_connections[fd].eject_mode == i);
+        }
+    }
+
+    // the files keep their handles, content and sessions
+    vfile_t* new_a = get_file_from_handle(new_storage, a_handle);
+    assert(new_a != NULL && strcmp(new_a->filename, "a") == 0 && new_a->size == 100000);
+    size_t num_segments;
+    const struct iovec* segments = get_file_segments(new_a, &num_segments);
+    assert(num_segments == 1 && ((char*)segments[0].iov_base)[99999] == 'a');
+    assert(FD_ISSET(new_fds[0], &new_a->opened_by) && FD_ISSET(new_fds[1], &new_a->opened_by));
+    assert(!FD_ISSET(new_fds[2], &new_a->opened_by));
+    assert(new_a->locked_by == new_fds[0]);
+    // the files keep their versions, and the new versions are newer
+    assert(new_a->version == a->version && new_storage->version_clock == old_storage->version_clock);
+    assert(FD_ISSET(new_fds[1], &new_a->lock_queue) && new_a->lock_queue_max == new_fds[1]);
+    vfile_t* new_ab = get_file_from_handle(new_storage, ab_handle);
+    assert(new_ab != NULL && strcmp(new_ab->filename, "ab") == 0);
+    assert(FD_ISSET(new_fds[2], &new_ab->opened_by) && new_ab->locked_by == -1);
+    assert(get_file_from_handle(new_storage, c_handle) != NULL);
+    assert(get_file_from_handle(new_storage, stale_handle) == NULL);
+
+    // the new files take the free slots, without reviving the stale handle
+    vfile_t* d = add_file(new_storage, "d", 1, "d");
+    assert(d->handle != stale_handle && get_file_from_handle(new_storage, d->handle) == d);
+    assert(get_file_from_handle(new_storage, a_handle) == new_a);
+    close_state(&state);
+    assert(destroy_file_storage(new_storage) == 0);
+
+    // the files that do not fit in the limits of the new server are skipped,
+    // with their sessions
+    new_storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(new_storage != NULL);
+    memset(new_connections, 0, FD_SETSIZE * sizeof(connection_state_t));
+    assert(handoff(old_storage, -1, listen_pair[0], &clients, clients_max, old_connections, 7, new_storage, 2,
+               new_connections, NULL, &state)
+        == 0);
+    assert(state.num_files == 2 && get_file_from_handle(new_storage, ab_handle) == NULL);
+    new_a = get_file_from_handle(new_storage, a_handle);
+    assert(new_a != NULL && new_a->locked_by != -1);
+    close_state(&state);
+    assert(destroy_file_storage(new_storage) == 0);
+
+    // the snapshot written in background needs the log
+    handoff_snapshot_t snapshot = { -1, -1 };
+    assert(handoff_start_snapshot(old_storage, &snapshot) == -1 && errno == EINVAL);
+    char wal_path[] = "/tmp/handoff_test_walXXXXXX";
+    int wal_fd = mkstemp(wal_path);
+    assert(wal_fd != -1);
+    close(wal_fd);
+    assert((old_storage->wal = wal_open(wal_path, WAL_DURABILITY_NONE, 0, 8)) != NULL);
+    assert(handoff_start_snapshot(old_storage, &snapshot) == 0 && snapshot.fd != -1);
+    assert(handoff_finish_snapshot(&snapshot, true) == 1 && snapshot.pid == -1);
+
+    // the clients go on meanwhile: a file opened after the snapshot is not in
+    // it, so the new process fails without the mutations of the log
+    vfile_t* late = add_file(old_storage, "late", 0, "l");
+    FD_SET(pairs[2][0], &late->opened_by);
+    uint64_t late_sequence;
+    assert(wal_append(old_storage->wal, WAL_CREATE, "late", late->version, NULL, 0, &late_sequence) == 0);
+    assert(late_sequence == 8);
+    new_storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(new_storage != NULL);
+    assert(handoff(old_storage, snapshot.fd, listen_pair[0], &clients, clients_max, old_connections, late_sequence,
+               new_storage, 100, new_connections, NULL, &state)
+            == -1
+        && errno == EPROTO);
+    assert(destroy_file_storage(new_storage) == 0);
+
+    // after catching up the session applies to the file too
+    new_storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(new_storage != NULL);
+    memset(new_connections, 0, FD_SETSIZE * sizeof(connection_state_t));
+    assert(handoff(old_storage, snapshot.fd, listen_pair[0], &clients, clients_max, old_connections, late_sequence,
+               new_storage, 100, new_connections, catch_up_late, &state)
+        == 0);
+    assert(state.num_files == 4 && state.wal_sequence == 8);
+    vfile_t* new_late = get_file_from_handle(new_storage, late->handle);
+    assert(new_late != NULL && strcmp(new_late->filename, "late") == 0);
+    int num_opened = 0;
+    for (int fd = 0; fd <= state.clients_max; ++fd) {
+        if (FD_ISSET(fd, &new_late->opened_by)) {
+            assert(FD_ISSET(fd, &state.clients));
+            ++num_opened;
+        }
+    }
+    assert(num_opened == 1);
+    close_state(&state);
+    assert(destroy_file_storage(new_storage) == 0);
+    handoff_discard_snapshot(&snapshot);
+    assert(snapshot.fd == -1);
+    assert(wal_close(old_storage->wal) == 0);
+    old_storage->wal = NULL;
+    assert(unlink(wal_path) == 0);
+
+    // if the new process goes away, the old one keeps its server
+    int control[2];
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, control) == 0);
+    close(control[1]);
+    assert(handoff_send(control[0], old_storage, -1, listen_pair[0], &clients, clients_max, old_connections, 7) == -1);
+    close(control[0]);
+
+    // no server is listening
+    assert(handoff_connect("/tmp/handoff_test_missing") == -1 && errno == ENOENT);
+    char path[] = "/tmp/handoff_testXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    int listen_fd = handoff_listen(path);
+    assert(listen_fd != -1);
+    int control_fd = handoff_connect(path);
+    assert(control_fd != -1);
+    close(control_fd);
+    close(listen_fd);
+    assert(handoff_connect(path) == -1 && errno == ECONNREFUSED);
+    assert(unlink(path) == 0);
+
+    for (int i = 0; i < NUM_CLIENTS; ++i) {
+        close(pairs[i][0]);
+        close(pairs[i][1]);
+    }
+    close(listen_pair[0]);
+    close(listen_pair[1]);
+    free(old_connections);
+    free(new_connections);
+    assert(destroy_file_storage(old_storage) == 0);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "object_pool.h"
+#include "unbounded_shared_buffer.h"
+
+#define NUM_ITEMS 100000
+
+object_pool_t* pool;
+usbuf_t* buf;
+
+// every object carries the identity of its producer and a sequence number,
+// a corrupted object means that it has been given to two threads at once
+struct item {
+    long producer;
+    long seq;
+};
+
+void* producer(void* arg)
+{
+    long id = (long)arg;
+    for (long i = 0; i < NUM_ITEMS; ++i) {
+        struct item* it = object_pool_alloc(pool);
+        assert(it != NULL);
+        it->producer = id;
+        it->seq = i;
+        assert(usbuf_put(buf, it) == 0);
+    }
+    return NULL;
+}
+
+void* consumer(void* arg)
+{
+    for (;;) {
+        void* res;
+        int get_res = usbuf_get(buf, &res);
+        assert(get_res == 0 || get_res == -2);
+        if (get_res == -2) {
+            break;
+        }
+        struct item* it = res;
+        assert(it->producer >= 0 && it->producer < 4);
+        assert(it->seq >= 0 && it->seq < NUM_ITEMS);
+        it->producer = -1;
+        // objects are freed by a thread different from the one that allocated them
+        object_pool_free(pool, it);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pool = create_object_pool(sizeof(struct item));
+    buf = usbuf_create(FIFO_POLICY);
+    assert(pool != NULL && buf != NULL);
+
+    pthread_t producers[4];
+    pthread_t consumers[4];
+    for (long i = 0; i < 4; ++i) {
+        pthread_create(&producers[i], NULL, producer, (void*)i);
+        pthread_create(&consumers[i], NULL, consumer, NULL);
+    }
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(producers[i], NULL);
+    }
+    assert(usbuf_close(buf) == 0);
+    for (int i = 0; i < 4; ++i) {
+        pthread_join(consumers[i], NULL);
+    }
+
+    // all the threads terminated, so their caches have been given back
+    struct object_pool_statistics stats;
+    assert(object_pool_get_statistics(pool, &stats) == 0);
+    assert(stats.num_taken == 0);
+    printf("slabs: %lu, refills: %lu, flushes: %lu\n", stats.num_slabs, stats.num_refills, stats.num_flushes);
+
+    assert(usbuf_free(buf) == 0);
+    assert(destroy_object_pool(pool) == 0);
+    return 0;
+}
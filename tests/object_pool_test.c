@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object_pool.h"
+
+#define NUM_OBJECTS 200
+
+int main(void)
+{
+    assert(create_object_pool(0) == NULL);
+
+    object_pool_t* pool = create_object_pool(100);
+    assert(pool != NULL);
+
+    // the objects are distinct, aligned and usable
+    char* objects[NUM_OBJECTS];
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        objects[i] = object_pool_alloc(pool);
+        assert(objects[i] != NULL);
+        assert((uintptr_t)objects[i] % 16 == 0);
+        memset(objects[i], i, 100);
+    }
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        for (int j = 0; j < 100; ++j) {
+            assert(objects[i][j] == (char)i);
+        }
+    }
+
+    // the freed objects are reused, without allocating new slabs
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        object_pool_free(pool, objects[i]);
+    }
+    struct object_pool_statistics stats;
+    assert(object_pool_get_statistics(pool, &stats) == 0);
+    unsigned long num_slabs = stats.num_slabs;
+    assert(num_slabs == (NUM_OBJECTS + OBJECT_POOL_SLAB_OBJECTS - 1) / OBJECT_POOL_SLAB_OBJECTS);
+    for (int i = 0; i < NUM_OBJECTS; ++i) {
+        objects[i] = object_pool_alloc(pool);
+        assert(objects[i] != NULL);
+    }
+    assert(object_pool_get_statistics(pool, &stats) == 0);
+    assert(stats.num_slabs == num_slabs);
+    // the cache of the thread gave back the objects in excess to the pool
+    assert(stats.num_flushes > 0);
+    assert(stats.maximum_taken >= NUM_OBJECTS);
+    assert(stats.num_taken <= NUM_OBJECTS + 2 * OBJECT_POOL_CACHE_BATCH);
+
+    // the objects still in use are freed with the pool
+    assert(destroy_object_pool(pool) == 0);
+    return 0;
+}
@@ -0,0 +1,181 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "preloader.h"
+
+/**
+ * Write in dir/name size bytes, all equal to fill
+*/
+static void write_file(const char* dir, const char* name, size_t size, char fill)
+{
+    char path[256];
+    sprintf(path, "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    assert(f != NULL);
+    for (size_t i = 0; i < size; ++i) {
+        assert(fputc(fill, f) == fill);
+    }
+    assert(fclose(f) == 0);
+}
+
+/**
+ * Assert that the storage has a file named dir/name with size bytes, all
+ * equal to fill
+*/
+static void check_file(file_storage_t* storage, const char* dir, const char* name, size_t size, char fill)
+{
+    char path[256];
+    sprintf(path, "%s/%s", dir, name);
+    vfile_t* vfile = get_file_from_name(storage, strlen(path) + 1, path);
+    assert(vfile != NULL && vfile->size == size);
+    size_t num_segments;
+    const struct iovec* segments = get_file_segments(vfile, &num_segments);
+    size_t total = 0;
+    for (size_t i = 0; i < num_segments; ++i) {
+        for (size_t j = 0; j < segments[i].iov_len; ++j) {
+            assert(((char*)segments[i].iov_base)[j] == fill);
+        }
+        total += segments[i].iov_len;
+    }
+    assert(total == size);
+}
+
+static void remove_path(const char* dir, const char* name)
+{
+    char path[256];
+    sprintf(path, "%s/%s", dir, name);
+    assert(remove(path) == 0);
+}
+
+int main(void)
+{
+    // dir/a, dir/sub/b, dir/sub/deeper/c, a link to a file and a link to a
+    // directory
+    char dir[] = "/tmp/preloader_testXXXXXX";
+    assert(mkdtemp(dir) != NULL);
+    char path[256];
+    sprintf(path, "%s/sub", dir);
+    assert(mkdir(path, 0700) == 0);
+    sprintf(path, "%s/sub/deeper", dir);
+    assert(mkdir(path, 0700) == 0);
+    write_file(dir, "a", 10, 'a');
+    write_file(dir, "sub/b", 5000, 'b');
+    write_file(dir, "sub/deeper/c", 0, 'c');
+    sprintf(path, "%s/a", dir);
+    char link[256];
+    sprintf(link, "%s/alink", dir);
+    assert(symlink(path, link) == 0);
+    sprintf(path, "%s/sub", dir);
+    sprintf(link, "%s/sublink", dir);
+    assert(symlink(path, link) == 0);
+
+    usbuf_t* logger_buffer = usbuf_create(FIFO_POLICY);
+    assert(logger_buffer != NULL);
+    struct preload_statistics stats;
+
+    // the directory must exist
+    file_storage_t* storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(preload_directory(storage, "/tmp/preloader_test_missing", 2, 100, 100000, NULL, logger_buffer, &stats) == -1);
+    assert(storage->num_files == 0);
+
+    // the files keep the names given by the client, and the links to the
+    // directories are not followed
+    assert(preload_directory(storage, dir, 3, 100, 100000, NULL, logger_buffer, &stats) == 0);
+    assert(stats.num_found == 4 && stats.num_loaded == 4 && stats.num_skipped == 0 && stats.num_errors == 0);
+    assert(stats.loaded_size == 5020 && stats.num_ejected == 0);
+    assert(storage->num_files == 4 && storage->total_size == 5020);
+    check_file(storage, dir, "a", 10, 'a');
+    check_file(storage, dir, "alink", 10, 'a');
+    check_file(storage, dir, "sub/b", 5000, 'b');
+    check_file(storage, dir, "sub/deeper/c", 0, 'c');
+    sprintf(path, "%s/sublink/b", dir);
+    assert(get_file_from_name(storage, strlen(path) + 1, path) == NULL);
+
+    // the files already in the storage are not replaced
+    write_file(dir, "a", 20, 'z');
+    assert(preload_directory(storage, dir, 1, 100, 100000, NULL, logger_buffer, &stats) == 0);
+    assert(stats.num_found == 4 && stats.num_loaded == 0 && stats.num_skipped == 4);
+    check_file(storage, dir, "a", 10, 'a');
+    assert(destroy_file_storage(storage) == 0);
+
+    // the storage stays within its limits, ejecting the files following its
+    // policy, and the files bigger than the storage are skipped
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(preload_directory(storage, dir, 2, 2, 4000, NULL, logger_buffer, &stats) == 0);
+    assert(stats.num_found == 4 && stats.num_loaded == 3 && stats.num_skipped == 1);
+    assert(stats.num_ejected == 1);
+    assert(storage->num_files == 2 && storage->total_size <= 4000);
+    assert(storage->statistics.num_replacements == 1);
+    sprintf(path, "%s/sub/b", dir);
+    assert(get_file_from_name(storage, strlen(path) + 1, path) == NULL);
+    assert(destroy_file_storage(storage) == 0);
+
+    // with the deduplication the files that contain the same chunks share
+    // them, as the files written by the clients
+    write_file(dir, "dup1", 2 * FILE_CHUNK_SIZE, 'd');
+    write_file(dir, "dup2", 2 * FILE_CHUNK_SIZE, 'd');
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL && enable_file_deduplication(storage) == 0);
+    assert(preload_directory(storage, dir, 2, 100, 1000000, NULL, logger_buffer, &stats) == 0);
+    assert(stats.num_loaded == 6 && stats.loaded_size == 20 + 20 + 5000 + 4 * FILE_CHUNK_SIZE);
+    assert(storage->total_size == 20 + 5000 + FILE_CHUNK_SIZE);
+    check_file(storage, dir, "dup1", 2 * FILE_CHUNK_SIZE, 'd');
+    check_file(storage, dir, "dup2", 2 * FILE_CHUNK_SIZE, 'd');
+    check_file(storage, dir, "alink", 20, 'z');
+    assert(destroy_file_storage(storage) == 0);
+    remove_path(dir, "dup1");
+    remove_path(dir, "dup2");
+
+    // the files loaded take their access hints, and the files without a hint
+    // are older than all of them
+    storage = create_file_storage(LRU_REPLACEMENT, 0);
+    assert(storage != NULL);
+    sprintf(path, "%s/sub/b", dir);
+    access_hint_t hint = { path, 7, 1000 };
+    access_hints_t hints = { 1, &hint, NULL, 1000 };
+    assert(preload_directory(storage, dir, 2, 100, 100000, &hints, logger_buffer, &stats) == 0);
+    assert(stats.num_loaded == 4 && stats.num_hinted == 1);
+    vfile_t* hinted = get_file_from_name(storage, strlen(path) + 1, path);
+    assert(hinted != NULL && hinted->used_counter == 7 && hinted->last_used == 1000);
+    sprintf(path, "%s/a", dir);
+    vfile_t* unhinted = get_file_from_name(storage, strlen(path) + 1, path);
+    assert(unhinted != NULL && unhinted->used_counter == 0 && unhinted->last_used == 999);
+    assert(destroy_file_storage(storage) == 0);
+
+    // the files that cannot be read are counted as errors
+    if (geteuid() != 0) {
+        storage = create_file_storage(FIFO_REPLACEMENT, 0);
+        assert(storage != NULL);
+        sprintf(path, "%s/sub/b", dir);
+        assert(chmod(path, 0) == 0);
+        assert(preload_directory(storage, dir, 2, 100, 100000, NULL, logger_buffer, &stats) == 0);
+        assert(stats.num_loaded == 3 && stats.num_errors == 1);
+        assert(get_file_from_name(storage, strlen(path) + 1, path) == NULL);
+        assert(destroy_file_storage(storage) == 0);
+    }
+
+    remove_path(dir, "sublink");
+    remove_path(dir, "alink");
+    remove_path(dir, "sub/deeper/c");
+    remove_path(dir, "sub/deeper");
+    remove_path(dir, "sub/b");
+    remove_path(dir, "sub");
+    remove_path(dir, "a");
+    assert(rmdir(dir) == 0);
+
+    // free the log messages
+    assert(usbuf_close(logger_buffer) == 0);
+    void* msg;
+    while (usbuf_get(logger_buffer, &msg) == 0) {
+        free(msg);
+    }
+    assert(usbuf_free(logger_buffer) == 0);
+    return 0;
+}
@@ -5,6 +5,7 @@
 #include <unistd.h>
 
 #include "protocol.h"
+#include "utils.h"
 
 int main(void)
 {
@@ -210,5 +211,291 @@ int main(void)
     assert(recv.filename[recv.name_length] == '\0');
     assert(destroy_packet(&recv) == 0);
 
+    // TEST READ_FILE_IF_MODIFIED
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = READ_FILE_IF_MODIFIED;
+    send.name_length = 5;
+    send.filename = dummy_filename;
+    send.version = 42;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == READ_FILE_IF_MODIFIED);
+    assert(recv.name_length == 5);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(recv.filename[recv.name_length] == '\0');
+    assert(recv.version == 42);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST VERSIONED_DATA
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = VERSIONED_DATA;
+    send.version = 42;
+    send.data_size = 10;
+    send.data = dummy_data;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == VERSIONED_DATA);
+    assert(recv.version == 42);
+    assert(recv.data_size == 10);
+    for (int i = 0; i < 10; ++i) {
+        assert(((char*)recv.data)[i] == dummy_data[i]);
+    }
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST NOT_MODIFIED
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = NOT_MODIFIED;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == NOT_MODIFIED);
+
+    // TEST LIST_FILES
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = LIST_FILES;
+    send.name_length = 5;
+    send.filename = dummy_filename;
+    send.cursor = 7;
+    send.count = 42;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == LIST_FILES);
+    assert(recv.name_length == 5);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(recv.cursor == 7);
+    assert(recv.count == 42);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST LIST_FILES with empty prefix
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = LIST_FILES;
+    send.name_length = 0;
+    send.filename = "";
+    send.count = -1;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == LIST_FILES);
+    assert(recv.name_length == 0);
+    assert(strcmp(recv.filename, "") == 0);
+    assert(recv.cursor == 0);
+    assert(recv.count == -1);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST STAT_FILE
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = STAT_FILE;
+    send.name_length = 5;
+    send.filename = dummy_filename;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == STAT_FILE);
+    assert(recv.name_length == 5);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST FILE_INFO
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = FILE_INFO;
+    send.name_length = 5;
+    send.filename = dummy_filename;
+    send.data_size = 1000;
+    send.version = 3;
+    send.cursor = 9;
+    send.flags = INFO_LOCKED | INFO_OPENED_BY_YOU;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == FILE_INFO);
+    assert(recv.name_length == 5);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(recv.data_size == 1000);
+    assert(recv.version == 3);
+    assert(recv.cursor == 9);
+    assert(recv.flags == (INFO_LOCKED | INFO_OPENED_BY_YOU));
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST READ_FILES, REMOVE_FILES, LOCK_FILES
+    char batch_ops[3] = { READ_FILES, REMOVE_FILES, LOCK_FILES };
+    char* batch_names[3] = { "A", "BB", "CCC" };
+    uint64_t batch_lengths[3] = { 1, 2, 3 };
+    for (int op = 0; op < 3; ++op) {
+        clear_packet(&send);
+        clear_packet(&recv);
+        send.op = batch_ops[op];
+        send.count = 3;
+        send.filenames = batch_names;
+        send.name_lengths = batch_lengths;
+        assert(send_packet(fds[1], &send) > 0);
+        assert(receive_packet(fds[0], &recv) > 0);
+        assert(recv.op == batch_ops[op]);
+        assert(recv.count == 3);
+        for (int i = 0; i < 3; ++i) {
+            assert(recv.name_lengths[i] == batch_lengths[i]);
+            assert(strcmp(recv.filenames[i], batch_names[i]) == 0);
+        }
+        assert(destroy_packet(&recv) == 0);
+    }
+
+    // a batch with a count out of range is malformed
+    int64_t bad_counts[2] = { 0, MAX_BATCH_FILES + 1 };
+    for (int i = 0; i < 2; ++i) {
+        char bad_op = READ_FILES;
+        assert(write(fds[1], &bad_op, 1) == 1);
+        assert(write(fds[1], &bad_counts[i], 8) == 8);
+        clear_packet(&recv);
+        errno = 0;
+        assert(receive_packet(fds[0], &recv) == -1 && errno == EBADMSG);
+        assert(recv.count == 0 && destroy_packet(&recv) == 0);
+    }
+    // and so is an unknown opcode
+    char bad_op = 127;
+    assert(write(fds[1], &bad_op, 1) == 1);
+    clear_packet(&recv);
+    errno = 0;
+    assert(receive_packet(fds[0], &recv) == -1 && errno == EBADMSG);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST HANDLE, READ_HANDLE, LOCK_HANDLE, UNLOCK_HANDLE, CLOSE_HANDLE
+    char handle_ops[5] = { HANDLE, READ_HANDLE, LOCK_HANDLE, UNLOCK_HANDLE, CLOSE_HANDLE };
+    for (int op = 0; op < 5; ++op) {
+        clear_packet(&send);
+        clear_packet(&recv);
+        send.op = handle_ops[op];
+        send.handle = 0x100000002;
+        assert(send_packet(fds[1], &send) > 0);
+        assert(receive_packet(fds[0], &recv) > 0);
+        assert(recv.op == handle_ops[op]);
+        assert(recv.handle == 0x100000002);
+        assert(destroy_packet(&recv) == 0);
+    }
+
+    // TEST WRITE_HANDLE, APPEND_HANDLE
+    char handle_data_ops[2] = { WRITE_HANDLE, APPEND_HANDLE };
+    for (int op = 0; op < 2; ++op) {
+        clear_packet(&send);
+        clear_packet(&recv);
+        send.op = handle_data_ops[op];
+        send.handle = 42;
+        send.data_size = 5;
+        send.data = "hello";
+        assert(send_packet(fds[1], &send) > 0);
+        assert(receive_packet(fds[0], &recv) > 0);
+        assert(recv.op == handle_data_ops[op]);
+        assert(recv.handle == 42);
+        assert(recv.data_size == 5);
+        assert(memcmp(recv.data, "hello", 5) == 0);
+        assert(destroy_packet(&recv) == 0);
+    }
+
+    // TEST the payload received separately from the header
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = APPEND_TO_FILE;
+    send.name_length = 5;
+    send.filename = "AAAAA";
+    send.data_size = 5;
+    send.data = "hello";
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet_header(fds[0], &recv) > 0);
+    assert(recv.op == APPEND_TO_FILE);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(recv.data_size == 5 && recv.data == NULL);
+    assert(receive_packet_payload(fds[0], &recv) > 0);
+    assert(memcmp(recv.data, "hello", 5) == 0);
+    assert(destroy_packet(&recv) == 0);
+
+    // the payload can be read directly from the fd
+    clear_packet(&recv);
+    send.op = APPEND_HANDLE;
+    send.handle = 42;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet_header(fds[0], &recv) > 0);
+    assert(recv.op == APPEND_HANDLE && recv.data_size == 5 && recv.data == NULL);
+    char payload[5];
+    assert(readn(fds[0], payload, 5) == 5);
+    assert(memcmp(payload, "hello", 5) == 0);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST the names and the small payloads received in an arena
+    arena_t* arena = create_arena(1024);
+    assert(arena != NULL);
+    clear_packet(&send);
+    clear_packet(&recv);
+    recv.arena = arena;
+    send.op = WRITE_FILE;
+    send.name_length = 5;
+    send.filename = "AAAAA";
+    send.data_size = 5;
+    send.data = "hello";
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(strcmp(recv.filename, "AAAAA") == 0);
+    assert(memcmp(recv.data, "hello", 5) == 0);
+    assert(packet_data_in_arena(&recv));
+    assert(arena->used > 0);
+    // nothing is freed, the memory belongs to the arena
+    assert(destroy_packet(&recv) == 0);
+
+    // the big payloads are allocated on the heap
+    char big_data[PACKET_ARENA_MAX_DATA + 1];
+    memset(big_data, 'x', sizeof(big_data));
+    clear_packet(&recv);
+    recv.arena = arena;
+    send.data_size = sizeof(big_data);
+    send.data = big_data;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(!packet_data_in_arena(&recv));
+    assert(memcmp(recv.data, big_data, sizeof(big_data)) == 0);
+    assert(destroy_packet(&recv) == 0);
+
+    char* arena_names[3] = { "A", "BB", "CCC" };
+    uint64_t arena_name_lengths[3] = { 1, 2, 3 };
+    clear_packet(&send);
+    clear_packet(&recv);
+    recv.arena = arena;
+    send.op = READ_FILES;
+    send.count = 3;
+    send.filenames = arena_names;
+    send.name_lengths = arena_name_lengths;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    for (int i = 0; i < 3; ++i) {
+        assert(strcmp(recv.filenames[i], arena_names[i]) == 0);
+    }
+    assert(destroy_packet(&recv) == 0);
+    arena_reset(arena);
+    assert(arena->used == 0);
+    assert(destroy_arena(arena) == 0);
+
+    // TEST SET_OPTIONS
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = SET_OPTIONS;
+    send.flags = EJECT_SEND_NAMES;
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == SET_OPTIONS);
+    assert(recv.flags == EJECT_SEND_NAMES);
+    assert(destroy_packet(&recv) == 0);
+
+    // TEST FILE_NAME
+    clear_packet(&send);
+    clear_packet(&recv);
+    send.op = FILE_NAME;
+    send.name_length = 5;
+    send.filename = "ABCDE";
+    assert(send_packet(fds[1], &send) > 0);
+    assert(receive_packet(fds[0], &recv) > 0);
+    assert(recv.op == FILE_NAME);
+    assert(recv.name_length == 5);
+    assert(strcmp(recv.filename, "ABCDE") == 0);
+    assert(destroy_packet(&recv) == 0);
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "storage_fixtures.h"
+
+/**
+ * Check that the content of the file with the given name is made of size
+ * bytes, given by the pattern string repeated
+*/
+static void check_file(file_storage_t* storage, const char* filename, size_t size, const char* pattern)
+{
+    vfile_t* vfile = get_file_from_name(storage, strlen(filename), filename);
+    assert(vfile != NULL);
+    assert(vfile->size == size);
+    size_t num_segments;
+    const struct iovec* segments = get_file_segments(vfile, &num_segments);
+    size_t pos = 0;
+    for (size_t i = 0; i < num_segments; ++i) {
+        const char* segment = segments[i].iov_base;
+        for (size_t j = 0; j < segments[i].iov_len; ++j, ++pos) {
+            assert(segment[j] == pattern[pos % strlen(pattern)]);
+        }
+    }
+    assert(pos == size);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/snapshot_testXXXXXX";
+    uint64_t wal_sequence;
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    // a storage with plain, empty and compressed files
+    file_storage_t* storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(storage != NULL);
+    add_file(storage, "small", 10, "s");
+    add_file(storage, "empty", 0, "e");
+    vfile_t* big = add_file(storage, "big", 3 * MAX_SEGMENT_SIZE, "random-ish content 0123456789");
+    big->used_counter = 7;
+    big->last_used = 1234;
+    vfile_t* text = add_file(storage, "text", 100000, "compressible text ");
+    assert(compress_file(storage, text) == 0 && text->compressed != NULL);
+    assert(bump_file_version(storage, big) == 0);
+    uint64_t big_version = big->version;
+    uint64_t version_clock = storage->version_clock;
+    assert(save_snapshot(storage, path, 42) == 0);
+    assert(destroy_file_storage(storage) == 0);
+
+    // the files are loaded in the same order, with their content mapped
+    storage = create_file_storage(LRU_REPLACEMENT, 64);
+    assert(storage != NULL);
+    assert(load_snapshot(storage, path, 100, 100 * MAX_SEGMENT_SIZE, &wal_sequence) == 4);
+    assert(wal_sequence == 42);
+    assert(storage->num_files == 4);
+    assert(storage->total_size == 10 + 3 * MAX_SEGMENT_SIZE + 100000);
+    assert(strcmp(storage->first->filename, "small") == 0 && strcmp(storage->last->filename, "text") == 0);
+    check_file(storage, "small", 10, "s");
+    check_file(storage, "empty", 0, "e");
+    check_file(storage, "big", 3 * MAX_SEGMENT_SIZE, "random-ish content 0123456789");
+    check_file(storage, "text", 100000, "compressible text ");
+    big = get_file_from_name(storage, 3, "big");
+    assert(big->mapped.iov_base != NULL && big->data.size == 0);
+    assert(big->used_counter == 7 && big->last_used == 1234);
+    // the files keep their versions, and the new versions are newer than all
+    // the ones assigned before the snapshot
+    assert(big->version == big_version && storage->version_clock == version_clock);
+    // the mapped contents are not charged to the memory of the files
+    assert(storage->memory.data == 0);
+
+    // a mapped content is copied before it is modified, or when the file
+    // leaves the storage
+    assert(unshare_file_content(storage, big) == 0);
+    assert(big->mapped.iov_base == NULL && big->data.size == 3 * MAX_SEGMENT_SIZE);
+    assert(storage->memory.data > 3 * MAX_SEGMENT_SIZE);
+    check_file(storage, "big", 3 * MAX_SEGMENT_SIZE, "random-ish content 0123456789");
+    vfile_t* small = get_file_from_name(storage, 5, "small");
+    assert(take_file_from_storage(storage, small) == 0);
+    assert(small->mapped.iov_base == NULL && small->data.size == 10);
+    assert(destroy_vfile(storage, small) == 0);
+
+    // a mapped content can be compressed
+    text = get_file_from_name(storage, 4, "text");
+    assert(compress_file(storage, text) == 0);
+    assert(text->compressed != NULL && text->mapped.iov_base == NULL);
+
+    // a new snapshot can replace the one that is mapped
+    assert(save_snapshot(storage, path, 0) == 0);
+    assert(destroy_file_storage(storage) == 0);
+
+    // the oldest files are skipped if the snapshot does not fit in the limits
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(load_snapshot(storage, path, 2, 100 * MAX_SEGMENT_SIZE, &wal_sequence) == 2);
+    assert(get_file_from_name(storage, 5, "empty") == NULL);
+    assert(storage->version_clock == version_clock);
+    check_file(storage, "big", 3 * MAX_SEGMENT_SIZE, "random-ish content 0123456789");
+    check_file(storage, "text", 100000, "compressible text ");
+    assert(destroy_file_storage(storage) == 0);
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == 1);
+    check_file(storage, "text", 100000, "compressible text ");
+    // the storage shall be empty
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == -1 && errno == EINVAL);
+    assert(destroy_file_storage(storage) == 0);
+
+    // a missing, truncated or corrupted snapshot is not loaded
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    assert(load_snapshot(storage, "/tmp/snapshot_test_missing", 100, 200000, &wal_sequence) == -1 && errno == ENOENT);
+    assert(truncate(path, 100) == 0);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == -1 && errno == EINVAL);
+    FILE* f = fopen(path, "w");
+    assert(f != NULL);
+    fprintf(f, "not a snapshot, but long enough for the header");
+    fclose(f);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == -1 && errno == EINVAL);
+    assert(storage->num_files == 0 && storage->snapshot == NULL);
+
+    // the contents of the entries shall not overlap, even if their sizes add
+    // up to the size of the data
+    assert(destroy_file_storage(storage) == 0);
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    add_file(storage, "one", 100, "1");
+    add_file(storage, "two", 100, "2");
+    assert(save_snapshot(storage, path, 0) == 0);
+    assert(destroy_file_storage(storage) == 0);
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    fd = open(path, O_RDWR);
+    assert(fd != -1);
+    struct snapshot_entry first;
+    assert(pread(fd, &first, sizeof(first), sizeof(struct snapshot_header)) == sizeof(first));
+    off_t second = sizeof(struct snapshot_header) + sizeof(first) + 8;
+    assert(pwrite(fd, &first.offset, sizeof(first.offset), second + offsetof(struct snapshot_entry, offset))
+        == sizeof(first.offset));
+    close(fd);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == -1 && errno == EINVAL);
+    assert(storage->num_files == 0 && storage->snapshot == NULL);
+
+    // a name length that wraps around when it is padded is not in the index
+    // (the name has no padding, so the first null is past the contents)
+    assert(destroy_file_storage(storage) == 0);
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    add_file(storage, "eight-ch", 100, "1");
+    assert(save_snapshot(storage, path, 0) == 0);
+    assert(destroy_file_storage(storage) == 0);
+    storage = create_file_storage(FIFO_REPLACEMENT, 0);
+    assert(storage != NULL);
+    fd = open(path, O_RDWR);
+    assert(fd != -1);
+    uint64_t name_length = UINT64_MAX - 3;
+    assert(pwrite(fd, &name_length, sizeof(name_length),
+               sizeof(struct snapshot_header) + offsetof(struct snapshot_entry, name_length))
+        == sizeof(name_length));
+    close(fd);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == -1 && errno == EINVAL);
+    assert(storage->num_files == 0 && storage->snapshot == NULL);
+
+    // an empty storage has an empty snapshot
+    assert(save_snapshot(storage, path, 0) == 0);
+    assert(load_snapshot(storage, path, 100, 200000, &wal_sequence) == 0);
+    assert(destroy_file_storage(storage) == 0);
+
+    assert(unlink(path) == 0);
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spill_store.h"
+
+/**
+ * Returns a copy of str on the heap
+*/
+static char* copy_of(const char* str)
+{
+    char* copy = malloc(strlen(str) + 1);
+    assert(copy != NULL);
+    strcpy(copy, str);
+    return copy;
+}
+
+/**
+ * Put in the store a file with the given name and size bytes of content,
+ * all equal to fill
+*/
+static void put_file(spill_store_t* store, const char* filename, size_t size, char fill)
+{
+    file_data_t data;
+    init_file_data(&data);
+    char* buf = malloc(size);
+    assert(buf != NULL);
+    memset(buf, fill, size);
+    assert(file_data_append(&data, buf, size) == 0);
+    free(buf);
+    assert(spill_store_put(store, copy_of(filename), &data) == 0);
+    assert(data.size == 0);
+    destroy_file_data(&data);
+}
+
+/**
+ * Take the file with the given name and check its content
+*/
+static void take_file(spill_store_t* store, const char* filename, size_t size, char fill)
+{
+    file_data_t data;
+    init_file_data(&data);
+    assert(spill_store_take(store, filename, &data) == 0);
+    assert(data.size == size);
+    char* buf = malloc(size);
+    assert(buf != NULL);
+    file_data_copy(&data, buf);
+    for (size_t i = 0; i < size; ++i) {
+        assert(buf[i] == fill);
+    }
+    free(buf);
+    destroy_file_data(&data);
+}
+
+/**
+ * Wait until the writer thread has written all the files
+*/
+static void wait_written(spill_store_t* store)
+{
+    struct timespec delay = { 0, 1000000 };
+    for (;;) {
+        assert(pthread_mutex_lock(&store->mutex) == 0);
+        unsigned long pending = store->num_pending;
+        assert(pthread_mutex_unlock(&store->mutex) == 0);
+        if (pending == 0) {
+            return;
+        }
+        nanosleep(&delay, NULL);
+    }
+}
+
+/**
+ * Returns the number of files in dirname, except . and ..
+*/
+static int count_files(const char* dirname)
+{
+    DIR* dir = opendir(dirname);
+    assert(dir != NULL);
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            ++count;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+int main(void)
+{
+    char dirname[] = "/tmp/spill_store_testXXXXXX";
+    assert(mkdtemp(dirname) != NULL);
+
+    // the files left by a previous store are removed
+    char stale[sizeof(dirname) + 16];
+    sprintf(stale, "%s/42.spill", dirname);
+    FILE* f = fopen(stale, "w");
+    assert(f != NULL);
+    fclose(f);
+    spill_store_t* store = create_spill_store(dirname, 100000);
+    assert(store != NULL);
+    assert(count_files(dirname) == 0);
+
+    // the files are written to the disk, and they can be taken back
+    put_file(store, "a", 1000, 'a');
+    put_file(store, "b", 20000, 'b');
+    put_file(store, "c", 0, 'c');
+    wait_written(store);
+    assert(count_files(dirname) == 3);
+    assert(store->total_size == 21000);
+    take_file(store, "b", 20000, 'b');
+    assert(count_files(dirname) == 2);
+    assert(store->total_size == 1000);
+
+    // a file can be taken only once
+    file_data_t data;
+    init_file_data(&data);
+    assert(spill_store_take(store, "b", &data) == -1 && errno == ENOENT);
+    assert(spill_store_take(store, "d", &data) == -1 && errno == ENOENT);
+    take_file(store, "c", 0, 'c');
+    take_file(store, "a", 1000, 'a');
+    assert(count_files(dirname) == 0);
+
+    // a file can be taken also before it is written
+    put_file(store, "e", 50000, 'e');
+    take_file(store, "e", 50000, 'e');
+
+    // when the store is full the oldest files are dropped
+    put_file(store, "f", 60000, 'f');
+    put_file(store, "g", 30000, 'g');
+    put_file(store, "h", 30000, 'h');
+    wait_written(store);
+    assert(spill_store_take(store, "f", &data) == -1 && errno == ENOENT);
+    assert(store->total_size == 60000);
+    put_file(store, "i", 200000, 'i');
+    assert(spill_store_take(store, "i", &data) == -1 && errno == ENOENT);
+
+    struct spill_store_statistics stats;
+    assert(spill_store_get_statistics(store, &stats) == 0);
+    assert(stats.num_spilled == 8);
+    assert(stats.num_hits == 4);
+    assert(stats.num_misses == 4);
+    assert(stats.num_write_errors == 0);
+    assert(stats.num_dropped >= 2);
+
+    // the files still in the store are removed with it
+    wait_written(store);
+    assert(destroy_spill_store(store) == 0);
+    assert(count_files(dirname) == 0);
+    assert(rmdir(dirname) == 0);
+    return 0;
+}
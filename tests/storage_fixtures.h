@@ -0,0 +1,35 @@
+#ifndef STORAGE_FIXTURES_H
+#define STORAGE_FIXTURES_H
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "file_storage_internal.h"
+
+/**
+ * Add to the storage a file with the given name and size bytes of content,
+ * given by the pattern string repeated (an empty pattern for an empty file)
+*/
+static vfile_t* add_file(file_storage_t* storage, const char* filename, size_t size, const char* pattern)
+{
+    vfile_t* vfile = create_vfile(storage);
+    assert(vfile != NULL);
+    vfile->filename = malloc(strlen(filename) + 1);
+    assert(vfile->filename != NULL);
+    strcpy(vfile->filename, filename);
+    if (size > 0) {
+        char* buf = malloc(size);
+        assert(buf != NULL);
+        for (size_t i = 0; i < size; ++i) {
+            buf[i] = pattern[i % strlen(pattern)];
+        }
+        assert(file_data_append(&vfile->data, buf, size) == 0);
+        free(buf);
+        vfile->size = size;
+    }
+    assert(add_vfile_to_storage(storage, vfile) == 0);
+    return vfile;
+}
+
+#endif
@@ -1,4 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -24,5 +27,29 @@ int main(void)
     assert(readn(fds[0], buf, 6) == 6);
 
     assert(strcmp(dummy_string, buf) == 0);
+
+    // vectored write, the empty buffers are skipped
+    struct iovec iov[3] = {
+        { dummy_data, 4 },
+        { dummy_string, 0 },
+        { dummy_data + 4, 6 }
+    };
+    assert(writevn(fds[1], iov, 3) == 10);
+    assert(readn(fds[0], buf, 10) == 10);
+    assert(memcmp(buf, dummy_data, 10) == 0);
+    assert(iov[0].iov_len == 4 && iov[2].iov_base == dummy_data + 4);
+
+    // a durable rename replaces the destination
+    char old_path[] = "/tmp/utils_testXXXXXX";
+    int fd = mkstemp(old_path);
+    assert(fd != -1);
+    assert(writen(fd, dummy_string, 6) == 6);
+    close(fd);
+    char new_path[sizeof(old_path) + 4];
+    sprintf(new_path, "%s.new", old_path);
+    assert(rename_durable(old_path, new_path) == 0);
+    assert(access(old_path, F_OK) == -1 && access(new_path, F_OK) == 0);
+    assert(rename_durable(old_path, new_path) == -1);
+    assert(unlink(new_path) == 0);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,253 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wal.h"
+
+#define NUM_WRITERS 8
+#define RECORDS_PER_WRITER 50
+
+/**
+ * Records seen by the replay, in order
+*/
+struct replayed {
+    int num_records;
+    char ops[16];
+    char names[16][32];
+    uint64_t versions[16];
+    size_t sizes[16];
+    char first_bytes[16];
+};
+
+// version clock of the files of the records, shared by the writers
+static uint64_t version_clock = 0;
+static pthread_mutex_t version_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int record_apply(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size)
+{
+    struct replayed* replayed = arg;
+    int i = replayed->num_records++;
+    assert(i < 16);
+    replayed->ops[i] = op;
+    strcpy(replayed->names[i], filename);
+    replayed->versions[i] = version;
+    replayed->sizes[i] = size;
+    assert((data == NULL) == (size == 0));
+    replayed->first_bytes[i] = size > 0 ? *(const char*)data : 0;
+    return 0;
+}
+
+static int count_apply(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size)
+{
+    ++*(long*)arg;
+    return 0;
+}
+
+static int failing_apply(void* arg, char op, const char* filename, uint64_t version, const void* data, size_t size)
+{
+    errno = EIO;
+    return -1;
+}
+
+/**
+ * Append a record with size bytes all equal to fill, split in two iovecs. The
+ * file takes a new version, except for a removal
+*/
+static uint64_t append_record(wal_t* wal, char op, const char* filename, size_t size, char fill)
+{
+    char* buf = malloc(size > 0 ? size : 1);
+    assert(buf != NULL);
+    memset(buf, fill, size);
+    struct iovec data[2] = { { buf, size / 2 }, { buf + size / 2, size - size / 2 } };
+    uint64_t sequence;
+    uint64_t version = 0;
+    if (op != WAL_REMOVE) {
+        assert(pthread_mutex_lock(&version_mutex) == 0);
+        version = ++version_clock;
+        assert(pthread_mutex_unlock(&version_mutex) == 0);
+    }
+    assert(wal_append(wal, op, filename, version, data, size > 0 ? 2 : 0, &sequence) == 0);
+    free(buf);
+    return sequence;
+}
+
+static off_t file_size(const char* path)
+{
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    return st.st_size;
+}
+
+struct writer_arg {
+    wal_t* wal;
+    int id;
+};
+
+/**
+ * Append records and wait for each of them to be durable
+*/
+static void* writer_entry_point(void* arg)
+{
+    struct writer_arg* writer = arg;
+    char name[32];
+    snprintf(name, sizeof(name), "writer%d", writer->id);
+    for (int i = 0; i < RECORDS_PER_WRITER; ++i) {
+        uint64_t sequence = append_record(writer->wal, WAL_APPEND, name, 100, 'w');
+        assert(wal_sync(writer->wal, sequence) == 0);
+        assert(writer->wal->durability == WAL_DURABILITY_NONE || writer->wal->durable_sequence >= sequence);
+    }
+    return NULL;
+}
+
+/**
+ * Run NUM_WRITERS concurrent writers on a log with the given durability, and
+ * check that all the records are in the log
+*/
+static void test_concurrent_writers(const char* path, enum wal_durability durability)
+{
+    assert(unlink(path) == 0 || errno == ENOENT);
+    wal_t* wal = wal_open(path, durability, 5, 1);
+    assert(wal != NULL);
+    pthread_t tids[NUM_WRITERS];
+    struct writer_arg args[NUM_WRITERS];
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        args[i].wal = wal;
+        args[i].id = i;
+        assert(pthread_create(&tids[i], NULL, writer_entry_point, &args[i]) == 0);
+    }
+    for (int i = 0; i < NUM_WRITERS; ++i) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+    struct wal_statistics stats;
+    assert(wal_get_statistics(wal, &stats) == 0);
+    assert(stats.num_records == NUM_WRITERS * RECORDS_PER_WRITER);
+    if (durability == WAL_DURABILITY_NONE) {
+        assert(stats.num_syncs == 0);
+    } else {
+        // the writers waiting at the same time share the syncs
+        assert(stats.num_syncs > 0 && stats.num_syncs <= stats.num_records);
+    }
+    assert(wal_get_last_sequence(wal) == NUM_WRITERS * RECORDS_PER_WRITER);
+    assert(wal_close(wal) == 0);
+
+    long num_records = 0;
+    uint64_t last_sequence;
+    assert(wal_replay(path, 0, count_apply, &num_records, &last_sequence) == NUM_WRITERS * RECORDS_PER_WRITER);
+    assert(num_records == NUM_WRITERS * RECORDS_PER_WRITER);
+    assert(last_sequence == NUM_WRITERS * RECORDS_PER_WRITER);
+}
+
+int main(void)
+{
+    char path[] = "/tmp/wal_testXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+    assert(unlink(path) == 0);
+
+    uint64_t last_sequence;
+    struct replayed replayed;
+    assert(wal_replay(path, 0, record_apply, &replayed, &last_sequence) == -1 && errno == ENOENT);
+    assert(wal_open(path, WAL_DURABILITY_BATCH, 0, 1) == NULL && errno == EINVAL);
+    assert(wal_open(path, WAL_DURABILITY_NONE, 0, 0) == NULL && errno == EINVAL);
+
+    // the records are replayed in order, with their data
+    wal_t* wal = wal_open(path, WAL_DURABILITY_ALWAYS, 0, 1);
+    assert(wal != NULL);
+    assert(append_record(wal, WAL_CREATE, "a", 0, 0) == 1);
+    assert(append_record(wal, WAL_WRITE, "a", 1000, 'x') == 2);
+    assert(append_record(wal, WAL_APPEND, "a", 10, 'y') == 3);
+    assert(append_record(wal, WAL_CREATE, "b", 0, 0) == 4);
+    assert(append_record(wal, WAL_REMOVE, "a", 0, 0) == 5);
+    assert(wal_sync(wal, 5) == 0 && wal->durable_sequence == 5);
+    assert(wal_sync(wal, 0) == 0);
+    assert(wal_close(wal) == 0);
+
+    memset(&replayed, 0, sizeof(replayed));
+    assert(wal_replay(path, 0, record_apply, &replayed, &last_sequence) == 5);
+    assert(last_sequence == 5 && replayed.num_records == 5);
+    assert(replayed.ops[0] == WAL_CREATE && strcmp(replayed.names[0], "a") == 0 && replayed.sizes[0] == 0);
+    assert(replayed.ops[1] == WAL_WRITE && replayed.sizes[1] == 1000 && replayed.first_bytes[1] == 'x');
+    assert(replayed.ops[2] == WAL_APPEND && replayed.sizes[2] == 10 && replayed.first_bytes[2] == 'y');
+    assert(replayed.ops[3] == WAL_CREATE && strcmp(replayed.names[3], "b") == 0);
+    assert(replayed.ops[4] == WAL_REMOVE && strcmp(replayed.names[4], "a") == 0);
+    // the records keep the versions of the files
+    assert(replayed.versions[0] == 1 && replayed.versions[2] == 3 && replayed.versions[3] == 4);
+
+    // the records already in a snapshot are skipped
+    memset(&replayed, 0, sizeof(replayed));
+    assert(wal_replay(path, 3, record_apply, &replayed, &last_sequence) == 2);
+    assert(last_sequence == 5 && replayed.ops[0] == WAL_CREATE && replayed.ops[1] == WAL_REMOVE);
+    assert(wal_replay(path, 10, record_apply, &replayed, &last_sequence) == 0 && last_sequence == 10);
+    assert(wal_replay(path, 0, failing_apply, NULL, &last_sequence) == -1 && errno == EIO);
+
+    // a log reopened after a replay continues the sequences
+    wal = wal_open(path, WAL_DURABILITY_NONE, 0, 6);
+    assert(wal != NULL);
+    assert(append_record(wal, WAL_APPEND, "b", 20, 'z') == 6);
+    assert(wal_sync(wal, 6) == 0);
+    assert(wal_close(wal) == 0);
+    off_t complete_size = file_size(path);
+
+    // a torn record at the end of the log is dropped, and the log is
+    // truncated so that the next records follow the valid ones
+    wal = wal_open(path, WAL_DURABILITY_NONE, 0, 7);
+    assert(wal != NULL);
+    append_record(wal, WAL_APPEND, "b", 500, 't');
+    assert(wal_close(wal) == 0);
+    assert(truncate(path, file_size(path) - 100) == 0);
+    memset(&replayed, 0, sizeof(replayed));
+    assert(wal_replay(path, 0, record_apply, &replayed, &last_sequence) == 6);
+    assert(last_sequence == 6 && file_size(path) == complete_size);
+
+    // a corrupted record ends the log as well
+    wal = wal_open(path, WAL_DURABILITY_NONE, 0, 7);
+    assert(wal != NULL);
+    append_record(wal, WAL_APPEND, "b", 500, 'c');
+    append_record(wal, WAL_APPEND, "b", 500, 'd');
+    assert(wal_close(wal) == 0);
+    FILE* f = fopen(path, "r+");
+    assert(f != NULL);
+    assert(fseek(f, complete_size + sizeof(struct wal_record_header) + 1 + 200, SEEK_SET) == 0);
+    assert(fputc('!', f) != EOF);
+    assert(fclose(f) == 0);
+    memset(&replayed, 0, sizeof(replayed));
+    assert(wal_replay(path, 0, record_apply, &replayed, &last_sequence) == 6);
+    assert(last_sequence == 6 && file_size(path) == complete_size);
+
+    // after a snapshot the records in it are removed, and the sequences go on
+    wal = wal_open(path, WAL_DURABILITY_BATCH, 1000, 7);
+    assert(wal != NULL);
+    uint64_t sequence = append_record(wal, WAL_CREATE, "c", 0, 0);
+    assert(wal_discard(wal, sequence) == 0);
+    // the discarded records are durable, without waiting for the flusher
+    assert(wal->durable_sequence == sequence && wal_sync(wal, sequence) == 0);
+    assert(file_size(path) == 0);
+    assert(append_record(wal, WAL_CREATE, "d", 0, 0) == sequence + 1);
+
+    // the records appended while a snapshot is written are kept
+    append_record(wal, WAL_WRITE, "d", 300, 'd');
+    append_record(wal, WAL_CREATE, "e", 0, 0);
+    assert(wal_discard(wal, sequence + 2) == 0);
+    assert(file_size(path) == sizeof(struct wal_record_header) + 1);
+    assert(append_record(wal, WAL_APPEND, "e", 40, 'e') == sequence + 4);
+    assert(wal_close(wal) == 0);
+    memset(&replayed, 0, sizeof(replayed));
+    assert(wal_replay(path, 0, record_apply, &replayed, &last_sequence) == 2);
+    assert(last_sequence == sequence + 4 && replayed.ops[0] == WAL_CREATE && strcmp(replayed.names[0], "e") == 0);
+    assert(replayed.ops[1] == WAL_APPEND && replayed.sizes[1] == 40);
+
+    // concurrent writers, the syncs are shared between them
+    test_concurrent_writers(path, WAL_DURABILITY_NONE);
+    test_concurrent_writers(path, WAL_DURABILITY_BATCH);
+    test_concurrent_writers(path, WAL_DURABILITY_ALWAYS);
+
+    assert(unlink(path) == 0);
+    return 0;
+}